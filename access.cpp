@@ -0,0 +1,327 @@
+
+#include "ptcx_internal.h"
+
+status skip_microblock(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry, uint32 block_width, uint32 block_height,
+                       PTCX_BAND_CURSOR *cursor)
+{
+    uint32 control_bytes = query_microblock_control_size(header, entry);
+
+    if (cursor->control + control_bytes > cursor->control_end)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    bool has_indices = (PTCX_BLOCK_MODE_PLANAR != entry.mode) && !is_solid_microblock(header, cursor->control);
+
+    cursor->control += control_bytes;
+
+    if (!has_indices)
+    {
+        return BASE_SUCCESS;
+    }
+
+    if (PTCX_BLOCK_MODE_CODEBOOK == entry.mode)
+    {
+        // Each tile is a single byte, unless it escapes to a full set of packed indices.
+        uint32 pattern_size = query_codebook_pattern_size(header);
+        uint32 tile_count = (block_width / PTCX_CODEBOOK_TILE_SIZE) * (block_height / PTCX_CODEBOOK_TILE_SIZE);
+
+        if ((block_width % PTCX_CODEBOOK_TILE_SIZE) || (block_height % PTCX_CODEBOOK_TILE_SIZE))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+
+        for (uint32 i = 0; i < tile_count; i++)
+        {
+            if (cursor->index >= cursor->index_end)
+            {
+                return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+            }
+
+            if (PTCX_CODEBOOK_ESCAPE == *(cursor->index++))
+            {
+                if (cursor->index + pattern_size > cursor->index_end)
+                {
+                    return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+                }
+
+                cursor->index += pattern_size;
+            }
+        }
+
+        return BASE_SUCCESS;
+    }
+
+    uint32 index_bytes = (block_width * block_height * entry.quant_step_bits + 7) >> 3;
+
+    if (cursor->index + index_bytes > cursor->index_end)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    cursor->index += index_bytes;
+
+    return BASE_SUCCESS;
+}
+
+status skip_macroblock(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry, PTCX_BAND_CURSOR *cursor)
+{
+    PTCX_PARTITION_REGION regions[PTCX_MAX_PARTITION_REGIONS];
+    uint32 region_count = query_partition_regions(header, entry, regions);
+
+    for (uint32 r = 0; r < region_count; r++)
+    {
+        uint32 microblock_count = query_region_microblock_count(regions[r]);
+
+        for (uint32 i = 0; i < microblock_count; i++)
+        {
+            if (base_failed(skip_microblock(header, entry, regions[r].micro_width, regions[r].micro_height, cursor)))
+            {
+                return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+            }
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+status index_band(const PTCX_FILE_HEADER &header, const PTCX_BAND_DATA &band, PTCX_BLOCK_LOCATION *blocks)
+{
+    uint32 block_count = query_band_macroblock_count(header);
+    PTCX_BAND_CURSOR cursor;
+
+    cursor.control = band.control.data();
+    cursor.control_end = cursor.control + band.control.size();
+    cursor.index = band.index.data();
+    cursor.index_end = cursor.index + band.index.size();
+
+    for (uint32 block_index = 0; block_index < block_count; block_index++)
+    {
+        PTCX_MACROBLOCK_ENTRY entry;
+
+        if (base_failed(read_macroblock_entry(header, band.table.data(), block_index, &entry)))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+
+        if (PTCX_BLOCK_MODE_REFERENCE == entry.mode)
+        {
+            uint32 distance = 0;
+
+            if (cursor.control + PTCX_REFERENCE_CONTROL_SIZE > cursor.control_end ||
+                base_failed(read_reference_distance(cursor.control, block_index, &distance)))
+            {
+                return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+            }
+
+            // The referenced macroblock has already been resolved, so chains of references
+            // collapse to the original.
+
+            cursor.control += PTCX_REFERENCE_CONTROL_SIZE;
+            blocks[block_index] = blocks[block_index - distance];
+
+            continue;
+        }
+
+        blocks[block_index].source_index = block_index;
+        blocks[block_index].control_offset = cursor.control - band.control.data();
+        blocks[block_index].index_offset = cursor.index - band.index.data();
+
+        if (base_failed(skip_macroblock(header, entry, &cursor)))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+status read_block_index(stream *input, uint32 level, PTCX_BLOCK_INDEX *output)
+{
+    PTCX_FILE_CONTEXT &context = output->context;
+    const PTCX_FILE_HEADER &header = context.header;
+
+    status result = read_level_context(input, level, &context);
+
+    if (base_failed(result))
+    {
+        return (BASE_ERROR_INVALIDARG == result) ? result : base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    // Version 2 files store a single stream of interleaved microblocks, with no bands
+    // that we could index.
+
+    if (PTCX_LEGACY_VERSION == header.version)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    uint32 band_count = query_band_count(header);
+    uint32 band_block_count = query_band_macroblock_count(header);
+
+    output->bands.resize(band_count);
+    output->blocks.resize(band_count * band_block_count);
+
+    for (uint32 i = 0; i < band_count; i++)
+    {
+        PTCX_BAND_DATA &band = output->bands[i];
+
+        if (base_failed(read_band(input, context, &band)))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+
+        // Only the decoded sections are needed from here on.
+        std::vector<uint8>().swap(band.residual);
+        std::vector<uint8>().swap(band.coded);
+
+        if (base_failed(index_band(header, band, &output->blocks[i * band_block_count])))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+uint32 query_indexed_block(const PTCX_FILE_HEADER &header, uint32 x, uint32 y)
+{
+    // Bands hold whole rows of macroblocks, so the blocks of the image are simply the 
+    // blocks of each band in turn.
+
+    return (y / header.block_height) * (header.image_width / header.block_width) + x / header.block_width;
+}
+
+uint32 query_indexed_source(const PTCX_BLOCK_INDEX &index, uint32 block_index)
+{
+    uint32 band_block_count = query_band_macroblock_count(index.context.header);
+
+    return block_index - (block_index % band_block_count) + index.blocks[block_index].source_index;
+}
+
+status read_indexed_entry(const PTCX_BLOCK_INDEX &index, uint32 block_index, PTCX_MACROBLOCK_ENTRY *entry)
+{
+    const PTCX_FILE_HEADER &header = index.context.header;
+    uint32 band_index = block_index / query_band_macroblock_count(header);
+
+    return read_macroblock_entry(header, index.bands[band_index].table.data(), index.blocks[block_index].source_index, entry);
+}
+
+status query_indexed_size(const PTCX_BLOCK_INDEX &index, uint32 block_index, uint32 *control_size, uint32 *index_size)
+{
+    const PTCX_FILE_HEADER &header = index.context.header;
+    const PTCX_BAND_DATA &band = index.bands[block_index / query_band_macroblock_count(header)];
+    const PTCX_BLOCK_LOCATION &location = index.blocks[block_index];
+    PTCX_MACROBLOCK_ENTRY entry;
+    PTCX_BAND_CURSOR cursor;
+
+    if (base_failed(read_indexed_entry(index, block_index, &entry)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    cursor.control = band.control.data() + location.control_offset;
+    cursor.control_end = band.control.data() + band.control.size();
+    cursor.index = band.index.data() + location.index_offset;
+    cursor.index_end = band.index.data() + band.index.size();
+
+    if (base_failed(skip_macroblock(header, entry, &cursor)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    (*control_size) = cursor.control - band.control.data() - location.control_offset;
+    (*index_size) = cursor.index - band.index.data() - location.index_offset;
+
+    return BASE_SUCCESS;
+}
+
+status decode_indexed_microblocks(const PTCX_BLOCK_INDEX &index, uint32 block_index, const PTCX_MACROBLOCK_ENTRY &entry, 
+                                  uint32 first, uint32 count, image *output, uint32 dest_x, uint32 dest_y)
+{
+    const PTCX_FILE_HEADER &header = index.context.header;
+    const PTCX_BAND_DATA &band = index.bands[block_index / query_band_macroblock_count(header)];
+    const PTCX_BLOCK_LOCATION &location = index.blocks[block_index];
+    PTCX_PARTITION_REGION regions[PTCX_MAX_PARTITION_REGIONS];
+    PTCX_BAND_CURSOR cursor;
+
+    cursor.control = band.control.data() + location.control_offset;
+    cursor.control_end = band.control.data() + band.control.size();
+    cursor.index = band.index.data() + location.index_offset;
+    cursor.index_end = band.index.data() + band.index.size();
+
+    // Microblocks are stored region by region, in row major order within each region, so 
+    // we skip over those that precede the first one we need.
+
+    uint32 region_count = query_partition_regions(header, entry, regions);
+    uint32 microblock = 0;
+
+    for (uint32 r = 0; r < region_count && microblock < first + count; r++)
+    {
+        const PTCX_PARTITION_REGION &region = regions[r];
+        uint32 row_count = region.width / region.micro_width;
+        uint32 microblock_count = query_region_microblock_count(region);
+
+        for (uint32 i = 0; i < microblock_count && microblock < first + count; i++, microblock++)
+        {
+            uint32 micro_width = region.micro_width;
+            uint32 micro_height = region.micro_height;
+
+            if (microblock < first)
+            {
+                if (base_failed(skip_microblock(header, entry, micro_width, micro_height, &cursor)))
+                {
+                    return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+                }
+
+                continue;
+            }
+
+            uint32 start_x = dest_x + region.x + (i % row_count) * micro_width;
+            uint32 start_y = dest_y + region.y + (i / row_count) * micro_height;
+            status result = BASE_SUCCESS;
+
+            if (PTCX_BLOCK_MODE_PLANAR == entry.mode)
+            {
+                result = decode_planar_microblock(micro_width, micro_height, entry.color_space, &cursor, output, start_x, start_y);
+            }
+            else if (PTCX_BLOCK_MODE_CODEBOOK == entry.mode)
+            {
+                result = decode_codebook_microblock(index.context, micro_width, micro_height, entry.color_space, &cursor, output, start_x, start_y);
+            }
+            else
+            {
+                result = decode_microblock(header, micro_width, micro_height, entry.quant_step_bits, entry.color_space, &cursor, output, start_x, start_y);
+            }
+
+            if (base_failed(result))
+            {
+                return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+            }
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+status decode_indexed_macroblock(const PTCX_BLOCK_INDEX &index, uint32 block_index, image *output, uint32 dest_x, uint32 dest_y)
+{
+    const PTCX_FILE_HEADER &header = index.context.header;
+    PTCX_PARTITION_REGION regions[PTCX_MAX_PARTITION_REGIONS];
+    PTCX_MACROBLOCK_ENTRY entry;
+
+    if (base_failed(read_indexed_entry(index, block_index, &entry)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    uint32 region_count = query_partition_regions(header, entry, regions);
+    uint32 microblock_count = 0;
+
+    for (uint32 r = 0; r < region_count; r++)
+    {
+        microblock_count += query_region_microblock_count(regions[r]);
+    }
+
+    return decode_indexed_microblocks(index, block_index, entry, 0, microblock_count, output, dest_x, dest_y);
+}
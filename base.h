@@ -231,6 +231,12 @@ inline uint32 post_error_i(uint8 error, const char *error_string, const char *fu
     type(const type &rvalue); \
     type &operator = (const type &rvalue);
 
+#if defined (BASE_PLATFORM_WINDOWS)
+    #define BASE_ALIGN(n)                       __declspec(align(n))
+#else
+    #define BASE_ALIGN(n)                       __attribute__((aligned(n)))
+#endif
+
 #define BASE_TEMPLATE_T                         template <class T>
 #define BASE_TEMPLATE_SPEC                      template <>
 
@@ -207,6 +207,12 @@ status save_bitmap(stream *dest, const image &input)
         return BASE_ERROR_INVALID_RESOURCE;
     }
 
+    // Bitmaps are written a scanline at a time, which requires a linear source.
+    if (IGN_IMAGE_LAYOUT_LINEAR != input.query_image_layout())
+    {
+        return BASE_ERROR_INVALID_RESOURCE;
+    }
+
     // One pre-step -- the bitmap format stores data in BGR(A) format, so we must
     // convert in order to save it to the stream as RGB(A)
 
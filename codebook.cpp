@@ -0,0 +1,615 @@
+
+#include "ptcx_internal.h"
+#include <unordered_map>
+#include <algorithm>
+
+// We train on the most frequent distinct patterns only, which keeps the cost of
+// clustering independent of the image size.
+#define PTCX_CODEBOOK_TRAINING_SIZE              (8192)
+#define PTCX_CODEBOOK_ITERATIONS                 (6)
+
+typedef struct PTCX_INDEX_PATTERN
+{
+    uint8 index[PTCX_CODEBOOK_TILE_PIXELS];
+
+} PTCX_INDEX_PATTERN;
+
+uint32 query_codebook_pattern_size(const PTCX_FILE_HEADER &header)
+{
+    return (PTCX_CODEBOOK_TILE_PIXELS * header.quant_step_bits) >> 3;
+}
+
+// Indices are packed from the least significant bits of each byte upward, and never
+// straddle a byte boundary.
+
+uint8 read_packed_index(const uint8 *data, uint32 position, uint32 step_bits)
+{
+    uint32 bit_offset = position * step_bits;
+    return (data[bit_offset >> 3] >> (bit_offset & 0x7)) & ((1 << step_bits) - 1);
+}
+
+void write_packed_index(uint8 *data, uint32 position, uint32 step_bits, uint8 value)
+{
+    uint32 bit_offset = position * step_bits;
+    data[bit_offset >> 3] |= value << (bit_offset & 0x7);
+}
+
+void extract_tile(const uint8 *indices, uint32 block_width, uint32 tile_x, uint32 tile_y, uint32 step_bits, PTCX_INDEX_PATTERN *pattern)
+{
+    for (uint32 j = 0; j < PTCX_CODEBOOK_TILE_SIZE; j++)
+    for (uint32 i = 0; i < PTCX_CODEBOOK_TILE_SIZE; i++)
+    {
+        uint32 position = (tile_y + j) * block_width + tile_x + i;
+        pattern->index[j * PTCX_CODEBOOK_TILE_SIZE + i] = read_packed_index(indices, position, step_bits);
+    }
+}
+
+void store_tile(const PTCX_INDEX_PATTERN &pattern, uint32 block_width, uint32 tile_x, uint32 tile_y, uint32 step_bits, uint8 *indices)
+{
+    for (uint32 j = 0; j < PTCX_CODEBOOK_TILE_SIZE; j++)
+    for (uint32 i = 0; i < PTCX_CODEBOOK_TILE_SIZE; i++)
+    {
+        uint32 position = (tile_y + j) * block_width + tile_x + i;
+        write_packed_index(indices, position, step_bits, pattern.index[j * PTCX_CODEBOOK_TILE_SIZE + i]);
+    }
+}
+
+void pack_pattern(const PTCX_INDEX_PATTERN &pattern, uint32 step_bits, uint8 *output)
+{
+    memset(output, 0, (PTCX_CODEBOOK_TILE_PIXELS * step_bits) >> 3);
+
+    for (uint32 i = 0; i < PTCX_CODEBOOK_TILE_PIXELS; i++)
+    {
+        write_packed_index(output, i, step_bits, pattern.index[i]);
+    }
+}
+
+void unpack_pattern(const uint8 *input, uint32 step_bits, PTCX_INDEX_PATTERN *pattern)
+{
+    for (uint32 i = 0; i < PTCX_CODEBOOK_TILE_PIXELS; i++)
+    {
+        pattern->index[i] = read_packed_index(input, i, step_bits);
+    }
+}
+
+uint64 query_pattern_key(const PTCX_INDEX_PATTERN &pattern, uint32 step_bits)
+{
+    // A tile holds at most 64 bits of indices, so the packed pattern is its own key.
+    uint64 key = 0;
+
+    for (uint32 i = 0; i < PTCX_CODEBOOK_TILE_PIXELS; i++)
+    {
+        key |= static_cast<uint64>(pattern.index[i]) << (i * step_bits);
+    }
+
+    return key;
+}
+
+bool is_codebook_candidate(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry)
+{
+    uint32 micro_width = 0;
+    uint32 micro_height = 0;
+
+    query_smallest_microblock_size(header, entry, &micro_width, &micro_height);
+
+    // Patterns use the step bits of the header, and cover whole tiles.
+    return PTCX_BLOCK_MODE_INDEXED == entry.mode && header.quant_step_bits == entry.quant_step_bits &&
+           0 == (micro_width % PTCX_CODEBOOK_TILE_SIZE) && 0 == (micro_height % PTCX_CODEBOOK_TILE_SIZE);
+}
+
+// The squared reconstruction difference between every pair of indices of a microblock,
+// using the same palette arithmetic as the decoder.
+void prepare_index_costs(const PTCX_FILE_HEADER &header, uint32 color_space, const uint8 *control, uint32 costs[][1 << PTCX_MAX_QUANT_STEP_BITS])
+{
+    PTCX_PIXEL_RANGE range = {{255, 255, 255}, {0, 0, 0}};
+    unpack_control_values(control, header, &range);
+
+    uint32 quant_step_mask = (1 << header.quant_step_bits) - 1;
+    uint8 palette[1 << PTCX_MAX_QUANT_STEP_BITS][3];
+
+    for (uint32 step_value = 0; step_value <= quant_step_mask; step_value++)
+    {
+        for (uint8 c = 0; c < 3; c++)
+        {
+            int16 range_delta = range.max_value[c] - range.min_value[c];
+            palette[step_value][c] = static_cast<uint8>(range.min_value[c] + range_delta / static_cast<int16>(quant_step_mask) * step_value);
+        }
+
+        if (PTCX_COLOR_SPACE_YCOCG == color_space)
+        {
+            correlate_color(palette[step_value], palette[step_value]);
+        }
+    }
+
+    for (uint32 a = 0; a <= quant_step_mask; a++)
+    for (uint32 b = 0; b <= quant_step_mask; b++)
+    {
+        costs[a][b] = 0;
+
+        for (uint8 c = 0; c < 3; c++)
+        {
+            int32 delta = static_cast<int32>(palette[a][c]) - palette[b][c];
+            costs[a][b] += delta * delta;
+        }
+    }
+}
+
+uint32 encode_codebook_microblock(const PTCX_FILE_HEADER &header, const std::vector<PTCX_INDEX_PATTERN> &patterns, uint32 color_space,
+                                  const uint8 *control, const uint8 *indices, uint32 micro_width, uint32 micro_height, std::vector<uint8> *output)
+{
+    uint32 step_bits = header.quant_step_bits;
+    uint32 pattern_size = query_codebook_pattern_size(header);
+    uint32 threshold = static_cast<uint32>(PTCX_QUALITY_DELTA * PTCX_CODEBOOK_DELTA_RATIO * PTCX_CODEBOOK_TILE_PIXELS);
+    uint32 costs[1 << PTCX_MAX_QUANT_STEP_BITS][1 << PTCX_MAX_QUANT_STEP_BITS];
+    uint32 start_size = output->size();
+
+    prepare_index_costs(header, color_space, control, costs);
+
+    for (uint32 tile_y = 0; tile_y < micro_height; tile_y += PTCX_CODEBOOK_TILE_SIZE)
+    for (uint32 tile_x = 0; tile_x < micro_width; tile_x += PTCX_CODEBOOK_TILE_SIZE)
+    {
+        PTCX_INDEX_PATTERN tile;
+        extract_tile(indices, micro_width, tile_x, tile_y, step_bits, &tile);
+
+        uint32 best_pattern = 0;
+        uint32 best_error = BASE_MAX_UINT32;
+
+        for (uint32 k = 0; k < patterns.size() && best_error; k++)
+        {
+            uint32 error = 0;
+
+            for (uint32 p = 0; p < PTCX_CODEBOOK_TILE_PIXELS; p++)
+            {
+                error += costs[tile.index[p]][patterns[k].index[p]];
+            }
+
+            if (error < best_error)
+            {
+                best_error = error;
+                best_pattern = k;
+            }
+        }
+
+        if (best_error <= threshold)
+        {
+            output->push_back(best_pattern);
+            continue;
+        }
+
+        uint8 packed[(PTCX_CODEBOOK_TILE_PIXELS * PTCX_MAX_QUANT_STEP_BITS) >> 3];
+        pack_pattern(tile, step_bits, packed);
+
+        output->push_back(PTCX_CODEBOOK_ESCAPE);
+        output->insert(output->end(), packed, packed + pattern_size);
+    }
+
+    return output->size() - start_size;
+}
+
+void unpack_codebook(const PTCX_FILE_HEADER &header, const std::vector<uint8> &codebook, std::vector<PTCX_INDEX_PATTERN> *patterns)
+{
+    uint32 pattern_size = query_codebook_pattern_size(header);
+    patterns->resize(codebook.size() / pattern_size);
+
+    for (uint32 k = 0; k < patterns->size(); k++)
+    {
+        unpack_pattern(&codebook[k * pattern_size], header.quant_step_bits, &(*patterns)[k]);
+    }
+}
+
+void accumulate_pattern_usage(const PTCX_FILE_HEADER &header, const std::vector<uint8> &coded_block, std::vector<uint32> *usage)
+{
+    for (uint32 i = 0; i < coded_block.size(); i++)
+    {
+        if (PTCX_CODEBOOK_ESCAPE == coded_block[i])
+        {
+            i += query_codebook_pattern_size(header);
+            continue;
+        }
+
+        (*usage)[coded_block[i]]++;
+    }
+}
+
+// Converts each eligible macroblock of a band to codebook form when doing so shrinks it,
+// optionally counting the number of tiles that select each pattern.
+status apply_codebook_patterns(const PTCX_FILE_HEADER &header, const std::vector<PTCX_INDEX_PATTERN> &patterns, PTCX_BAND_DATA *band, std::vector<uint32> *usage)
+{
+    uint32 control_offset = 0;
+    uint32 index_offset = 0;
+
+    std::vector<uint8> coded_index;
+    std::vector<uint8> coded_block;
+
+    coded_index.reserve(band->index.size());
+
+    for (uint32 block_index = 0; block_index < query_band_macroblock_count(header); block_index++)
+    {
+        PTCX_PARTITION_REGION regions[PTCX_MAX_PARTITION_REGIONS];
+        PTCX_MACROBLOCK_ENTRY entry;
+
+        if (base_failed(read_macroblock_entry(header, band->table.data(), block_index, &entry)))
+        {
+            return base_post_error(BASE_ERROR_INVALIDARG);
+        }
+
+        if (PTCX_BLOCK_MODE_REFERENCE == entry.mode)
+        {
+            control_offset += PTCX_REFERENCE_CONTROL_SIZE;
+            continue;
+        }
+
+        uint32 region_count = query_partition_regions(header, entry, regions);
+        bool is_candidate = !patterns.empty() && is_codebook_candidate(header, entry);
+        uint32 block_index_offset = index_offset;
+
+        if (PTCX_BLOCK_MODE_CODEBOOK == entry.mode)
+        {
+            // Macroblocks that are already coded against the codebook, such as those that
+            // an incremental update carries over, are copied through unchanged.
+
+            PTCX_BAND_CURSOR cursor;
+
+            cursor.control = band->control.data() + control_offset;
+            cursor.control_end = band->control.data() + band->control.size();
+            cursor.index = band->index.data() + index_offset;
+            cursor.index_end = band->index.data() + band->index.size();
+
+            if (base_failed(skip_macroblock(header, entry, &cursor)))
+            {
+                return base_post_error(BASE_ERROR_INVALIDARG);
+            }
+
+            control_offset = cursor.control - band->control.data();
+            index_offset = cursor.index - band->index.data();
+
+            coded_index.insert(coded_index.end(), band->index.begin() + block_index_offset, band->index.begin() + index_offset);
+
+            continue;
+        }
+
+        coded_block.clear();
+
+        for (uint32 r = 0; r < region_count; r++)
+        for (uint32 k = 0; k < query_region_microblock_count(regions[r]); k++)
+        {
+            uint32 micro_width = regions[r].micro_width;
+            uint32 micro_height = regions[r].micro_height;
+            const uint8 *control = &band->control[control_offset];
+            control_offset += query_microblock_control_size(header, entry);
+
+            if (PTCX_BLOCK_MODE_PLANAR == entry.mode || is_solid_microblock(header, control))
+            {
+                continue;
+            }
+
+            if (is_candidate)
+            {
+                encode_codebook_microblock(header, patterns, entry.color_space, control, &band->index[index_offset], micro_width, micro_height, &coded_block);
+            }
+
+            index_offset += (micro_width * micro_height * entry.quant_step_bits + 7) >> 3;
+        }
+
+        // Switch the macroblock to its codebook form only when it is smaller.
+
+        if (is_candidate && coded_block.size() < index_offset - block_index_offset)
+        {
+            entry.mode = PTCX_BLOCK_MODE_CODEBOOK;
+            write_macroblock_entry(header, band->table.data(), block_index, entry);
+            coded_index.insert(coded_index.end(), coded_block.begin(), coded_block.end());
+
+            if (usage)
+            {
+                accumulate_pattern_usage(header, coded_block, usage);
+            }
+        }
+        else
+        {
+            coded_index.insert(coded_index.end(), band->index.begin() + block_index_offset, band->index.begin() + index_offset);
+        }
+    }
+
+    band->index.swap(coded_index);
+
+    return BASE_SUCCESS;
+}
+
+status apply_index_codebook(const PTCX_FILE_HEADER &header, const std::vector<uint8> &codebook, PTCX_BAND_DATA *band)
+{
+    std::vector<PTCX_INDEX_PATTERN> patterns;
+    unpack_codebook(header, codebook, &patterns);
+
+    return apply_codebook_patterns(header, patterns, band, 0);
+}
+
+status build_index_codebook(const PTCX_FILE_HEADER &header, const std::vector<PTCX_BAND_DATA> &bands, std::vector<uint8> *codebook)
+{
+    uint32 step_bits = header.quant_step_bits;
+    uint32 quant_step_mask = (1 << step_bits) - 1;
+    std::unordered_map<uint64, uint32> pattern_counts;
+
+    codebook->clear();
+
+    // Gather every tile that could be coded against the codebook.
+
+    for (uint32 band_index = 0; band_index < bands.size(); band_index++)
+    {
+        const PTCX_BAND_DATA &band = bands[band_index];
+        uint32 control_offset = 0;
+        uint32 index_offset = 0;
+
+        for (uint32 block_index = 0; block_index < query_band_macroblock_count(header); block_index++)
+        {
+            PTCX_PARTITION_REGION regions[PTCX_MAX_PARTITION_REGIONS];
+            PTCX_MACROBLOCK_ENTRY entry;
+
+            if (base_failed(read_macroblock_entry(header, band.table.data(), block_index, &entry)))
+            {
+                return base_post_error(BASE_ERROR_INVALIDARG);
+            }
+
+            if (PTCX_BLOCK_MODE_REFERENCE == entry.mode)
+            {
+                control_offset += PTCX_REFERENCE_CONTROL_SIZE;
+                continue;
+            }
+
+            uint32 region_count = query_partition_regions(header, entry, regions);
+            bool is_candidate = is_codebook_candidate(header, entry);
+
+            for (uint32 r = 0; r < region_count; r++)
+            for (uint32 k = 0; k < query_region_microblock_count(regions[r]); k++)
+            {
+                uint32 micro_width = regions[r].micro_width;
+                uint32 micro_height = regions[r].micro_height;
+                const uint8 *control = &band.control[control_offset];
+                control_offset += query_microblock_control_size(header, entry);
+
+                if (PTCX_BLOCK_MODE_PLANAR == entry.mode || is_solid_microblock(header, control))
+                {
+                    continue;
+                }
+
+                if (is_candidate)
+                {
+                    for (uint32 tile_y = 0; tile_y < micro_height; tile_y += PTCX_CODEBOOK_TILE_SIZE)
+                    for (uint32 tile_x = 0; tile_x < micro_width; tile_x += PTCX_CODEBOOK_TILE_SIZE)
+                    {
+                        PTCX_INDEX_PATTERN pattern;
+                        extract_tile(&band.index[index_offset], micro_width, tile_x, tile_y, step_bits, &pattern);
+                        pattern_counts[query_pattern_key(pattern, step_bits)]++;
+                    }
+                }
+
+                index_offset += (micro_width * micro_height * entry.quant_step_bits + 7) >> 3;
+            }
+        }
+    }
+
+    if (pattern_counts.empty())
+    {
+        return BASE_SUCCESS;
+    }
+
+    // Order our distinct patterns by frequency. Ties are broken by key so that the
+    // codebook does not depend upon the iteration order of the hash table.
+
+    std::vector<std::pair<uint32, uint64> > ranked;
+    ranked.reserve(pattern_counts.size());
+
+    for (std::unordered_map<uint64, uint32>::iterator i = pattern_counts.begin(); i != pattern_counts.end(); ++i)
+    {
+        ranked.push_back(std::make_pair(i->second, i->first));
+    }
+
+    std::sort(ranked.begin(), ranked.end(), std::greater<std::pair<uint32, uint64> >());
+    ranked.resize(base_min2((uint32) ranked.size(), (uint32) PTCX_CODEBOOK_TRAINING_SIZE));
+
+    std::vector<PTCX_INDEX_PATTERN> training(ranked.size());
+
+    for (uint32 i = 0; i < ranked.size(); i++)
+    {
+        for (uint32 p = 0; p < PTCX_CODEBOOK_TILE_PIXELS; p++)
+        {
+            training[i].index[p] = (ranked[i].second >> (p * step_bits)) & quant_step_mask;
+        }
+    }
+
+    // Weighted k-means, seeded with the most frequent patterns.
+
+    uint32 centroid_count = base_min2((uint32) training.size(), (uint32) PTCX_MAX_CODEBOOK_SIZE);
+    std::vector<float> centroids(centroid_count * PTCX_CODEBOOK_TILE_PIXELS);
+    std::vector<float> sums(centroid_count * PTCX_CODEBOOK_TILE_PIXELS);
+    std::vector<float> weights(centroid_count);
+
+    for (uint32 k = 0; k < centroid_count; k++)
+    for (uint32 p = 0; p < PTCX_CODEBOOK_TILE_PIXELS; p++)
+    {
+        centroids[k * PTCX_CODEBOOK_TILE_PIXELS + p] = training[k].index[p];
+    }
+
+    for (uint32 iteration = 0; iteration < PTCX_CODEBOOK_ITERATIONS; iteration++)
+    {
+        std::fill(sums.begin(), sums.end(), 0.0f);
+        std::fill(weights.begin(), weights.end(), 0.0f);
+
+        for (uint32 i = 0; i < training.size(); i++)
+        {
+            uint32 nearest = 0;
+            float nearest_distance = BASE_INFINITY;
+
+            for (uint32 k = 0; k < centroid_count; k++)
+            {
+                const float *centroid = &centroids[k * PTCX_CODEBOOK_TILE_PIXELS];
+                float distance = 0;
+
+                for (uint32 p = 0; p < PTCX_CODEBOOK_TILE_PIXELS; p++)
+                {
+                    float delta = training[i].index[p] - centroid[p];
+                    distance += delta * delta;
+                }
+
+                if (distance < nearest_distance)
+                {
+                    nearest_distance = distance;
+                    nearest = k;
+                }
+            }
+
+            float weight = ranked[i].first;
+
+            for (uint32 p = 0; p < PTCX_CODEBOOK_TILE_PIXELS; p++)
+            {
+                sums[nearest * PTCX_CODEBOOK_TILE_PIXELS + p] += weight * training[i].index[p];
+            }
+
+            weights[nearest] += weight;
+        }
+
+        for (uint32 k = 0; k < centroid_count; k++)
+        {
+            if (weights[k] > 0)
+            {
+                for (uint32 p = 0; p < PTCX_CODEBOOK_TILE_PIXELS; p++)
+                {
+                    centroids[k * PTCX_CODEBOOK_TILE_PIXELS + p] = sums[k * PTCX_CODEBOOK_TILE_PIXELS + p] / weights[k];
+                }
+            }
+        }
+    }
+
+    // Round our centroids back to valid index patterns.
+
+    std::vector<PTCX_INDEX_PATTERN> patterns(centroid_count);
+
+    for (uint32 k = 0; k < centroid_count; k++)
+    for (uint32 p = 0; p < PTCX_CODEBOOK_TILE_PIXELS; p++)
+    {
+        uint32 value = static_cast<uint32>(centroids[k * PTCX_CODEBOOK_TILE_PIXELS + p] + 0.5f);
+        patterns[k].index[p] = base_min2(value, quant_step_mask);
+    }
+
+    // Many patterns never meet the accuracy threshold against real tiles, so we trial 
+    // the codebook against a copy of each band and keep only the patterns it selects.
+
+    std::vector<uint32> usage(centroid_count, 0);
+
+    for (uint32 band_index = 0; band_index < bands.size(); band_index++)
+    {
+        PTCX_BAND_DATA trial_band = bands[band_index];
+
+        if (base_failed(apply_codebook_patterns(header, patterns, &trial_band, &usage)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    uint32 pattern_size = query_codebook_pattern_size(header);
+
+    for (uint32 k = 0; k < centroid_count; k++)
+    {
+        if (usage[k])
+        {
+            codebook->resize(codebook->size() + pattern_size);
+            pack_pattern(patterns[k], step_bits, &(*codebook)[codebook->size() - pattern_size]);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+
+status write_index_codebook(stream *output, const PTCX_FILE_HEADER &header, const std::vector<uint8> &codebook)
+{
+    uint16 pattern_count = codebook.size() / query_codebook_pattern_size(header);
+
+    if (base_failed(write_stream_data(output, &pattern_count, sizeof(pattern_count))) ||
+        base_failed(write_stream_data(output, codebook.data(), codebook.size())))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status read_index_codebook(stream *input, const PTCX_FILE_HEADER &header, std::vector<uint8> *codebook)
+{
+    uint16 pattern_count = 0;
+
+    if (base_failed(read_stream_data(input, &pattern_count, sizeof(pattern_count))))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    if (pattern_count > PTCX_MAX_CODEBOOK_SIZE)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    codebook->resize(pattern_count * query_codebook_pattern_size(header));
+
+    if (base_failed(read_stream_data(input, codebook->data(), codebook->size())))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status expand_codebook_indices(const PTCX_FILE_HEADER &header, const std::vector<uint8> &codebook, uint32 block_width, uint32 block_height,
+                               const uint8 **input, const uint8 *input_end, uint8 *output)
+{
+    uint32 step_bits = header.quant_step_bits;
+    uint32 pattern_size = query_codebook_pattern_size(header);
+    uint32 pattern_count = codebook.size() / pattern_size;
+    const uint8 *data = *input;
+
+    if ((block_width % PTCX_CODEBOOK_TILE_SIZE) || (block_height % PTCX_CODEBOOK_TILE_SIZE))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    memset(output, 0, (block_width * block_height * step_bits) >> 3);
+
+    for (uint32 tile_y = 0; tile_y < block_height; tile_y += PTCX_CODEBOOK_TILE_SIZE)
+    for (uint32 tile_x = 0; tile_x < block_width; tile_x += PTCX_CODEBOOK_TILE_SIZE)
+    {
+        PTCX_INDEX_PATTERN pattern;
+        const uint8 *packed = 0;
+
+        if (data >= input_end)
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+
+        uint8 code = *(data++);
+
+        if (PTCX_CODEBOOK_ESCAPE == code)
+        {
+            if (data + pattern_size > input_end)
+            {
+                return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+            }
+
+            packed = data;
+            data += pattern_size;
+        }
+        else
+        {
+            if (code >= pattern_count)
+            {
+                return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+            }
+
+            packed = &codebook[code * pattern_size];
+        }
+
+        unpack_pattern(packed, step_bits, &pattern);
+        store_tile(pattern, block_width, tile_x, tile_y, step_bits, output);
+    }
+
+    (*input) = data;
+
+    return BASE_SUCCESS;
+}
@@ -57,20 +57,6 @@ status read_macroblock_table(stream *input, const PTCX_FILE_HEADER &header, std:
     return BASE_SUCCESS;
 }
 
-uint8 query_macroblock_shift(uint8 *input, uint32 x, uint32 width_in_blocks, uint32 y)
-{
-    // The byte we must access is uiBlockIndex / 4, and the bits within that byte are defined by
-    // ( bits >> ( 2 * ( uiBlockIndex % 4 ) ) ) & 0x3.
-
-    uint32 block_index = y * width_in_blocks + x;
-    uint32 byte_index = block_index >> 2;
-    uint32 bit_data = 0;
-
-    bit_data = input[byte_index];
-
-    return (bit_data >> ((block_index % 4) << 1)) & 0x3;
-}
-
 status read_macroblock(stream *input, const PTCX_FILE_HEADER &header, uint32 start_x, uint32 start_y, image *output)
 {
     uint32 quant_step_count = 1 << header.quant_step_bits;
@@ -84,18 +70,22 @@ status read_macroblock(stream *input, const PTCX_FILE_HEADER &header, uint32 sta
 
     read_control_values(input, &range, header);
 
-    int16 min_value[3] = {range.min_value[0], range.min_value[1], range.min_value[2]};
-    int16 max_value[3] = {range.max_value[0], range.max_value[1], range.max_value[2]};
-    int16 range_delta[3] = {max_value[0] - min_value[0], max_value[1] - min_value[1], max_value[2] - min_value[2]};
+    PTCX_PALETTE_RANGE palette_range;
+
+    expand_palette_range(range, &palette_range);
 
     // Read our quantization table out to the image, using the number of bits (and
     // thus steps) as defined by our ptcx file header structure.
 
+    uint32 block_pitch = output->query_block_pitch();
+    uint32 pixel_bytes = output->query_bits_per_pixel() >> 3;
+    uint8 *block_data = output->query_data() + output->query_block_offset(start_x, start_y);
+
     for (uint32 subj = 0; subj < header.block_height; subj++)
     for (uint32 subi = 0; subi < header.block_width; subi++)
     {
         uint32 linear_sub_index = subi + subj * header.block_width;
-        uint8 *dest_pixel = output->query_data() + output->query_block_offset(start_x + subi, start_y + subj);
+        uint8 *dest_pixel = block_data + subj * block_pitch + subi * pixel_bytes;
 
         // If we have an empty byte of data in our look aside buffer, read one in.
         if (0 == ((header.quant_step_bits * linear_sub_index) % 8))
@@ -113,51 +103,50 @@ status read_macroblock(stream *input, const PTCX_FILE_HEADER &header, uint32 sta
         uint32 step_value = (quant_look_aside & quant_step_mask);
         quant_look_aside >>= header.quant_step_bits;
 
-        dest_pixel[0] = min_value[0] + range_delta[0] / quant_step_mask * step_value;
-        dest_pixel[1] = min_value[1] + range_delta[1] / quant_step_mask * step_value;
-        dest_pixel[2] = min_value[2] + range_delta[2] / quant_step_mask * step_value;
+        dest_pixel[0] = palette_range.min_value[0] + palette_range.range_delta[0] / quant_step_mask * step_value;
+        dest_pixel[1] = palette_range.min_value[1] + palette_range.range_delta[1] / quant_step_mask * step_value;
+        dest_pixel[2] = palette_range.min_value[2] + palette_range.range_delta[2] / quant_step_mask * step_value;
     }
 
     return BASE_SUCCESS;
 }
 
-status inverse_quantize(stream *input, const PTCX_FILE_HEADER &header, image *output)
+// Version 2 files store a single macroblock table for the whole image, followed by the
+// control values and indices of every microblock interleaved in one payload.
+//
+// At the start of these files, just after our header, we have a quantization map that indicates a 
+// per-macro-block block shift. Each entry in our map is two bits, and we have one set of these
+// bits for each macro block (defined as the block width * height in our header). The caller reads 
+// the map, and we then decode row_count rows starting at first_row into output at row dest_y.
+status inverse_quantize_legacy(stream *input, const PTCX_FILE_HEADER &header, const std::vector<uint8> &macroblock_table, 
+                               uint32 first_row, uint32 row_count, image *output, uint32 dest_y)
 {    
-    std::vector<uint8> macroblock_table;
     PTCX_FILE_HEADER temp_header = header;  
-    
-    // At the start of our file, just after our header, we have a quantization map that indicates a 
-    // per-macro-block block shift. Each entry in our map is two bits, and we have one set of these
-    // bits for each macro block (defined as the block width * height in our header). 
-
-    if (base_failed(read_macroblock_table(input, header, &macroblock_table)))
-    {
-        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
-    }
 
     // Dequantize the data and place in our output buffer
-    for (uint32 j = 0; j < output->query_height(); j += header.block_height)
-    for (uint32 i = 0; i < output->query_width(); i += header.block_width)
+    for (uint32 j = first_row; j < first_row + row_count; j += header.block_height)
+    for (uint32 i = 0; i < header.image_width; i += header.block_width)
     {
         // Query our micro-block size and proceed to decompress each micro-block
         // within our larger macro-block. We grab our two bits and divide the 
         // supplied macroblock dimensions by that amount (down to a minimum of two).
 
-        uint8 macro_scale_bits = \
-            query_macroblock_shift(&macroblock_table[0], i / header.block_width,
-                                   header.image_width / header.block_width, j / header.block_height );
+        uint32 block_index = (j / header.block_height) * (header.image_width / header.block_width) + i / header.block_width;
+        uint32 micro_width = 0;
+        uint32 micro_height = 0;
 
-        temp_header.block_width = header.block_width >> macro_scale_bits;
-        temp_header.block_height = header.block_height >> macro_scale_bits;
+        PTCX_MACROBLOCK_ENTRY entry;
+        read_macroblock_entry(header, &macroblock_table[0], block_index, &entry);
+        query_microblock_size(header, entry, &micro_width, &micro_height);
 
-        if (temp_header.block_width < 2) temp_header.block_width = 2;
-        if (temp_header.block_height < 2) temp_header.block_height = 2;
+        temp_header.block_width = micro_width;
+        temp_header.block_height = micro_height;
 
         for (uint32 micro_j = 0; micro_j < (header.block_height / temp_header.block_height); micro_j++)
         for (uint32 micro_i = 0; micro_i < (header.block_width / temp_header.block_width); micro_i++)
         {
             uint32 adjusted_i = i + micro_i * temp_header.block_width;
-            uint32 adjusted_j = j + micro_j * temp_header.block_height;
+            uint32 adjusted_j = j - first_row + dest_y + micro_j * temp_header.block_height;
 
             if (base_failed(read_macroblock(input, temp_header, adjusted_i, adjusted_j, output)))
             {
@@ -171,9 +160,9 @@ status inverse_quantize(stream *input, const PTCX_FILE_HEADER &header, image *ou
             for (uint32 subi = 0; subi < temp_header.block_width; subi++)
             {
                 uint8 *dest_pixel = output->query_data() + output->query_block_offset(adjusted_i + subi, adjusted_j + subj);
-                dest_pixel[0] = (128 + macro_scale_bits * 32);
-                dest_pixel[1] = (64 + macro_scale_bits * 32);
-                dest_pixel[2] = (64 + macro_scale_bits * 32); 
+                dest_pixel[0] = (128 + (entry.shift_x + entry.shift_y) * 16);
+                dest_pixel[1] = (64 + (entry.shift_x + entry.shift_y) * 16);
+                dest_pixel[2] = (64 + (entry.shift_x + entry.shift_y) * 16); 
             }
 #endif
         }        
@@ -182,51 +171,812 @@ status inverse_quantize(stream *input, const PTCX_FILE_HEADER &header, image *ou
     return BASE_SUCCESS;
 }
 
-status load_ptcx(stream *input, image *output)
+void unpack_control_values(const uint8 *input, const PTCX_FILE_HEADER &header, PTCX_PIXEL_RANGE *range)
 {
-    uint32 bytes_read = 0;
-    PTCX_FILE_HEADER pxh = {0};
+    switch (header.quant_control_bits)
+    {
+        case 16:
+        {
+            uint16 min_value = input[0] | (input[1] << 8);
+            uint16 max_value = input[2] | (input[3] << 8);
 
-    if (BASE_PARAM_CHECK)
+            range->min_value[0] = ((min_value) & 0x1F) * 8;
+            range->min_value[1] = ((min_value >> 5) & 0x3F) * 4;
+            range->min_value[2] = ((min_value >> 11) & 0x1F) * 8;
+
+            range->max_value[0] = ((max_value) & 0x1F) * 8;
+            range->max_value[1] = ((max_value >> 5) & 0x3F) * 4;
+            range->max_value[2] = ((max_value >> 11) & 0x1F) * 8;
+
+        } break;
+
+        default: base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    };
+}
+
+void expand_palette_range(const PTCX_PIXEL_RANGE &range, PTCX_PALETTE_RANGE *palette)
+{
+    for (uint8 c = 0; c < 3; c++)
     {
-        if (!input || !output || input->is_empty()) 
+        palette->min_value[c] = range.min_value[c];
+        palette->range_delta[c] = static_cast<int16>(range.max_value[c] - range.min_value[c]);
+    }
+}
+
+status decode_microblock(const PTCX_FILE_HEADER &header, uint32 block_width, uint32 block_height, uint32 quant_step_bits,
+                         uint32 color_space, PTCX_BAND_CURSOR *cursor, image *output, uint32 start_x, uint32 start_y)
+{
+    uint32 quant_step_mask = (1 << quant_step_bits) - 1;
+    uint32 control_bytes = (header.quant_control_bits << 1) >> 3;
+    uint32 index_bytes = (block_width * block_height * quant_step_bits + 7) >> 3;
+
+    if (cursor->control + control_bytes > cursor->control_end)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    // Solid microblocks carry no indices.
+    bool is_solid = is_solid_microblock(header, cursor->control);
+
+    if (is_solid)
+    {
+        index_bytes = 0;
+    }
+
+    if (cursor->index + index_bytes > cursor->index_end)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    PTCX_PIXEL_RANGE range = {{255, 255, 255}, {0, 0, 0}};
+
+    unpack_control_values(cursor->control, header, &range);
+    cursor->control += control_bytes;
+
+    // Large blocks in tiled images span several tiles, so we write each row in runs that
+    // never cross a tile boundary.
+
+    uint32 pixel_bytes = output->query_bits_per_pixel() >> 3;
+    uint32 run_width = base_min2(block_width, output->query_block_run_width());
+
+    if (is_solid)
+    {
+        // Expand the color into a single run, and then replicate that run with block copies.
+        uint8 solid_row[PTCX_MAX_BLOCK_SIZE * 3];
+        uint8 color[3] = {range.min_value[0], range.min_value[1], range.min_value[2]};
+        uint32 run_bytes = run_width * pixel_bytes;
+
+        if (PTCX_COLOR_SPACE_YCOCG == color_space)
         {
-            return BASE_ERROR_INVALIDARG;
+            correlate_color(color, color);
+        }
+
+        for (uint32 subi = 0; subi < run_bytes; subi += pixel_bytes)
+        {
+            solid_row[subi + 0] = color[0];
+            solid_row[subi + 1] = color[1];
+            solid_row[subi + 2] = color[2];
+        }
+
+        for (uint32 subj = 0; subj < block_height; subj++)
+        for (uint32 run = 0; run < block_width; run += run_width)
+        {
+            memcpy(output->query_data() + output->query_block_offset(start_x + run, start_y + subj), solid_row, run_bytes);
+        }
+
+        return BASE_SUCCESS;
+    }
+
+    // Expand the control values into the full palette of reconstruction colors once, 
+    // so that each pixel is a simple table lookup.
+
+    PTCX_PALETTE_RANGE palette_range;
+
+    expand_palette_range(range, &palette_range);
+    uint8 palette[1 << PTCX_MAX_QUANT_STEP_BITS][3];
+
+    for (uint32 step_value = 0; step_value <= quant_step_mask; step_value++)
+    {
+        palette[step_value][0] = palette_range.min_value[0] + palette_range.range_delta[0] / quant_step_mask * step_value;
+        palette[step_value][1] = palette_range.min_value[1] + palette_range.range_delta[1] / quant_step_mask * step_value;
+        palette[step_value][2] = palette_range.min_value[2] + palette_range.range_delta[2] / quant_step_mask * step_value;
+
+        if (PTCX_COLOR_SPACE_YCOCG == color_space)
+        {
+            correlate_color(palette[step_value], palette[step_value]);
+        }
+    }
+
+    const uint8 *index_data = cursor->index;
+    uint8 quant_look_aside = 0;
+
+    for (uint32 subj = 0; subj < block_height; subj++)
+    for (uint32 run = 0; run < block_width; run += run_width)
+    {
+        uint8 *dest_pixel = output->query_data() + output->query_block_offset(start_x + run, start_y + subj);
+
+        for (uint32 subi = run; subi < run + run_width; subi++, dest_pixel += pixel_bytes)
+        {
+            uint32 linear_sub_index = subi + subj * block_width;
+
+            // Indices are packed from the least significant bits upward, and never 
+            // straddle a byte boundary.
+
+            if (0 == ((quant_step_bits * linear_sub_index) % 8))
+            {
+                quant_look_aside = *(index_data++);
+            }
+
+            const uint8 *color = palette[quant_look_aside & quant_step_mask];
+            quant_look_aside >>= quant_step_bits;
+
+            dest_pixel[0] = color[0];
+            dest_pixel[1] = color[1];
+            dest_pixel[2] = color[2];
         }
     }
 
-    if (base_failed(input->read_data(&pxh, sizeof(PTCX_FILE_HEADER), &bytes_read)))
+    cursor->index += index_bytes;
+
+    return BASE_SUCCESS;
+}
+
+status decode_planar_microblock(uint32 block_width, uint32 block_height, uint32 color_space,
+                                PTCX_BAND_CURSOR *cursor, image *output, uint32 start_x, uint32 start_y)
+{
+    if (cursor->control + PTCX_PLANAR_CONTROL_SIZE > cursor->control_end)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    PTCX_PLANAR_COLORS colors;
+
+    unpack_planar_colors(cursor->control, &colors);
+    cursor->control += PTCX_PLANAR_CONTROL_SIZE;
+
+    // Each channel is a linear function of x and y, so we step across each row with a
+    // single add per channel. This matches evaluate_planar_color exactly.
+
+    uint32 width_bits = log2(block_width);
+    uint32 height_bits = log2(block_height);
+    uint32 area_bits = width_bits + height_bits;
+    uint32 pixel_bytes = output->query_bits_per_pixel() >> 3;
+    uint32 run_width = base_min2(block_width, output->query_block_run_width());
+    bool is_decorrelated = PTCX_COLOR_SPACE_YCOCG == color_space;
+
+    int32 step_x[3];
+    int32 step_y[3];
+    int32 row_value[3];
+
+    for (uint8 c = 0; c < 3; c++)
+    {
+        step_x[c] = (colors.horizontal[c] - colors.origin[c]) * (1 << height_bits);
+        step_y[c] = (colors.vertical[c] - colors.origin[c]) * (1 << width_bits);
+        row_value[c] = (colors.origin[c] << area_bits) + ((1 << area_bits) >> 1);
+    }
+
+    for (uint32 subj = 0; subj < block_height; subj++)
+    {
+        for (uint32 run = 0; run < block_width; run += run_width)
+        {
+            uint8 *dest_pixel = output->query_data() + output->query_block_offset(start_x + run, start_y + subj);
+            int32 value[3] = {row_value[0] + step_x[0] * static_cast<int32>(run), 
+                              row_value[1] + step_x[1] * static_cast<int32>(run), 
+                              row_value[2] + step_x[2] * static_cast<int32>(run)};
+
+            for (uint32 subi = 0; subi < run_width; subi++, dest_pixel += pixel_bytes)
+            {
+                dest_pixel[0] = base_min2(base_max2(value[0], 0) >> area_bits, 255);
+                dest_pixel[1] = base_min2(base_max2(value[1], 0) >> area_bits, 255);
+                dest_pixel[2] = base_min2(base_max2(value[2], 0) >> area_bits, 255);
+
+                if (is_decorrelated)
+                {
+                    correlate_color(dest_pixel, dest_pixel);
+                }
+
+                value[0] += step_x[0];
+                value[1] += step_x[1];
+                value[2] += step_x[2];
+            }
+        }
+
+        row_value[0] += step_y[0];
+        row_value[1] += step_y[1];
+        row_value[2] += step_y[2];
+    }
+
+    return BASE_SUCCESS;
+}
+
+status decode_codebook_microblock(const PTCX_FILE_CONTEXT &context, uint32 block_width, uint32 block_height, uint32 color_space,
+                                  PTCX_BAND_CURSOR *cursor, image *output, uint32 start_x, uint32 start_y)
+{
+    const PTCX_FILE_HEADER &header = context.header;
+    uint32 control_bytes = (header.quant_control_bits << 1) >> 3;
+
+    if (cursor->control + control_bytes > cursor->control_end)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    if (is_solid_microblock(header, cursor->control))
+    {
+        return decode_microblock(header, block_width, block_height, header.quant_step_bits, color_space, cursor, output, start_x, start_y);
+    }
+
+    // Expand our tiles into conventional packed indices, and decode from those.
+
+    uint8 indices[PTCX_MAX_INDEX_DATA_SIZE];
+    PTCX_BAND_CURSOR tile_cursor = *cursor;
+
+    if (base_failed(expand_codebook_indices(header, context.codebook, block_width, block_height, &cursor->index, cursor->index_end, indices)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    tile_cursor.index = indices;
+    tile_cursor.index_end = indices + ((block_width * block_height * header.quant_step_bits) >> 3);
+
+    if (base_failed(decode_microblock(header, block_width, block_height, header.quant_step_bits, color_space, &tile_cursor, output, start_x, start_y)))
     {
         return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
     }
 
-    if (bytes_read != sizeof(PTCX_FILE_HEADER))
+    cursor->control = tile_cursor.control;
+
+    return BASE_SUCCESS;
+}
+
+status decode_reference_macroblock(const PTCX_FILE_HEADER &header, uint32 block_index, PTCX_BAND_CURSOR *cursor, image *output, 
+                                   uint32 start_x, uint32 start_y)
+{
+    uint32 distance = 0;
+
+    if (cursor->control + PTCX_REFERENCE_CONTROL_SIZE > cursor->control_end)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    if ((header.flags & PTCX_FLAG_KEPT_BLOCKS) && !cursor->control[0] && !cursor->control[1])
+    {
+        // The macroblock is unchanged from the previous frame, whose pixels the output 
+        // already holds.
+
+        cursor->control += PTCX_REFERENCE_CONTROL_SIZE;
+        return BASE_SUCCESS;
+    }
+
+    if (base_failed(read_reference_distance(cursor->control, block_index, &distance)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    cursor->control += PTCX_REFERENCE_CONTROL_SIZE;
+
+    // The referenced macroblock lies earlier in the same band, and so has already been
+    // decoded into the output. We simply copy its pixels.
+
+    uint32 blocks_per_row = header.image_width / header.block_width;
+    uint32 source_index = block_index - distance;
+    uint32 source_x = (source_index % blocks_per_row) * header.block_width;
+    uint32 source_y = start_y - (block_index / blocks_per_row - source_index / blocks_per_row) * header.block_height;
+
+    uint32 pixel_bytes = output->query_bits_per_pixel() >> 3;
+    uint32 run_width = base_min2((uint32) header.block_width, output->query_block_run_width());
+
+    for (uint32 subj = 0; subj < header.block_height; subj++)
+    for (uint32 run = 0; run < header.block_width; run += run_width)
+    {
+        memcpy(output->query_data() + output->query_block_offset(start_x + run, start_y + subj),
+               output->query_data() + output->query_block_offset(source_x + run, source_y + subj), run_width * pixel_bytes);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status read_header(stream *input, PTCX_FILE_HEADER *header)
+{
+    return read_header(input, PTCX_SUPPORTED_FLAGS, header);
+}
+
+status read_header(stream *input, uint32 supported_flags, PTCX_FILE_HEADER *header)
+{
+    memset(header, 0, sizeof(PTCX_FILE_HEADER));
+
+    // All versions share the legacy header as a prefix. Later versions append fields,
+    // which we read once we've established the version of the file.
+
+    if (base_failed(read_stream_data(input, header, PTCX_LEGACY_HEADER_SIZE)))
     {
         return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
     }
-    
+
+    if (PTCX_MAGIC_VALUE != header->magic)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    if (PTCX_LEGACY_VERSION != header->version)
+    {
+        if (sizeof(PTCX_FILE_HEADER) != header->header_size)
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+
+        if (base_failed(read_stream_data(input, reinterpret_cast<uint8 *>(header) + PTCX_LEGACY_HEADER_SIZE, 
+                                         sizeof(PTCX_FILE_HEADER) - PTCX_LEGACY_HEADER_SIZE)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
     // Verify the integrity of our file
-    if (PTCX_MAGIC_VALUE != pxh.magic || sizeof(PTCX_FILE_HEADER) != pxh.header_size)
+    if (base_failed(verify_header(*header, supported_flags)))
     {
         return base_post_error(BASE_ERROR_INVALID_RESOURCE);
     }
 
-    if (2 != pxh.version)
+    return BASE_SUCCESS;
+}
+
+status read_file_context(stream *input, PTCX_FILE_CONTEXT *context)
+{
+    return read_level_context(input, 0, context);
+}
+
+status read_level_context(stream *input, uint32 level, PTCX_FILE_CONTEXT *context)
+{
+    if (base_failed(read_header(input, &context->header)))
     {
-        return base_post_error( BASE_ERROR_INVALID_RESOURCE );
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
     }
 
-    // Create our image as an RGB8 source.
-    if (base_failed(create_image(IGN_IMAGE_FORMAT_R8G8B8, pxh.image_width, pxh.image_height, output)))
+    // A mip chain skips ahead to the requested level, which is itself a single level file.
+    if (context->header.flags & PTCX_FLAG_MIP_CHAIN)
+    {
+        if (level >= context->header.image_depth)
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+
+        if (base_failed(seek_mip_level(input, context->header, level)) || 
+            base_failed(read_header(input, &context->header)) ||
+            (context->header.flags & PTCX_FLAG_MIP_CHAIN))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+    }
+    else if (level)
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    if (base_failed(read_file_models(input, context)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status read_file_models(stream *input, PTCX_FILE_CONTEXT *context)
+{
+    if (context->header.flags & PTCX_FLAG_INDEX_CODEBOOK)
+    {
+        if (base_failed(read_index_codebook(input, context->header, &context->codebook)))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+    }
+
+    if (context->header.flags & PTCX_FLAG_ENTROPY_CODED)
+    {
+        if (base_failed(read_entropy_table(input, &context->control_model)) ||
+            base_failed(read_entropy_table(input, &context->index_model)))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+status read_band_section(stream *input, const PTCX_ENTROPY_TABLE &model, std::vector<uint8> *coded, std::vector<uint8> *output)
+{
+    uint32 coded_size = 0;
+
+    if (base_failed(read_stream_data(input, &coded_size, sizeof(coded_size))))
     {
         return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
     }
 
+    if (coded_size > query_entropy_capacity(output->size()))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    coded->resize(coded_size);
+
+    if (base_failed(read_stream_data(input, coded->data(), coded_size)) ||
+        base_failed(entropy_decode(model, coded->data(), coded_size, output->data(), output->size())))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status read_band(stream *input, const PTCX_FILE_CONTEXT &context, PTCX_BAND_DATA *output)
+{
+    const PTCX_FILE_HEADER &header = context.header;
+    PTCX_BAND_HEADER band_header = {};
+
+    if (base_failed(read_stream_data(input, &band_header, sizeof(PTCX_BAND_HEADER))))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    // Reject sizes that no encoder could have produced, before allocating anything.
+    if (band_header.control_size > query_band_control_capacity(header) || band_header.index_size > query_band_capacity(header))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    // Predicted endpoints are read into a staging section, and then reconstructed into
+    // the raw control values that decode_band expects.
+
+    bool is_predicted = !!(header.flags & PTCX_FLAG_PREDICTED_ENDPOINTS);
+    std::vector<uint8> *control = is_predicted ? &output->residual : &output->control;
+
+    output->table.resize(query_band_table_size(header));
+    control->resize(band_header.control_size);
+    output->index.resize(band_header.index_size);
+
+    if (base_failed(read_stream_data(input, output->table.data(), output->table.size())))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    if (header.flags & PTCX_FLAG_ENTROPY_CODED)
+    {
+        if (base_failed(read_band_section(input, context.control_model, &output->coded, control)) ||
+            base_failed(read_band_section(input, context.index_model, &output->coded, &output->index)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+    else
+    {
+        if (base_failed(read_stream_data(input, control->data(), control->size())) ||
+            base_failed(read_stream_data(input, output->index.data(), output->index.size())))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    if (is_predicted)
+    {
+        if (base_failed(reconstruct_band_endpoints(header, output->table.data(), output->residual, &output->control)))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+status skip_band(stream *input, const PTCX_FILE_CONTEXT &context)
+{
+    const PTCX_FILE_HEADER &header = context.header;
+    PTCX_BAND_HEADER band_header = {};
+
+    if (base_failed(read_stream_data(input, &band_header, sizeof(PTCX_BAND_HEADER))))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    if (band_header.control_size > query_band_control_capacity(header) || band_header.index_size > query_band_capacity(header))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    if (base_failed(input->skip_data(query_band_table_size(header))))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    // Entropy coded sections lead with their coded size, so neither section needs to be
+    // decoded in order to pass over it.
+
+    uint32 section_sizes[2] = {band_header.control_size, band_header.index_size};
+
+    for (uint32 i = 0; i < 2; i++)
+    {
+        uint32 section_size = section_sizes[i];
+
+        if (header.flags & PTCX_FLAG_ENTROPY_CODED)
+        {
+            if (base_failed(read_stream_data(input, &section_size, sizeof(section_size))))
+            {
+                return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+            }
+
+            if (section_size > query_entropy_capacity(section_sizes[i]))
+            {
+                return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+            }
+        }
+
+        if (base_failed(input->skip_data(section_size)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+status decode_band(const PTCX_FILE_CONTEXT &context, const PTCX_BAND_DATA &band, image *output, uint32 dest_y)
+{
+    const PTCX_FILE_HEADER &header = context.header;
+    uint32 block_index = 0;
+    PTCX_BAND_CURSOR cursor;
+
+    cursor.control = band.control.data();
+    cursor.control_end = cursor.control + band.control.size();
+    cursor.index = band.index.data();
+    cursor.index_end = cursor.index + band.index.size();
+
+    for (uint32 j = 0; j < header.band_height; j += header.block_height)
+    for (uint32 i = 0; i < header.image_width; i += header.block_width)
+    {
+        // Query our micro-block size and proceed to decompress each micro-block
+        // within our larger macro-block.
+
+        PTCX_PARTITION_REGION regions[PTCX_MAX_PARTITION_REGIONS];
+        PTCX_MACROBLOCK_ENTRY entry;
+
+        if (base_failed(read_macroblock_entry(header, band.table.data(), block_index++, &entry)))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+
+        if (PTCX_BLOCK_MODE_REFERENCE == entry.mode)
+        {
+            if (base_failed(decode_reference_macroblock(header, block_index - 1, &cursor, output, i, dest_y + j)))
+            {
+                return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+            }
+
+            continue;
+        }
+
+        uint32 region_count = query_partition_regions(header, entry, regions);
+
+        for (uint32 r = 0; r < region_count; r++)
+        for (uint32 micro_j = regions[r].y; micro_j < regions[r].y + regions[r].height; micro_j += regions[r].micro_height)
+        for (uint32 micro_i = regions[r].x; micro_i < regions[r].x + regions[r].width; micro_i += regions[r].micro_width)
+        {
+            uint32 micro_width = regions[r].micro_width;
+            uint32 micro_height = regions[r].micro_height;
+            status result = BASE_SUCCESS;
+
+            if (PTCX_BLOCK_MODE_PLANAR == entry.mode)
+            {
+                result = decode_planar_microblock(micro_width, micro_height, entry.color_space, &cursor, output, i + micro_i, dest_y + j + micro_j);
+            }
+            else if (PTCX_BLOCK_MODE_CODEBOOK == entry.mode)
+            {
+                result = decode_codebook_microblock(context, micro_width, micro_height, entry.color_space, &cursor, output, i + micro_i, dest_y + j + micro_j);
+            }
+            else
+            {
+                result = decode_microblock(header, micro_width, micro_height, entry.quant_step_bits, entry.color_space, &cursor, output, 
+                                           i + micro_i, dest_y + j + micro_j);
+            }
+
+            if (base_failed(result))
+            {
+                return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+            }
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+status inverse_quantize(stream *input, const PTCX_FILE_CONTEXT &context, image *output)
+{
+    const PTCX_FILE_HEADER &header = context.header;
+    PTCX_BAND_DATA band;
+
+    for (uint32 j = 0; j < header.image_height; j += header.band_height)
+    {
+        if (base_failed(read_band(input, context, &band)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+
+        if (base_failed(decode_band(context, band, output, j)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+status decode_image(stream *input, const PTCX_FILE_CONTEXT &context, image *output)
+{
+    const PTCX_FILE_HEADER &pxh = context.header;
+
     // Dequantize our image blob based on the header data.
-    if (base_failed(inverse_quantize(input, pxh, output)))
+    if (PTCX_LEGACY_VERSION == pxh.version)
+    {
+        std::vector<uint8> macroblock_table;
+
+        if (base_failed(read_macroblock_table(input, pxh, &macroblock_table)) ||
+            base_failed(inverse_quantize_legacy(input, pxh, macroblock_table, 0, pxh.image_height, output, 0)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+
+        return BASE_SUCCESS;
+    }
+
+    if (base_failed(inverse_quantize(input, context, output)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status load_ptcx(stream *input, image *output)
+{
+    return load_ptcx(input, IGN_IMAGE_LAYOUT_LINEAR, output);
+}
+
+status load_ptcx(stream *input, IGN_IMAGE_LAYOUT layout, image *output)
+{
+    return load_ptcx_level(input, 0, layout, output);
+}
+
+status load_ptcx_level(stream *input, uint32 level, image *output)
+{
+    return load_ptcx_level(input, level, IGN_IMAGE_LAYOUT_LINEAR, output);
+}
+
+status load_ptcx_level(stream *input, uint32 level, IGN_IMAGE_LAYOUT layout, image *output)
+{
+    PTCX_FILE_CONTEXT context;
+    const PTCX_FILE_HEADER &pxh = context.header;
+
+    if (BASE_PARAM_CHECK)
+    {
+        if (!input || !output || input->is_empty()) 
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    status result = read_level_context(input, level, &context);
+
+    if (base_failed(result))
+    {
+        return (BASE_ERROR_INVALIDARG == result) ? result : base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    // Create our image as an RGB8 source.
+    if (base_failed(create_image(IGN_IMAGE_FORMAT_R8G8B8, layout, pxh.image_width, pxh.image_height, output)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    if (base_failed(decode_image(input, context, output)))
     {
         return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
     }
 
     return BASE_SUCCESS;
 }
+
+status decode_delta(stream *input, uint32 supported_flags, image *output)
+{
+    PTCX_FILE_CONTEXT context;
+    const PTCX_FILE_HEADER &header = context.header;
+
+    if (base_failed(read_header(input, supported_flags, &context.header)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    // A delta is a single level file of the size of the image that it updates.
+
+    if (PTCX_MAJOR_VERSION != header.version || (header.flags & PTCX_FLAG_MIP_CHAIN) ||
+        header.image_width != output->query_width() || header.image_height != output->query_height())
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    if (base_failed(read_file_models(input, &context)) ||
+        base_failed(inverse_quantize(input, context, output)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status load_ptcx_scanlines(stream *input, PTCX_SCANLINE_CALLBACK callback, void *context)
+{
+    PTCX_FILE_CONTEXT file_context;
+    const PTCX_FILE_HEADER &pxh = file_context.header;
+
+    if (BASE_PARAM_CHECK)
+    {
+        if (!input || !callback || input->is_empty()) 
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    if (base_failed(read_file_context(input, &file_context)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    // Legacy files have no bands, but their macroblock rows never exceed the default 
+    // band height, so we deliver them in the same sized groups.
+
+    uint32 band_height = (PTCX_LEGACY_VERSION == pxh.version) ? PTCX_BAND_HEIGHT : pxh.band_height;
+
+    // Our rolling buffer holds a single band. It is the only pixel storage we allocate, 
+    // regardless of the height of the image.
+
+    image band_image;
+    PTCX_BAND_DATA band;
+    std::vector<uint8> macroblock_table;
+
+    if (base_failed(create_image(IGN_IMAGE_FORMAT_R8G8B8, pxh.image_width, band_height, &band_image)))
+    {
+        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+    }
+
+    if (PTCX_LEGACY_VERSION == pxh.version)
+    {
+        if (base_failed(read_macroblock_table(input, pxh, &macroblock_table)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    for (uint32 j = 0; j < pxh.image_height; j += band_height)
+    {
+        if (PTCX_LEGACY_VERSION == pxh.version)
+        {
+            if (base_failed(inverse_quantize_legacy(input, pxh, macroblock_table, j, band_height, &band_image, 0)))
+            {
+                return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+            }
+        }
+        else
+        {
+            if (base_failed(read_band(input, file_context, &band)) || base_failed(decode_band(file_context, band, &band_image, 0)))
+            {
+                return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+            }
+        }
+
+        status result = callback(band_image, j, pxh.image_height, context);
+
+        if (base_failed(result))
+        {
+            // The consumer asked us to stop.
+            return result;
+        }
+    }
+
+    return BASE_SUCCESS;
+}
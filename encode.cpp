@@ -1,5 +1,6 @@
 
 #include "ptcx_internal.h"
+#include <unordered_map>
 
 uint32 configure_quality_quant_step_bits(uint8 quality)
 {
@@ -21,11 +22,11 @@ uint32 configure_quality_block_width(uint8 quality)
     switch (quality)
     {
         case 0:
-        case 1: return PTCX_MAX_BLOCK_SIZE;
-        case 2: return PTCX_MAX_BLOCK_SIZE >> 1;
-        case 3: return PTCX_MAX_BLOCK_SIZE >> 2;
-        case 4: return PTCX_MAX_BLOCK_SIZE >> 3;
-        default: return PTCX_MAX_BLOCK_SIZE >> 2;
+        case 1: return PTCX_DEFAULT_BLOCK_SIZE;
+        case 2: return PTCX_DEFAULT_BLOCK_SIZE >> 1;
+        case 3: return PTCX_DEFAULT_BLOCK_SIZE >> 2;
+        case 4: return PTCX_DEFAULT_BLOCK_SIZE >> 3;
+        default: return PTCX_DEFAULT_BLOCK_SIZE >> 2;
     }
 
     return 4;
@@ -52,15 +53,56 @@ uint32 sum_square_differences(uint8 *list_a, uint8 *list_b, uint32 count)
     return total;
 }
 
-// Computes the quantization step value and (optionally) returns the quantized result.
-uint8 quantize_pixel(uint8 quant_step_bits, const PTCX_PIXEL_RANGE &range, uint8 *source_pixel, uint32 *error = NULL)
+uint32 measure_pixel_error(const PTCX_BLOCK_DATA &block, const uint8 *source_pixel, const uint8 *reconstruction)
 {
-    uint8 step_value = 0;
+    // Decorrelated blocks are measured in RGB, as the decoder will reconstruct them, so 
+    // that every file is held to the same quality threshold.
+
+    uint8 source_color[3] = {source_pixel[0], source_pixel[1], source_pixel[2]};
+    uint8 color[3] = {reconstruction[0], reconstruction[1], reconstruction[2]};
+
+    if (PTCX_COLOR_SPACE_YCOCG == block.color_space)
+    {
+        correlate_color(source_color, source_color);
+        correlate_color(color, color);
+    }
+
+    return sum_square_differences(source_color, color, 3);
+}
+
+// Rectangular partitions pair every horizontal level with every vertical level.
+#define PTCX_MAX_PARTITION_COUNT                 (PTCX_MAX_PARTITION_LEVELS * PTCX_MAX_PARTITION_LEVELS)
 
+// Each partition may be tried as both an indexed and a planar macroblock.
+#define PTCX_MAX_TRIAL_COUNT                     (PTCX_MAX_PARTITION_COUNT * 2 * 2)
+
+// Output of a single partition trial. Control values and indices are kept apart
+// because they are stored in separate sections of a band.
+typedef struct PTCX_TRIAL_BUFFER
+{
+    ring_buffer<uint8> control;
+    ring_buffer<uint8> index;
+    uint32 error;
+
+} PTCX_TRIAL_BUFFER;
+
+// Per-range constants used by quantize_pixel. These depend only upon the range and
+// the step count, so we compute them once per trial rather than once per pixel.
+typedef struct PTCX_QUANTIZER
+{
+    int16 min_value[3];
+    int16 range_delta[3];
+    int16 unit_length;
+    uint8 step_count;
+
+} PTCX_QUANTIZER;
+
+void prepare_quantizer(uint8 quant_step_bits, const PTCX_PIXEL_RANGE &range, PTCX_QUANTIZER *output)
+{
     // Here we're simply calculating the length of the vector that runs from our 
-    // pixel boundary maximum coordinate to that of our minimum coordinate (range). We then
-    // calculate the vector from our minimum coordinate to our current pixel (pixel) and 
-    // project this vector onto (range) in order to determine its relative length percentage.
+    // pixel boundary maximum coordinate to that of our minimum coordinate (range). Each
+    // pixel vector is later projected onto (range) in order to determine its relative 
+    // length percentage.
 
     int16 min_value[3] = {range.min_value[0], range.min_value[1], range.min_value[2]};
     int16 max_value[3] = {range.max_value[0], range.max_value[1], range.max_value[2]};
@@ -68,47 +110,64 @@ uint8 quantize_pixel(uint8 quant_step_bits, const PTCX_PIXEL_RANGE &range, uint8
     int32 range_dot = range_delta[0] * range_delta[0] + range_delta[1] * range_delta[1] + range_delta[2] * range_delta[2];
     int16 range_length = sqrt(range_dot);
 
-    uint8 step_count = (1 << quant_step_bits) - 1;
-    int16 unit_length = (step_count ? (range_length / step_count) : 0);
+    output->step_count = (1 << quant_step_bits) - 1;
+    output->unit_length = (output->step_count ? (range_length / output->step_count) : 0);
+
+    for (uint8 c = 0; c < 3; c++)
+    {
+        output->min_value[c] = min_value[c];
+        output->range_delta[c] = range_delta[c];
+    }
+}
+
+// Computes the quantization step value and (optionally) returns the reconstructed pixel.
+uint8 quantize_pixel(const PTCX_QUANTIZER &quantizer, const uint8 *source_pixel, uint8 *reconstruction = NULL)
+{
+    uint8 step_value = 0;
 
     // We calculate the ratio of our (pixel) vector to that of our (range) vector and then 
     // map it to the set of quantization values, which are based on the number of quantization 
     // steps we're allowed to use (minus one to account for the inclusion of 1.0f).
 
+    const int16 *min_value = quantizer.min_value;
     int16 pixel_values[3] = {source_pixel[0], source_pixel[1], source_pixel[2]};
     int16 pixel_delta[3] = {pixel_values[0] - min_value[0], pixel_values[1] - min_value[1], pixel_values[2] - min_value[2]};
     int32 pixel_dot = pixel_delta[0] * pixel_delta[0] + pixel_delta[1] * pixel_delta[1] + pixel_delta[2] * pixel_delta[2];
     int16 pixel_length = sqrt(pixel_dot);
 
-    step_value = (unit_length ? (pixel_length / unit_length) : 0);
-    
-    if (error)
-    {
-        uint8 reconstruction[3] =
-        {
-            min_value[0] + range_delta[0] / step_count * step_value,
-            min_value[1] + range_delta[1] / step_count * step_value,
-            min_value[2] + range_delta[2] / step_count * step_value,
-        };
+    step_value = (quantizer.unit_length ? (pixel_length / quantizer.unit_length) : 0);
+
+    // Pixels beyond the far endpoint (or short ranges whose unit length truncates) may
+    // exceed the final step, which would spill into the neighbouring index bits.
 
-        (*error) = sum_square_differences(source_pixel, reconstruction, 3);
+    step_value = base_min2(step_value, quantizer.step_count);
+
+    if (reconstruction)
+    {
+        reconstruction[0] = min_value[0] + quantizer.range_delta[0] / quantizer.step_count * step_value;
+        reconstruction[1] = min_value[1] + quantizer.range_delta[1] / quantizer.step_count * step_value;
+        reconstruction[2] = min_value[2] + quantizer.range_delta[2] / quantizer.step_count * step_value;
     }
 
     return step_value;
 }
 
-void write_quantization_table(const PTCX_FILE_HEADER &header, const PTCX_PIXEL_RANGE &range, const image &input, uint32 x, uint32 y, ring_buffer<uint8> *output)
+void write_quantization_table(const PTCX_FILE_HEADER &header, const PTCX_PIXEL_RANGE &range, const PTCX_BLOCK_DATA &block, uint32 x, uint32 y, ring_buffer<uint8> *output)
 {
     uint32 quant_step_count = 1 << header.quant_step_bits;
     uint32 quant_step_mask = quant_step_count - 1;
     uint8 quant_look_aside = 0;
 
+    PTCX_QUANTIZER quantizer;
+    prepare_quantizer(header.quant_step_bits, range, &quantizer);
+
     for (uint32 subj = 0; subj < header.block_height; subj++)
     for (uint32 subi = 0; subi < header.block_width; subi++)
     {
         uint32 linear_sub_index = subi + subj * header.block_width;
-        uint8 *src_pixel = input.query_data() + input.query_block_offset(x + subi, y + subj);
-        uint32 clamped_index = quantize_pixel(header.quant_step_bits, range, src_pixel);
+        uint32 staged_index = (y + subj) * PTCX_MAX_BLOCK_SIZE + (x + subi);
+        uint8 src_pixel[3] = {block.channel[0][staged_index], block.channel[1][staged_index], block.channel[2][staged_index]};
+        uint32 clamped_index = quantize_pixel(quantizer, src_pixel);
 
         // Add this new quantized value into our list. Note that we always add to the most 
         // significant bits in order to ensure proper ordering for a future dequantization 
@@ -129,6 +188,19 @@ void write_quantization_table(const PTCX_FILE_HEADER &header, const PTCX_PIXEL_R
             }
         }
     }
+
+    // Small blocks with single bit indices may end part way through a byte. We flush the
+    // remaining bits, shifted down to where the decoder expects them.
+
+    uint32 trailing_bits = (header.block_width * header.block_height * header.quant_step_bits) % 8;
+
+    if (trailing_bits)
+    {
+        if (base_failed(output->write(quant_look_aside >> (8 - trailing_bits))))
+        {
+            base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
 }
 
 void write_control_values(const PTCX_PIXEL_RANGE &range, const PTCX_FILE_HEADER &header, ring_buffer<uint8> *output)
@@ -168,29 +240,95 @@ void write_control_values(const PTCX_PIXEL_RANGE &range, const PTCX_FILE_HEADER
     };
 }
 
-uint32 estimate_quantization_error(const PTCX_FILE_HEADER &header, const PTCX_PIXEL_RANGE &range, const image &input, uint32 pixel_x, uint32 pixel_y)
+uint32 estimate_quantization_error(const PTCX_FILE_HEADER &header, const PTCX_PIXEL_RANGE &range, const PTCX_BLOCK_DATA &block, uint32 pixel_x, uint32 pixel_y)
 {
     uint32 error = 0;
-    uint8 quant_look_aside = 0;
-    uint32 quant_step_count = 1 << header.quant_step_bits;
-    uint32 quant_step_mask = quant_step_count - 1;
+
+    PTCX_QUANTIZER quantizer;
+    prepare_quantizer(header.quant_step_bits, range, &quantizer);
 
     for (uint32 subj = 0; subj < header.block_height; subj++)
     for (uint32 subi = 0; subi < header.block_width;  subi++ )
     {
-        uint32 temp_error;
+        uint8 reconstruction[3];
 
         // quantize the source value, dequantize it, and then compare against the source (add squared error to sum)
-        uint8 *source_pixel = input.query_data() + input.query_block_offset(pixel_x + subi, pixel_y + subj);        
-        quantize_pixel(header.quant_step_bits, range, source_pixel, &temp_error);
+        uint32 staged_index = (pixel_y + subj) * PTCX_MAX_BLOCK_SIZE + (pixel_x + subi);
+        uint8 source_pixel[3] = {block.channel[0][staged_index], block.channel[1][staged_index], block.channel[2][staged_index]};
+        quantize_pixel(quantizer, source_pixel, reconstruction);
+
+        error += measure_pixel_error(block, source_pixel, reconstruction); 
+    }
+
+    return error;
+}
+
+bool is_uniform_microblock(const PTCX_BLOCK_MOMENTS &moments)
+{
+    // A microblock is uniform when every channel has zero variance, in which case 
+    // n * sum(x^2) == sum(x)^2. Such blocks quantize without error.
+
+    for (uint8 c = 0; c < 3; c++)
+    {
+        if (static_cast<uint64>(moments.count) * moments.sum_squares[c] != static_cast<uint64>(moments.sum[c]) * moments.sum[c])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool is_solid_range(const PTCX_PIXEL_RANGE &range)
+{
+    // Ranges whose endpoints pack to the same control value reconstruct to a single color.
+    return (range.min_value[0] >> 3) == (range.max_value[0] >> 3) &&
+           (range.min_value[1] >> 2) == (range.max_value[1] >> 2) &&
+           (range.min_value[2] >> 3) == (range.max_value[2] >> 3);
+}
+
+uint32 estimate_solid_range(const PTCX_BLOCK_MOMENTS &moments, PTCX_PIXEL_RANGE *range)
+{
+    const uint8 channel_shift[3] = {3, 2, 3};
+    int64 error = 0;
+
+    // Select the control value nearest to the mean of each channel, and measure the squared
+    // error of representing every pixel with it: sum((x - v)^2) = sum(x^2) - 2v * sum(x) + n * v^2.
+
+    for (uint8 c = 0; c < 3; c++)
+    {
+        uint32 step_count = moments.count << channel_shift[c];
+        uint32 code = base_min2((moments.sum[c] + (step_count >> 1)) / step_count, (uint32) (255 >> channel_shift[c]));
+        int64 value = code << channel_shift[c];
 
-        error += temp_error; 
+        range->min_value[c] = value;
+        range->max_value[c] = value;
+
+        error += moments.sum_squares[c] - 2 * value * moments.sum[c] + moments.count * value * value;
     }
 
     return error;
 }
 
-void quantize_microblock(const image &input, const PTCX_FILE_HEADER &header, uint32 pixel_x, uint32 pixel_y, ring_buffer<uint8> *output, uint32 *error)
+void round_control_range(PTCX_PIXEL_RANGE *range)
+{
+    // Stored control values truncate each channel. In YCoCg-R the truncation of luma and
+    // of both chroma channels accumulates within the reconstructed RGB channels, so blocks 
+    // in that space round to the nearest stored value instead.
+
+    const uint8 channel_shift[3] = {3, 2, 3};
+
+    for (uint8 c = 0; c < 3; c++)
+    {
+        uint32 half = 1 << (channel_shift[c] - 1);
+        uint32 limit = 255 >> channel_shift[c];
+
+        range->min_value[c] = base_min2((range->min_value[c] + half) >> channel_shift[c], limit) << channel_shift[c];
+        range->max_value[c] = base_min2((range->max_value[c] + half) >> channel_shift[c], limit) << channel_shift[c];
+    }
+}
+
+void quantize_microblock(const PTCX_BLOCK_DATA &block, const PTCX_FILE_HEADER &header, uint32 pixel_x, uint32 pixel_y, PTCX_TRIAL_BUFFER *output)
 {
     uint32 best_quant_func = 0;
     uint32 lowest_quant_error = BASE_MAX_UINT32;   
@@ -202,6 +340,14 @@ void quantize_microblock(const image &input, const PTCX_FILE_HEADER &header, uin
         {{255, 255, 255}, {0, 0, 0}}
     };
 
+    // Uniform blocks are represented exactly by their min/max range, so we skip the
+    // trial error measurement entirely.
+
+    PTCX_BLOCK_MOMENTS moments;
+    query_block_moments(block, pixel_x, pixel_y, header.block_width, header.block_height, &moments);
+
+    bool is_uniform = is_uniform_microblock(moments);
+
     // We support three different methods for generating the control values. Selection
     // of these values, in conjunction with the particular characteristics of the source
     // data, has a large impact on the quality of the compression -- so we perform all three 
@@ -211,17 +357,29 @@ void quantize_microblock(const image &input, const PTCX_FILE_HEADER &header, uin
     {
         switch (quant)
         {
-            case 0: range_estimate_min_max(header, &range[quant], input, pixel_x, pixel_y); break;
+            case 0: range_estimate_min_max(header, &range[quant], block, pixel_x, pixel_y); break;
             
             // For most images these estimators will increase processing costs with little added benefit.
-            // case 1: range_estimate_regression(header, &range[quant], input, pixel_x, pixel_y); break;
-            // case 2: range_estimate_linear_distance(header, &range[quant], input, pixel_x, pixel_y); break;
+            // case 1: range_estimate_regression(header, &range[quant], block, pixel_x, pixel_y); break;
+            // case 2: range_estimate_linear_distance(header, &range[quant], block, pixel_x, pixel_y); break;
 
             default: continue;
         };
 
+        if (PTCX_COLOR_SPACE_YCOCG == block.color_space)
+        {
+            round_control_range(&range[quant]);
+        }
+
+        if (is_uniform)
+        {
+            lowest_quant_error = 0;
+            best_quant_func = quant;
+            break;
+        }
+
         // Calculate the expected error to determine the best range method.
-        uint32 quant_error = estimate_quantization_error(header, range[quant], input, pixel_x, pixel_y);
+        uint32 quant_error = estimate_quantization_error(header, range[quant], block, pixel_x, pixel_y);
 
         if (quant_error <= lowest_quant_error)
         {
@@ -230,6 +388,30 @@ void quantize_microblock(const image &input, const PTCX_FILE_HEADER &header, uin
         }
     }
 
+    // A single color is cheaper to store than a full range, so we prefer it whenever it
+    // is no less accurate.
+
+    bool use_solid_blocks = !!(header.flags & PTCX_FLAG_SOLID_BLOCKS);
+
+    if (use_solid_blocks && !is_uniform)
+    {
+        PTCX_PIXEL_RANGE solid_range;
+        uint32 solid_error = estimate_solid_range(moments, &solid_range);
+
+        if (PTCX_COLOR_SPACE_YCOCG == block.color_space)
+        {
+            // Our moments only describe the error in the transformed space.
+            round_control_range(&solid_range);
+            solid_error = estimate_quantization_error(header, solid_range, block, pixel_x, pixel_y);
+        }
+
+        if (solid_error <= lowest_quant_error)
+        {
+            lowest_quant_error = solid_error;
+            range[best_quant_func] = solid_range;
+        }
+    }
+
 #if PTCX_SHOW_RANGE_MAP
     range[best_quant_func].min_value[0] =  64 + best_quant_func * 32;
     range[best_quant_func].min_value[1] = 128 + best_quant_func * 32;
@@ -242,245 +424,1367 @@ void quantize_microblock(const image &input, const PTCX_FILE_HEADER &header, uin
     // Using the best quant func write out our control values as well as
     // our full quantization table.
 
-    (*error) += lowest_quant_error;
-    write_control_values(range[best_quant_func], header, output);
-    write_quantization_table(header, range[best_quant_func], input, pixel_x, pixel_y, output);
+    output->error += lowest_quant_error;
+    write_control_values(range[best_quant_func], header, &output->control);
+
+    if (!use_solid_blocks || !is_solid_range(range[best_quant_func]))
+    {
+        write_quantization_table(header, range[best_quant_func], block, pixel_x, pixel_y, &output->index);
+    }
 }
 
-void write_macroblock_table_entry(uint8 *mb_table, uint32 x, uint32 width_in_blocks, uint32 y, uint8 value)
+uint8 quantize_planar_channel(float value, uint32 channel_shift)
 {
-    // The byte we must access is block_index / 4, and the bits within that byte 
-    // are defined by (bits >> (2 * (block_index % 4))) & 0x3.
-
-    uint32 block_index = y * width_in_blocks + x;
-    uint32 byte_index = block_index >> 2;
-    uint8 bit_shift = (block_index % 4) << 1;
-    uint8 *bit_data = 0;
-    uint8 bit_mask = 0;
-
-    // Fetch our byte from the buffer.
-    bit_data = &mb_table[byte_index];
-    bit_mask = 0x3 << bit_shift;
-    (*bit_data) &= (value << bit_shift) | (~bit_mask);
+    int32 code = static_cast<int32>(value / (1 << channel_shift) + 0.5f);
+    return base_min2(base_max2(code, 0), 255 >> channel_shift) << channel_shift;
 }
 
-status quantize_macroblock(const image &input, const PTCX_FILE_HEADER &header, uint32 pixel_x, uint32 pixel_y, ring_buffer<uint8> *trial_buffers, uint8 *mb_table, stream *out_stream)
+void quantize_planar_microblock(const PTCX_BLOCK_DATA &block, const PTCX_FILE_HEADER &header, uint32 pixel_x, uint32 pixel_y, PTCX_TRIAL_BUFFER *output)
 {
-    PTCX_FILE_HEADER trial_header = header;
-    
-    uint8 final_macroblock_level = 2;
-    uint32 block_pixel_count = header.block_width * header.block_height;
-    uint32 trial_macroblock_error[3] = {0};
+    const uint8 channel_shift[3] = {3, 2, 3};
+    uint32 width = header.block_width;
+    uint32 height = header.block_height;
+    uint32 width_bits = log2(width);
+    uint32 height_bits = log2(height);
 
-    // We check which microblock size yields the best compression 
-    // ratio for the provided quality.
+    // Fit a plane to each channel by least squares. Our pixel grid is symmetric about its
+    // center, so the horizontal and vertical slopes may be solved independently.
+
+    float center_x = (width - 1) * 0.5f;
+    float center_y = (height - 1) * 0.5f;
+    float variance_x = height * width * (width * width - 1.0f) / 12.0f;
+    float variance_y = width * height * (height * height - 1.0f) / 12.0f;
 
-    for (uint32 block_shift = 0; block_shift < 3; block_shift++)
+    PTCX_PLANAR_COLORS colors;
+
+    for (uint8 c = 0; c < 3; c++)
     {
-        trial_buffers[block_shift].empty();
+        float sum = 0;
+        float sum_x = 0;
+        float sum_y = 0;
 
-        trial_header.block_width = header.block_width >> block_shift;
-        trial_header.block_height = header.block_height >> block_shift;
+        for (uint32 subj = 0; subj < height; subj++)
+        for (uint32 subi = 0; subi < width; subi++)
+        {
+            float value = block.channel[c][(pixel_y + subj) * PTCX_MAX_BLOCK_SIZE + (pixel_x + subi)];
 
-        if (trial_header.block_width < 2) trial_header.block_width = 2;
-        if (trial_header.block_height < 2) trial_header.block_height = 2;
+            sum += value;
+            sum_x += (subi - center_x) * value;
+            sum_y += (subj - center_y) * value;
+        }
 
-        // Traverse each pixel, appending control bits onto our trial table. Note that
-        // the control bits specified in the header will be a power of 2 between 2 and 8.
+        float slope_x = sum_x / variance_x;
+        float slope_y = sum_y / variance_y;
+        float origin = sum / (width * height) - slope_x * center_x - slope_y * center_y;
 
-        for (uint32 micro_j = 0; micro_j < (header.block_height / trial_header.block_height); micro_j++)
-        for (uint32 micro_i = 0; micro_i < (header.block_width / trial_header.block_width); micro_i++)
-        {
-            uint32 sub_x = pixel_x + micro_i * trial_header.block_width;
-            uint32 sub_y = pixel_y + micro_j * trial_header.block_height;
+        colors.origin[c] = quantize_planar_channel(origin, channel_shift[c]);
+        colors.horizontal[c] = quantize_planar_channel(origin + slope_x * width, channel_shift[c]);
+        colors.vertical[c] = quantize_planar_channel(origin + slope_y * height, channel_shift[c]);
+    }
+
+    // Measure the error of the plane exactly as the decoder will reconstruct it.
+
+    for (uint32 subj = 0; subj < height; subj++)
+    for (uint32 subi = 0; subi < width; subi++)
+    {
+        uint32 staged_index = (pixel_y + subj) * PTCX_MAX_BLOCK_SIZE + (pixel_x + subi);
+        uint8 source_pixel[3] = {block.channel[0][staged_index], block.channel[1][staged_index], block.channel[2][staged_index]};
+        uint8 reconstruction[3];
 
-            quantize_microblock(input, trial_header, sub_x, sub_y, &trial_buffers[block_shift], 
-                                &trial_macroblock_error[block_shift]);
+        for (uint8 c = 0; c < 3; c++)
+        {
+            reconstruction[c] = evaluate_planar_color(colors, c, width_bits, height_bits, subi, subj);
         }
 
-        // Convert our measured sum of squared error into mean squared quantization error.
-        trial_macroblock_error[block_shift] = trial_macroblock_error[block_shift] / block_pixel_count;
+        output->error += measure_pixel_error(block, source_pixel, reconstruction);
     }
 
-    // Select the best compression option whose error rate is below our threshold, and write its 
-    // results to the output.
+    uint8 control[PTCX_PLANAR_CONTROL_SIZE];
+    pack_planar_colors(colors, control);
 
-    if (trial_macroblock_error[0] <= PTCX_QUALITY_DELTA) 
+    for (uint32 i = 0; i < PTCX_PLANAR_CONTROL_SIZE; i++)
     {
-        final_macroblock_level = 0;
+        output->control.write(control[i]);
     }
-    else if (trial_macroblock_error[1] <= PTCX_QUALITY_DELTA) 
+}
+
+// The location of a macroblock's coded data within its band, which allows later 
+// macroblocks to confirm that they are exact duplicates.
+typedef struct PTCX_BLOCK_RECORD
+{
+    PTCX_MACROBLOCK_ENTRY entry;
+    uint32 control_offset;
+    uint32 control_size;
+    uint32 index_offset;
+    uint32 index_size;
+
+} PTCX_BLOCK_RECORD;
+
+// Encoder state that persists across bands. Everything here is proportional to the
+// width of the image (or smaller), regardless of its height, with the exception of 
+// deferred bands.
+struct PTCX_BAND_ENCODER_STATE
+{
+    PTCX_FILE_CONTEXT context;
+    stream *output;
+    uint32 band_index;
+
+    PTCX_TRIAL_BUFFER trial_buffers[PTCX_MAX_TRIAL_COUNT];
+    PTCX_TRIAL_BUFFER region_buffers[PTCX_MAX_PARTITION_COUNT];
+    PTCX_BLOCK_DATA staging[2];                  // indexed by PTCX_COLOR_SPACE_*
+    PTCX_BAND_DATA band;
+
+    // Entropy coded files cannot be written until every band has contributed to the
+    // file models, so we hold on to the quantized bands until the encode completes.
+    std::vector<PTCX_BAND_DATA> deferred_bands;
+
+    // Macroblocks of the current band, hashed by their source pixels and by their coded
+    // output, used to emit references to duplicates.
+    std::vector<PTCX_BLOCK_RECORD> band_blocks;
+    std::unordered_map<uint64, uint32> source_hashes;
+    std::unordered_map<uint64, uint32> output_hashes;
+
+    // The images that a delta file may keep macroblocks from, if any (see save_ptcx_delta).
+    const image *previous_frame;
+    const PTCX_BLOCK_INDEX *base_index;
+};
+
+uint64 hash_bytes(const uint8 *data, uint32 size, uint64 hash)
+{
+    // 64 bit FNV-1a.
+    for (uint32 i = 0; i < size; i++)
     {
-        final_macroblock_level = 1;
+        hash = (hash ^ data[i]) * 0x100000001B3ull;
     }
 
-    write_macroblock_table_entry(mb_table, pixel_x / header.block_width, header.image_width / header.block_width, 
-                                 pixel_y / header.block_height, final_macroblock_level);
+    return hash;
+}
+
+uint64 hash_block_data(const PTCX_BLOCK_DATA &block, uint32 width, uint32 height)
+{
+    uint64 hash = PTCX_HASH_BASIS;
 
-    out_stream->write_data(trial_buffers[final_macroblock_level].peek(), 
-                           trial_buffers[final_macroblock_level].query_occupancy());
+    for (uint8 c = 0; c < 3; c++)
+    for (uint32 j = 0; j < height; j++)
+    {
+        hash = hash_bytes(&block.channel[c][j * PTCX_MAX_BLOCK_SIZE], width, hash);
+    }
 
-    return BASE_SUCCESS;
+    return hash;
 }
 
-status quantize_worker(const image &input, const PTCX_FILE_HEADER &header, uint8 *mb_table, stream *out_stream)
-{    
-    ring_buffer<uint8> trial_buffers[3];
+bool is_identical_source(const image &input, const image &source, uint32 width, uint32 height, uint32 x, uint32 y, 
+                         uint32 source_x, uint32 source_y)
+{
+    uint32 pixel_bytes = input.query_bits_per_pixel() >> 3;
+    uint32 run_width = base_min2(width, base_min2(input.query_block_run_width(), source.query_block_run_width()));
 
-    for (uint8 i = 0; i < 3; i++)
+    for (uint32 j = 0; j < height; j++)
+    for (uint32 run = 0; run < width; run += run_width)
     {
-        if (PTCX_MAX_BLOCK_DATA_SIZE != trial_buffers[i].resize_capacity(PTCX_MAX_BLOCK_DATA_SIZE))
+        if (memcmp(input.query_data() + input.query_block_offset(x + run, y + j),
+                   source.query_data() + source.query_block_offset(source_x + run, source_y + j), run_width * pixel_bytes))
         {
-            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+            return false;
         }
     }
 
-    for (uint32 j = 0; j < input.query_height(); j += header.block_height)
-    for (uint32 i = 0; i < input.query_width(); i += header.block_width)
+    return true;
+}
+
+bool is_identical_base_output(const PTCX_BLOCK_INDEX &base, uint32 block_index, const PTCX_MACROBLOCK_ENTRY &entry,
+                              const uint8 *control, uint32 control_size, const uint8 *index, uint32 index_size)
+{
+    // The microblocks of a base macroblock are decoded from the bytes at its location, so
+    // matching entries and bytes reconstruct identical pixels.
+
+    const PTCX_BLOCK_LOCATION &location = base.blocks[block_index];
+    const PTCX_BAND_DATA &band = base.bands[block_index / query_band_macroblock_count(base.context.header)];
+    PTCX_MACROBLOCK_ENTRY base_entry;
+
+    if (base_failed(read_indexed_entry(base, block_index, &base_entry)))
     {
-        if (base_failed(quantize_macroblock(input, header, i, j, trial_buffers, mb_table, out_stream)))
-        {
-            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
-        }
+        return false;
     }
 
-    return BASE_SUCCESS;
+    return is_identical_entry(base.context.header, base_entry, entry) &&
+           location.control_offset + control_size <= band.control.size() && location.index_offset + index_size <= band.index.size() &&
+           !memcmp(&band.control[location.control_offset], control, control_size) &&
+           (0 == index_size || !memcmp(&band.index[location.index_offset], index, index_size));
+}
+
+bool is_identical_output(const PTCX_FILE_HEADER &header, const PTCX_BAND_DATA &band, const PTCX_BLOCK_RECORD &record, 
+                         const PTCX_MACROBLOCK_ENTRY &entry, const uint8 *control, uint32 control_size, const uint8 *index, uint32 index_size)
+{
+    return is_identical_entry(header, record.entry, entry) &&
+           record.control_size == control_size && record.index_size == index_size &&
+           !memcmp(&band.control[record.control_offset], control, control_size) &&
+           (0 == index_size || !memcmp(&band.index[record.index_offset], index, index_size));
+}
+
+void write_reference_macroblock(PTCX_BAND_ENCODER_STATE *state, uint32 block_index, uint32 source_index)
+{
+    const PTCX_FILE_HEADER &header = state->context.header;
+    PTCX_MACROBLOCK_ENTRY entry = {PTCX_BLOCK_MODE_REFERENCE, 0, 0, header.quant_step_bits, {0}, {0}, 0};
+    uint32 distance = block_index - source_index;
+
+    write_macroblock_entry(header, &state->band.table[0], block_index, entry);
+
+    state->band.control.push_back(distance & 0xFF);
+    state->band.control.push_back(distance >> 8);
+
+    // References are never themselves the target of an output match.
+    memset(&state->band_blocks[block_index], 0, sizeof(PTCX_BLOCK_RECORD));
+    state->band_blocks[block_index].entry = entry;
 }
 
-status prepare_temporary_buffers(const PTCX_FILE_HEADER &header, memory_stream *temp_stream, std::vector<uint8> *macroblock_table)
+void append_trial_buffer(ring_buffer<uint8> *input, std::vector<uint8> *output)
 {
-    uint32 max_image_size = (header.image_width / 2) * (header.image_height * 2) * (6 + 2);
-    uint32 macroblock_table_size = (header.image_width / header.block_width) * (header.image_height / header.block_height);
-    macroblock_table_size = (macroblock_table_size << 1) >> 3;
+    uint32 occupancy = input->query_occupancy();
 
-    if (!macroblock_table_size)
+    if (occupancy)
     {
-        // We do not support images with fewer than 4 blocks.
-        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        uint8 *data = input->peek();
+        output->insert(output->end(), data, data + occupancy);
     }
+}
 
-    macroblock_table->resize(macroblock_table_size);
+void append_region_buffer(ring_buffer<uint8> *input, ring_buffer<uint8> *output)
+{
+    uint32 occupancy = input->query_occupancy();
+    const uint8 *data = occupancy ? input->peek() : 0;
 
-    if (macroblock_table_size != macroblock_table->size())
+    for (uint32 i = 0; i < occupancy; i++)
     {
-        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        output->write(data[i]);
     }
+}
+
+void quantize_region(const PTCX_BLOCK_DATA &block, const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry,
+                     const PTCX_PARTITION_REGION &region, PTCX_TRIAL_BUFFER *output)
+{
+    PTCX_FILE_HEADER trial_header = header;
 
-    if (max_image_size != temp_stream->resize_capacity(max_image_size))
+    trial_header.block_width = region.micro_width;
+    trial_header.block_height = region.micro_height;
+    trial_header.quant_step_bits = entry.quant_step_bits;
+
+    // Traverse each microblock, appending its control values and indices onto our trial
+    // buffer.
+
+    for (uint32 sub_y = region.y; sub_y < region.y + region.height; sub_y += region.micro_height)
+    for (uint32 sub_x = region.x; sub_x < region.x + region.width; sub_x += region.micro_width)
     {
-        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        if (PTCX_BLOCK_MODE_PLANAR == entry.mode)
+        {
+            quantize_planar_microblock(block, trial_header, sub_x, sub_y, output);
+        }
+        else
+        {
+            quantize_microblock(block, trial_header, sub_x, sub_y, output);
+        }
     }
-
-    return BASE_SUCCESS;
 }
 
-status quantize_image(const image &input, const PTCX_FILE_HEADER &header, stream *out_stream)
+void quantize_split_macroblock(PTCX_BAND_ENCODER_STATE *state, PTCX_MACROBLOCK_ENTRY *entry, PTCX_TRIAL_BUFFER *output)
 {
-    if (BASE_PARAM_CHECK)
+    const PTCX_FILE_HEADER &header = state->context.header;
+    PTCX_PARTITION_REGION regions[PTCX_MAX_PARTITION_REGIONS];
+    bool is_rectangular = !!(header.flags & PTCX_FLAG_RECTANGULAR_PARTITIONS);
+    float quality_delta = PTCX_QUALITY_DELTA;
+
+    memset(entry->region_shift_x, 0, sizeof(entry->region_shift_x));
+    memset(entry->region_shift_y, 0, sizeof(entry->region_shift_y));
+
+    uint32 region_count = query_partition_regions(header, *entry, regions);
+
+    // Each region selects its partition as a default sized macroblock would: the smallest
+    // whose error meets our threshold, preferring fewer microblocks on ties, or otherwise 
+    // the finest.
+
+    for (uint32 r = 0; r < region_count; r++)
     {
-        if (!out_stream)
+        PTCX_PARTITION_REGION region = regions[r];
+        uint32 partition_count = 0;
+        uint32 final_partition = BASE_MAX_UINT32;
+        uint32 final_size = BASE_MAX_UINT32;
+
+        for (uint32 shift_y = 0; shift_y < PTCX_MAX_PARTITION_LEVELS; shift_y++)
+        for (uint32 shift_x = 0; shift_x < PTCX_MAX_PARTITION_LEVELS; shift_x++)
         {
-            return base_post_error(BASE_ERROR_INVALIDARG);
+            if (!is_rectangular && shift_x != shift_y)
+            {
+                continue;
+            }
+
+            PTCX_TRIAL_BUFFER *buffer = &state->region_buffers[partition_count++];
+
+            buffer->control.empty();
+            buffer->index.empty();
+            buffer->error = 0;
+
+            region.micro_width = base_max2(region.width >> shift_x, (uint32) PTCX_MIN_BLOCK_SIZE);
+            region.micro_height = base_max2(region.height >> shift_y, (uint32) PTCX_MIN_BLOCK_SIZE);
+
+            quantize_region(state->staging[entry->color_space], header, *entry, region, buffer);
+
+            uint32 size = buffer->control.query_occupancy() + buffer->index.query_occupancy();
+
+            if (buffer->error / (region.width * region.height) <= quality_delta && size < final_size)
+            {
+                final_partition = partition_count - 1;
+                final_size = size;
+                entry->region_shift_x[r] = shift_x;
+                entry->region_shift_y[r] = shift_y;
+            }
         }
 
-        if (!is_pow2(header.quant_step_bits))
+        if (BASE_MAX_UINT32 == final_partition)
         {
-            return base_post_error(BASE_ERROR_INVALIDARG);
+            final_partition = partition_count - 1;
+            entry->region_shift_x[r] = PTCX_MAX_PARTITION_LEVELS - 1;
+            entry->region_shift_y[r] = PTCX_MAX_PARTITION_LEVELS - 1;
         }
-    }
 
-    memory_stream image_stream;
-    std::vector<uint8> macroblock_table;
+        PTCX_TRIAL_BUFFER *final_buffer = &state->region_buffers[final_partition];
 
-    if (base_failed(prepare_temporary_buffers(header, &image_stream, &macroblock_table)))
-    {
-        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+        append_region_buffer(&final_buffer->control, &output->control);
+        append_region_buffer(&final_buffer->index, &output->index);
+        output->error += final_buffer->error;
     }
+}
 
-    if (base_failed(quantize_worker(input, header, &(macroblock_table[0]), &image_stream)))
-    {
-        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
-    }
+void quantize_partition(PTCX_BAND_ENCODER_STATE *state, PTCX_MACROBLOCK_ENTRY *entry, PTCX_TRIAL_BUFFER *output)
+{
+    const PTCX_FILE_HEADER &header = state->context.header;
+
+    output->control.empty();
+    output->index.empty();
+    output->error = 0;
 
-    // Relay our quantization table and image buffer out to the final output stream with correct order.
-    if (base_failed(out_stream->write_data(&macroblock_table[0], macroblock_table.size())))
+    if (is_split_macroblock(header, *entry))
     {
-        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        quantize_split_macroblock(state, entry, output);
     }
-
-    if (base_failed(out_stream->write_data(image_stream.query_read_pointer(), image_stream.query_occupancy())))
+    else
     {
-        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        PTCX_PARTITION_REGION regions[PTCX_MAX_PARTITION_REGIONS];
+        query_partition_regions(header, *entry, regions);
+        quantize_region(state->staging[entry->color_space], header, *entry, regions[0], output);
     }
 
-    return BASE_SUCCESS;
+    // Convert our measured sum of squared error into mean squared quantization error.
+    output->error = output->error / (header.block_width * header.block_height);
 }
 
-void configure_header_quality(PTCX_FILE_HEADER *header, uint8 quality)
+bool is_color_space_variant(const PTCX_MACROBLOCK_ENTRY &entry_a, const PTCX_MACROBLOCK_ENTRY &entry_b)
 {
-    header->block_width = configure_quality_block_width(quality);
-    header->block_height = configure_quality_block_height(quality);
-    header->quant_step_bits = configure_quality_quant_step_bits(quality);
+    return entry_a.mode == entry_b.mode && entry_a.shift_x == entry_b.shift_x && entry_a.shift_y == entry_b.shift_y &&
+           entry_a.color_space != entry_b.color_space;
 }
 
-void configure_header(const image &input, PTCX_FILE_HEADER *out_header, uint8 quality)
+status quantize_macroblock(const image &input, uint32 pixel_x, uint32 pixel_y, uint32 block_index, PTCX_BAND_ENCODER_STATE *state)
 {
-    out_header->magic = PTCX_MAGIC_VALUE;
-    out_header->version = PTCX_MAJOR_VERSION;                    
-    out_header->header_size = sizeof(PTCX_FILE_HEADER);
-    out_header->image_width = input.query_width();
-    out_header->image_height = input.query_height();
-    out_header->image_depth = PTCX_DEFAULT_IMAGE_DEPTH;
-    out_header->block_width = PTCX_MAX_BLOCK_SIZE / 4;
-    out_header->block_height = PTCX_MAX_BLOCK_SIZE / 4;
-    out_header->quant_step_bits = PTCX_MAX_QUANT_STEP_BITS;
-    out_header->quant_control_bits = PTCX_MAX_QUANT_CONTROL_BITS;
-    out_header->source_format = input.query_image_format();
+    const PTCX_FILE_HEADER &header = state->context.header;
+    PTCX_TRIAL_BUFFER *trial_buffers = state->trial_buffers;
+    PTCX_MACROBLOCK_ENTRY trial_entries[PTCX_MAX_TRIAL_COUNT];
+    
+    uint32 level_count = query_partition_level_count(header);
+    uint32 trial_count = 0;
+    float quality_delta = PTCX_QUALITY_DELTA;
 
-    configure_header_quality(out_header, quality);
-}
+    // Files with adaptive step bits may select any supported index width up to that of the
+    // header, otherwise every macroblock uses the width in the header.
 
-status save_ptcx(const image &input, uint8 quality, stream *output)
-{
-    if (BASE_PARAM_CHECK)
+    const uint8 adaptive_step_bits[] = {1, 2, 4};
+    const uint8 *step_bits_options = &header.quant_step_bits;
+    uint32 step_bits_option_count = 1;
+
+    if (header.flags & PTCX_FLAG_ADAPTIVE_STEP_BITS)
     {
-        if (!output || output->is_full()) 
+        step_bits_options = adaptive_step_bits;
+        step_bits_option_count = log2(header.quant_step_bits) + 1;
+    }
+
+    // Within a sequence, a macroblock whose pixels are unchanged from the previous frame
+    // is kept from that frame, as a reference with a distance of zero.
+
+    if (state->previous_frame && is_identical_source(input, *state->previous_frame, header.block_width, header.block_height, 
+                                                     pixel_x, pixel_y, pixel_x, pixel_y))
+    {
+        write_reference_macroblock(state, block_index, block_index);
+        return BASE_SUCCESS;
+    }
+
+    // Stage the macroblock once per color space. Every trial below reads from the staged 
+    // copy of its color space. Decorrelated files try both, unless the macroblock is too 
+    // saturated for YCoCg-R.
+
+    if (base_failed(load_block_data(input, pixel_x, pixel_y, header.block_width, header.block_height, 
+                                   PTCX_COLOR_SPACE_RGB, &state->staging[PTCX_COLOR_SPACE_RGB])))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    uint32 color_space_count = 1;
+
+    if (header.flags & PTCX_FLAG_DECORRELATED_COLOR)
+    {
+        if (base_failed(load_block_data(input, pixel_x, pixel_y, header.block_width, header.block_height, 
+                                       PTCX_COLOR_SPACE_YCOCG, &state->staging[PTCX_COLOR_SPACE_YCOCG])))
         {
-            return BASE_ERROR_INVALIDARG;
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
         }
 
-        if (IGN_IMAGE_FORMAT_R8G8B8 != input.query_image_format())
+        if (PTCX_COLOR_SPACE_YCOCG == state->staging[PTCX_COLOR_SPACE_YCOCG].color_space)
         {
-            return BASE_ERROR_INVALIDARG;
+            color_space_count = 2;
         }
     }
 
-    uint32 bytes_written = 0;
+    // Enumerate our candidate partitions, from coarsest to finest. Square partitions 
+    // subdivide both dimensions together, while rectangular partitions also consider 
+    // every pairing of horizontal and vertical levels. Each partition is tried in every
+    // block mode and color space that the file permits. The finest partition of a large 
+    // macroblock splits it into regions that each select their own partition.
 
-    PTCX_FILE_HEADER pxh = {0};
+    memset(trial_entries, 0, sizeof(trial_entries));
 
-    // Our input image must be 16 pixel aligned, for now.
-    if (input.query_width() % 16 || input.query_height() % 16)
-    {
-        return BASE_ERROR_INVALID_RESOURCE;
-    }
-    
-    configure_header(input, &pxh, quality);
+    bool is_rectangular = !!(header.flags & PTCX_FLAG_RECTANGULAR_PARTITIONS);
+    uint32 mode_count = (header.flags & PTCX_FLAG_PLANAR_BLOCKS) ? 2 : 1;
 
-    if (base_failed(output->write_data(&pxh, sizeof(PTCX_FILE_HEADER), &bytes_written)))
+    for (uint32 shift_y = 0; shift_y < level_count; shift_y++)
+    for (uint32 shift_x = 0; shift_x < level_count; shift_x++)
+    for (uint32 mode = 0; mode < mode_count; mode++)
+    for (uint32 color_space = 0; color_space < color_space_count; color_space++)
     {
-        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        if (is_rectangular || shift_x == shift_y)
+        {
+            trial_entries[trial_count].mode = mode;
+            trial_entries[trial_count].shift_x = shift_x;
+            trial_entries[trial_count].shift_y = shift_y;
+            trial_entries[trial_count].quant_step_bits = header.quant_step_bits;
+            trial_entries[trial_count].color_space = color_space;
+            trial_count++;
+        }
     }
 
-    if (bytes_written != sizeof(PTCX_FILE_HEADER))
+    // A macroblock whose pixels match an earlier macroblock in the band is stored as a
+    // reference to it, without performing any trials.
+
+    bool use_references = !!(header.flags & PTCX_FLAG_BLOCK_REFERENCES);
+    uint32 blocks_per_row = header.image_width / header.block_width;
+
+    if (use_references)
     {
-        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        uint64 source_hash = hash_block_data(state->staging[PTCX_COLOR_SPACE_RGB], header.block_width, header.block_height);
+        std::unordered_map<uint64, uint32>::iterator match = state->source_hashes.find(source_hash);
+
+        if (match != state->source_hashes.end() && block_index - match->second <= PTCX_MAX_REFERENCE_DISTANCE)
+        {
+            uint32 source_x = (match->second % blocks_per_row) * header.block_width;
+            uint32 source_y = pixel_y - (block_index / blocks_per_row - match->second / blocks_per_row) * header.block_height;
+
+            if (is_identical_source(input, input, header.block_width, header.block_height, pixel_x, pixel_y, source_x, source_y))
+            {
+                write_reference_macroblock(state, block_index, match->second);
+                return BASE_SUCCESS;
+            }
+        }
+
+        state->source_hashes[source_hash] = block_index;
     }
 
-    if (base_failed(quantize_image(input, pxh, output)))
+    // We check which microblock size yields the best compression 
+    // ratio for the provided quality.
+
+    for (uint32 trial = 0; trial < trial_count; trial++)
     {
-        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        PTCX_MACROBLOCK_ENTRY *entry = &trial_entries[trial];
+
+        if (PTCX_BLOCK_MODE_PLANAR == entry->mode)
+        {
+            quantize_partition(state, entry, &trial_buffers[trial]);
+            continue;
+        }
+
+        // Index widths are tried from narrowest to widest, stopping at the first that meets
+        // our threshold, since a wider index would only cost more at this partition.
+
+        for (uint32 k = 0; k < step_bits_option_count; k++)
+        {
+            entry->quant_step_bits = step_bits_options[k];
+            quantize_partition(state, entry, &trial_buffers[trial]);
+
+            if (trial_buffers[trial].error <= quality_delta)
+            {
+                break;
+            }
+        }
+    }
+
+    // Select the smallest option whose error rate is below our threshold, preferring the 
+    // partition with fewer microblocks on ties, or between the color spaces of a partition
+    // the one with less error, and write its results to the output. If no option meets 
+    // the threshold we use the finest partition, in its most accurate mode and color space.
+
+    uint32 final_trial = trial_count - 1;
+
+    for (uint32 variant = 1; variant < mode_count * color_space_count; variant++)
+    {
+        if (trial_buffers[trial_count - 1 - variant].error < trial_buffers[final_trial].error)
+        {
+            final_trial = trial_count - 1 - variant;
+        }
+    }
+
+    uint32 final_size = BASE_MAX_UINT32;
+    uint32 final_shift = BASE_MAX_UINT32;
+
+    for (uint32 trial = 0; trial < trial_count; trial++)
+    {
+        uint32 trial_size = trial_buffers[trial].control.query_occupancy() + 
+                            trial_buffers[trial].index.query_occupancy();
+        uint32 trial_shift = trial_entries[trial].shift_x + trial_entries[trial].shift_y;
+
+        if (trial_buffers[trial].error > quality_delta)
+        {
+            continue;
+        }
+
+        if (trial_size < final_size || (trial_size == final_size && trial_shift < final_shift) ||
+            (trial_size == final_size && is_color_space_variant(trial_entries[trial], trial_entries[final_trial]) &&
+             trial_buffers[trial].error < trial_buffers[final_trial].error))
+        {
+            final_trial = trial;
+            final_size = trial_size;
+            final_shift = trial_shift;
+        }
+    }
+
+    const PTCX_MACROBLOCK_ENTRY &final_entry = trial_entries[final_trial];
+    ring_buffer<uint8> &final_control = trial_buffers[final_trial].control;
+    ring_buffer<uint8> &final_index = trial_buffers[final_trial].index;
+
+    if (use_references)
+    {
+        // Distinct source pixels may still quantize to identical output, which we also
+        // store as a reference.
+
+        uint32 control_size = final_control.query_occupancy();
+        uint32 index_size = final_index.query_occupancy();
+        const uint8 *control = control_size ? final_control.peek() : 0;
+        const uint8 *index = index_size ? final_index.peek() : 0;
+
+        // A variant keeps a macroblock that quantizes exactly as its base did.
+
+        if (state->base_index && is_identical_base_output(*state->base_index, state->band_index * query_band_macroblock_count(header) + block_index,
+                                                          final_entry, control, control_size, index, index_size))
+        {
+            write_reference_macroblock(state, block_index, block_index);
+            return BASE_SUCCESS;
+        }
+
+        uint64 output_hash = hash_bytes(control, control_size, PTCX_HASH_BASIS);
+        output_hash = hash_bytes(index, index_size, output_hash);
+
+        std::unordered_map<uint64, uint32>::iterator match = state->output_hashes.find(output_hash);
+
+        if (match != state->output_hashes.end() && block_index - match->second <= PTCX_MAX_REFERENCE_DISTANCE &&
+            is_identical_output(header, state->band, state->band_blocks[match->second], final_entry, control, control_size, index, index_size))
+        {
+            write_reference_macroblock(state, block_index, match->second);
+            return BASE_SUCCESS;
+        }
+
+        state->output_hashes[output_hash] = block_index;
+
+        PTCX_BLOCK_RECORD &record = state->band_blocks[block_index];
+
+        record.entry = final_entry;
+        record.control_offset = state->band.control.size();
+        record.control_size = control_size;
+        record.index_offset = state->band.index.size();
+        record.index_size = index_size;
+    }
+
+    write_macroblock_entry(header, &state->band.table[0], block_index, final_entry);
+
+    append_trial_buffer(&final_control, &state->band.control);
+    append_trial_buffer(&final_index, &state->band.index);
+
+    return BASE_SUCCESS;
+}
+
+void reset_band(PTCX_BAND_ENCODER_STATE *state)
+{
+    const PTCX_FILE_HEADER &header = state->context.header;
+
+    state->band.control.clear();
+    state->band.index.clear();
+    state->band.table.assign(query_band_table_size(header), 0);
+
+    if (header.flags & PTCX_FLAG_BLOCK_REFERENCES)
+    {
+        // References never cross bands.
+        state->band_blocks.resize(query_band_macroblock_count(header));
+        state->source_hashes.clear();
+        state->output_hashes.clear();
+    }
+}
+
+status finish_band(PTCX_BAND_ENCODER_STATE *state)
+{
+    const PTCX_FILE_HEADER &header = state->context.header;
+
+    if (header.flags & PTCX_FLAG_PREDICTED_ENDPOINTS)
+    {
+        if (base_failed(predict_band_endpoints(header, state->band.table.data(), state->band.control, &state->band.residual)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+status quantize_band(const image &input, uint32 source_y, PTCX_BAND_ENCODER_STATE *state)
+{
+    const PTCX_FILE_HEADER &header = state->context.header;
+    uint32 block_index = 0;
+
+    reset_band(state);
+
+    for (uint32 j = 0; j < header.band_height; j += header.block_height)
+    for (uint32 i = 0; i < header.image_width; i += header.block_width)
+    {
+        if (base_failed(quantize_macroblock(input, i, source_y + j, block_index++, state)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    return finish_band(state);
+}
+
+const std::vector<uint8> &query_control_section(const PTCX_FILE_HEADER &header, const PTCX_BAND_DATA &band)
+{
+    return (header.flags & PTCX_FLAG_PREDICTED_ENDPOINTS) ? band.residual : band.control;
+}
+
+status write_band_section(stream *output, const PTCX_ENTROPY_TABLE &model, const std::vector<uint8> &section, std::vector<uint8> *coded)
+{
+    if (base_failed(entropy_encode(model, section.data(), section.size(), coded)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    uint32 coded_size = coded->size();
+
+    if (base_failed(write_stream_data(output, &coded_size, sizeof(coded_size))) ||
+        base_failed(write_stream_data(output, coded->data(), coded_size)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status write_band(stream *output, const PTCX_FILE_CONTEXT &context, PTCX_BAND_DATA *band)
+{
+    // Each band is self delimiting, so a decoder can consume it without any knowledge 
+    // of the bands that follow.
+
+    const std::vector<uint8> &control = query_control_section(context.header, *band);
+    PTCX_BAND_HEADER band_header = {};
+
+    band_header.control_size = control.size();
+    band_header.index_size = band->index.size();
+
+    if (base_failed(write_stream_data(output, &band_header, sizeof(PTCX_BAND_HEADER))) ||
+        base_failed(write_stream_data(output, band->table.data(), band->table.size())))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    if (context.header.flags & PTCX_FLAG_ENTROPY_CODED)
+    {
+        if (base_failed(write_band_section(output, context.control_model, control, &band->coded)) ||
+            base_failed(write_band_section(output, context.index_model, band->index, &band->coded)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+
+        return BASE_SUCCESS;
+    }
+
+    if (base_failed(write_stream_data(output, control.data(), band_header.control_size)) ||
+        base_failed(write_stream_data(output, band->index.data(), band_header.index_size)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    return BASE_SUCCESS;
+}
+
+void accumulate_histogram(const std::vector<uint8> &data, uint32 *histogram)
+{
+    for (uint32 i = 0; i < data.size(); i++)
+    {
+        histogram[data[i]]++;
+    }
+}
+
+bool is_deferred_encoding(const PTCX_FILE_HEADER &header)
+{
+    // Entropy models and the index codebook are both built from every band of the image.
+    return !!(header.flags & (PTCX_FLAG_ENTROPY_CODED | PTCX_FLAG_INDEX_CODEBOOK));
+}
+
+status apply_deferred_codebook(PTCX_BAND_ENCODER_STATE *state)
+{
+    const PTCX_FILE_HEADER &header = state->context.header;
+
+    if (base_failed(build_index_codebook(header, state->deferred_bands, &state->context.codebook)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    for (uint32 i = 0; i < state->deferred_bands.size(); i++)
+    {
+        // Only index data changes, so predicted endpoints remain valid.
+
+        if (base_failed(apply_index_codebook(header, state->context.codebook, &state->deferred_bands[i])))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+status write_deferred_bands(PTCX_BAND_ENCODER_STATE *state)
+{
+    const PTCX_FILE_HEADER &header = state->context.header;
+    uint32 control_histogram[PTCX_ENTROPY_SYMBOL_COUNT] = {0};
+    uint32 index_histogram[PTCX_ENTROPY_SYMBOL_COUNT] = {0};
+
+    // Build our codebook and file models from every band, then emit the header, the 
+    // codebook, the models, and finally the bands themselves.
+
+    if (header.flags & PTCX_FLAG_INDEX_CODEBOOK)
+    {
+        if (base_failed(apply_deferred_codebook(state)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    if (header.flags & PTCX_FLAG_ENTROPY_CODED)
+    {
+        for (uint32 i = 0; i < state->deferred_bands.size(); i++)
+        {
+            accumulate_histogram(query_control_section(header, state->deferred_bands[i]), control_histogram);
+            accumulate_histogram(state->deferred_bands[i].index, index_histogram);
+        }
+
+        build_entropy_table(control_histogram, &state->context.control_model);
+        build_entropy_table(index_histogram, &state->context.index_model);
+    }
+
+    if (base_failed(write_stream_data(state->output, &header, sizeof(PTCX_FILE_HEADER))))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    if (header.flags & PTCX_FLAG_INDEX_CODEBOOK)
+    {
+        if (base_failed(write_index_codebook(state->output, header, state->context.codebook)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    if (header.flags & PTCX_FLAG_ENTROPY_CODED)
+    {
+        if (base_failed(write_entropy_table(state->output, state->context.control_model)) ||
+            base_failed(write_entropy_table(state->output, state->context.index_model)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    for (uint32 i = 0; i < state->deferred_bands.size(); i++)
+    {
+        if (base_failed(write_band(state->output, state->context, &state->deferred_bands[i])))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+void configure_header_quality(PTCX_FILE_HEADER *header, uint8 quality)
+{
+    header->block_width = configure_quality_block_width(quality);
+    header->block_height = configure_quality_block_height(quality);
+    header->quant_step_bits = configure_quality_quant_step_bits(quality);
+}
+
+status configure_header(uint32 width, uint32 height, PTCX_FILE_HEADER *out_header, uint8 quality, uint32 options)
+{
+    out_header->magic = PTCX_MAGIC_VALUE;
+    out_header->version = PTCX_MAJOR_VERSION;                    
+    out_header->header_size = sizeof(PTCX_FILE_HEADER);
+    out_header->image_width = width;
+    out_header->image_height = height;
+    out_header->image_depth = PTCX_DEFAULT_IMAGE_DEPTH;
+    out_header->block_width = PTCX_DEFAULT_BLOCK_SIZE / 4;
+    out_header->block_height = PTCX_DEFAULT_BLOCK_SIZE / 4;
+    out_header->quant_step_bits = PTCX_MAX_QUANT_STEP_BITS;
+    out_header->quant_control_bits = PTCX_MAX_QUANT_CONTROL_BITS;
+    out_header->source_format = IGN_IMAGE_FORMAT_R8G8B8;
+    out_header->flags = 0;
+    out_header->band_height = PTCX_BAND_HEIGHT;
+    out_header->reserved = 0;
+
+    configure_header_quality(out_header, quality);
+
+    // An explicit block size overrides the one selected by quality. Bands must hold at 
+    // least one row of macroblocks.
+
+    uint32 block_size_bits = (options & PTCX_OPTION_BLOCK_SIZE_MASK) >> PTCX_OPTION_BLOCK_SIZE_SHIFT;
+
+    if (block_size_bits)
+    {
+        if ((1u << block_size_bits) < PTCX_MIN_BLOCK_SIZE || (1u << block_size_bits) > PTCX_MAX_BLOCK_SIZE)
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+
+        out_header->block_width = 1 << block_size_bits;
+        out_header->block_height = 1 << block_size_bits;
+    }
+
+    out_header->band_height = base_max2(out_header->band_height, out_header->block_height);
+
+    // Minimum sized macroblocks can neither subdivide nor hold a whole codebook tile, so
+    // those flags would only widen every table entry, and we leave them clear.
+
+    bool is_minimum_block = PTCX_MIN_BLOCK_SIZE == out_header->block_width && PTCX_MIN_BLOCK_SIZE == out_header->block_height;
+
+    if (options & PTCX_OPTION_ENTROPY_CODING)
+    {
+        out_header->flags |= PTCX_FLAG_ENTROPY_CODED;
+    }
+
+    if (options & PTCX_OPTION_PREDICTIVE_ENDPOINTS)
+    {
+        out_header->flags |= PTCX_FLAG_PREDICTED_ENDPOINTS;
+    }
+
+    if (options & PTCX_OPTION_SOLID_BLOCKS)
+    {
+        out_header->flags |= PTCX_FLAG_SOLID_BLOCKS;
+    }
+
+    if ((options & PTCX_OPTION_RECTANGULAR_PARTITIONS) && !is_minimum_block)
+    {
+        out_header->flags |= PTCX_FLAG_RECTANGULAR_PARTITIONS;
+    }
+
+    if (options & PTCX_OPTION_PLANAR_BLOCKS)
+    {
+        out_header->flags |= PTCX_FLAG_PLANAR_BLOCKS;
+    }
+
+    if (options & PTCX_OPTION_BLOCK_REFERENCES)
+    {
+        out_header->flags |= PTCX_FLAG_BLOCK_REFERENCES;
+    }
+
+    if ((options & PTCX_OPTION_INDEX_CODEBOOK) && !is_minimum_block)
+    {
+        out_header->flags |= PTCX_FLAG_INDEX_CODEBOOK;
+    }
+
+    if (options & PTCX_OPTION_DECORRELATED_COLOR)
+    {
+        out_header->flags |= PTCX_FLAG_DECORRELATED_COLOR;
+    }
+
+    if (options & PTCX_OPTION_ADAPTIVE_STEP_BITS)
+    {
+        // The quality's step bits become the widest index that any macroblock may use.
+        out_header->flags |= PTCX_FLAG_ADAPTIVE_STEP_BITS;
+    }
+
+    return BASE_SUCCESS;
+}
+
+bool is_aligned_image_size(const PTCX_FILE_HEADER &header, uint32 width, uint32 height)
+{
+    // Our image must be 16 pixel aligned, for now, and must hold a whole number of 
+    // macroblocks and bands.
+
+    uint32 alignment = base_max2((uint32) PTCX_DEFAULT_BLOCK_SIZE, (uint32) header.block_width);
+
+    return width && height && !(width % alignment) && !(height % header.band_height);
+}
+
+ptcx_band_encoder::ptcx_band_encoder()
+{
+    state = 0;
+}
+
+ptcx_band_encoder::~ptcx_band_encoder()
+{
+    delete state;
+}
+
+status ptcx_band_encoder::begin(uint32 width, uint32 height, uint8 quality, stream *output)
+{
+    return begin(width, height, quality, 0, output);
+}
+
+status configure_band_encoder(uint32 width, uint32 height, uint8 quality, uint32 options, PTCX_FILE_HEADER *header)
+{
+    memset(header, 0, sizeof(PTCX_FILE_HEADER));
+
+    if (width > BASE_MAX_UINT16 || height > BASE_MAX_UINT16)
+    {
+        return BASE_ERROR_INVALID_RESOURCE;
+    }
+
+    if (base_failed(configure_header(width, height, header, quality, options)))
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    if (!is_aligned_image_size(*header, width, height))
+    {
+        return BASE_ERROR_INVALID_RESOURCE;
     }
 
     return BASE_SUCCESS;
-}
\ No newline at end of file
+}
+
+status prepare_band_encoder(const PTCX_FILE_HEADER &header, const image *previous_frame, const PTCX_BLOCK_INDEX *base_index,
+                            stream *output, PTCX_BAND_ENCODER_STATE *state)
+{
+    state->context.header = header;
+    state->output = output;
+    state->band_index = 0;
+    state->previous_frame = previous_frame;
+    state->base_index = base_index;
+
+    for (uint8 i = 0; i < PTCX_MAX_TRIAL_COUNT; i++)
+    {
+        if (PTCX_MAX_CONTROL_DATA_SIZE != state->trial_buffers[i].control.resize_capacity(PTCX_MAX_CONTROL_DATA_SIZE) ||
+            PTCX_MAX_INDEX_DATA_SIZE != state->trial_buffers[i].index.resize_capacity(PTCX_MAX_INDEX_DATA_SIZE))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    for (uint8 i = 0; i < PTCX_MAX_PARTITION_COUNT; i++)
+    {
+        if (PTCX_MAX_CONTROL_DATA_SIZE != state->region_buffers[i].control.resize_capacity(PTCX_MAX_CONTROL_DATA_SIZE) ||
+            PTCX_MAX_INDEX_DATA_SIZE != state->region_buffers[i].index.resize_capacity(PTCX_MAX_INDEX_DATA_SIZE))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    state->band.table.resize(query_band_table_size(header));
+    state->band.control.reserve(query_band_capacity(header));
+    state->band.index.reserve(query_band_capacity(header));
+
+    return BASE_SUCCESS;
+}
+
+status start_band_encoder(const PTCX_FILE_HEADER &header, const image *previous_frame, const PTCX_BLOCK_INDEX *base_index,
+                          stream *output, PTCX_BAND_ENCODER_STATE *state)
+{
+    if (base_failed(prepare_band_encoder(header, previous_frame, base_index, output, state)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    if (is_deferred_encoding(header))
+    {
+        // The header is written along with the file models once every band is known.
+        return BASE_SUCCESS;
+    }
+
+    if (base_failed(write_stream_data(output, &header, sizeof(PTCX_FILE_HEADER))))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status push_encoder_band(const image &source, uint32 source_y, PTCX_BAND_ENCODER_STATE *state)
+{
+    if (IGN_IMAGE_FORMAT_R8G8B8 != source.query_image_format() || !source.query_data())
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    const PTCX_FILE_HEADER &header = state->context.header;
+
+    if (source.query_width() != header.image_width || 
+        source.query_height() < source_y + header.band_height)
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    if (state->band_index >= query_band_count(header))
+    {
+        return base_post_error(BASE_ERROR_CAPACITY_LIMIT);
+    }
+
+    if (base_failed(quantize_band(source, source_y, state)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    if (is_deferred_encoding(header))
+    {
+        state->deferred_bands.push_back(state->band);
+    }
+    else if (base_failed(write_band(state->output, state->context, &state->band)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    state->band_index++;
+
+    return BASE_SUCCESS;
+}
+
+status finish_band_encoder(PTCX_BAND_ENCODER_STATE *state)
+{
+    if (state->band_index != query_band_count(state->context.header))
+    {
+        // The caller did not supply every band of the image.
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    if (is_deferred_encoding(state->context.header))
+    {
+        if (base_failed(write_deferred_bands(state)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+status ptcx_band_encoder::begin(uint32 width, uint32 height, uint8 quality, uint32 options, stream *output)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!output || output->is_full()) 
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    PTCX_FILE_HEADER header;
+    status result = configure_band_encoder(width, height, quality, options, &header);
+
+    if (base_failed(result))
+    {
+        return result;
+    }
+
+    delete state;
+    state = new PTCX_BAND_ENCODER_STATE;
+
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+    }
+
+    return start_band_encoder(header, 0, 0, output, state);
+}
+
+status ptcx_band_encoder::push_band(const image &band)
+{
+    return push_band(band, 0);
+}
+
+status ptcx_band_encoder::push_band(const image &source, uint32 source_y)
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_NOT_READY);
+    }
+
+    return push_encoder_band(source, source_y, state);
+}
+
+uint32 ptcx_band_encoder::query_band_height() const
+{
+    if (state)
+    {
+        return state->context.header.band_height;
+    }
+
+    return PTCX_BAND_HEIGHT;
+}
+
+status ptcx_band_encoder::end()
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_NOT_READY);
+    }
+
+    status result = finish_band_encoder(state);
+
+    delete state;
+    state = 0;
+
+    return result;
+}
+
+status save_ptcx(const image &input, uint8 quality, stream *output)
+{
+    return save_ptcx(input, quality, 0, output);
+}
+
+status save_ptcx(const image &input, uint8 quality, uint32 options, stream *output)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!output || output->is_full()) 
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+
+        if (IGN_IMAGE_FORMAT_R8G8B8 != input.query_image_format())
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    ptcx_band_encoder encoder;
+
+    // A whole image encode is simply a band encode in which every band is already 
+    // resident.
+
+    status result = encoder.begin(input.query_width(), input.query_height(), quality, options, output);
+
+    if (base_failed(result))
+    {
+        return result;
+    }
+
+    for (uint32 j = 0; j < input.query_height(); j += encoder.query_band_height())
+    {
+        if (base_failed(encoder.push_band(input, j)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    return encoder.end();
+}
+
+status save_ptcx_delta(const image &input, const image *previous, const PTCX_BLOCK_INDEX *base, uint8 quality, uint32 options, stream *output)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!output || output->is_full()) 
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+
+        if (IGN_IMAGE_FORMAT_R8G8B8 != input.query_image_format())
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    if (!previous && !base)
+    {
+        return save_ptcx(input, quality, options, output);
+    }
+
+    if (previous && (previous->query_image_format() != input.query_image_format() || 
+                     previous->query_width() != input.query_width() || previous->query_height() != input.query_height()))
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    PTCX_FILE_HEADER header;
+    status result = configure_band_encoder(input.query_width(), input.query_height(), quality, options, &header);
+
+    if (base_failed(result))
+    {
+        return result;
+    }
+
+    if (base && !is_compatible_base(header, base->context.header))
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    // Kept macroblocks are stored as references, so every delta file carries block modes
+    // whether or not its options request references.
+
+    header.flags |= PTCX_FLAG_KEPT_BLOCKS | PTCX_FLAG_BLOCK_REFERENCES;
+
+    // The encoder state is driven directly, as ptcx_band_encoder does, since only this
+    // path may keep macroblocks from an image that the decoder already holds.
+
+    PTCX_BAND_ENCODER_STATE *state = new PTCX_BAND_ENCODER_STATE;
+
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+    }
+
+    result = start_band_encoder(header, previous, base, output, state);
+
+    for (uint32 j = 0; j < input.query_height() && !base_failed(result); j += header.band_height)
+    {
+        result = push_encoder_band(input, j, state);
+    }
+
+    if (!base_failed(result))
+    {
+        result = finish_band_encoder(state);
+    }
+
+    delete state;
+
+    return result;
+}
+
+bool is_dirty_band(const PTCX_FILE_HEADER &header, const std::vector<uint8> &dirty_blocks, uint32 band_index)
+{
+    uint32 band_block_count = query_band_macroblock_count(header);
+
+    for (uint32 i = band_index * band_block_count; i < (band_index + 1) * band_block_count; i++)
+    {
+        if (dirty_blocks[i]) return true;
+    }
+
+    return false;
+}
+
+status copy_indexed_macroblock(const PTCX_BLOCK_INDEX &index, const std::vector<uint8> &dirty_blocks, uint32 block_index, 
+                               PTCX_BAND_ENCODER_STATE *state)
+{
+    const PTCX_FILE_HEADER &header = state->context.header;
+    uint32 band_block_count = query_band_macroblock_count(header);
+    uint32 first_block = block_index - (block_index % band_block_count);
+    uint32 source_index = query_indexed_source(index, block_index);
+
+    // The macroblock that a reference resolves to keeps its position, so the reference
+    // remains valid unless that macroblock is dirty. A reference to a dirty macroblock 
+    // instead takes a copy of the original data.
+
+    if (source_index != block_index && !dirty_blocks[source_index] && block_index - source_index <= PTCX_MAX_REFERENCE_DISTANCE)
+    {
+        write_reference_macroblock(state, block_index - first_block, source_index - first_block);
+        return BASE_SUCCESS;
+    }
+
+    const PTCX_BAND_DATA &band = index.bands[block_index / band_block_count];
+    const PTCX_BLOCK_LOCATION &location = index.blocks[block_index];
+    PTCX_MACROBLOCK_ENTRY entry;
+    uint32 control_size = 0;
+    uint32 index_size = 0;
+
+    if (base_failed(read_indexed_entry(index, block_index, &entry)) ||
+        base_failed(query_indexed_size(index, block_index, &control_size, &index_size)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    write_macroblock_entry(header, &state->band.table[0], block_index - first_block, entry);
+
+    state->band.control.insert(state->band.control.end(), band.control.begin() + location.control_offset, 
+                               band.control.begin() + location.control_offset + control_size);
+    state->band.index.insert(state->band.index.end(), band.index.begin() + location.index_offset, 
+                             band.index.begin() + location.index_offset + index_size);
+
+    return BASE_SUCCESS;
+}
+
+status requantize_band(const image &input, const std::vector<uint8> &dirty_blocks, uint32 band_index, PTCX_BLOCK_INDEX *index,
+                       PTCX_BAND_ENCODER_STATE *state)
+{
+    const PTCX_FILE_HEADER &header = state->context.header;
+    uint32 first_block = band_index * query_band_macroblock_count(header);
+    uint32 block_index = 0;
+
+    reset_band(state);
+
+    for (uint32 j = 0; j < header.band_height; j += header.block_height)
+    for (uint32 i = 0; i < header.image_width; i += header.block_width)
+    {
+        status result = dirty_blocks[first_block + block_index] ? 
+                        quantize_macroblock(input, i, band_index * header.band_height + j, block_index, state) :
+                        copy_indexed_macroblock(*index, dirty_blocks, first_block + block_index, state);
+
+        if (base_failed(result))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+
+        block_index++;
+    }
+
+    if (base_failed(finish_band(state)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    // New macroblocks are coded against the existing codebook, while carried over 
+    // macroblocks keep the form they already had.
+
+    if (header.flags & PTCX_FLAG_INDEX_CODEBOOK)
+    {
+        if (base_failed(apply_index_codebook(header, index->context.codebook, &state->band)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    std::swap(index->bands[band_index], state->band);
+
+    return index_band(header, index->bands[band_index], &index->blocks[first_block]);
+}
+
+status requantize_macroblocks(const image &input, const std::vector<uint8> &dirty_blocks, PTCX_BLOCK_INDEX *index)
+{
+    const PTCX_FILE_HEADER &header = index->context.header;
+    PTCX_BAND_ENCODER_STATE *state = new PTCX_BAND_ENCODER_STATE;
+
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+    }
+
+    status result = prepare_band_encoder(header, 0, 0, 0, state);
+
+    for (uint32 i = 0; i < query_band_count(header) && !base_failed(result); i++)
+    {
+        if (is_dirty_band(header, dirty_blocks, i))
+        {
+            result = requantize_band(input, dirty_blocks, i, index, state);
+        }
+    }
+
+    delete state;
+
+    return result;
+}
@@ -0,0 +1,410 @@
+
+#include "ptcx_internal.h"
+
+// Residuals are stored as order zero Exp-Golomb codes. A zigzagged 6 bit residual never
+// requires a prefix longer than this.
+#define PTCX_MAX_VLC_PREFIX_BITS                 (6)
+#define PTCX_ENDPOINT_COMPONENT_COUNT            (6)
+#define PTCX_PLANAR_COMPONENT_COUNT              (9)
+#define PTCX_ENDPOINT_CELL_SIZE                  (PTCX_ENDPOINT_COMPONENT_COUNT + 1)   // endpoints, then color space
+
+// Appends bits to a byte vector, least significant bits first.
+typedef struct PTCX_BIT_WRITER
+{
+    std::vector<uint8> *output;
+    uint32 accumulator;
+    uint32 bit_count;
+
+} PTCX_BIT_WRITER;
+
+// Reads bits from a byte range, least significant bits first.
+typedef struct PTCX_BIT_READER
+{
+    const uint8 *data;
+    const uint8 *data_end;
+    uint32 accumulator;
+    uint32 bit_count;
+
+} PTCX_BIT_READER;
+
+void write_bits(PTCX_BIT_WRITER *writer, uint32 value, uint32 count)
+{
+    writer->accumulator |= value << writer->bit_count;
+    writer->bit_count += count;
+
+    while (writer->bit_count >= 8)
+    {
+        writer->output->push_back(writer->accumulator & 0xFF);
+        writer->accumulator >>= 8;
+        writer->bit_count -= 8;
+    }
+}
+
+void flush_bits(PTCX_BIT_WRITER *writer)
+{
+    if (writer->bit_count)
+    {
+        writer->output->push_back(writer->accumulator & 0xFF);
+    }
+
+    writer->accumulator = 0;
+    writer->bit_count = 0;
+}
+
+bool read_bits(PTCX_BIT_READER *reader, uint32 count, uint32 *value)
+{
+    while (reader->bit_count < count)
+    {
+        if (reader->data == reader->data_end)
+        {
+            return false;
+        }
+
+        reader->accumulator |= *(reader->data++) << reader->bit_count;
+        reader->bit_count += 8;
+    }
+
+    (*value) = reader->accumulator & ((1 << count) - 1);
+    reader->accumulator >>= count;
+    reader->bit_count -= count;
+
+    return true;
+}
+
+void write_vlc(PTCX_BIT_WRITER *writer, uint32 value)
+{
+    // An Exp-Golomb code: k zero bits and a one, followed by the low k bits of value + 1.
+    uint32 code = value + 1;
+    uint32 prefix_bits = log2(code);
+
+    write_bits(writer, 1 << prefix_bits, prefix_bits + 1);
+    write_bits(writer, code - (1 << prefix_bits), prefix_bits);
+}
+
+bool read_vlc(PTCX_BIT_READER *reader, uint32 *value)
+{
+    uint32 prefix_bits = 0;
+    uint32 bit = 0;
+    uint32 suffix = 0;
+
+    while (true)
+    {
+        if (!read_bits(reader, 1, &bit))
+        {
+            return false;
+        }
+
+        if (bit) break;
+
+        if (++prefix_bits > PTCX_MAX_VLC_PREFIX_BITS)
+        {
+            return false;
+        }
+    }
+
+    if (!read_bits(reader, prefix_bits, &suffix))
+    {
+        return false;
+    }
+
+    (*value) = (1 << prefix_bits) + suffix - 1;
+
+    return true;
+}
+
+uint8 predict_median(uint8 left, uint8 top, uint8 top_left)
+{
+    // The median edge detector from LOCO-I. It selects the smaller or larger neighbour
+    // when top_left suggests an edge, and otherwise assumes a planar gradient.
+
+    uint8 low = base_min2(left, top);
+    uint8 high = base_max2(left, top);
+
+    if (top_left >= high) return low;
+    if (top_left <= low) return high;
+
+    return left + top - top_left;
+}
+
+// The bit width of each endpoint component, in the order min (blue, green, red) and
+// then max (blue, green, red). Planar microblocks store their origin and horizontal
+// colors in place of min and max, followed by their vertical color.
+const uint8 endpoint_component_bits[PTCX_PLANAR_COMPONENT_COUNT] = {5, 6, 5, 5, 6, 5, 5, 6, 5};
+const uint8 endpoint_component_shift[PTCX_PLANAR_COMPONENT_COUNT] = {0, 5, 11, 0, 5, 11, 0, 5, 11};
+
+/*
+// Endpoint prediction
+//
+//   We track the endpoints of every 2x2 cell in the band. Once a microblock is coded,
+//   its endpoints are copied into every cell it covers, which allows the microblocks
+//   that follow to locate their left, top and top left neighbours regardless of the
+//   partition of each macroblock. Cells above the band are treated as unavailable so
+//   that bands remain independently decodable.
+//
+//   The vertical color of a planar microblock has no counterpart in its neighbours, and
+//   is instead predicted from the origin color of the same microblock.
+//
+//   Each cell also records the color space of its endpoints. In decorrelated files, a
+//   neighbour held in another color space than the microblock is converted before it
+//   contributes to a prediction.
+*/
+
+void convert_endpoints(const uint8 *input, uint32 color_space, uint8 *output)
+{
+    for (uint32 k = 0; k < PTCX_ENDPOINT_COMPONENT_COUNT; k += 3)
+    {
+        uint8 color[3] = {static_cast<uint8>(input[k] << 3), static_cast<uint8>(input[k + 1] << 2), static_cast<uint8>(input[k + 2] << 3)};
+
+        if (PTCX_COLOR_SPACE_YCOCG == color_space)
+        {
+            decorrelate_color(color, color);
+        }
+        else
+        {
+            correlate_color(color, color);
+        }
+
+        output[k] = color[0] >> 3;
+        output[k + 1] = color[1] >> 2;
+        output[k + 2] = color[2] >> 3;
+    }
+}
+
+// Reference macroblocks store their distance without prediction, and take on the 
+// endpoints of the macroblock that they copy.
+status code_reference_endpoints(const PTCX_FILE_HEADER &header, uint32 block_index, bool is_encoding, const std::vector<uint8> &input, 
+                                uint32 *control_offset, PTCX_BIT_WRITER *writer, PTCX_BIT_READER *reader, uint8 *cells, 
+                                std::vector<uint8> *output)
+{
+    uint8 control[PTCX_REFERENCE_CONTROL_SIZE];
+    uint32 distance = 0;
+
+    if (is_encoding)
+    {
+        if ((*control_offset) + PTCX_REFERENCE_CONTROL_SIZE > input.size())
+        {
+            return base_post_error(BASE_ERROR_INVALIDARG);
+        }
+
+        memcpy(control, &input[*control_offset], PTCX_REFERENCE_CONTROL_SIZE);
+        (*control_offset) += PTCX_REFERENCE_CONTROL_SIZE;
+
+        write_bits(writer, control[0] | (control[1] << 8), PTCX_REFERENCE_CONTROL_SIZE << 3);
+    }
+    else
+    {
+        if (!read_bits(reader, PTCX_REFERENCE_CONTROL_SIZE << 3, &distance))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+
+        control[0] = distance & 0xFF;
+        control[1] = distance >> 8;
+
+        output->push_back(control[0]);
+        output->push_back(control[1]);
+    }
+
+    if ((header.flags & PTCX_FLAG_KEPT_BLOCKS) && !control[0] && !control[1])
+    {
+        // Macroblocks kept from the previous frame leave their cells empty, as their
+        // endpoints are not part of this frame.
+        return BASE_SUCCESS;
+    }
+
+    if (base_failed(read_reference_distance(control, block_index, &distance)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    uint32 blocks_per_row = header.image_width / header.block_width;
+    uint32 source_index = block_index - distance;
+    uint32 cells_x = header.image_width / PTCX_MIN_BLOCK_SIZE;
+    uint32 cell_x = (block_index % blocks_per_row) * header.block_width / PTCX_MIN_BLOCK_SIZE;
+    uint32 cell_y = (block_index / blocks_per_row) * header.block_height / PTCX_MIN_BLOCK_SIZE;
+    uint32 source_cell_x = (source_index % blocks_per_row) * header.block_width / PTCX_MIN_BLOCK_SIZE;
+    uint32 source_cell_y = (source_index / blocks_per_row) * header.block_height / PTCX_MIN_BLOCK_SIZE;
+    uint32 row_size = (header.block_width / PTCX_MIN_BLOCK_SIZE) * PTCX_ENDPOINT_CELL_SIZE;
+
+    for (uint32 y = 0; y < header.block_height / PTCX_MIN_BLOCK_SIZE; y++)
+    {
+        memcpy(cells + ((cell_y + y) * cells_x + cell_x) * PTCX_ENDPOINT_CELL_SIZE,
+               cells + ((source_cell_y + y) * cells_x + source_cell_x) * PTCX_ENDPOINT_CELL_SIZE, row_size);
+    }
+
+    return BASE_SUCCESS;
+}
+
+// When encoding, input holds raw control values and output receives residual codes. When
+// decoding, input holds residual codes and output receives raw control values.
+status code_band_endpoints(const PTCX_FILE_HEADER &header, const uint8 *mb_table, bool is_encoding,
+                           const std::vector<uint8> &input, std::vector<uint8> *output)
+{
+    uint32 cells_x = header.image_width / PTCX_MIN_BLOCK_SIZE;
+    uint32 cells_y = header.band_height / PTCX_MIN_BLOCK_SIZE;
+    uint32 control_offset = 0;
+    uint32 block_index = 0;
+
+    std::vector<uint8> cells(cells_x * cells_y * PTCX_ENDPOINT_CELL_SIZE);
+
+    PTCX_BIT_WRITER writer = {output, 0, 0};
+    PTCX_BIT_READER reader = {input.data(), input.data() + input.size(), 0, 0};
+
+    output->clear();
+
+    for (uint32 j = 0; j < header.band_height; j += header.block_height)
+    for (uint32 i = 0; i < header.image_width; i += header.block_width)
+    {
+        PTCX_PARTITION_REGION regions[PTCX_MAX_PARTITION_REGIONS];
+        PTCX_MACROBLOCK_ENTRY entry;
+
+        if (base_failed(read_macroblock_entry(header, mb_table, block_index++, &entry)))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+
+        if (PTCX_BLOCK_MODE_REFERENCE == entry.mode)
+        {
+            if (base_failed(code_reference_endpoints(header, block_index - 1, is_encoding, input, &control_offset, &writer, &reader, 
+                                                     cells.data(), output)))
+            {
+                return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+            }
+
+            continue;
+        }
+
+        uint32 region_count = query_partition_regions(header, entry, regions);
+        uint32 control_size = query_microblock_control_size(header, entry);
+        uint32 component_count = (PTCX_BLOCK_MODE_PLANAR == entry.mode) ? PTCX_PLANAR_COMPONENT_COUNT : PTCX_ENDPOINT_COMPONENT_COUNT;
+
+        for (uint32 r = 0; r < region_count; r++)
+        for (uint32 micro_j = regions[r].y; micro_j < regions[r].y + regions[r].height; micro_j += regions[r].micro_height)
+        for (uint32 micro_i = regions[r].x; micro_i < regions[r].x + regions[r].width; micro_i += regions[r].micro_width)
+        {
+            uint32 micro_width = regions[r].micro_width;
+            uint32 micro_height = regions[r].micro_height;
+            uint32 cell_x = (i + micro_i) / PTCX_MIN_BLOCK_SIZE;
+            uint32 cell_y = (j + micro_j) / PTCX_MIN_BLOCK_SIZE;
+            uint8 *cell = &cells[(cell_y * cells_x + cell_x) * PTCX_ENDPOINT_CELL_SIZE];
+            const uint8 *left = cell - PTCX_ENDPOINT_CELL_SIZE;
+            const uint8 *top = cell - cells_x * PTCX_ENDPOINT_CELL_SIZE;
+            const uint8 *top_left = top - PTCX_ENDPOINT_CELL_SIZE;
+            uint8 converted[3][PTCX_ENDPOINT_COMPONENT_COUNT];
+            uint8 endpoint[PTCX_PLANAR_COMPONENT_COUNT];
+            uint16 packed[3] = {0};
+
+            if (cell_x && entry.color_space != left[PTCX_ENDPOINT_COMPONENT_COUNT])
+            {
+                convert_endpoints(left, entry.color_space, converted[0]);
+                left = converted[0];
+            }
+
+            if (cell_y && entry.color_space != top[PTCX_ENDPOINT_COMPONENT_COUNT])
+            {
+                convert_endpoints(top, entry.color_space, converted[1]);
+                top = converted[1];
+            }
+
+            if (cell_x && cell_y && entry.color_space != top_left[PTCX_ENDPOINT_COMPONENT_COUNT])
+            {
+                convert_endpoints(top_left, entry.color_space, converted[2]);
+                top_left = converted[2];
+            }
+
+            if (is_encoding)
+            {
+                if (control_offset + control_size > input.size())
+                {
+                    return base_post_error(BASE_ERROR_INVALIDARG);
+                }
+
+                for (uint32 k = 0; k < (control_size >> 1); k++)
+                {
+                    packed[k] = input[control_offset + k * 2] | (input[control_offset + k * 2 + 1] << 8);
+                }
+
+                control_offset += control_size;
+            }
+
+            for (uint8 c = 0; c < component_count; c++)
+            {
+                uint8 component_mask = (1 << endpoint_component_bits[c]) - 1;
+                uint8 component_half = 1 << (endpoint_component_bits[c] - 1);
+                uint8 prediction = 0;
+                uint32 code = 0;
+
+                if (c >= PTCX_ENDPOINT_COMPONENT_COUNT) prediction = endpoint[c - PTCX_ENDPOINT_COMPONENT_COUNT];
+                else if (cell_x && cell_y) prediction = predict_median(left[c], top[c], top_left[c]);
+                else if (cell_x) prediction = left[c];
+                else if (cell_y) prediction = top[c];
+
+                if (is_encoding)
+                {
+                    // Residuals wrap within the component's range, and are zigzagged so that
+                    // small magnitudes of either sign map to short codes.
+
+                    endpoint[c] = (packed[c / 3] >> endpoint_component_shift[c]) & component_mask;
+
+                    uint8 wrapped = (endpoint[c] - prediction) & component_mask;
+                    int32 delta = (wrapped >= component_half) ? wrapped - (component_mask + 1) : wrapped;
+
+                    code = (delta >= 0) ? (delta << 1) : ((-delta << 1) - 1);
+                    write_vlc(&writer, code);
+                }
+                else
+                {
+                    if (!read_vlc(&reader, &code) || code > component_mask)
+                    {
+                        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+                    }
+
+                    int32 delta = (code & 1) ? -static_cast<int32>((code + 1) >> 1) : (code >> 1);
+
+                    endpoint[c] = (prediction + delta) & component_mask;
+                    packed[c / 3] |= endpoint[c] << endpoint_component_shift[c];
+                }
+            }
+
+            if (!is_encoding)
+            {
+                for (uint32 k = 0; k < (control_size >> 1); k++)
+                {
+                    output->push_back(packed[k] & 0xFF);
+                    output->push_back(packed[k] >> 8);
+                }
+            }
+
+            // Record our endpoints, and their color space, for every cell that this microblock
+            // covers.
+
+            uint8 record[PTCX_ENDPOINT_CELL_SIZE];
+
+            memcpy(record, endpoint, PTCX_ENDPOINT_COMPONENT_COUNT);
+            record[PTCX_ENDPOINT_COMPONENT_COUNT] = entry.color_space;
+
+            for (uint32 y = 0; y < micro_height / PTCX_MIN_BLOCK_SIZE; y++)
+            for (uint32 x = 0; x < micro_width / PTCX_MIN_BLOCK_SIZE; x++)
+            {
+                memcpy(cell + (y * cells_x + x) * PTCX_ENDPOINT_CELL_SIZE, record, PTCX_ENDPOINT_CELL_SIZE);
+            }
+        }
+    }
+
+    if (is_encoding)
+    {
+        flush_bits(&writer);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status predict_band_endpoints(const PTCX_FILE_HEADER &header, const uint8 *mb_table, const std::vector<uint8> &control, std::vector<uint8> *output)
+{
+    return code_band_endpoints(header, mb_table, true, control, output);
+}
+
+status reconstruct_band_endpoints(const PTCX_FILE_HEADER &header, const uint8 *mb_table, const std::vector<uint8> &input, std::vector<uint8> *control)
+{
+    return code_band_endpoints(header, mb_table, false, input, control);
+}
@@ -0,0 +1,275 @@
+
+#include "ptcx_internal.h"
+
+// Our coder keeps each lane state within [PTCX_ENTROPY_STATE_LOW, PTCX_ENTROPY_STATE_LOW << 8),
+// and renormalizes a byte at a time.
+#define PTCX_ENTROPY_STATE_LOW                   (1u << 23)
+
+void build_entropy_table(const uint32 *histogram, PTCX_ENTROPY_TABLE *table)
+{
+    uint32 total = 0;
+    uint32 frequency_total = 0;
+    uint32 largest_symbol = 0;
+
+    memset(table, 0, sizeof(PTCX_ENTROPY_TABLE));
+
+    for (uint32 i = 0; i < PTCX_ENTROPY_SYMBOL_COUNT; i++)
+    {
+        total += histogram[i];
+
+        if (histogram[i] > histogram[largest_symbol])
+        {
+            largest_symbol = i;
+        }
+    }
+
+    if (0 == total)
+    {
+        // An empty model. No symbols will ever be coded against it.
+        return;
+    }
+
+    // Scale our counts to the model precision, making sure that every symbol that
+    // occurs retains a non-zero frequency.
+
+    for (uint32 i = 0; i < PTCX_ENTROPY_SYMBOL_COUNT; i++)
+    {
+        if (histogram[i])
+        {
+            uint64 scaled = (static_cast<uint64>(histogram[i]) << PTCX_ENTROPY_PRECISION_BITS) / total;
+            table->frequency[i] = base_max2(scaled, (uint64) 1);
+            frequency_total += table->frequency[i];
+        }
+    }
+
+    // Distribute the rounding error. We adjust the most frequent symbols, as they can
+    // best absorb the change.
+
+    while (frequency_total != PTCX_ENTROPY_TOTAL)
+    {
+        if (frequency_total < PTCX_ENTROPY_TOTAL)
+        {
+            table->frequency[largest_symbol]++;
+            frequency_total++;
+            continue;
+        }
+
+        uint32 donor = largest_symbol;
+
+        for (uint32 i = 0; i < PTCX_ENTROPY_SYMBOL_COUNT; i++)
+        {
+            if (table->frequency[i] > table->frequency[donor]) donor = i;
+        }
+
+        table->frequency[donor]--;
+        frequency_total--;
+    }
+
+    prepare_entropy_table(table);
+}
+
+status prepare_entropy_table(PTCX_ENTROPY_TABLE *table)
+{
+    uint32 frequency_total = 0;
+
+    for (uint32 i = 0; i < PTCX_ENTROPY_SYMBOL_COUNT; i++)
+    {
+        table->cumulative[i] = frequency_total;
+        frequency_total += table->frequency[i];
+    }
+
+    table->cumulative[PTCX_ENTROPY_SYMBOL_COUNT] = frequency_total;
+
+    if (0 == frequency_total)
+    {
+        return BASE_SUCCESS;
+    }
+
+    if (PTCX_ENTROPY_TOTAL != frequency_total)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    // Build the slot to symbol lookup used by the decoder.
+    for (uint32 i = 0; i < PTCX_ENTROPY_SYMBOL_COUNT; i++)
+    {
+        memset(&table->symbol[table->cumulative[i]], i, table->frequency[i]);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status write_entropy_table(stream *output, const PTCX_ENTROPY_TABLE &table)
+{
+    uint8 packed[PTCX_ENTROPY_SYMBOL_COUNT << 1];
+    uint32 packed_size = 0;
+
+    // Frequencies are written in one byte when they are small, which is the common case,
+    // and otherwise in two bytes with the high bit of the first byte set.
+
+    for (uint32 i = 0; i < PTCX_ENTROPY_SYMBOL_COUNT; i++)
+    {
+        uint16 frequency = table.frequency[i];
+
+        if (frequency < 0x80)
+        {
+            packed[packed_size++] = frequency;
+        }
+        else
+        {
+            packed[packed_size++] = 0x80 | (frequency >> 8);
+            packed[packed_size++] = frequency & 0xFF;
+        }
+    }
+
+    return write_stream_data(output, packed, packed_size);
+}
+
+status read_entropy_table(stream *input, PTCX_ENTROPY_TABLE *table)
+{
+    memset(table, 0, sizeof(PTCX_ENTROPY_TABLE));
+
+    for (uint32 i = 0; i < PTCX_ENTROPY_SYMBOL_COUNT; i++)
+    {
+        uint8 value[2] = {0};
+
+        if (base_failed(read_stream_data(input, &value[0], 1)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+
+        if (value[0] & 0x80)
+        {
+            if (base_failed(read_stream_data(input, &value[1], 1)))
+            {
+                return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+            }
+
+            table->frequency[i] = ((value[0] & 0x7F) << 8) | value[1];
+        }
+        else
+        {
+            table->frequency[i] = value[0];
+        }
+
+        if (table->frequency[i] > PTCX_ENTROPY_TOTAL)
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+    }
+
+    return prepare_entropy_table(table);
+}
+
+uint32 query_entropy_capacity(uint32 size)
+{
+    // No symbol costs more than PTCX_ENTROPY_PRECISION_BITS, and the coder adds its 
+    // final lane states.
+
+    return ((size * PTCX_ENTROPY_PRECISION_BITS + 7) >> 3) + (PTCX_ENTROPY_LANE_COUNT << 2) + 4;
+}
+
+status entropy_encode(const PTCX_ENTROPY_TABLE &table, const uint8 *input, uint32 size, std::vector<uint8> *output)
+{
+    uint32 state[PTCX_ENTROPY_LANE_COUNT];
+    std::vector<uint8> reversed;
+
+    output->clear();
+
+    if (0 == size)
+    {
+        return BASE_SUCCESS;
+    }
+
+    reversed.reserve(size + (PTCX_ENTROPY_LANE_COUNT << 2));
+
+    for (uint32 lane = 0; lane < PTCX_ENTROPY_LANE_COUNT; lane++)
+    {
+        state[lane] = PTCX_ENTROPY_STATE_LOW;
+    }
+
+    // rANS operates as a stack, so we encode symbols in reverse order and later reverse
+    // the output. Symbol i is always coded by lane (i % PTCX_ENTROPY_LANE_COUNT), which
+    // allows the decoder to keep several independent states in flight.
+
+    for (uint32 i = size; i-- > 0;)
+    {
+        uint32 &x = state[i % PTCX_ENTROPY_LANE_COUNT];
+        uint32 frequency = table.frequency[input[i]];
+
+        if (0 == frequency)
+        {
+            // The model was not built from this data.
+            return base_post_error(BASE_ERROR_INVALIDARG);
+        }
+
+        uint32 x_max = ((PTCX_ENTROPY_STATE_LOW >> PTCX_ENTROPY_PRECISION_BITS) << 8) * frequency;
+
+        while (x >= x_max)
+        {
+            reversed.push_back(x & 0xFF);
+            x >>= 8;
+        }
+
+        x = ((x / frequency) << PTCX_ENTROPY_PRECISION_BITS) + (x % frequency) + table.cumulative[input[i]];
+    }
+
+    // Flush our final states such that, once reversed, lane zero appears first in
+    // little endian order.
+
+    for (uint32 lane = PTCX_ENTROPY_LANE_COUNT; lane-- > 0;)
+    {
+        reversed.push_back(state[lane] >> 24);
+        reversed.push_back(state[lane] >> 16);
+        reversed.push_back(state[lane] >> 8);
+        reversed.push_back(state[lane]);
+    }
+
+    output->assign(reversed.rbegin(), reversed.rend());
+
+    return BASE_SUCCESS;
+}
+
+status entropy_decode(const PTCX_ENTROPY_TABLE &table, const uint8 *input, uint32 input_size, uint8 *output, uint32 output_size)
+{
+    uint32 state[PTCX_ENTROPY_LANE_COUNT];
+    const uint8 *input_end = input + input_size;
+    const uint32 slot_mask = PTCX_ENTROPY_TOTAL - 1;
+
+    if (0 == output_size)
+    {
+        return BASE_SUCCESS;
+    }
+
+    if (input_size < (PTCX_ENTROPY_LANE_COUNT << 2) || PTCX_ENTROPY_TOTAL != table.cumulative[PTCX_ENTROPY_SYMBOL_COUNT])
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    for (uint32 lane = 0; lane < PTCX_ENTROPY_LANE_COUNT; lane++)
+    {
+        state[lane] = input[0] | (input[1] << 8) | (input[2] << 16) | (static_cast<uint32>(input[3]) << 24);
+        input += 4;
+    }
+
+    for (uint32 i = 0; i < output_size; i++)
+    {
+        uint32 &x = state[i % PTCX_ENTROPY_LANE_COUNT];
+        uint8 symbol = table.symbol[x & slot_mask];
+
+        output[i] = symbol;
+        x = table.frequency[symbol] * (x >> PTCX_ENTROPY_PRECISION_BITS) + (x & slot_mask) - table.cumulative[symbol];
+
+        while (x < PTCX_ENTROPY_STATE_LOW)
+        {
+            if (input == input_end)
+            {
+                return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+            }
+
+            x = (x << 8) | *(input++);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
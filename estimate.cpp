@@ -1,7 +1,125 @@
 
 #include "ptcx_internal.h"
 
-status range_estimate_min_max(const PTCX_FILE_HEADER &header, PTCX_PIXEL_RANGE *range, const image &input, uint32 x, uint32 y)
+status load_block_data(const image &input, uint32 x, uint32 y, uint32 width, uint32 height, uint32 color_space, PTCX_BLOCK_DATA *output)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!output || width > PTCX_MAX_BLOCK_SIZE || height > PTCX_MAX_BLOCK_SIZE)
+        {
+            return base_post_error(BASE_ERROR_INVALIDARG);
+        }
+    }
+
+    uint32 pixel_bytes = input.query_bits_per_pixel() >> 3;
+    uint32 run_width = base_min2(width, input.query_block_run_width());
+
+    output->width = width;
+    output->height = height;
+    output->color_space = color_space;
+
+    // Blocks holding a color too saturated for its chroma to fit within a channel remain
+    // in RGB, so we check every pixel before we transform any.
+
+    for (uint32 subj = 0; PTCX_COLOR_SPACE_YCOCG == output->color_space && subj < height; subj++)
+    for (uint32 run = 0; run < width; run += run_width)
+    {
+        uint8 *src_pixel = input.query_data() + input.query_block_offset(x + run, y + subj);
+
+        for (uint32 subi = 0; subi < run_width; subi++, src_pixel += pixel_bytes)
+        {
+            if (!is_decorrelated_range(src_pixel))
+            {
+                output->color_space = PTCX_COLOR_SPACE_RGB;
+            }
+        }
+    }
+
+    // Deinterleave the block into our planar arrays. This is the only point at which 
+    // the encoder reads pixels of the macroblock from the source image. Large blocks in 
+    // tiled images span several tiles, so we read each row in runs that never cross a 
+    // tile boundary. Decorrelated blocks transform each pixel as it is read.
+
+    for (uint32 subj = 0; subj < height; subj++)
+    for (uint32 run = 0; run < width; run += run_width)
+    {
+        uint8 *src_pixel = input.query_data() + input.query_block_offset(x + run, y + subj);
+        uint8 *dest_red = &output->channel[0][subj * PTCX_MAX_BLOCK_SIZE + run];
+        uint8 *dest_green = &output->channel[1][subj * PTCX_MAX_BLOCK_SIZE + run];
+        uint8 *dest_blue = &output->channel[2][subj * PTCX_MAX_BLOCK_SIZE + run];
+
+        for (uint32 subi = 0; subi < run_width; subi++, src_pixel += pixel_bytes)
+        {
+            uint8 color[3] = {src_pixel[0], src_pixel[1], src_pixel[2]};
+
+            if (PTCX_COLOR_SPACE_YCOCG == output->color_space)
+            {
+                decorrelate_color(src_pixel, color);
+            }
+
+            dest_red[subi] = color[0];
+            dest_green[subi] = color[1];
+            dest_blue[subi] = color[2];
+        }
+    }
+
+    // Accumulate the cell moments from the planar data.
+    for (uint32 cell_j = 0; cell_j < height / PTCX_STAGING_CELL_SIZE; cell_j++)
+    for (uint32 cell_i = 0; cell_i < width / PTCX_STAGING_CELL_SIZE; cell_i++)
+    {
+        uint32 cell_index = cell_j * PTCX_STAGING_CELL_STRIDE + cell_i;
+
+        for (uint8 c = 0; c < 3; c++)
+        {
+            uint32 sum = 0;
+            uint32 sum_squares = 0;
+
+            for (uint32 subj = 0; subj < PTCX_STAGING_CELL_SIZE; subj++)
+            for (uint32 subi = 0; subi < PTCX_STAGING_CELL_SIZE; subi++)
+            {
+                uint32 value = output->channel[c][(cell_j * PTCX_STAGING_CELL_SIZE + subj) * PTCX_MAX_BLOCK_SIZE + 
+                                                  (cell_i * PTCX_STAGING_CELL_SIZE + subi)];
+                sum += value;
+                sum_squares += value * value;
+            }
+
+            output->cell_sum[c][cell_index] = sum;
+            output->cell_sum_squares[c][cell_index] = sum_squares;
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+void query_block_moments(const PTCX_BLOCK_DATA &block, uint32 x, uint32 y, uint32 width, uint32 height, PTCX_BLOCK_MOMENTS *output)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!output || (x | y | width | height) % PTCX_STAGING_CELL_SIZE)
+        {
+            base_post_error(BASE_ERROR_INVALIDARG);
+            return;
+        }
+    }
+
+    memset(output, 0, sizeof(PTCX_BLOCK_MOMENTS));
+
+    output->count = width * height;
+
+    for (uint32 cell_j = y / PTCX_STAGING_CELL_SIZE; cell_j < (y + height) / PTCX_STAGING_CELL_SIZE; cell_j++)
+    for (uint32 cell_i = x / PTCX_STAGING_CELL_SIZE; cell_i < (x + width) / PTCX_STAGING_CELL_SIZE; cell_i++)
+    {
+        uint32 cell_index = cell_j * PTCX_STAGING_CELL_STRIDE + cell_i;
+
+        for (uint8 c = 0; c < 3; c++)
+        {
+            output->sum[c] += block.cell_sum[c][cell_index];
+            output->sum_squares[c] += block.cell_sum_squares[c][cell_index];
+        }
+    }
+}
+
+status range_estimate_min_max(const PTCX_FILE_HEADER &header, PTCX_PIXEL_RANGE *range, const PTCX_BLOCK_DATA &block, uint32 x, uint32 y)
 {
     if (BASE_PARAM_CHECK )
     {
@@ -11,32 +129,33 @@ status range_estimate_min_max(const PTCX_FILE_HEADER &header, PTCX_PIXEL_RANGE *
         }
     }
 
-    range->min_value[0] = 255;
-    range->min_value[1] = 255;
-    range->min_value[2] = 255;
+    for (uint8 c = 0; c < 3; c++)
+    {
+        uint8 min_value = 255;
+        uint8 max_value = 0;
 
-    range->max_value[0] = 0;
-    range->max_value[1] = 0;
-    range->max_value[2] = 0;
+        // Each channel is scanned independently over contiguous rows, which is a 
+        // trivially vectorizable reduction.
 
-    for (uint32 subj = 0; subj < header.block_height; subj++)
-    for (uint32 subi = 0; subi < header.block_width; subi++)
-    {
-        uint8 *src_pixel = input.query_data() + input.query_block_offset(x + subi, y + subj);
+        for (uint32 subj = 0; subj < header.block_height; subj++)
+        {
+            const uint8 *src_row = &block.channel[c][(y + subj) * PTCX_MAX_BLOCK_SIZE + x];
 
-        if (src_pixel[0] < range->min_value[0]) range->min_value[0] = src_pixel[0];
-        if (src_pixel[1] < range->min_value[1]) range->min_value[1] = src_pixel[1];
-        if (src_pixel[2] < range->min_value[2]) range->min_value[2] = src_pixel[2];
+            for (uint32 subi = 0; subi < header.block_width; subi++)
+            {
+                min_value = base_min2(min_value, src_row[subi]);
+                max_value = base_max2(max_value, src_row[subi]);
+            }
+        }
 
-        if (src_pixel[0] > range->max_value[0]) range->max_value[0] = src_pixel[0];
-        if (src_pixel[1] > range->max_value[1]) range->max_value[1] = src_pixel[1];
-        if (src_pixel[2] > range->max_value[2]) range->max_value[2] = src_pixel[2];
-    }     
+        range->min_value[c] = min_value;
+        range->max_value[c] = max_value;
+    }
 
     return BASE_SUCCESS;
 }
 
-status range_estimate_linear_distance(const PTCX_FILE_HEADER &header, PTCX_PIXEL_RANGE *range, const image &input, uint32 x, uint32 y)
+status range_estimate_linear_distance(const PTCX_FILE_HEADER &header, PTCX_PIXEL_RANGE *range, const PTCX_BLOCK_DATA &block, uint32 x, uint32 y)
 {
     if (BASE_PARAM_CHECK)
     {
@@ -57,14 +176,14 @@ status range_estimate_linear_distance(const PTCX_FILE_HEADER &header, PTCX_PIXEL
     {
         if (subjj == subj && subii == subi) continue;
 
-        uint8 *src_pixel_a = input.query_data() + input.query_block_offset(x + subi, y + subj);
-        uint8 *src_pixel_b = input.query_data() + input.query_block_offset(x + subii, y + subjj);
+        uint32 index_a = (y + subj) * PTCX_MAX_BLOCK_SIZE + (x + subi);
+        uint32 index_b = (y + subjj) * PTCX_MAX_BLOCK_SIZE + (x + subii);
 
         int32 delta[3] = 
         { 
-            static_cast<int32>(src_pixel_a[0]) - src_pixel_b[0], 
-            static_cast<int32>(src_pixel_a[1]) - src_pixel_b[1],
-            static_cast<int32>(src_pixel_a[2]) - src_pixel_b[2]
+            static_cast<int32>(block.channel[0][index_a]) - block.channel[0][index_b], 
+            static_cast<int32>(block.channel[1][index_a]) - block.channel[1][index_b],
+            static_cast<int32>(block.channel[2][index_a]) - block.channel[2][index_b]
         };
 
         uint32 length = sqrt(static_cast<uint32>(delta[0] * delta[0] + delta[1] * delta[1] + delta[2] * delta[2]));
@@ -80,8 +199,11 @@ status range_estimate_linear_distance(const PTCX_FILE_HEADER &header, PTCX_PIXEL
     }     
 
     // Compute the final pixel range.
-    uint8 * min_pixel = input.query_data() + input.query_block_offset(x + aii, y + ajj);
-    uint8 * max_pixel = input.query_data() + input.query_block_offset(x + ai, y + aj);
+    uint32 min_index = (y + ajj) * PTCX_MAX_BLOCK_SIZE + (x + aii);
+    uint32 max_index = (y + aj) * PTCX_MAX_BLOCK_SIZE + (x + ai);
+
+    uint8 min_pixel[3] = { block.channel[0][min_index], block.channel[1][min_index], block.channel[2][min_index] };
+    uint8 max_pixel[3] = { block.channel[0][max_index], block.channel[1][max_index], block.channel[2][max_index] };
 
     uint32 min_pixel_values[3] = { min_pixel[0], min_pixel[1], min_pixel[2] };
     uint32 max_pixel_values[3] = { max_pixel[0], max_pixel[1], max_pixel[2] };
@@ -170,14 +292,14 @@ status compute_linear_squares_3(uint8 *pixel_set, uint32 pixel_count, uint8 *out
 {
    if (BASE_PARAM_CHECK)
     {
-        if (!pixel_set || !out_start || !out_end)
+        if (!pixel_set || !out_start || !out_end || pixel_count > PTCX_MAX_MB_TABLE_SIZE)
         {
             return base_post_error(BASE_ERROR_INVALIDARG);
         }
     }
 
-   uint8  a_list[PTCX_MAX_BLOCK_SIZE * PTCX_MAX_BLOCK_SIZE * 2];
-   uint8  b_list[PTCX_MAX_BLOCK_SIZE * PTCX_MAX_BLOCK_SIZE * 2];
+   uint8  a_list[PTCX_MAX_MB_TABLE_SIZE * 2];
+   uint8  b_list[PTCX_MAX_MB_TABLE_SIZE * 2];
 
    for (uint32 i = 0; i < pixel_count; i++)
    {
@@ -210,7 +332,7 @@ status compute_linear_squares_3(uint8 *pixel_set, uint32 pixel_count, uint8 *out
    return BASE_SUCCESS;
 }
 
-status range_estimate_regression(const PTCX_FILE_HEADER &header, PTCX_PIXEL_RANGE *range, const image &input, uint32 x, uint32 y)
+status range_estimate_regression(const PTCX_FILE_HEADER &header, PTCX_PIXEL_RANGE *range, const PTCX_BLOCK_DATA &block, uint32 x, uint32 y)
 {
     if (BASE_PARAM_CHECK)
     {
@@ -220,7 +342,7 @@ status range_estimate_regression(const PTCX_FILE_HEADER &header, PTCX_PIXEL_RANG
         }
     }
 
-    uint8 pixel_set[PTCX_MAX_BLOCK_SIZE * PTCX_MAX_BLOCK_SIZE * 3];
+    uint8 pixel_set[PTCX_MAX_MB_TABLE_SIZE * 3];
     uint32 index = 0;
 
     range->min_value[0] = 255;
@@ -234,12 +356,12 @@ status range_estimate_regression(const PTCX_FILE_HEADER &header, PTCX_PIXEL_RANG
     for (uint32 subj = 0; subj < header.block_height; subj++)
     for (uint32 subi = 0; subi < header.block_width; subi++)
     {
-        uint8 *src_pixel = input.query_data() + input.query_block_offset(x + subi, y + subj);
-        uint32 index = subj * header.block_width + subi;
+        uint32 src_index = (y + subj) * PTCX_MAX_BLOCK_SIZE + (x + subi);
+        uint32 index = (subj * header.block_width + subi) * 3;
 
-        pixel_set[index++] = src_pixel[0];
-        pixel_set[index++] = src_pixel[1];
-        pixel_set[index++] = src_pixel[2];
+        pixel_set[index++] = block.channel[0][src_index];
+        pixel_set[index++] = block.channel[1][src_index];
+        pixel_set[index++] = block.channel[2][src_index];
     }     
 
     if (base_failed(compute_linear_squares_3(pixel_set, header.block_width * header.block_height, range->min_value, range->max_value)))
@@ -0,0 +1,664 @@
+
+#include "ptcx_internal.h"
+
+status verify_header(const PTCX_FILE_HEADER &header)
+{
+    return verify_header(header, PTCX_SUPPORTED_FLAGS);
+}
+
+status verify_header(const PTCX_FILE_HEADER &header, uint32 supported_flags)
+{
+    if (PTCX_MAGIC_VALUE != header.magic)
+    {
+        return BASE_ERROR_INVALID_RESOURCE;
+    }
+
+    switch (header.version)
+    {
+        case PTCX_LEGACY_VERSION:
+        {
+            if (PTCX_LEGACY_HEADER_SIZE != header.header_size) return BASE_ERROR_INVALID_RESOURCE;
+        } break;
+
+        case PTCX_MAJOR_VERSION:
+        {
+            if (sizeof(PTCX_FILE_HEADER) != header.header_size) return BASE_ERROR_INVALID_RESOURCE;
+        } break;
+
+        default: return BASE_ERROR_INVALID_RESOURCE;
+    };
+
+    if (0 == header.image_width || 0 == header.image_height)
+    {
+        return BASE_ERROR_INVALID_RESOURCE;
+    }
+
+    // Block dimensions must be powers of two within our supported range, and must
+    // evenly divide the image.
+
+    if (header.block_width < PTCX_MIN_BLOCK_SIZE || header.block_width > PTCX_MAX_BLOCK_SIZE ||
+        header.block_height < PTCX_MIN_BLOCK_SIZE || header.block_height > PTCX_MAX_BLOCK_SIZE ||
+        !is_pow2(header.block_width) || !is_pow2(header.block_height))
+    {
+        return BASE_ERROR_INVALID_RESOURCE;
+    }
+
+    if (header.image_width % header.block_width || header.image_height % header.block_height)
+    {
+        return BASE_ERROR_INVALID_RESOURCE;
+    }
+
+    if (0 == header.quant_step_bits || header.quant_step_bits > PTCX_MAX_QUANT_STEP_BITS || !is_pow2(header.quant_step_bits))
+    {
+        return BASE_ERROR_INVALID_RESOURCE;
+    }
+
+    if (PTCX_MAX_QUANT_CONTROL_BITS != header.quant_control_bits)
+    {
+        return BASE_ERROR_INVALID_RESOURCE;
+    }
+
+    if (PTCX_MAJOR_VERSION == header.version)
+    {
+        if (0 == header.band_height || header.band_height % header.block_height || header.image_height % header.band_height)
+        {
+            return BASE_ERROR_INVALID_RESOURCE;
+        }
+
+        if (header.flags & ~supported_flags)
+        {
+            // The file uses features that we do not support.
+            return BASE_ERROR_INVALID_RESOURCE;
+        }
+
+        // Only mip chains hold more than a single level.
+        bool is_mip_chain = !!(header.flags & PTCX_FLAG_MIP_CHAIN);
+
+        if (is_mip_chain ? (header.image_depth < 2 || header.image_depth > PTCX_MAX_MIP_LEVELS) : 
+                           (PTCX_DEFAULT_IMAGE_DEPTH != header.image_depth))
+        {
+            return BASE_ERROR_INVALID_RESOURCE;
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+bool is_compatible_base(const PTCX_FILE_HEADER &header, const PTCX_FILE_HEADER &base_header)
+{
+    // Coded data is interpreted identically when the geometry and every flag that changes
+    // the meaning of control or index values agree. Flags that only change how sections
+    // are stored, such as entropy coding, may differ.
+
+    const uint32 coding_flags = PTCX_FLAG_SOLID_BLOCKS | PTCX_FLAG_ADAPTIVE_STEP_BITS | PTCX_FLAG_RECTANGULAR_PARTITIONS | 
+                                PTCX_FLAG_PLANAR_BLOCKS | PTCX_FLAG_DECORRELATED_COLOR;
+
+    return header.image_width == base_header.image_width && header.image_height == base_header.image_height &&
+           header.block_width == base_header.block_width && header.block_height == base_header.block_height &&
+           header.band_height == base_header.band_height && header.quant_step_bits == base_header.quant_step_bits &&
+           header.quant_control_bits == base_header.quant_control_bits &&
+           (header.flags & coding_flags) == (base_header.flags & coding_flags);
+}
+
+uint32 query_band_count(const PTCX_FILE_HEADER &header)
+{
+    return header.image_height / header.band_height;
+}
+
+uint32 query_band_macroblock_count(const PTCX_FILE_HEADER &header)
+{
+    return (header.image_width / header.block_width) * (header.band_height / header.block_height);
+}
+
+uint32 query_band_table_size(const PTCX_FILE_HEADER &header)
+{
+    return (query_band_macroblock_count(header) * query_macroblock_entry_bits(header) + 7) >> 3;
+}
+
+uint32 query_band_capacity(const PTCX_FILE_HEADER &header)
+{
+    // The worst case band is made up entirely of minimum sized microblocks, each
+    // carrying a pair of control values, plus a full set of indices.
+
+    uint32 band_pixels = header.image_width * header.band_height;
+    uint32 microblock_count = band_pixels / (PTCX_MIN_BLOCK_SIZE * PTCX_MIN_BLOCK_SIZE);
+
+    return ((microblock_count * (header.quant_control_bits << 1)) >> 3) +
+           ((band_pixels * header.quant_step_bits + 7) >> 3);
+}
+
+uint32 query_band_control_capacity(const PTCX_FILE_HEADER &header)
+{
+    uint32 microblock_count = (header.image_width * header.band_height) / (PTCX_MIN_BLOCK_SIZE * PTCX_MIN_BLOCK_SIZE);
+    uint32 microblock_bits = header.quant_control_bits << 1;
+    uint32 component_count = 6;
+
+    if (header.flags & PTCX_FLAG_PLANAR_BLOCKS)
+    {
+        // Planar microblocks carry a third color.
+        microblock_bits = PTCX_PLANAR_CONTROL_SIZE << 3;
+        component_count = 9;
+    }
+
+    if (header.flags & PTCX_FLAG_PREDICTED_ENDPOINTS)
+    {
+        // Each endpoint component requires at most a 13 bit code.
+        microblock_bits = component_count * 13;
+    }
+
+    return (microblock_count * microblock_bits + 7) >> 3;
+}
+
+bool is_large_macroblock(const PTCX_FILE_HEADER &header)
+{
+    return header.block_width > PTCX_DEFAULT_BLOCK_SIZE || header.block_height > PTCX_DEFAULT_BLOCK_SIZE;
+}
+
+uint32 query_partition_level_count(const PTCX_FILE_HEADER &header)
+{
+    // Default sized macroblocks retain the three levels of the original format. Larger 
+    // macroblocks halve down to the default size, where their final level splits them
+    // into regions that each subdivide as a default sized macroblock would.
+
+    if (!is_large_macroblock(header))
+    {
+        return 3;
+    }
+
+    uint32 largest_dimension = base_max2(header.block_width, header.block_height);
+
+    return log2(largest_dimension / PTCX_DEFAULT_BLOCK_SIZE) + 1;
+}
+
+uint32 query_partition_region_count(const PTCX_FILE_HEADER &header)
+{
+    if (!is_large_macroblock(header))
+    {
+        return 0;
+    }
+
+    uint32 region_width = base_min2(header.block_width, (uint16) PTCX_DEFAULT_BLOCK_SIZE);
+    uint32 region_height = base_min2(header.block_height, (uint16) PTCX_DEFAULT_BLOCK_SIZE);
+
+    return (header.block_width / region_width) * (header.block_height / region_height);
+}
+
+bool is_split_macroblock(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry)
+{
+    if (!is_large_macroblock(header) || PTCX_BLOCK_MODE_REFERENCE == entry.mode)
+    {
+        return false;
+    }
+
+    uint32 split_level = query_partition_level_count(header) - 1;
+
+    return split_level == entry.shift_x && split_level == entry.shift_y;
+}
+
+bool is_identical_entry(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry_a, const PTCX_MACROBLOCK_ENTRY &entry_b)
+{
+    if (entry_a.mode != entry_b.mode || entry_a.shift_x != entry_b.shift_x || entry_a.shift_y != entry_b.shift_y ||
+        entry_a.quant_step_bits != entry_b.quant_step_bits || entry_a.color_space != entry_b.color_space)
+    {
+        return false;
+    }
+
+    if (is_split_macroblock(header, entry_a))
+    {
+        uint32 region_count = query_partition_region_count(header);
+
+        return !memcmp(entry_a.region_shift_x, entry_b.region_shift_x, region_count) &&
+               !memcmp(entry_a.region_shift_y, entry_b.region_shift_y, region_count);
+    }
+
+    return true;
+}
+
+uint32 query_macroblock_partition_bits(const PTCX_FILE_HEADER &header)
+{
+    if (header.flags & PTCX_FLAG_RECTANGULAR_PARTITIONS)
+    {
+        return PTCX_MB_TABLE_ENTRY_BITS << 1;
+    }
+
+    return PTCX_MB_TABLE_ENTRY_BITS;
+}
+
+uint32 query_macroblock_field_bits(const PTCX_FILE_HEADER &header)
+{
+    uint32 field_bits = query_macroblock_partition_bits(header);
+
+    if (header.flags & PTCX_FLAG_ADAPTIVE_STEP_BITS)
+    {
+        field_bits += PTCX_MB_TABLE_STEP_CODE_BITS;
+    }
+
+    if (header.flags & PTCX_BLOCK_MODE_FLAGS)
+    {
+        field_bits += PTCX_MB_TABLE_MODE_BITS;
+    }
+
+    if (header.flags & PTCX_FLAG_DECORRELATED_COLOR)
+    {
+        field_bits += PTCX_MB_TABLE_COLOR_SPACE_BITS;
+    }
+
+    return field_bits;
+}
+
+uint32 query_macroblock_entry_bits(const PTCX_FILE_HEADER &header)
+{
+    // Large macroblocks carry the subdivision levels of each of their regions.
+    return query_macroblock_field_bits(header) + query_partition_region_count(header) * query_macroblock_partition_bits(header);
+}
+
+uint32 query_microblock_control_size(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry)
+{
+    if (PTCX_BLOCK_MODE_PLANAR == entry.mode)
+    {
+        return PTCX_PLANAR_CONTROL_SIZE;
+    }
+
+    if (PTCX_BLOCK_MODE_REFERENCE == entry.mode)
+    {
+        return PTCX_REFERENCE_CONTROL_SIZE;
+    }
+
+    return (header.quant_control_bits << 1) >> 3;
+}
+
+void write_macroblock_table_bits(uint8 *mb_table, uint32 bit_offset, uint32 bit_count, uint32 value)
+{
+    // Entries are packed from the least significant bit of each byte upward, and may 
+    // straddle byte boundaries.
+
+    for (uint32 i = 0; i < bit_count;)
+    {
+        uint32 byte_index = (bit_offset + i) >> 3;
+        uint32 bit_shift = (bit_offset + i) & 0x7;
+        uint32 chunk_bits = base_min2(8 - bit_shift, bit_count - i);
+        uint8 bit_mask = ((1 << chunk_bits) - 1) << bit_shift;
+
+        mb_table[byte_index] = (mb_table[byte_index] & ~bit_mask) | (((value >> i) << bit_shift) & bit_mask);
+        i += chunk_bits;
+    }
+}
+
+uint32 read_macroblock_table_bits(const uint8 *mb_table, uint32 bit_offset, uint32 bit_count)
+{
+    uint32 value = 0;
+
+    for (uint32 i = 0; i < bit_count;)
+    {
+        uint32 byte_index = (bit_offset + i) >> 3;
+        uint32 bit_shift = (bit_offset + i) & 0x7;
+        uint32 chunk_bits = base_min2(8 - bit_shift, bit_count - i);
+
+        value |= ((mb_table[byte_index] >> bit_shift) & ((1 << chunk_bits) - 1)) << i;
+        i += chunk_bits;
+    }
+
+    return value;
+}
+
+void write_macroblock_entry(const PTCX_FILE_HEADER &header, uint8 *mb_table, uint32 block_index, const PTCX_MACROBLOCK_ENTRY &entry)
+{
+    uint32 entry_offset = block_index * query_macroblock_entry_bits(header);
+    uint32 value = entry.shift_x;
+
+    if (header.flags & PTCX_FLAG_RECTANGULAR_PARTITIONS)
+    {
+        value |= entry.shift_y << PTCX_MB_TABLE_ENTRY_BITS;
+    }
+
+    uint32 field_offset = query_macroblock_partition_bits(header);
+
+    if (header.flags & PTCX_FLAG_ADAPTIVE_STEP_BITS)
+    {
+        // Step bits are always a power of two, so we store their log.
+        value |= log2(entry.quant_step_bits) << field_offset;
+        field_offset += PTCX_MB_TABLE_STEP_CODE_BITS;
+    }
+
+    if (header.flags & PTCX_BLOCK_MODE_FLAGS)
+    {
+        value |= entry.mode << field_offset;
+        field_offset += PTCX_MB_TABLE_MODE_BITS;
+    }
+
+    if (header.flags & PTCX_FLAG_DECORRELATED_COLOR)
+    {
+        value |= entry.color_space << field_offset;
+        field_offset += PTCX_MB_TABLE_COLOR_SPACE_BITS;
+    }
+
+    write_macroblock_table_bits(mb_table, entry_offset, field_offset, value);
+
+    // Region levels follow, and are zero unless the macroblock is split.
+
+    uint32 region_count = query_partition_region_count(header);
+    uint32 region_bits = query_macroblock_partition_bits(header);
+    bool is_split = is_split_macroblock(header, entry);
+
+    for (uint32 i = 0; i < region_count; i++)
+    {
+        uint32 region_value = 0;
+
+        if (is_split)
+        {
+            region_value = entry.region_shift_x[i];
+
+            if (header.flags & PTCX_FLAG_RECTANGULAR_PARTITIONS)
+            {
+                region_value |= entry.region_shift_y[i] << PTCX_MB_TABLE_ENTRY_BITS;
+            }
+        }
+
+        write_macroblock_table_bits(mb_table, entry_offset + field_offset + i * region_bits, region_bits, region_value);
+    }
+}
+
+status read_macroblock_entry(const PTCX_FILE_HEADER &header, const uint8 *mb_table, uint32 block_index, PTCX_MACROBLOCK_ENTRY *entry)
+{
+    uint32 entry_offset = block_index * query_macroblock_entry_bits(header);
+    uint32 field_bits = query_macroblock_field_bits(header);
+    uint32 value = read_macroblock_table_bits(mb_table, entry_offset, field_bits);
+    uint32 shift_mask = (1 << PTCX_MB_TABLE_ENTRY_BITS) - 1;
+
+    entry->mode = PTCX_BLOCK_MODE_INDEXED;
+    entry->shift_x = value & shift_mask;
+    entry->shift_y = entry->shift_x;
+    entry->quant_step_bits = header.quant_step_bits;
+    entry->color_space = 0;
+
+    if (header.flags & PTCX_FLAG_RECTANGULAR_PARTITIONS)
+    {
+        entry->shift_y = (value >> PTCX_MB_TABLE_ENTRY_BITS) & shift_mask;
+    }
+
+    uint32 field_offset = query_macroblock_partition_bits(header);
+
+    if (header.flags & PTCX_FLAG_ADAPTIVE_STEP_BITS)
+    {
+        uint32 step_code = (value >> field_offset) & ((1 << PTCX_MB_TABLE_STEP_CODE_BITS) - 1);
+
+        if ((1u << step_code) > PTCX_MAX_QUANT_STEP_BITS)
+        {
+            return BASE_ERROR_INVALID_RESOURCE;
+        }
+
+        entry->quant_step_bits = 1 << step_code;
+        field_offset += PTCX_MB_TABLE_STEP_CODE_BITS;
+    }
+
+    if (header.flags & PTCX_BLOCK_MODE_FLAGS)
+    {
+        entry->mode = (value >> field_offset) & ((1 << PTCX_MB_TABLE_MODE_BITS) - 1);
+
+        // Each mode other than indexed requires its flag.
+        if ((PTCX_BLOCK_MODE_PLANAR == entry->mode && !(header.flags & PTCX_FLAG_PLANAR_BLOCKS)) ||
+            (PTCX_BLOCK_MODE_REFERENCE == entry->mode && !(header.flags & PTCX_FLAG_BLOCK_REFERENCES)) ||
+            (PTCX_BLOCK_MODE_CODEBOOK == entry->mode && !(header.flags & PTCX_FLAG_INDEX_CODEBOOK)))
+        {
+            return BASE_ERROR_INVALID_RESOURCE;
+        }
+
+        field_offset += PTCX_MB_TABLE_MODE_BITS;
+    }
+
+    if (header.flags & PTCX_FLAG_DECORRELATED_COLOR)
+    {
+        entry->color_space = (value >> field_offset) & ((1 << PTCX_MB_TABLE_COLOR_SPACE_BITS) - 1);
+    }
+
+    if (is_large_macroblock(header))
+    {
+        // Large macroblocks never subdivide beyond their split level.
+
+        uint32 split_level = query_partition_level_count(header) - 1;
+
+        if (entry->shift_x > split_level || entry->shift_y > split_level)
+        {
+            return BASE_ERROR_INVALID_RESOURCE;
+        }
+
+        if (is_split_macroblock(header, *entry))
+        {
+            uint32 region_count = query_partition_region_count(header);
+            uint32 region_bits = query_macroblock_partition_bits(header);
+
+            for (uint32 i = 0; i < region_count; i++)
+            {
+                uint32 region_value = read_macroblock_table_bits(mb_table, entry_offset + field_bits + i * region_bits, region_bits);
+
+                entry->region_shift_x[i] = region_value & shift_mask;
+                entry->region_shift_y[i] = entry->region_shift_x[i];
+
+                if (header.flags & PTCX_FLAG_RECTANGULAR_PARTITIONS)
+                {
+                    entry->region_shift_y[i] = (region_value >> PTCX_MB_TABLE_ENTRY_BITS) & shift_mask;
+                }
+            }
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+void query_microblock_size(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry, uint32 *width, uint32 *height)
+{
+    // Each level of subdivision halves a dimension, down to our minimum block size.
+
+    (*width) = base_max2(static_cast<uint32>(header.block_width >> entry.shift_x), (uint32) PTCX_MIN_BLOCK_SIZE);
+    (*height) = base_max2(static_cast<uint32>(header.block_height >> entry.shift_y), (uint32) PTCX_MIN_BLOCK_SIZE);
+}
+
+uint32 query_partition_regions(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry, PTCX_PARTITION_REGION *regions)
+{
+    if (!is_split_macroblock(header, entry))
+    {
+        regions[0].x = 0;
+        regions[0].y = 0;
+        regions[0].width = header.block_width;
+        regions[0].height = header.block_height;
+
+        query_microblock_size(header, entry, &regions[0].micro_width, &regions[0].micro_height);
+
+        return 1;
+    }
+
+    // Regions are ordered row major, and each halves down to our minimum block size.
+
+    uint32 region_width = base_min2(header.block_width, (uint16) PTCX_DEFAULT_BLOCK_SIZE);
+    uint32 region_height = base_min2(header.block_height, (uint16) PTCX_DEFAULT_BLOCK_SIZE);
+    uint32 region_count = 0;
+
+    for (uint32 y = 0; y < header.block_height; y += region_height)
+    for (uint32 x = 0; x < header.block_width; x += region_width)
+    {
+        PTCX_PARTITION_REGION &region = regions[region_count];
+
+        region.x = x;
+        region.y = y;
+        region.width = region_width;
+        region.height = region_height;
+        region.micro_width = base_max2(region_width >> entry.region_shift_x[region_count], (uint32) PTCX_MIN_BLOCK_SIZE);
+        region.micro_height = base_max2(region_height >> entry.region_shift_y[region_count], (uint32) PTCX_MIN_BLOCK_SIZE);
+
+        region_count++;
+    }
+
+    return region_count;
+}
+
+uint32 query_region_microblock_count(const PTCX_PARTITION_REGION &region)
+{
+    return (region.width / region.micro_width) * (region.height / region.micro_height);
+}
+
+void query_smallest_microblock_size(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry, uint32 *width, uint32 *height)
+{
+    // Microblock dimensions are powers of two, so the smallest of them is a multiple of 
+    // any alignment that every microblock meets.
+
+    PTCX_PARTITION_REGION regions[PTCX_MAX_PARTITION_REGIONS];
+    uint32 region_count = query_partition_regions(header, entry, regions);
+
+    (*width) = regions[0].micro_width;
+    (*height) = regions[0].micro_height;
+
+    for (uint32 i = 1; i < region_count; i++)
+    {
+        (*width) = base_min2((*width), regions[i].micro_width);
+        (*height) = base_min2((*height), regions[i].micro_height);
+    }
+}
+
+status read_reference_distance(const uint8 *control, uint32 block_index, uint32 *distance)
+{
+    // References may only point backward, to a macroblock within the same band.
+
+    (*distance) = control[0] | (control[1] << 8);
+
+    if (0 == (*distance) || (*distance) > block_index)
+    {
+        return BASE_ERROR_INVALID_RESOURCE;
+    }
+
+    return BASE_SUCCESS;
+}
+
+bool is_solid_microblock(const PTCX_FILE_HEADER &header, const uint8 *control)
+{
+    // Solid microblocks are signalled by a pair of identical control values.
+    uint32 value_bytes = header.quant_control_bits >> 3;
+
+    return (header.flags & PTCX_FLAG_SOLID_BLOCKS) && !memcmp(control, control + value_bytes, value_bytes);
+}
+
+void unpack_planar_colors(const uint8 *input, PTCX_PLANAR_COLORS *colors)
+{
+    int32 *values[3] = {colors->origin, colors->horizontal, colors->vertical};
+
+    for (uint8 i = 0; i < 3; i++)
+    {
+        uint16 packed = input[i * 2] | (input[i * 2 + 1] << 8);
+
+        values[i][0] = ((packed) & 0x1F) * 8;
+        values[i][1] = ((packed >> 5) & 0x3F) * 4;
+        values[i][2] = ((packed >> 11) & 0x1F) * 8;
+    }
+}
+
+void pack_planar_colors(const PTCX_PLANAR_COLORS &colors, uint8 *output)
+{
+    const int32 *values[3] = {colors.origin, colors.horizontal, colors.vertical};
+
+    for (uint8 i = 0; i < 3; i++)
+    {
+        uint16 packed = ((values[i][2] / 8) << 11) | ((values[i][1] / 4) << 5) | (values[i][0] / 8);
+
+        output[i * 2] = packed & 0xFF;
+        output[i * 2 + 1] = packed >> 8;
+    }
+}
+
+uint8 evaluate_planar_color(const PTCX_PLANAR_COLORS &colors, uint32 channel, uint32 width_bits, uint32 height_bits, uint32 x, uint32 y)
+{
+    // origin + (horizontal - origin) * x / width + (vertical - origin) * y / height, with
+    // both fractions placed over the block area so that a single shift rounds the sum.
+
+    int32 origin = colors.origin[channel];
+    int32 value = (origin << (width_bits + height_bits)) + 
+                  (colors.horizontal[channel] - origin) * static_cast<int32>(x << height_bits) +
+                  (colors.vertical[channel] - origin) * static_cast<int32>(y << width_bits) + 
+                  ((1 << (width_bits + height_bits)) >> 1);
+
+    return base_min2(base_max2(value, 0) >> (width_bits + height_bits), 255);
+}
+
+void decorrelate_color(const uint8 *input, uint8 *output)
+{
+    // Colors outside of is_decorrelated_range have their differences clamped, and the
+    // lifting continues from the clamped value so that luma remains consistent with 
+    // the decoder.
+
+    int32 co = base_min2(base_max2(input[0] - input[2], -128), 127);
+    int32 t = input[2] + (co >> 1);
+    int32 cg = base_min2(base_max2(input[1] - t, -128), 127);
+    int32 y = t + (cg >> 1);
+
+    output[0] = co + 128;
+    output[1] = base_min2(base_max2(y, 0), 255);
+    output[2] = cg + 128;
+}
+
+void correlate_color(const uint8 *input, uint8 *output)
+{
+    // Reverse the lifting steps. Palettes may hold any combination of channel values,
+    // including those that no RGB color produces, so we clamp the result.
+
+    int32 co = input[0] - 128;
+    int32 cg = input[2] - 128;
+    int32 t = input[1] - (cg >> 1);
+    int32 g = cg + t;
+    int32 b = t - (co >> 1);
+    int32 r = b + co;
+
+    output[0] = base_min2(base_max2(r, 0), 255);
+    output[1] = base_min2(base_max2(g, 0), 255);
+    output[2] = base_min2(base_max2(b, 0), 255);
+}
+
+bool is_decorrelated_range(const uint8 *input)
+{
+    int32 co = input[0] - input[2];
+    int32 cg = input[1] - (input[2] + (co >> 1));
+
+    return co >= -128 && co <= 127 && cg >= -128 && cg <= 127;
+}
+
+bool is_correlated_range(const uint8 *input)
+{
+    // True when correlate_color reproduces the color without clamping.
+    int32 co = input[0] - 128;
+    int32 cg = input[2] - 128;
+    int32 t = input[1] - (cg >> 1);
+    int32 b = t - (co >> 1);
+
+    return cg + t >= 0 && cg + t <= 255 && b >= 0 && b <= 255 && b + co >= 0 && b + co <= 255;
+}
+
+status read_stream_data(stream *input, void *data, uint32 size)
+{
+    uint32 bytes_read = 0;
+
+    if (0 == size)
+    {
+        return BASE_SUCCESS;
+    }
+
+    if (base_failed(input->read_data(data, size, &bytes_read)) || bytes_read != size)
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status write_stream_data(stream *output, const void *data, uint32 size)
+{
+    uint32 bytes_written = 0;
+
+    if (0 == size)
+    {
+        return BASE_SUCCESS;
+    }
+
+    if (base_failed(output->write_data(const_cast<void *>(data), size, &bytes_written)) || bytes_written != size)
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    return BASE_SUCCESS;
+}
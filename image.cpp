@@ -1,5 +1,6 @@
 
 #include "image.h"
+#include "math.h"
 
 namespace imagine {
 
@@ -32,6 +33,7 @@ uint8 pixel_rate_from_format(IGN_IMAGE_FORMAT format)
 image::image()
 {
     image_format = IGN_IMAGE_FORMAT_NONE;
+    image_layout = IGN_IMAGE_LAYOUT_LINEAR;
     placement_allocation = false;
     width_in_pixels = 0;
     height_in_pixels = 0;
@@ -48,18 +50,118 @@ image::~image()
     deallocate();
 }
 
+image::image(image &&rvalue)
+{
+    image_format = IGN_IMAGE_FORMAT_NONE;
+    image_layout = IGN_IMAGE_LAYOUT_LINEAR;
+    placement_allocation = false;
+    width_in_pixels = 0;
+    height_in_pixels = 0;
+    bits_per_pixel = 0;
+    channel_count = 0;
+    data_buffer = 0;
+
+    swap(rvalue);
+}
+
+image &image::operator = (image &&rvalue)
+{
+    if (this != &rvalue)
+    {
+        // Release our current contents before taking over those of rvalue, so that the
+        // moved-from image is always left uninitialized.
+
+        image empty_image;
+
+        swap(empty_image);
+        swap(rvalue);
+    }
+
+    return *this;
+}
+
+void image::swap(image &rvalue)
+{
+    IGN_IMAGE_FORMAT temp_format = image_format;
+    IGN_IMAGE_LAYOUT temp_layout = image_layout;
+    bool temp_placement = placement_allocation;
+    uint32 temp_width = width_in_pixels;
+    uint32 temp_height = height_in_pixels;
+    uint32 temp_bits = bits_per_pixel;
+    uint8 temp_channels = channel_count;
+    uint8 *temp_buffer = data_buffer;
+
+    image_format = rvalue.image_format;
+    image_layout = rvalue.image_layout;
+    placement_allocation = rvalue.placement_allocation;
+    width_in_pixels = rvalue.width_in_pixels;
+    height_in_pixels = rvalue.height_in_pixels;
+    bits_per_pixel = rvalue.bits_per_pixel;
+    channel_count = rvalue.channel_count;
+    data_buffer = rvalue.data_buffer;
+
+    rvalue.image_format = temp_format;
+    rvalue.image_layout = temp_layout;
+    rvalue.placement_allocation = temp_placement;
+    rvalue.width_in_pixels = temp_width;
+    rvalue.height_in_pixels = temp_height;
+    rvalue.bits_per_pixel = temp_bits;
+    rvalue.channel_count = temp_channels;
+    rvalue.data_buffer = temp_buffer;
+}
+
 uint32 image::query_row_pitch() const
 {
     return (width_in_pixels * bits_per_pixel) >> 3;
 }
 
+uint32 image::query_block_pitch() const
+{
+    if (IGN_IMAGE_LAYOUT_TILED == image_layout)
+    {
+        return (IGN_IMAGE_TILE_SIZE * bits_per_pixel) >> 3;
+    }
+
+    return query_row_pitch();
+}
+
+uint32 image::query_block_run_width() const
+{
+    if (IGN_IMAGE_LAYOUT_TILED == image_layout)
+    {
+        return IGN_IMAGE_TILE_SIZE;
+    }
+
+    return width_in_pixels;
+}
+
 uint32 image::query_slice_pitch() const
 {
+    if (IGN_IMAGE_LAYOUT_TILED == image_layout)
+    {
+        uint32 tiled_width = greater_multiple(width_in_pixels, IGN_IMAGE_TILE_SIZE);
+        uint32 tiled_height = greater_multiple(height_in_pixels, IGN_IMAGE_TILE_SIZE);
+
+        return ((tiled_width * bits_per_pixel) >> 3) * tiled_height;
+    }
+
     return query_row_pitch() * height_in_pixels;
 }
 
 uint32 image::query_block_offset(uint32 i, uint32 j) const
 {
+    if (IGN_IMAGE_LAYOUT_TILED == image_layout)
+    {
+        // Tiles are power of two sized, so we can locate the tile and the pixel within 
+        // the tile using shifts and masks rather than divisions.
+
+        uint32 tiles_per_row = (width_in_pixels + IGN_IMAGE_TILE_SIZE - 1) >> IGN_IMAGE_TILE_SHIFT;
+        uint32 tile_index = (j >> IGN_IMAGE_TILE_SHIFT) * tiles_per_row + (i >> IGN_IMAGE_TILE_SHIFT);
+        uint32 local_index = ((j & (IGN_IMAGE_TILE_SIZE - 1)) << IGN_IMAGE_TILE_SHIFT) + (i & (IGN_IMAGE_TILE_SIZE - 1));
+
+        return (((tile_index << (IGN_IMAGE_TILE_SHIFT << 1)) + local_index) * bits_per_pixel) >> 3;
+    }
+
     return (query_row_pitch() * j) + ((i * bits_per_pixel) >> 3);
 }
 
@@ -169,6 +271,21 @@ status image::set_image_format(IGN_IMAGE_FORMAT format)
     return BASE_SUCCESS;
 }
 
+status image::set_image_layout(IGN_IMAGE_LAYOUT layout)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (IGN_IMAGE_LAYOUT_LINEAR != layout && IGN_IMAGE_LAYOUT_TILED != layout)
+        {
+            return base_post_error(BASE_ERROR_INVALIDARG);
+        }
+    }
+
+    image_layout = layout;
+
+    return BASE_SUCCESS;
+}
+
 uint32 image::query_width() const
 {
     return width_in_pixels;
@@ -194,12 +311,22 @@ IGN_IMAGE_FORMAT image::query_image_format() const
     return image_format;
 }
 
+IGN_IMAGE_LAYOUT image::query_image_layout() const
+{
+    return image_layout;
+}
+
 uint8 image::query_channel_count() const
 {
     return channel_count;
 }
 
 status create_image(IGN_IMAGE_FORMAT format, uint32 width, uint32 height, image *output)
+{
+    return create_image(format, IGN_IMAGE_LAYOUT_LINEAR, width, height, output);
+}
+
+status create_image(IGN_IMAGE_FORMAT format, void *image_data, uint32 width, uint32 height, image *output)
 {
     if (BASE_PARAM_CHECK)
     {
@@ -208,7 +335,7 @@ status create_image(IGN_IMAGE_FORMAT format, uint32 width, uint32 height, image
             return base_post_error(BASE_ERROR_INVALIDARG);
         }
 
-        if (!output)
+        if (!image_data || !output)
         {
             return base_post_error(BASE_ERROR_INVALIDARG);
         }
@@ -224,10 +351,12 @@ status create_image(IGN_IMAGE_FORMAT format, uint32 width, uint32 height, image
         return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
     }
 
-    // All images are required to use byte aligned pixel rates, so there is 
-    // no need to align the allocation size.
+    if (base_failed(output->set_image_layout(IGN_IMAGE_LAYOUT_LINEAR)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
 
-    if (base_failed(output->allocate((width * height * output->query_bits_per_pixel()) >> 3)))
+    if (base_failed(output->set_placement(image_data)))
     {
         return base_post_error(BASE_ERROR_OUTOFMEMORY);
     }
@@ -235,7 +364,7 @@ status create_image(IGN_IMAGE_FORMAT format, uint32 width, uint32 height, image
     return BASE_SUCCESS;
 }
 
-status create_image(IGN_IMAGE_FORMAT format, void *image_data, uint32 width, uint32 height, image *output)
+status create_image(IGN_IMAGE_FORMAT format, IGN_IMAGE_LAYOUT layout, uint32 width, uint32 height, image *output)
 {
     if (BASE_PARAM_CHECK)
     {
@@ -244,7 +373,7 @@ status create_image(IGN_IMAGE_FORMAT format, void *image_data, uint32 width, uin
             return base_post_error(BASE_ERROR_INVALIDARG);
         }
 
-        if (!image_data || !output)
+        if (!output)
         {
             return base_post_error(BASE_ERROR_INVALIDARG);
         }
@@ -260,7 +389,13 @@ status create_image(IGN_IMAGE_FORMAT format, void *image_data, uint32 width, uin
         return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
     }
 
-    if (base_failed(output->set_placement(image_data)))
+    if (base_failed(output->set_image_layout(layout)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    // The slice pitch accounts for any tile padding required by the layout.
+    if (base_failed(output->allocate(output->query_slice_pitch())))
     {
         return base_post_error(BASE_ERROR_OUTOFMEMORY);
     }
@@ -283,4 +418,174 @@ status destroy_image(image *input)
     return BASE_SUCCESS;
 }
 
+status clone_image(const image &input, image *output)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!output || &input == output || !input.query_data())
+        {
+            return base_post_error(BASE_ERROR_INVALIDARG);
+        }
+    }
+
+    if (base_failed(create_image(input.query_image_format(), input.query_image_layout(), 
+                                 input.query_width(), input.query_height(), output)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    memcpy(output->data_buffer, input.data_buffer, input.query_slice_pitch());
+
+    return BASE_SUCCESS;
+}
+
+status adopt_image(IGN_IMAGE_FORMAT format, IGN_IMAGE_LAYOUT layout, uint8 *image_data, uint32 width, uint32 height, image *output)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (0 == width || 0 == height)
+        {
+            return base_post_error(BASE_ERROR_INVALIDARG);
+        }
+
+        if (!image_data || !output)
+        {
+            return base_post_error(BASE_ERROR_INVALIDARG);
+        }
+    }
+
+    output->deallocate();
+
+    if (base_failed(output->set_image_format(format)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    if (base_failed(output->set_dimension(width, height)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    if (base_failed(output->set_image_layout(layout)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    // The buffer becomes ours, and will be freed by deallocate.
+    output->data_buffer = image_data;
+    output->placement_allocation = false;
+
+    return BASE_SUCCESS;
+}
+
+status release_image(image *input, uint8 **output)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!input || !output)
+        {
+            return base_post_error(BASE_ERROR_INVALIDARG);
+        }
+    }
+
+    if (input->placement_allocation || !input->data_buffer)
+    {
+        // We cannot hand over memory that we do not own.
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    (*output) = input->data_buffer;
+
+    // Detach the buffer before resetting the image so that it is not freed.
+    input->data_buffer = 0;
+
+    image empty_image;
+    input->swap(empty_image);
+
+    return BASE_SUCCESS;
+}
+
+status convert_image_layout(const image &input, IGN_IMAGE_LAYOUT layout, image *output)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!output || &input == output || !input.query_data())
+        {
+            return base_post_error(BASE_ERROR_INVALIDARG);
+        }
+    }
+
+    uint32 width = input.query_width();
+    uint32 height = input.query_height();
+    uint32 pixel_bytes = input.query_bits_per_pixel() >> 3;
+
+    if (base_failed(create_image(input.query_image_format(), layout, width, height, output)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    // Every tile aligned run of pixels within a row is contiguous in both layouts, so
+    // we copy one tile row at a time. Partial tiles along the right edge simply copy 
+    // a shorter run.
+
+    for (uint32 j = 0; j < height; j++)
+    for (uint32 i = 0; i < width; i += IGN_IMAGE_TILE_SIZE)
+    {
+        uint32 run_length = base_min2(width - i, (uint32) IGN_IMAGE_TILE_SIZE);
+        uint8 *src_data = input.query_data() + input.query_block_offset(i, j);
+        uint8 *dest_data = output->query_data() + output->query_block_offset(i, j);
+
+        memcpy(dest_data, src_data, run_length * pixel_bytes);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status downsample_image(const image &input, image *output)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!output || &input == output || !input.query_data() || !output->query_data())
+        {
+            return base_post_error(BASE_ERROR_INVALIDARG);
+        }
+    }
+
+    uint32 width = output->query_width();
+    uint32 height = output->query_height();
+    uint32 pixel_bytes = input.query_bits_per_pixel() >> 3;
+
+    if (input.query_image_format() != output->query_image_format() || 
+        width != (input.query_width() >> 1) || height != (input.query_height() >> 1))
+    {
+        return base_post_error(BASE_ERROR_INVALIDARG);
+    }
+
+    // Each run of output pixels reads a run twice as wide from two source rows, and both
+    // runs must be contiguous. Within a run every channel is averaged independently, which
+    // leaves a simple loop over bytes that the compiler is free to vectorize.
+
+    uint32 run_width = base_min2(output->query_block_run_width(), input.query_block_run_width() >> 1);
+
+    for (uint32 j = 0; j < height; j++)
+    for (uint32 i = 0; i < width; i += run_width)
+    {
+        uint32 run_length = base_min2(width - i, run_width);
+        const uint8 *src_upper = input.query_data() + input.query_block_offset(i << 1, j << 1);
+        const uint8 *src_lower = input.query_data() + input.query_block_offset(i << 1, (j << 1) + 1);
+        uint8 *dest_data = output->query_data() + output->query_block_offset(i, j);
+
+        for (uint32 k = 0; k < run_length; k++)
+        for (uint32 c = 0; c < pixel_bytes; c++)
+        {
+            uint32 left = k * pixel_bytes * 2 + c;
+            uint32 right = left + pixel_bytes;
+
+            dest_data[k * pixel_bytes + c] = (src_upper[left] + src_upper[right] + src_lower[left] + src_lower[right] + 2) >> 2;
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
 } // namespace imagine
\ No newline at end of file
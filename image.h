@@ -45,15 +45,31 @@ enum IGN_IMAGE_FORMAT
     IGN_IMAGE_FORMAT_R8G8B8,            // RGB, 8 bits per channel
 };
 
+enum IGN_IMAGE_LAYOUT
+{
+    IGN_IMAGE_LAYOUT_LINEAR = 0,        // rows of pixels stored top to bottom
+    IGN_IMAGE_LAYOUT_TILED,             // IGN_IMAGE_TILE_SIZE square tiles, each stored contiguously
+};
+
+#define IGN_IMAGE_TILE_SHIFT            (4)
+#define IGN_IMAGE_TILE_SIZE             (1 << IGN_IMAGE_TILE_SHIFT)
+
 class image
 {
+    BASE_DISABLE_COPY_AND_ASSIGN(image);
+
     friend status create_image(IGN_IMAGE_FORMAT format, uint32 width, uint32 height, image *output);
     friend status create_image(IGN_IMAGE_FORMAT format, void *image_data, uint32 width, uint32 height, image *output);
+    friend status create_image(IGN_IMAGE_FORMAT format, IGN_IMAGE_LAYOUT layout, uint32 width, uint32 height, image *output);
     friend status destroy_image(image *input);
+    friend status clone_image(const image &input, image *output);
+    friend status adopt_image(IGN_IMAGE_FORMAT format, IGN_IMAGE_LAYOUT layout, uint8 *image_data, uint32 width, uint32 height, image *output);
+    friend status release_image(image *input, uint8 **output);
 
 private:
 
     IGN_IMAGE_FORMAT image_format;
+    IGN_IMAGE_LAYOUT image_layout;
     bool placement_allocation;
 
     uint32 width_in_pixels;
@@ -90,6 +106,14 @@ private:
 
     status set_dimension(uint32 width, uint32 height);
 
+    /*
+    // Tiled images store each IGN_IMAGE_TILE_SIZE square tile as a contiguous run of 
+    // rows, with tiles ordered left to right and top to bottom. The backing storage is 
+    // padded out to a whole number of tiles.
+    */
+
+    status set_image_layout(IGN_IMAGE_LAYOUT layout);
+
     /*
     // placement_allocation identifies whether the image owns its backing storage or
     // whether the memory was provided by the caller.
@@ -102,6 +126,17 @@ public:
     image();		
     virtual ~image();	
 
+    /*
+    // Images are move-only. Copying is disabled because an image owns its buffer, but
+    // ownership may be transferred cheaply by moving or swapping. The moved-from image 
+    // is left uninitialized. Use clone_image to produce an explicit deep copy.
+    */
+
+    image(image &&rvalue);
+    image &operator = (image &&rvalue);
+
+    void swap(image &rvalue);
+
     /*
     // Image dimensions are always specified in pixels. Note that compressed image
     // formats may not store their image data as a contiguous set of pixels.
@@ -115,6 +150,7 @@ public:
     uint8 query_channel_count() const;
 
     IGN_IMAGE_FORMAT query_image_format() const;
+    IGN_IMAGE_LAYOUT query_image_layout() const;
 
     /*
     // Row Pitch
@@ -125,6 +161,27 @@ public:
     */
 
     uint32 query_row_pitch() const;
+
+    /*
+    // Block Pitch
+    //
+    // Block pitch is the byte delta between two vertically adjacent pixels that reside
+    // within the same IGN_IMAGE_TILE_SIZE aligned block. For linear images this is the 
+    // row pitch, while for tiled images it is the byte width of a single tile. Callers
+    // that walk a tile aligned block may fetch a pointer once and step by this amount.
+    */
+
+    uint32 query_block_pitch() const;
+
+    /*
+    // Block Run Width
+    //
+    // The number of horizontally adjacent pixels, starting at an IGN_IMAGE_TILE_SIZE 
+    // aligned column, that are guaranteed to be contiguous in memory. This is the tile 
+    // size for tiled images and the image width for linear images.
+    */
+
+    uint32 query_block_run_width() const;
     
     /*
     // Slice Pitch
@@ -141,7 +198,7 @@ public:
     //
     // Block offset returns the byte offset from the start of the image to pixel (i,j).
     // Formats are required to use byte aligned pixel rates, so this function will always
-    // point to the start of a pixel block.
+    // point to the start of a pixel block. The offset respects the image layout.
     */
 
     uint32 query_block_offset(uint32 i, uint32 j) const;
@@ -157,8 +214,48 @@ public:
 
 status create_image(IGN_IMAGE_FORMAT format, uint32 width, uint32 height, image *output);
 status create_image(IGN_IMAGE_FORMAT format, void *image_data, uint32 width, uint32 height, image *output);
+status create_image(IGN_IMAGE_FORMAT format, IGN_IMAGE_LAYOUT layout, uint32 width, uint32 height, image *output);
 status destroy_image(image *input);
 
+/*
+// Ownership management
+//
+// clone_image allocates output and copies the pixels (and layout) of input into it.
+//
+// adopt_image initializes output around an existing buffer that was allocated with 
+// new uint8[], and takes ownership of it. The buffer must hold at least the slice 
+// pitch of an image with the given format, layout and dimensions.
+//
+// release_image relinquishes ownership of the buffer held by input, returning it to 
+// the caller who becomes responsible for freeing it with delete []. The image is left
+// uninitialized. Placement images do not own their buffers and cannot be released.
+*/
+
+status clone_image(const image &input, image *output);
+status adopt_image(IGN_IMAGE_FORMAT format, IGN_IMAGE_LAYOUT layout, uint8 *image_data, uint32 width, uint32 height, image *output);
+status release_image(image *input, uint8 **output);
+
+/*
+// Layout conversion
+//
+// Copies the contents of input into a freshly allocated output image that uses the 
+// requested layout. Conversion is performed a tile row at a time, so the cost is 
+// roughly that of a memcpy of the image.
+*/
+
+status convert_image_layout(const image &input, IGN_IMAGE_LAYOUT layout, image *output);
+
+/*
+// Downsampling
+//
+// Reduces input to half of its width and height with a 2x2 box filter, rounding each
+// channel to nearest. Output must already be initialized with the same format and half
+// the dimensions of input (rounded down), and may use either layout. Callers that build 
+// a chain of levels may therefore reuse the same buffers for every level. 
+*/
+
+status downsample_image(const image &input, image *output);
+
 } // namespace imagine
 
 #endif // __IMAGE_H__
@@ -0,0 +1,288 @@
+
+#include "ptcx_internal.h"
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+// A decoded macroblock held by the cache, and its position within the recency list.
+typedef struct PTCX_LAZY_TILE
+{
+    uint32 slot;
+    std::list<uint32>::iterator position;
+
+} PTCX_LAZY_TILE;
+
+// Tiles are keyed by their source macroblock, so duplicate macroblocks share a single
+// decoded copy. Slots are allocated as the cache fills, and are then reused by eviction,
+// so the resident size follows the number of distinct blocks actually read.
+struct PTCX_LAZY_IMAGE_STATE
+{
+    PTCX_BLOCK_INDEX index;
+    uint32 tile_size;
+    uint32 tile_capacity;
+
+    std::mutex lock;
+    std::vector<std::vector<uint8> > slots;
+    std::list<uint32> recency;                  // source macroblocks, most recently used first
+    std::unordered_map<uint32, PTCX_LAZY_TILE> tiles;
+    uint64 hit_count;
+    uint64 miss_count;
+};
+
+void copy_tile_region(const uint8 *tile, uint32 tile_pitch, uint32 x, uint32 y, uint32 width, uint32 height,
+                      image *output, uint32 dest_x, uint32 dest_y)
+{
+    uint32 pixel_bytes = output->query_bits_per_pixel() >> 3;
+    uint32 run_width = output->query_block_run_width();
+
+    // Rows are copied in runs that never cross a tile boundary of the output.
+
+    for (uint32 j = 0; j < height; j++)
+    for (uint32 i = 0; i < width;)
+    {
+        uint32 run_length = base_min2(width - i, run_width - ((dest_x + i) % run_width));
+
+        memcpy(output->query_data() + output->query_block_offset(dest_x + i, dest_y + j),
+               tile + (y + j) * tile_pitch + (x + i) * pixel_bytes, run_length * pixel_bytes);
+
+        i += run_length;
+    }
+}
+
+status read_lazy_block(PTCX_LAZY_IMAGE_STATE *state, uint32 block_index, uint32 x, uint32 y, uint32 width, uint32 height,
+                       image *output, uint32 dest_x, uint32 dest_y)
+{
+    const PTCX_FILE_HEADER &header = state->index.context.header;
+    uint32 source_index = query_indexed_source(state->index, block_index);
+    uint32 tile_pitch = header.block_width * 3;
+
+    {
+        std::lock_guard<std::mutex> guard(state->lock);
+        std::unordered_map<uint32, PTCX_LAZY_TILE>::iterator match = state->tiles.find(source_index);
+
+        if (match != state->tiles.end())
+        {
+            state->hit_count++;
+            state->recency.splice(state->recency.begin(), state->recency, match->second.position);
+
+            copy_tile_region(state->slots[match->second.slot].data(), tile_pitch, x, y, width, height, output, dest_x, dest_y);
+
+            return BASE_SUCCESS;
+        }
+
+        state->miss_count++;
+    }
+
+    // Blocks are decoded outside of the lock, so concurrent readers only contend while
+    // copying. Readers that miss on the same block at once each decode it, and all but
+    // the first discard their copy.
+
+    uint8 decoded[PTCX_MAX_BLOCK_SIZE * PTCX_MAX_BLOCK_SIZE * 3];
+    image decoded_image;
+
+    if (base_failed(create_image(IGN_IMAGE_FORMAT_R8G8B8, decoded, header.block_width, header.block_height, &decoded_image)) ||
+        base_failed(decode_indexed_macroblock(state->index, block_index, &decoded_image, 0, 0)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    copy_tile_region(decoded, tile_pitch, x, y, width, height, output, dest_x, dest_y);
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    if (state->tiles.count(source_index))
+    {
+        return BASE_SUCCESS;
+    }
+
+    PTCX_LAZY_TILE tile;
+
+    if (state->slots.size() < state->tile_capacity)
+    {
+        tile.slot = state->slots.size();
+        state->slots.push_back(std::vector<uint8>(state->tile_size));
+    }
+    else
+    {
+        uint32 evicted = state->recency.back();
+
+        tile.slot = state->tiles[evicted].slot;
+        state->tiles.erase(evicted);
+        state->recency.pop_back();
+    }
+
+    memcpy(state->slots[tile.slot].data(), decoded, state->tile_size);
+
+    state->recency.push_front(source_index);
+    tile.position = state->recency.begin();
+    state->tiles[source_index] = tile;
+
+    return BASE_SUCCESS;
+}
+
+ptcx_lazy_image::ptcx_lazy_image()
+{
+    state = 0;
+}
+
+ptcx_lazy_image::~ptcx_lazy_image()
+{
+    delete state;
+}
+
+status ptcx_lazy_image::load(stream *input, uint32 cache_size)
+{
+    return load(input, 0, cache_size);
+}
+
+status ptcx_lazy_image::load(stream *input, uint32 level, uint32 cache_size)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!input || input->is_empty())
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    delete state;
+    state = new PTCX_LAZY_IMAGE_STATE;
+
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+    }
+
+    status result = read_block_index(input, level, &state->index);
+
+    if (base_failed(result))
+    {
+        delete state;
+        state = 0;
+
+        return result;
+    }
+
+    const PTCX_FILE_HEADER &header = state->index.context.header;
+
+    // The cache always holds at least one block, whatever its budget.
+    state->tile_size = header.block_width * header.block_height * 3;
+    state->tile_capacity = base_max2(cache_size / state->tile_size, (uint32) 1);
+    state->hit_count = 0;
+    state->miss_count = 0;
+
+    return BASE_SUCCESS;
+}
+
+status ptcx_lazy_image::read_pixel(uint32 x, uint32 y, uint8 *color) const
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_NOT_READY);
+    }
+
+    if (!color || x >= query_width() || y >= query_height())
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    const PTCX_FILE_HEADER &header = state->index.context.header;
+    image pixel;
+
+    if (base_failed(create_image(IGN_IMAGE_FORMAT_R8G8B8, color, 1, 1, &pixel)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    return read_lazy_block(state, query_indexed_block(header, x, y), x % header.block_width, y % header.block_height, 1, 1, &pixel, 0, 0);
+}
+
+status ptcx_lazy_image::read_region(uint32 x, uint32 y, image *output) const
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_NOT_READY);
+    }
+
+    if (!output || IGN_IMAGE_FORMAT_R8G8B8 != output->query_image_format() || !output->query_data() ||
+        x + output->query_width() > query_width() || y + output->query_height() > query_height())
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    const PTCX_FILE_HEADER &header = state->index.context.header;
+    uint32 end_x = x + output->query_width();
+    uint32 end_y = y + output->query_height();
+
+    // Visit each macroblock that overlaps the region, and copy the part of it that lies
+    // within the region.
+
+    for (uint32 j = y; j < end_y;)
+    {
+        uint32 local_y = j % header.block_height;
+        uint32 height = base_min2(header.block_height - local_y, end_y - j);
+
+        for (uint32 i = x; i < end_x;)
+        {
+            uint32 local_x = i % header.block_width;
+            uint32 width = base_min2(header.block_width - local_x, end_x - i);
+
+            if (base_failed(read_lazy_block(state, query_indexed_block(header, i, j), local_x, local_y, width, height, output, i - x, j - y)))
+            {
+                return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+            }
+
+            i += width;
+        }
+
+        j += height;
+    }
+
+    return BASE_SUCCESS;
+}
+
+uint32 ptcx_lazy_image::query_width() const
+{
+    return state ? state->index.context.header.image_width : 0;
+}
+
+uint32 ptcx_lazy_image::query_height() const
+{
+    return state ? state->index.context.header.image_height : 0;
+}
+
+uint64 ptcx_lazy_image::query_hit_count() const
+{
+    if (!state)
+    {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    return state->hit_count;
+}
+
+uint64 ptcx_lazy_image::query_miss_count() const
+{
+    if (!state)
+    {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    return state->miss_count;
+}
+
+uint32 ptcx_lazy_image::query_resident_size() const
+{
+    if (!state)
+    {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    return state->slots.size() * state->tile_size;
+}
@@ -2,6 +2,7 @@
 #include "base.h"
 #include "ptcx.h"
 #include "bitmap.h"
+#include <vector>
 
 using namespace base;
 
@@ -98,14 +99,306 @@ void _stream_test(char *input_filename, char *output_filename)
     fclose(output);
 }
 
+#define TILE_TEST_SIZE      (64)
+#define TILE_TEST_VIEW      (1)                 // tiles to each side of the visible center
+#define TILE_TEST_PREFETCH  (2)                 // tiles to each side that are prefetched
+#define TILE_TEST_STEPS     (48)
+#define TILE_TEST_UNBOUNDED (0xFFFFFFFF)        // a cache budget that never evicts
+
+bool _tile_test_failed(const char *check)
+{
+    base_msg("Tile camera test failed: %s", check);
+    return false;
+}
+
+bool _check_tile_pixels(ptcx_tile_service *service, const image &level_image, uint32 x, uint32 y, uint32 level)
+{
+    image tile;
+    status result = service->query_tile(x, y, level, &tile);
+
+    // Tiles that have already been evicted to make room for newer ones are skipped.
+
+    if (BASE_ERROR_NOT_READY == result)
+    {
+        return true;
+    }
+
+    if (base_failed(result))
+    {
+        return false;
+    }
+
+    for (uint32 row = 0; row < tile.query_height(); row++)
+    {
+        if (memcmp(tile.query_data() + tile.query_block_offset(0, row),
+                   level_image.query_data() + level_image.query_block_offset(x * TILE_TEST_SIZE, y * TILE_TEST_SIZE + row),
+                   tile.query_width() * 3))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool _check_tile_statistics(const PTCX_TILE_STATISTICS &statistics, uint32 cache_size)
+{
+    if (statistics.resident_size > cache_size)
+    {
+        return _tile_test_failed("resident tiles exceed the cache budget");
+    }
+
+    if (statistics.failure_count)
+    {
+        return _tile_test_failed("a tile failed to decode");
+    }
+
+    // Every decode lands in both histograms once, and a request can never complete before
+    // its own decode does, so at least as many requests as decodes reach each bucket.
+
+    uint64 request_total = 0;
+    uint64 decode_total = 0;
+
+    for (int32 i = PTCX_TILE_HISTOGRAM_SIZE - 1; i >= 0; i--)
+    {
+        request_total += statistics.request_latency[i];
+        decode_total += statistics.decode_latency[i];
+
+        if (request_total < decode_total)
+        {
+            return _tile_test_failed("a request completed faster than its decode");
+        }
+    }
+
+    if (request_total != statistics.decode_count || decode_total != statistics.decode_count)
+    {
+        return _tile_test_failed("latency histograms do not match the decode count");
+    }
+
+    return true;
+}
+
+bool _tile_cancel_test(const memory_stream &ptcx_stream)
+{
+    // A single worker is flooded with every tile of the full size level, and all of them
+    // are cancelled at once. Each request must then end exactly once, either decoded or
+    // cancelled, and no cancelled tile may become resident afterwards.
+
+    ptcx_tile_service service;
+    uint32 columns = 0;
+    uint32 rows = 0;
+
+    if (base_failed(service.open(ptcx_stream.query_read_pointer(), ptcx_stream.query_occupancy(), TILE_TEST_SIZE, 1, TILE_TEST_UNBOUNDED)) ||
+        base_failed(service.query_tile_grid(0, &columns, &rows)))
+    {
+        return _tile_test_failed("unable to open the tile service");
+    }
+
+    for (uint32 y = 0; y < rows; y++)
+    for (uint32 x = 0; x < columns; x++)
+    {
+        service.request_tile(x, y, 0, 1);
+    }
+
+    service.cancel_all();
+    service.wait_idle();
+
+    PTCX_TILE_STATISTICS statistics;
+    service.query_statistics(&statistics);
+
+    if (statistics.decode_count + statistics.cancel_count != columns * rows)
+    {
+        return _tile_test_failed("requests were not each decoded or cancelled once");
+    }
+
+    printf("Cancelled %u of %u tiles\n", (uint32) statistics.cancel_count, columns * rows);
+
+    std::vector<uint32> cancelled;
+    image tile;
+
+    for (uint32 i = 0; i < columns * rows; i++)
+    {
+        if (BASE_ERROR_NOT_READY == service.query_tile(i % columns, i / columns, 0, &tile))
+        {
+            cancelled.push_back(i);
+        }
+    }
+
+    // The worker serves its queue in order, so once a fresh request completes, any decode
+    // that was under way at the time of cancellation has also finished.
+
+    if (!cancelled.empty())
+    {
+        uint32 fresh = cancelled.back();
+
+        cancelled.pop_back();
+        service.request_tile(fresh % columns, fresh / columns, 0, 1);
+        service.wait_idle();
+
+        if (base_failed(service.query_tile(fresh % columns, fresh / columns, 0, &tile)))
+        {
+            return _tile_test_failed("a tile requested after cancellation did not decode");
+        }
+    }
+
+    for (uint32 i = 0; i < cancelled.size(); i++)
+    {
+        if (BASE_ERROR_NOT_READY != service.query_tile(cancelled[i] % columns, cancelled[i] / columns, 0, &tile))
+        {
+            return _tile_test_failed("a cancelled tile became resident");
+        }
+    }
+
+    service.query_statistics(&statistics);
+
+    return _check_tile_statistics(statistics, TILE_TEST_UNBOUNDED);
+}
+
+bool _tile_camera_test(const memory_stream &ptcx_stream)
+{
+    // The cache holds fewer tiles than the prefetched area, so that the camera keeps the
+    // service evicting.
+
+    ptcx_tile_service service;
+    uint32 cache_size = 12 * TILE_TEST_SIZE * TILE_TEST_SIZE * 3;
+
+    if (base_failed(service.open(ptcx_stream.query_read_pointer(), ptcx_stream.query_occupancy(), TILE_TEST_SIZE, 0, cache_size)))
+    {
+        return _tile_test_failed("unable to open the tile service");
+    }
+
+    uint32 level_count = service.query_level_count();
+    std::vector<image> level_images(level_count);
+
+    for (uint32 i = 0; i < level_count; i++)
+    {
+        buffer_stream level_stream(ptcx_stream.query_read_pointer(), ptcx_stream.query_occupancy());
+
+        if (base_failed(load_ptcx_level(&level_stream, i, &level_images[i])))
+        {
+            return _tile_test_failed("unable to decode a level");
+        }
+    }
+
+    // The camera pans diagonally across the image while it zooms out one level at a time,
+    // and then zooms back in. Visible tiles are requested ahead of the prefetched ring
+    // around them, and tiles that leave the prefetched area are cancelled.
+
+    int32 previous_x = 0;
+    int32 previous_y = 0;
+    uint32 previous_level = 0;
+
+    for (uint32 step = 0; step < TILE_TEST_STEPS; step++)
+    {
+        uint32 phase = step * 2 * level_count / TILE_TEST_STEPS;
+        uint32 level = (phase < level_count) ? phase : 2 * level_count - 1 - phase;
+        uint32 columns = 0;
+        uint32 rows = 0;
+
+        service.query_tile_grid(level, &columns, &rows);
+
+        int32 center_x = step * columns / TILE_TEST_STEPS;
+        int32 center_y = step * rows / TILE_TEST_STEPS;
+
+        for (int32 j = previous_y - TILE_TEST_PREFETCH; j <= previous_y + TILE_TEST_PREFETCH; j++)
+        for (int32 i = previous_x - TILE_TEST_PREFETCH; i <= previous_x + TILE_TEST_PREFETCH; i++)
+        {
+            if (i >= 0 && j >= 0 && (level != previous_level || abs(i - center_x) > TILE_TEST_PREFETCH || abs(j - center_y) > TILE_TEST_PREFETCH))
+            {
+                service.cancel_tile(i, j, previous_level);
+            }
+        }
+
+        for (int32 j = center_y - TILE_TEST_PREFETCH; j <= center_y + TILE_TEST_PREFETCH; j++)
+        for (int32 i = center_x - TILE_TEST_PREFETCH; i <= center_x + TILE_TEST_PREFETCH; i++)
+        {
+            if (i < 0 || j < 0 || i >= (int32) columns || j >= (int32) rows)
+            {
+                continue;
+            }
+
+            bool is_visible = abs(i - center_x) <= TILE_TEST_VIEW && abs(j - center_y) <= TILE_TEST_VIEW;
+
+            if (base_failed(service.request_tile(i, j, level, is_visible ? 2 : 1)))
+            {
+                return _tile_test_failed("unable to request a tile");
+            }
+        }
+
+        // Every few steps the camera rests until its view has completed.
+
+        if (3 == (step % 4))
+        {
+            service.wait_idle();
+
+            for (int32 j = center_y - TILE_TEST_VIEW; j <= center_y + TILE_TEST_VIEW; j++)
+            for (int32 i = center_x - TILE_TEST_VIEW; i <= center_x + TILE_TEST_VIEW; i++)
+            {
+                if (i >= 0 && j >= 0 && i < (int32) columns && j < (int32) rows &&
+                    !_check_tile_pixels(&service, level_images[level], i, j, level))
+                {
+                    return _tile_test_failed("a tile does not match its level");
+                }
+            }
+        }
+
+        PTCX_TILE_STATISTICS statistics;
+        service.query_statistics(&statistics);
+
+        if (statistics.resident_size > cache_size)
+        {
+            return _tile_test_failed("resident tiles exceed the cache budget");
+        }
+
+        previous_x = center_x;
+        previous_y = center_y;
+        previous_level = level;
+    }
+
+    service.cancel_all();
+    service.wait_idle();
+
+    PTCX_TILE_STATISTICS statistics;
+    service.query_statistics(&statistics);
+
+    if (statistics.hit_count + statistics.decode_count + statistics.cancel_count > statistics.request_count)
+    {
+        return _tile_test_failed("more requests completed than were made");
+    }
+
+    printf("Camera path over %u levels: %u requests, %u hits, %u decodes, %u cancelled, %u evicted\n", level_count,
+           (uint32) statistics.request_count, (uint32) statistics.hit_count, (uint32) statistics.decode_count,
+           (uint32) statistics.cancel_count, (uint32) statistics.eviction_count);
+
+    return _check_tile_statistics(statistics, cache_size);
+}
+
 int main(int argc, char **argv)
 {
     memory_stream ptcx_stream;
     image bitmap_image;
 
+    if (4 == argc && !strcmp(argv[1], "-tiles"))
+    {
+        // Exercise the tile service along a synthetic camera path over a mip chain.
+
+        _read_bitmap_from_file(argv[2], &bitmap_image);
+
+        ptcx_stream.resize_capacity(bitmap_image.query_width() * bitmap_image.query_height() * 3 + 1*BASE_MB);
+
+        if (base_failed(save_ptcx_mips(bitmap_image, atoi(argv[3]), 0, 0, &ptcx_stream)))
+        {
+            base_msg("Unable to encode a mip chain from %s.", argv[2]);
+            return 1;
+        }
+
+        return (_tile_cancel_test(ptcx_stream) && _tile_camera_test(ptcx_stream)) ? 0 : 1;
+    }
+
     if (4 != argc)
     {
         base_msg("Required syntax: ptcx_test input_filename quality output_filename");
+        base_msg("             or: ptcx_test -tiles input_filename quality");
         return 0;
     }
 
@@ -0,0 +1,181 @@
+
+#include "ptcx_internal.h"
+
+uint32 query_mip_level_limit(const PTCX_FILE_HEADER &header)
+{
+    uint32 level_count = 1;
+
+    while (level_count < PTCX_MAX_MIP_LEVELS &&
+           is_aligned_image_size(header, header.image_width >> level_count, header.image_height >> level_count))
+    {
+        level_count++;
+    }
+
+    return level_count;
+}
+
+status read_mip_table(stream *input, const PTCX_FILE_HEADER &header, std::vector<uint32> *offsets)
+{
+    offsets->resize(header.image_depth);
+
+    if (base_failed(read_stream_data(input, offsets->data(), offsets->size() * sizeof(uint32))))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    // Levels are stored in order, and the first begins immediately after the table.
+    if (0 != (*offsets)[0])
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    for (uint32 i = 1; i < offsets->size(); i++)
+    {
+        if ((*offsets)[i] <= (*offsets)[i - 1])
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+status seek_mip_level(stream *input, const PTCX_FILE_HEADER &header, uint32 level)
+{
+    std::vector<uint32> offsets;
+
+    if (level >= header.image_depth)
+    {
+        return base_post_error(BASE_ERROR_INVALIDARG);
+    }
+
+    if (base_failed(read_mip_table(input, header, &offsets)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    if (offsets[level] && base_failed(input->skip_data(offsets[level])))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status save_ptcx_mips(const image &input, uint8 quality, uint32 options, uint32 level_count, stream *output)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!output || output->is_full())
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+
+        if (IGN_IMAGE_FORMAT_R8G8B8 != input.query_image_format())
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    PTCX_FILE_HEADER header;
+    memset(&header, 0, sizeof(PTCX_FILE_HEADER));
+
+    if (input.query_width() > BASE_MAX_UINT16 || input.query_height() > BASE_MAX_UINT16)
+    {
+        return BASE_ERROR_INVALID_RESOURCE;
+    }
+
+    if (base_failed(configure_header(input.query_width(), input.query_height(), &header, quality, options)))
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    // Every level must satisfy the same alignment as the first, which bounds the length
+    // of the chain. A count of zero requests the longest chain that the image permits.
+
+    uint32 level_limit = query_mip_level_limit(header);
+
+    if (0 == level_count)
+    {
+        level_count = level_limit;
+    }
+
+    if (level_count > level_limit)
+    {
+        return BASE_ERROR_INVALID_RESOURCE;
+    }
+
+    if (1 == level_count)
+    {
+        return save_ptcx(input, quality, options, output);
+    }
+
+    // Each level is downsampled from the one before it. We allocate buffers for the
+    // second and third levels only, and every later level reuses the buffer of the level
+    // two steps above it, which is no longer needed by then.
+
+    std::vector<uint8> level_buffers[2];
+    file_buffer_stream levels[PTCX_MAX_MIP_LEVELS];
+    image level_images[2];
+
+    for (uint32 i = 0; i < 2; i++)
+    {
+        level_buffers[i].resize(((input.query_width() >> (i + 1)) * (input.query_height() >> (i + 1)) * input.query_bits_per_pixel()) >> 3);
+    }
+
+    for (uint32 i = 0; i < level_count; i++)
+    {
+        const image *source = &input;
+
+        if (i)
+        {
+            image &level_image = level_images[(i - 1) & 1];
+            const image &parent = (1 == i) ? input : level_images[i & 1];
+
+            if (base_failed(create_image(IGN_IMAGE_FORMAT_R8G8B8, level_buffers[(i - 1) & 1].data(),
+                                         input.query_width() >> i, input.query_height() >> i, &level_image)) ||
+                base_failed(downsample_image(parent, &level_image)))
+            {
+                return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+            }
+
+            source = &level_image;
+        }
+
+        if (base_failed(save_ptcx(*source, quality, options, &levels[i])))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    // The chain header describes the first level, which also lets readers that decode
+    // only the first level treat the file as an image of that size.
+
+    std::vector<uint32> offsets(level_count);
+
+    memcpy(&header, levels[0].query_data(), sizeof(PTCX_FILE_HEADER));
+
+    header.flags |= PTCX_FLAG_MIP_CHAIN;
+    header.image_depth = level_count;
+
+    for (uint32 i = 1; i < level_count; i++)
+    {
+        offsets[i] = offsets[i - 1] + levels[i - 1].query_occupancy();
+    }
+
+    if (base_failed(write_stream_data(output, &header, sizeof(PTCX_FILE_HEADER))) ||
+        base_failed(write_stream_data(output, offsets.data(), offsets.size() * sizeof(uint32))))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    for (uint32 i = 0; i < level_count; i++)
+    {
+        if (base_failed(write_stream_data(output, levels[i].query_data(), levels[i].query_occupancy())))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
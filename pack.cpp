@@ -0,0 +1,494 @@
+
+#include "ptcx_internal.h"
+#include <unordered_map>
+
+#if !defined (BASE_PLATFORM_WINDOWS)
+  #include "fcntl.h"
+  #include "sys/mman.h"
+  #include "sys/stat.h"
+#endif
+
+// Entries refer to payloads by index, and identical files share a single payload. Names
+// are kept in the order they were added, so that a given set of entries always produces
+// the same pack.
+struct PTCX_PACK_WRITER_STATE
+{
+    std::vector<std::vector<uint8> > payloads;
+    std::unordered_multimap<uint64, uint32> payload_hashes;
+    std::unordered_map<uint64, uint32> names;   // name hash to payload
+    std::vector<uint64> name_order;
+};
+
+struct PTCX_PACK_STATE
+{
+    const uint8 *data;
+    uint32 size;
+    bool is_mapped;
+
+    const PTCX_PACK_HEADER *header;
+    const PTCX_PACK_ENTRY *slots;
+};
+
+uint64 hash_pack_name(const char *name)
+{
+    return hash_bytes(reinterpret_cast<const uint8 *>(name), strlen(name), PTCX_HASH_BASIS);
+}
+
+status map_pack_file(const char *filename, PTCX_PACK_STATE *state)
+{
+    // The file and mapping handles may be closed as soon as the view exists, which keeps
+    // the mapping alive on its own.
+
+#if defined (BASE_PLATFORM_WINDOWS)
+
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+
+    if (INVALID_HANDLE_VALUE == file)
+    {
+        return BASE_ERROR_IO_FAILURE;
+    }
+
+    LARGE_INTEGER file_size;
+    HANDLE mapping = 0;
+
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart && file_size.QuadPart <= BASE_MAX_UINT32)
+    {
+        mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+    }
+
+    CloseHandle(file);
+
+    if (!mapping)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    state->data = static_cast<const uint8 *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    state->size = static_cast<uint32>(file_size.QuadPart);
+
+    CloseHandle(mapping);
+
+    if (!state->data)
+    {
+        return base_post_error(BASE_ERROR_IO_FAILURE);
+    }
+
+#else
+
+    int32 file = ::open(filename, O_RDONLY);
+
+    if (file < 0)
+    {
+        return BASE_ERROR_IO_FAILURE;
+    }
+
+    struct stat file_info;
+    void *view = MAP_FAILED;
+
+    if (0 == fstat(file, &file_info) && file_info.st_size > 0 && file_info.st_size <= BASE_MAX_UINT32)
+    {
+        view = mmap(0, file_info.st_size, PROT_READ, MAP_SHARED, file, 0);
+    }
+
+    ::close(file);
+
+    if (MAP_FAILED == view)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    state->data = static_cast<const uint8 *>(view);
+    state->size = static_cast<uint32>(file_info.st_size);
+
+#endif
+
+    state->is_mapped = true;
+
+    return BASE_SUCCESS;
+}
+
+void unmap_pack_file(PTCX_PACK_STATE *state)
+{
+#if defined (BASE_PLATFORM_WINDOWS)
+    UnmapViewOfFile(state->data);
+#else
+    munmap(const_cast<uint8 *>(state->data), state->size);
+#endif
+}
+
+status verify_pack(PTCX_PACK_STATE *state)
+{
+    // Every entry is validated once here, so that lookups may trust the table.
+
+    if (state->size < sizeof(PTCX_PACK_HEADER))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    const PTCX_PACK_HEADER *header = reinterpret_cast<const PTCX_PACK_HEADER *>(state->data);
+
+    if (PTCX_PACK_MAGIC_VALUE != header->magic || PTCX_PACK_VERSION != header->version ||
+        sizeof(PTCX_PACK_HEADER) != header->header_size)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    if (!header->slot_count || (header->slot_count & (header->slot_count - 1)) ||
+        header->entry_count >= header->slot_count ||
+        header->slot_count > (state->size - sizeof(PTCX_PACK_HEADER)) / sizeof(PTCX_PACK_ENTRY))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    const PTCX_PACK_ENTRY *slots = reinterpret_cast<const PTCX_PACK_ENTRY *>(state->data + sizeof(PTCX_PACK_HEADER));
+    uint32 entry_count = 0;
+
+    for (uint32 i = 0; i < header->slot_count; i++)
+    {
+        const PTCX_PACK_ENTRY &entry = slots[i];
+
+        if (!entry.size)
+        {
+            continue;
+        }
+
+        if ((entry.offset % PTCX_PACK_ALIGNMENT) || entry.offset > state->size || entry.size > state->size - entry.offset)
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+
+        entry_count++;
+    }
+
+    if (entry_count != header->entry_count)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    state->header = header;
+    state->slots = slots;
+
+    return BASE_SUCCESS;
+}
+
+const PTCX_PACK_ENTRY *find_pack_entry(const PTCX_PACK_STATE &state, const char *name)
+{
+    uint64 name_hash = hash_pack_name(name);
+    uint32 slot_mask = state.header->slot_count - 1;
+
+    // The table always holds free slots, so every probe sequence ends at one.
+
+    for (uint32 i = 0; i < state.header->slot_count; i++)
+    {
+        const PTCX_PACK_ENTRY &entry = state.slots[(name_hash + i) & slot_mask];
+
+        if (!entry.size)
+        {
+            break;
+        }
+
+        if (entry.name_hash == name_hash)
+        {
+            return &entry;
+        }
+    }
+
+    return 0;
+}
+
+ptcx_pack_writer::ptcx_pack_writer()
+{
+    state = new PTCX_PACK_WRITER_STATE;
+}
+
+ptcx_pack_writer::~ptcx_pack_writer()
+{
+    delete state;
+}
+
+status ptcx_pack_writer::add_entry(const char *name, const void *data, uint32 size)
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+    }
+
+    if (!name || !data || !size)
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    uint64 name_hash = hash_pack_name(name);
+
+    if (state->names.count(name_hash))
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    // Entries are verified as they are added, so that a pack never holds a file that readers reject.
+    PTCX_FILE_HEADER header;
+    buffer_stream input(data, size);
+
+    if (base_failed(read_header(&input, &header)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    const uint8 *bytes = static_cast<const uint8 *>(data);
+    uint64 payload_hash = hash_bytes(bytes, size, PTCX_HASH_BASIS);
+    std::pair<std::unordered_multimap<uint64, uint32>::iterator, std::unordered_multimap<uint64, uint32>::iterator> matches =
+        state->payload_hashes.equal_range(payload_hash);
+
+    for (std::unordered_multimap<uint64, uint32>::iterator i = matches.first; i != matches.second; ++i)
+    {
+        const std::vector<uint8> &payload = state->payloads[i->second];
+
+        if (payload.size() == size && !memcmp(payload.data(), bytes, size))
+        {
+            state->names[name_hash] = i->second;
+            state->name_order.push_back(name_hash);
+
+            return BASE_SUCCESS;
+        }
+    }
+
+    state->names[name_hash] = state->payloads.size();
+    state->name_order.push_back(name_hash);
+    state->payload_hashes.insert(std::make_pair(payload_hash, (uint32) state->payloads.size()));
+    state->payloads.push_back(std::vector<uint8>(bytes, bytes + size));
+
+    return BASE_SUCCESS;
+}
+
+status ptcx_pack_writer::write(stream *output)
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+    }
+
+    if (BASE_PARAM_CHECK)
+    {
+        if (!output || output->is_full())
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    PTCX_PACK_HEADER header;
+    uint32 slot_count = 1;
+
+    while (slot_count < (state->names.size() << 1) + 1)
+    {
+        slot_count <<= 1;
+    }
+
+    header.magic = PTCX_PACK_MAGIC_VALUE;
+    header.version = PTCX_PACK_VERSION;
+    header.header_size = sizeof(PTCX_PACK_HEADER);
+    header.entry_count = state->names.size();
+    header.slot_count = slot_count;
+
+    // Assign each payload its aligned offset, and then place each name in the table.
+
+    std::vector<uint32> offsets(state->payloads.size());
+    uint64 offset = sizeof(PTCX_PACK_HEADER) + (uint64) slot_count * sizeof(PTCX_PACK_ENTRY);
+
+    for (uint32 i = 0; i < state->payloads.size(); i++)
+    {
+        offset = (offset + PTCX_PACK_ALIGNMENT - 1) & ~((uint64) PTCX_PACK_ALIGNMENT - 1);
+        offsets[i] = static_cast<uint32>(offset);
+        offset += state->payloads[i].size();
+    }
+
+    if (offset > BASE_MAX_UINT32)
+    {
+        return base_post_error(BASE_ERROR_CAPACITY_LIMIT);
+    }
+
+    std::vector<PTCX_PACK_ENTRY> slots(slot_count);
+    memset(slots.data(), 0, slot_count * sizeof(PTCX_PACK_ENTRY));
+
+    for (uint32 i = 0; i < state->name_order.size(); i++)
+    {
+        uint64 name_hash = state->name_order[i];
+        uint32 payload = state->names[name_hash];
+        uint32 slot = static_cast<uint32>(name_hash) & (slot_count - 1);
+
+        while (slots[slot].size)
+        {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+
+        slots[slot].name_hash = name_hash;
+        slots[slot].offset = offsets[payload];
+        slots[slot].size = state->payloads[payload].size();
+    }
+
+    if (base_failed(write_stream_data(output, &header, sizeof(PTCX_PACK_HEADER))) ||
+        base_failed(write_stream_data(output, slots.data(), slot_count * sizeof(PTCX_PACK_ENTRY))))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    uint8 padding[PTCX_PACK_ALIGNMENT] = {0};
+    uint32 position = sizeof(PTCX_PACK_HEADER) + slot_count * sizeof(PTCX_PACK_ENTRY);
+
+    for (uint32 i = 0; i < state->payloads.size(); i++)
+    {
+        const std::vector<uint8> &payload = state->payloads[i];
+
+        if ((offsets[i] > position && base_failed(write_stream_data(output, padding, offsets[i] - position))) ||
+            base_failed(write_stream_data(output, payload.data(), payload.size())))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+
+        position = offsets[i] + payload.size();
+    }
+
+    return BASE_SUCCESS;
+}
+
+uint32 ptcx_pack_writer::query_entry_count() const
+{
+    return state ? state->names.size() : 0;
+}
+
+uint32 ptcx_pack_writer::query_payload_count() const
+{
+    return state ? state->payloads.size() : 0;
+}
+
+ptcx_pack::ptcx_pack()
+{
+    state = 0;
+}
+
+ptcx_pack::~ptcx_pack()
+{
+    close();
+}
+
+status ptcx_pack::open(const char *filename)
+{
+    if (!filename)
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    close();
+    state = new PTCX_PACK_STATE;
+
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+    }
+
+    state->is_mapped = false;
+
+    status result = map_pack_file(filename, state);
+
+    if (base_succeeded(result))
+    {
+        result = verify_pack(state);
+    }
+
+    if (base_failed(result))
+    {
+        close();
+    }
+
+    return result;
+}
+
+status ptcx_pack::open(const void *data, uint32 size)
+{
+    if (!data || !size)
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    close();
+    state = new PTCX_PACK_STATE;
+
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+    }
+
+    state->data = static_cast<const uint8 *>(data);
+    state->size = size;
+    state->is_mapped = false;
+
+    status result = verify_pack(state);
+
+    if (base_failed(result))
+    {
+        close();
+    }
+
+    return result;
+}
+
+void ptcx_pack::close()
+{
+    if (state && state->is_mapped)
+    {
+        unmap_pack_file(state);
+    }
+
+    delete state;
+    state = 0;
+}
+
+status ptcx_pack::find_entry(const char *name, const uint8 **data, uint32 *size) const
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_NOT_READY);
+    }
+
+    if (!name || !data || !size)
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    const PTCX_PACK_ENTRY *entry = find_pack_entry(*state, name);
+
+    if (!entry)
+    {
+        return BASE_ERROR_INVALID_INDEX;
+    }
+
+    (*data) = state->data + entry->offset;
+    (*size) = entry->size;
+
+    return BASE_SUCCESS;
+}
+
+status ptcx_pack::load_entry(const char *name, image *output) const
+{
+    return load_entry(name, IGN_IMAGE_LAYOUT_LINEAR, output);
+}
+
+status ptcx_pack::load_entry(const char *name, IGN_IMAGE_LAYOUT layout, image *output) const
+{
+    const uint8 *data = 0;
+    uint32 size = 0;
+    status result = find_entry(name, &data, &size);
+
+    if (base_failed(result))
+    {
+        return result;
+    }
+
+    buffer_stream input(data, size);
+
+    return load_ptcx(&input, layout, output);
+}
+
+uint32 ptcx_pack::query_entry_count() const
+{
+    return state ? state->header->entry_count : 0;
+}
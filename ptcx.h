@@ -73,6 +73,500 @@ using namespace imagine;
 
 status load_ptcx(stream *input, image *output);
 
+/* 
+// PTCX Decode (Layout)
+//
+//   Identical to load_ptcx, but places the result in an output image that uses the 
+//   requested memory layout. Decoding into a tiled image writes each macroblock to 
+//   contiguous memory.
+//
+// Returns:
+//
+//   BASE_SUCCESS upon success, otherwise a specific error value will be returned. 
+*/
+
+status load_ptcx(stream *input, IGN_IMAGE_LAYOUT layout, image *output);
+
+/* 
+// PTCX Decode (Level)
+//
+//   Decompresses a single level of a mip chain written by save_ptcx_mips. Level 0 is 
+//   the full size image, and each level halves the dimensions of the one before it.
+//   The levels before the requested one are skipped using the offsets stored in the
+//   file, rather than decoded. Files without a chain hold only level 0, and load_ptcx
+//   decodes level 0 of any file.
+//
+// Returns:
+//
+//   BASE_SUCCESS upon success, BASE_ERROR_INVALIDARG if the file holds no such level,
+//   otherwise a specific error value will be returned. 
+*/
+
+status load_ptcx_level(stream *input, uint32 level, image *output);
+status load_ptcx_level(stream *input, uint32 level, IGN_IMAGE_LAYOUT layout, image *output);
+
+/* 
+// PTCX Scaled Decode
+//
+//   Decompresses a reduced resolution copy of an image, such as a thumbnail or a distant
+//   level of detail, with its width and height divided by (1 << scale_shift). Each output
+//   pixel is the average of the pixels it covers, computed from the endpoints of each 
+//   microblock and the sum of its indices within each output pixel, so that no full 
+//   resolution pixels are produced. Solid microblocks contribute their color directly, 
+//   and planar microblocks their color at the center of each output pixel. Results may 
+//   differ by one from a full decode followed by a box filter.
+//
+// Returns:
+//
+//   BASE_SUCCESS upon success, otherwise a specific error value will be returned. 
+//
+// Notes:
+//
+//   o: scale_shift ranges from 0 to 4, for scales from 1/1 to 1/16.
+//   o: Mip chains begin from the level nearest to the requested scale (see load_ptcx_level). 
+//   o: Version 2 files, and files whose width or band height is not a multiple of the 
+//      scale, are decoded in full and then reduced.
+//   o: Files at half scale are decoded a band at a time and each band is then reduced.
+*/
+
+status load_ptcx_scaled(stream *input, uint32 scale_shift, image *output);
+
+/* 
+// PTCX Scanline Decode
+//
+//   Decompresses data one band at a time into a small rolling buffer, and invokes the
+//   callback once per band with the decoded scanlines. This allows consumers that 
+//   only stream pixels to avoid allocating the full image. Peak memory is proportional
+//   to the width of the image.
+//
+//   The callback receives a linear image that spans the full image width and holds 
+//   one band of scanlines (16 for the default band height), the index of the first 
+//   row in that band, and the total image height. The image is only valid for the
+//   duration of the call. Returning a failure code stops the decode and is passed 
+//   back to the caller.
+//
+// Returns:
+//
+//   BASE_SUCCESS upon success, otherwise a specific error value will be returned. 
+*/
+
+typedef status (*PTCX_SCANLINE_CALLBACK)(const image &scanlines, uint32 first_row, uint32 image_height, void *context);
+
+status load_ptcx_scanlines(stream *input, PTCX_SCANLINE_CALLBACK callback, void *context);
+
+/*
+// PTCX Sampler
+//
+//   Answers texel queries directly from compressed data, for callers that only need
+//   occasional lookups (such as the material beneath a point on a splat map) and would
+//   otherwise keep the whole decoded image resident.
+//
+//   load reads every band of a file (or of one level of a mip chain) into memory in its
+//   decoded section form, and builds an index holding the position of each macroblock.
+//   fetch then decodes only the microblock that holds the requested texel, and 
+//   sample_bilinear decodes at most the four that hold its neighbours. A small cache of
+//   the most recently decoded microblocks serves repeated queries near the same point.
+//
+//   Colors are written as three RGB8 bytes. sample_bilinear takes normalized coordinates,
+//   with texel centers at half integer positions, and clamps to the edges of the image.
+//
+// Returns:
+//
+//   BASE_SUCCESS upon success, otherwise a specific error value will be returned.
+//
+// Notes:
+//
+//   o: Resident memory is roughly the size of the file before entropy coding, plus 
+//      twelve bytes per macroblock and the cache.
+//   o: fetch returns the same texels as load_ptcx, and fails with BASE_ERROR_INVALIDARG
+//      for coordinates outside of the image.
+//   o: Version 2 files store no bands, and cannot be sampled.
+//   o: A sampler is not safe to share between threads, as every query updates its cache.
+*/
+
+class ptcx_sampler
+{
+    BASE_DISABLE_COPY_AND_ASSIGN(ptcx_sampler);
+
+    struct PTCX_SAMPLER_STATE *state;
+
+public:
+
+    ptcx_sampler();
+    virtual ~ptcx_sampler();
+
+    status load(stream *input);
+    status load(stream *input, uint32 level);
+
+    status fetch(uint32 x, uint32 y, uint8 *color);
+    status sample_bilinear(float32 u, float32 v, uint8 *color);
+
+    uint32 query_width() const;
+    uint32 query_height() const;
+};
+
+/*
+// PTCX Lazy Decode
+//
+//   An image that decodes each macroblock upon its first access, for very large images
+//   that are read sparsely. Decoded macroblocks are held in a least recently used cache
+//   bounded by cache_size bytes, so resident memory follows the parts of the image that
+//   are in use rather than its size. Duplicate macroblocks share a single cached copy.
+//
+//   load reads the file as the sampler does (see ptcx_sampler). read_pixel writes three 
+//   RGB8 bytes, and read_region fills an initialized RGB8 image, of either layout, with
+//   the pixels of the image whose top left corner lies at (x, y).
+//
+//   The hit and miss counters count macroblock accesses, so a region read that spans
+//   several macroblocks counts once for each of them.
+//
+// Returns:
+//
+//   BASE_SUCCESS upon success, otherwise a specific error value will be returned.
+//
+// Notes:
+//
+//   o: Reads may be issued concurrently from any number of threads. Macroblocks are 
+//      decoded outside of the cache lock, so concurrent misses proceed in parallel.
+//   o: The cache always holds at least one macroblock, whatever its budget.
+//   o: load must not be called while other threads are reading.
+*/
+
+class ptcx_lazy_image
+{
+    BASE_DISABLE_COPY_AND_ASSIGN(ptcx_lazy_image);
+
+    struct PTCX_LAZY_IMAGE_STATE *state;
+
+public:
+
+    ptcx_lazy_image();
+    virtual ~ptcx_lazy_image();
+
+    status load(stream *input, uint32 cache_size);
+    status load(stream *input, uint32 level, uint32 cache_size);
+
+    status read_pixel(uint32 x, uint32 y, uint8 *color) const;
+    status read_region(uint32 x, uint32 y, image *output) const;
+
+    uint32 query_width() const;
+    uint32 query_height() const;
+
+    uint64 query_hit_count() const;
+    uint64 query_miss_count() const;
+    uint32 query_resident_size() const;
+};
+
+/*
+// PTCX Pack
+//
+//   A pack gathers many PTCX files into a single file, so that projects with large numbers
+//   of small textures open one file rather than thousands. Entries are located through a
+//   hash table of name hashes, which makes each lookup a constant time probe into memory.
+//   Every entry begins on a 64 byte boundary, and entries whose files are identical share
+//   a single copy.
+//
+//   ptcx_pack_writer collects entries and writes the pack to a stream. Each entry must be
+//   a complete PTCX file, and its header is verified as it is added.
+//
+//   ptcx_pack maps a pack file into memory (or uses a pack that is already resident) and
+//   verifies its table once upon open. find_entry then returns the file of an entry in
+//   place, and load_entry decodes it through a buffer_stream, without any further system
+//   calls or copies of the file.
+//
+// Returns:
+//
+//   BASE_SUCCESS upon success, BASE_ERROR_INVALID_INDEX if the pack holds no entry with 
+//   the given name, otherwise a specific error value will be returned.
+//
+// Notes:
+//
+//   o: Names are stored only as 64 bit hashes. Adding a name that is already present,
+//      or one whose hash collides with another, fails with BASE_ERROR_INVALIDARG.
+//   o: Packs are limited to 4 GB.
+//   o: A pack may be read from any number of threads once it is open.
+*/
+
+class ptcx_pack_writer
+{
+    BASE_DISABLE_COPY_AND_ASSIGN(ptcx_pack_writer);
+
+    struct PTCX_PACK_WRITER_STATE *state;
+
+public:
+
+    ptcx_pack_writer();
+    virtual ~ptcx_pack_writer();
+
+    status add_entry(const char *name, const void *data, uint32 size);
+    status write(stream *output);
+
+    uint32 query_entry_count() const;
+    uint32 query_payload_count() const;
+};
+
+class ptcx_pack
+{
+    BASE_DISABLE_COPY_AND_ASSIGN(ptcx_pack);
+
+    struct PTCX_PACK_STATE *state;
+
+public:
+
+    ptcx_pack();
+    virtual ~ptcx_pack();
+
+    // The memory of a resident pack must outlive the pack object.
+    status open(const char *filename);
+    status open(const void *data, uint32 size);
+    void close();
+
+    status find_entry(const char *name, const uint8 **data, uint32 *size) const;
+    status load_entry(const char *name, image *output) const;
+    status load_entry(const char *name, IGN_IMAGE_LAYOUT layout, image *output) const;
+
+    uint32 query_entry_count() const;
+};
+
+/*
+// PTCX Tile Service
+//
+//   Decodes square tiles of a PTCX file, or of any level of a mip chain, on a pool of
+//   worker threads, for viewers that stream a large image as the camera moves. Callers
+//   request the tiles they will need with a priority (visible tiles highest), and later
+//   copy out those that have completed with query_tile. Requests that are no longer 
+//   needed, such as tiles that have left the view, may be cancelled before they decode.
+//
+//   Each worker serves its own queue in priority order, and steals from the queues of 
+//   other workers once its own is empty. Requesting a pending tile again with a new 
+//   priority moves it within the queues.
+//
+//   Decoded tiles are held in a least recently used cache bounded by cache_size bytes.
+//   Statistics count requests, cache hits, decodes, cancellations and evictions, and 
+//   hold histograms of request latency (from the first request until the tile is ready)
+//   and of decode latency. Bucket i of each histogram counts latencies of at least 2^i
+//   microseconds, and the final bucket also holds every longer latency.
+//
+// Returns:
+//
+//   BASE_SUCCESS upon success, BASE_ERROR_NOT_READY from query_tile if the tile is not 
+//   resident, otherwise a specific error value will be returned.
+//
+// Notes:
+//
+//   o: open indexes the file up front, so its memory need not outlive the service.
+//   o: A thread_count of zero uses one worker per hardware thread.
+//   o: Tiles along the right and bottom edges are clipped to the level.
+//   o: Every method other than open and close may be called from any thread.
+*/
+
+#define PTCX_TILE_HISTOGRAM_SIZE                 (24)
+
+typedef struct PTCX_TILE_STATISTICS
+{
+    uint64 request_count;
+    uint64 hit_count;
+    uint64 decode_count;
+    uint64 cancel_count;
+    uint64 eviction_count;
+    uint64 failure_count;
+    uint32 resident_size;
+    uint64 request_latency[PTCX_TILE_HISTOGRAM_SIZE];
+    uint64 decode_latency[PTCX_TILE_HISTOGRAM_SIZE];
+
+} PTCX_TILE_STATISTICS;
+
+class ptcx_tile_service
+{
+    BASE_DISABLE_COPY_AND_ASSIGN(ptcx_tile_service);
+
+    struct PTCX_TILE_SERVICE_STATE *state;
+
+public:
+
+    ptcx_tile_service();
+    virtual ~ptcx_tile_service();
+
+    status open(const void *data, uint32 size, uint32 tile_size, uint32 thread_count, uint32 cache_size);
+    void close();
+
+    status request_tile(uint32 x, uint32 y, uint32 level, uint32 priority);
+    status cancel_tile(uint32 x, uint32 y, uint32 level);
+    status cancel_all();
+    status query_tile(uint32 x, uint32 y, uint32 level, image *output);
+    status wait_idle();
+
+    uint32 query_level_count() const;
+    status query_tile_grid(uint32 level, uint32 *columns, uint32 *rows) const;
+    status query_statistics(PTCX_TILE_STATISTICS *output) const;
+};
+
+/*
+// PTCX Sequences
+//
+//   A sequence stores the frames of an animated texture, such as a flipbook of water 
+//   caustics, in a single file. Each frame after the first stores only the macroblocks
+//   whose pixels differ from those of the previous frame, and marks the rest as kept.
+//
+//   ptcx_sequence_writer encodes each frame as it is added, using the quality and 
+//   options of save_ptcx, and write emits the sequence once every frame is known.
+//
+//   ptcx_sequence holds a persistent frame buffer. decode_frame updates it in place from
+//   the frame it holds, so that stepping to the next frame decodes only the macroblocks
+//   that changed, and query_frame returns the buffer (or null before any frame has been
+//   decoded). Stepping backward decodes again from the first frame.
+//
+// Returns:
+//
+//   BASE_SUCCESS upon success, BASE_ERROR_INVALIDARG if the sequence holds no such frame,
+//   otherwise a specific error value will be returned.
+//
+// Notes:
+//
+//   o: Macroblocks are kept only when their source pixels are identical, so unchanged
+//      areas stay stable from frame to frame rather than shimmering as they requantize.
+//   o: Frames after the first are not valid files on their own, and load_ptcx rejects them.
+//   o: The writer holds every encoded frame, and a copy of the previous frame, in memory.
+*/
+
+class ptcx_sequence_writer
+{
+    BASE_DISABLE_COPY_AND_ASSIGN(ptcx_sequence_writer);
+
+    struct PTCX_SEQUENCE_WRITER_STATE *state;
+
+public:
+
+    ptcx_sequence_writer();
+    virtual ~ptcx_sequence_writer();
+
+    status begin(uint32 width, uint32 height, uint8 quality, uint32 options);
+    status add_frame(const image &frame);
+    status write(stream *output);
+
+    uint32 query_frame_count() const;
+};
+
+class ptcx_sequence
+{
+    BASE_DISABLE_COPY_AND_ASSIGN(ptcx_sequence);
+
+    struct PTCX_SEQUENCE_STATE *state;
+
+public:
+
+    ptcx_sequence();
+    virtual ~ptcx_sequence();
+
+    status load(stream *input);
+    status load(stream *input, IGN_IMAGE_LAYOUT layout);
+
+    status decode_frame(uint32 frame);
+    const image *query_frame() const;
+
+    uint32 query_frame_index() const;
+    uint32 query_frame_count() const;
+    uint32 query_width() const;
+    uint32 query_height() const;
+};
+
+/*
+// PTCX Variants
+//
+//   Encodes an image as a variant of a base PTCX file, such as a seasonal version of a 
+//   terrain texture. Each macroblock is quantized as save_ptcx would, and a macroblock
+//   whose coded data matches that of the base is stored as a reference to the base, 
+//   without any payload. load_ptcx_variant copies an already decoded base image and 
+//   decodes only the differing macroblocks over the copy.
+//
+// Returns:
+//
+//   BASE_SUCCESS upon success, BASE_ERROR_INVALIDARG if the quality and options produce
+//   coding parameters that differ from those of the base, otherwise a specific error 
+//   value will be returned.
+//
+// Notes:
+//
+//   o: The variant must use the quality, block size and coding options of the base. 
+//      Entropy coding, predicted endpoints, block references and the index codebook
+//      only change how data is stored, and may differ.
+//   o: Base macroblocks stored through the index codebook are never matched.
+//   o: A mip chain base is matched against its first level.
+//   o: Variants are not valid files on their own, and load_ptcx rejects them. The file
+//      does not identify its base, so callers must supply the image decoded from the 
+//      same base that the variant was encoded against.
+*/
+
+status save_ptcx_variant(const image &input, uint8 quality, uint32 options, stream *base, stream *output);
+
+status load_ptcx_variant(stream *input, const image &base, image *output);
+status load_ptcx_variant(stream *input, const image &base, IGN_IMAGE_LAYOUT layout, image *output);
+
+/*
+// PTCX Incremental Update
+//
+//   Re-encodes the parts of an existing PTCX file that an editor has repainted, such as
+//   the strokes made on a terrain splat map. Only the macroblocks that overlap a dirty
+//   rectangle are quantized again, from the updated image, and every other macroblock
+//   keeps its coded data. Bands without a dirty macroblock are copied to the output
+//   without being decoded, so the time taken follows the size of the edit rather than
+//   the size of the image.
+//
+// Returns:
+//
+//   BASE_SUCCESS upon success, BASE_ERROR_INVALIDARG if the image differs in size from
+//   the file or a rectangle extends beyond it, otherwise a specific error value will be
+//   returned.
+//
+// Notes:
+//
+//   o: The output keeps the quality, options and index codebook of the file. Its entropy
+//      models are also kept unless the new macroblocks hold data that they cannot code,
+//      in which case the models are rebuilt and every band is coded again.
+//   o: Pixels outside of the dirty rectangles are assumed to be unchanged, and decode
+//      exactly as they did before the update.
+//   o: The output is a complete file, but is generally not identical to save_ptcx of
+//      the updated image, since new macroblocks are never matched against the rest.
+//   o: Mip chains and version 2 files cannot be updated.
+*/
+
+typedef struct PTCX_RECT
+{
+    uint32 x;
+    uint32 y;
+    uint32 width;
+    uint32 height;
+
+} PTCX_RECT;
+
+status save_ptcx_update(stream *input, const image &updated, const PTCX_RECT *dirty_rects, uint32 rect_count, stream *output);
+
+/*
+// PTCX BC1 Transcode
+//
+//   Converts a PTCX file directly into BC1 (DXT1) blocks for upload, without decoding it
+//   to RGB. Indexed microblocks that cover whole 4x4 blocks already hold a pair of 565 
+//   endpoints with evenly spaced palette steps, and are converted by repacking their 
+//   endpoints and remapping their indices through a small table. Smaller microblocks, 
+//   planar microblocks and decorrelated files are decoded and fit to BC1 a macroblock at
+//   a time, and duplicated macroblocks copy their BC1 blocks. 
+//
+//   Blocks are written to the output in row major order, eight bytes per 4x4 block, and
+//   width and height receive the dimensions of the image.
+//
+// Returns:
+//
+//   BASE_SUCCESS upon success, otherwise a specific error value will be returned. 
+//
+// Notes:
+//
+//   o: The image dimensions must be multiples of four.
+//   o: Files written at qualities 1 through 3 map almost entirely without decoding. Four
+//      bit indices map each of their steps to the nearest of the four BC1 colors.
+*/
+
+status transcode_ptcx_bc1(stream *input, uint32 *width, uint32 *height, stream *output);
+
 /*
 // PTCX Encode
 //
@@ -87,8 +581,146 @@ status load_ptcx(stream *input, image *output);
 //
 //   o: Quality ranges from 1-4, with 4 being the highest quality (least compression)
 //   o: The input image must be RGB8 and macroblock (BASE_PTCX_MAX_BLOCK_SIZE) pixel aligned.
+//   o: The input image may use either layout, though tiled inputs encode with better locality.
+//   o: Options is a combination of PTCX_OPTION_* values, and defaults to none.
 */
 
+// Entropy codes the control and index data of each band against per-file models. This
+// typically reduces file size substantially for low frequency content, at the cost of
+// some decode performance. Files written with this option require a version 3 reader
+// that supports the entropy coded flag.
+#define PTCX_OPTION_ENTROPY_CODING               (1 << 0)
+
+// Stores the endpoints of each microblock as residuals against a prediction from its
+// neighbours. This mostly benefits higher qualities, where endpoints dominate file size.
+#define PTCX_OPTION_PREDICTIVE_ENDPOINTS         (1 << 1)
+
+// Stores single color microblocks without indices, and represents low variance 
+// microblocks by their mean color when doing so is no less accurate. This benefits
+// flat content such as sky, water and terrain.
+#define PTCX_OPTION_SOLID_BLOCKS                 (1 << 2)
+
+// Allows each macroblock to select 1, 2 or 4 index bits per pixel, choosing the smallest
+// encoding that meets our quality threshold. Mixed content benefits the most.
+#define PTCX_OPTION_ADAPTIVE_STEP_BITS           (1 << 3)
+
+// Allows macroblocks to subdivide each dimension independently, such as into 16x8 or
+// 8x16 microblocks, rather than only into smaller squares. This benefits content with
+// strong horizontal or vertical structure, at the cost of a slower encode.
+#define PTCX_OPTION_RECTANGULAR_PARTITIONS       (1 << 4)
+
+// Allows macroblocks to store each microblock as a plane through three colors, with no
+// per pixel indices. Smooth two dimensional gradients, such as baked lighting and terrain
+// tints, are then represented by large blocks rather than many small ones.
+#define PTCX_OPTION_PLANAR_BLOCKS                (1 << 5)
+
+// Stores each macroblock that duplicates an earlier macroblock in the same band, either in
+// its source pixels or in its compressed form, as a reference to that macroblock. Tiled 
+// and repeating textures benefit the most, and encode faster as duplicates skip all 
+// quantization work. Images without repetition may grow slightly, particularly at high
+// qualities, as every macroblock table entry grows by two bits.
+#define PTCX_OPTION_BLOCK_REFERENCES             (1 << 6)
+
+// Trains a shared codebook of up to 255 4x4 index patterns over the whole image, and
+// replaces each index tile that closely matches a pattern with a single byte. This suits
+// textures whose blocks share recurring structure, such as brick, tiles and foliage. Only
+// the macroblocks that shrink are converted, but every macroblock table entry grows by two
+// bits, so small block sizes may grow slightly. Output is deferred until the final band.
+#define PTCX_OPTION_INDEX_CODEBOOK               (1 << 7)
+
+// Overrides the macroblock size selected by quality with a square block of (1 << bits)
+// pixels, from 2 up to 64. Large blocks suit very low frequency content such as sky 
+// gradients and distant terrain. Where the content requires it they split into 16x16 
+// regions that subdivide independently, so detailed areas cost about as much as they 
+// would at the default size. Blocks of 2 pixels can use neither rectangular partitions
+// nor the index codebook, and those options are then ignored. The image dimensions must
+// be multiples of the block size.
+#define PTCX_OPTION_BLOCK_SIZE_SHIFT             (8)
+#define PTCX_OPTION_BLOCK_SIZE_MASK              (0xF << PTCX_OPTION_BLOCK_SIZE_SHIFT)
+#define PTCX_OPTION_BLOCK_SIZE(bits)             (((bits) << PTCX_OPTION_BLOCK_SIZE_SHIFT) & PTCX_OPTION_BLOCK_SIZE_MASK)
+
+// Allows each macroblock to be quantized in a YCoCg-R color space rather than RGB, so that
+// the range of a block may follow its luma rather than three independent channels. The
+// encoder tries both spaces and keeps whichever reconstructs more accurately in RGB, and
+// blocks too saturated for the transform to hold exactly remain RGB. This costs one bit
+// per macroblock and roughly doubles the encoder trials. Decoding converts each palette
+// back to RGB, and planar blocks convert each pixel, which adds a small cost to both.
+#define PTCX_OPTION_DECORRELATED_COLOR           (1 << 12)
+
 status save_ptcx(const image &input, uint8 quality, stream *output);
+status save_ptcx(const image &input, uint8 quality, uint32 options, stream *output);
+
+/*
+// PTCX Mip Chain Encode
+//
+//   Compresses an image along with a chain of successively half sized levels, produced
+//   with a 2x2 box filter, into a single file. Each level is encoded with the quality and
+//   options of save_ptcx, and the file begins with a table of level offsets so that a 
+//   loader may skip directly to the coarse levels (see load_ptcx_level). 
+//
+// Returns:
+//
+//   BASE_SUCCESS upon success, otherwise a specific error value will be returned.
+//
+// Notes:
+//
+//   o: Level count includes the full size image. Zero selects the longest chain that the
+//      image permits, which ends at the last level that keeps the alignment required by 
+//      save_ptcx. Requesting more levels than that fails.
+//   o: A level count of one produces an ordinary single level file.
+//   o: Every level is encoded before any output is written.
+*/
+
+status save_ptcx_mips(const image &input, uint8 quality, uint32 options, uint32 level_count, stream *output);
+
+/*
+// PTCX Band Encode
+//
+//   Compresses an image incrementally, one band of scanlines at a time. Each band is 
+//   emitted to the output as soon as it is pushed, so the encoder never requires more 
+//   than a single band of the source image to be resident.
+//
+//   Usage: call begin with the full image dimensions, push every band from top to 
+//   bottom, and then call end. Each band must be query_band_height rows tall and span
+//   the full width of the image. The band height is at least 16, and grows to match
+//   larger block sizes, so it should be queried after begin.
+//
+// Returns:
+//
+//   BASE_SUCCESS upon success, otherwise a specific error value will be returned.
+//
+// Notes:
+//
+//   o: Produces output that is identical to save_ptcx for the same image, quality and options.
+//   o: end reports an error if fewer bands were pushed than the image requires.
+//   o: With PTCX_OPTION_ENTROPY_CODING or PTCX_OPTION_INDEX_CODEBOOK, output is deferred
+//      until end because the file models and codebook depend upon every band. Quantized
+//      bands are held in memory until then.
+*/
+
+class ptcx_band_encoder
+{
+    BASE_DISABLE_COPY_AND_ASSIGN(ptcx_band_encoder);
+
+    struct PTCX_BAND_ENCODER_STATE *state;
+
+public:
+
+    ptcx_band_encoder();
+    virtual ~ptcx_band_encoder();
+
+    status begin(uint32 width, uint32 height, uint8 quality, stream *output);
+    status begin(uint32 width, uint32 height, uint8 quality, uint32 options, stream *output);
+
+    // Encodes the next band from a band sized image, or from the band_height rows of a 
+    // larger image that begin at source_y.
+
+    status push_band(const image &band);
+    status push_band(const image &source, uint32 source_y);
+
+    status end();
+
+    uint32 query_band_height() const;
+};
 
 #endif // __PTCX_H__
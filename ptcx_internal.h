@@ -36,16 +36,28 @@
 #include "ptcx.h"
 #include "math.h"
 
-#define PTCX_MAJOR_VERSION                       (2)
+#define PTCX_MAJOR_VERSION                       (3)
+#define PTCX_LEGACY_VERSION                      (2)
 #define PTCX_MAGIC_VALUE                         (0x50544358)   // "PTCX"
-#define PTCX_MAX_BLOCK_SIZE                      (16)
+#define PTCX_MAX_BLOCK_SIZE                      (64)
+#define PTCX_MIN_BLOCK_SIZE                      (2)
+#define PTCX_DEFAULT_BLOCK_SIZE                  (16)
 #define PTCX_MAX_QUANT_CONTROL_BITS              (16)
 #define PTCX_DEFAULT_IMAGE_DEPTH                 (1)
 #define PTCX_MAX_QUANT_STEP_BITS                 (4)
 #define PTCX_QUALITY_DELTA                       (64.0f)
+#define PTCX_BAND_HEIGHT                         (PTCX_DEFAULT_BLOCK_SIZE)
+#define PTCX_MB_TABLE_ENTRY_BITS                 (2)
+#define PTCX_MAX_PARTITION_LEVELS                (3)
+#define PTCX_MAX_PARTITION_REGIONS               ((PTCX_MAX_BLOCK_SIZE / PTCX_DEFAULT_BLOCK_SIZE) * (PTCX_MAX_BLOCK_SIZE / PTCX_DEFAULT_BLOCK_SIZE))
+#define PTCX_MB_TABLE_STEP_CODE_BITS             (2)
+#define PTCX_MB_TABLE_MODE_BITS                  (2)
+#define PTCX_MB_TABLE_COLOR_SPACE_BITS          (1)
 #define PTCX_MAX_MB_TABLE_SIZE                   (PTCX_MAX_BLOCK_SIZE * PTCX_MAX_BLOCK_SIZE)
-#define PTCX_MAX_BLOCK_DATA_SIZE                 ((PTCX_MAX_MB_TABLE_SIZE * PTCX_MAX_QUANT_STEP_BITS + \
-                                                 (PTCX_MAX_QUANT_CONTROL_BITS << 1)) >> 3)
+#define PTCX_MAX_MICROBLOCK_COUNT                (PTCX_MAX_MB_TABLE_SIZE / (PTCX_MIN_BLOCK_SIZE * PTCX_MIN_BLOCK_SIZE))
+#define PTCX_MAX_CONTROL_DATA_SIZE               ((PTCX_MAX_MICROBLOCK_COUNT * PTCX_MAX_QUANT_CONTROL_BITS * 3) >> 3)   // planar microblocks carry three control values
+#define PTCX_MAX_INDEX_DATA_SIZE                 ((PTCX_MAX_MB_TABLE_SIZE * PTCX_MAX_QUANT_STEP_BITS) >> 3)
+#define PTCX_MAX_BLOCK_DATA_SIZE                 (PTCX_MAX_CONTROL_DATA_SIZE + PTCX_MAX_INDEX_DATA_SIZE)
 
 #if (0 == (PTCX_MAX_BLOCK_SIZE >> 3))
   #error "Maximum block size is too small"
@@ -70,9 +82,114 @@ typedef struct PTCX_FILE_HEADER
     uint8 quant_step_bits;                      // the number of lerp steps in between the quantization base colors 
     uint8 quant_control_bits;                   // control bit count -- this defines the precision of the quantization base colors
     uint32 source_format;                       // source format -- dictates reconstituted format
+    uint32 flags;                               // format features in use (version 3 and later)
+    uint16 band_height;                         // scanlines per band (version 3 and later)
+    uint16 reserved;
 
 } PTCX_FILE_HEADER;
 
+// Version 2 files end their header just after the source format field.
+#define PTCX_LEGACY_HEADER_SIZE                  (24)
+
+// Header flags. Readers reject files that use any flag outside of PTCX_SUPPORTED_FLAGS.
+#define PTCX_FLAG_ENTROPY_CODED                  (1 << 0)
+#define PTCX_FLAG_PREDICTED_ENDPOINTS            (1 << 1)
+#define PTCX_FLAG_SOLID_BLOCKS                   (1 << 2)
+#define PTCX_FLAG_ADAPTIVE_STEP_BITS             (1 << 3)
+#define PTCX_FLAG_RECTANGULAR_PARTITIONS         (1 << 4)
+#define PTCX_FLAG_PLANAR_BLOCKS                  (1 << 5)
+#define PTCX_FLAG_BLOCK_REFERENCES               (1 << 6)
+#define PTCX_FLAG_INDEX_CODEBOOK                 (1 << 7)
+#define PTCX_FLAG_DECORRELATED_COLOR             (1 << 8)
+#define PTCX_FLAG_MIP_CHAIN                      (1 << 9)
+
+// Files that may keep macroblocks from an image that the decoder already holds: the 
+// previous frame of a sequence, or the base of a variant (see Delta files). Such files
+// are incomplete on their own, so this flag is deliberately absent from 
+// PTCX_SUPPORTED_FLAGS, and only the sequence and variant readers accept it.
+#define PTCX_FLAG_KEPT_BLOCKS                    (1 << 10)
+#define PTCX_SUPPORTED_FLAGS                     (PTCX_FLAG_ENTROPY_CODED | PTCX_FLAG_PREDICTED_ENDPOINTS | \
+                                                  PTCX_FLAG_SOLID_BLOCKS | PTCX_FLAG_ADAPTIVE_STEP_BITS | \
+                                                  PTCX_FLAG_RECTANGULAR_PARTITIONS | PTCX_FLAG_PLANAR_BLOCKS | \
+                                                  PTCX_FLAG_BLOCK_REFERENCES | PTCX_FLAG_INDEX_CODEBOOK | \
+                                                  PTCX_FLAG_DECORRELATED_COLOR | PTCX_FLAG_MIP_CHAIN)
+
+// Flags that add a block mode to each macroblock table entry.
+#define PTCX_BLOCK_MODE_FLAGS                    (PTCX_FLAG_PLANAR_BLOCKS | PTCX_FLAG_BLOCK_REFERENCES | PTCX_FLAG_INDEX_CODEBOOK)
+
+/*
+// Bands
+//
+//   Starting with version 3, the image is stored as a sequence of bands, each covering
+//   band_height scanlines. A band is self contained, which allows both the encoder and
+//   decoder to operate with memory proportional to the image width:
+//
+//     PTCX_BAND_HEADER
+//     macroblock table for the band (query_macroblock_entry_bits per macroblock, row major)
+//     control values for every microblock in the band (control_size bytes)
+//     quantization indices for every microblock in the band (index_size bytes)
+//
+//   Microblocks appear in the same order in both the control and index sections.
+//
+//   Each macroblock table entry stores a two bit subdivision level. Bands are never 
+//   shorter than a macroblock.
+//
+//   Macroblocks larger than PTCX_DEFAULT_BLOCK_SIZE are partitioned in two stages. Their
+//   deepest level, at which every dimension holds the value 
+//   query_partition_level_count - 1, splits the macroblock into regions of at most
+//   PTCX_DEFAULT_BLOCK_SIZE pixels on a side, and each region is then subdivided 
+//   as a default sized macroblock would be. Such entries end with the subdivision levels
+//   of every region, in row major order, which are zero unless the macroblock is split.
+//   The microblocks of a split macroblock are stored region by region.
+//
+//   When PTCX_FLAG_RECTANGULAR_PARTITIONS is set, each entry holds separate horizontal and
+//   vertical subdivision levels (horizontal first), which allows splits such as 16x8 and 
+//   8x16. Otherwise a single level applies to both dimensions.
+//
+//   When PTCX_FLAG_ADAPTIVE_STEP_BITS is set, each macroblock table entry also holds the 
+//   log of the index bits used by the macroblock (1, 2 or 4), following the subdivision
+//   levels, and the step bits of the header are the largest permitted value.
+//
+//   When any of PTCX_BLOCK_MODE_FLAGS is set, each entry ends with the block mode of the
+//   macroblock. Every microblock of a planar macroblock stores three colors in its control
+//   values: the origin, and the colors one block width to the right and one block height 
+//   below it. Pixels are reconstructed by interpolating across the plane through these 
+//   colors, and store no indices.
+//
+//   A reference macroblock is a copy of an earlier macroblock in the same band. Its
+//   control values hold the distance back to that macroblock, in macroblocks, as a 
+//   uint16, and it has no microblocks of its own. In files with PTCX_FLAG_KEPT_BLOCKS,
+//   a distance of zero keeps the pixels that the output already holds.
+//
+//   The microblocks of a codebook macroblock store control values as usual, but replace
+//   their indices with one byte per 4x4 tile, in row major order. Each byte selects an 
+//   index pattern from the file codebook, or is PTCX_CODEBOOK_ESCAPE and is followed by 
+//   the packed indices of the tile.
+//
+//   When PTCX_FLAG_DECORRELATED_COLOR is set, the mode (if any) is followed by a single 
+//   bit holding the color space of the macroblock's control values (see 
+//   decorrelate_color).
+//
+//   When PTCX_FLAG_SOLID_BLOCKS is set, a microblock whose two control values are equal
+//   is a single color, and stores no indices.
+//
+//   When PTCX_FLAG_PREDICTED_ENDPOINTS is set, the control section instead holds a bit
+//   stream of variable length codes, one per endpoint component, each of which is the 
+//   residual against a median prediction from the neighbouring microblocks. 
+//
+//   When PTCX_FLAG_ENTROPY_CODED is set, the header is followed by the control and index
+//   entropy models, and each of the two sections is replaced by a uint32 coded size and 
+//   the rANS coded bytes of the section. The band header continues to hold the decoded
+//   section sizes.
+*/
+
+typedef struct PTCX_BAND_HEADER
+{
+    uint32 control_size;
+    uint32 index_size;
+
+} PTCX_BAND_HEADER;
+
 typedef struct PTCX_PIXEL_RANGE
 {
     uint8 min_value[3];
@@ -82,8 +199,572 @@ typedef struct PTCX_PIXEL_RANGE
 
 #pragma pack(pop)
 
-status range_estimate_min_max(const PTCX_FILE_HEADER &header, PTCX_PIXEL_RANGE *range, const image &input, uint32 x, uint32 y);
-status range_estimate_linear_distance(const PTCX_FILE_HEADER &header, PTCX_PIXEL_RANGE *range, const image &input, uint32 x, uint32 y);
-status range_estimate_regression(const PTCX_FILE_HEADER &header, PTCX_PIXEL_RANGE *range, const image &input, uint32 x, uint32 y);
+/*
+// Format helpers
+*/
+
+status verify_header(const PTCX_FILE_HEADER &header);
+status verify_header(const PTCX_FILE_HEADER &header, uint32 supported_flags);
+uint32 query_band_count(const PTCX_FILE_HEADER &header);
+uint32 query_band_macroblock_count(const PTCX_FILE_HEADER &header);
+uint32 query_band_table_size(const PTCX_FILE_HEADER &header);
+uint32 query_band_capacity(const PTCX_FILE_HEADER &header);
+uint32 query_band_control_capacity(const PTCX_FILE_HEADER &header);
+
+// Block modes, which determine how the microblocks of a macroblock are coded.
+#define PTCX_BLOCK_MODE_INDEXED                  (0)     // control values and per pixel indices
+#define PTCX_BLOCK_MODE_PLANAR                   (1)     // three planar colors without indices
+#define PTCX_BLOCK_MODE_REFERENCE                (2)     // a copy of an earlier macroblock in the band
+#define PTCX_BLOCK_MODE_CODEBOOK                 (3)     // control values and codebook index patterns
+
+// Color spaces of the control values of a macroblock. Only files with 
+// PTCX_FLAG_DECORRELATED_COLOR store macroblocks in YCoCg-R.
+#define PTCX_COLOR_SPACE_RGB                     (0)
+#define PTCX_COLOR_SPACE_YCOCG                   (1)
+
+// Each planar color is a single 565 control value.
+#define PTCX_PLANAR_CONTROL_SIZE                 (6)
+#define PTCX_REFERENCE_CONTROL_SIZE              (2)
+#define PTCX_MAX_REFERENCE_DISTANCE              (BASE_MAX_UINT16)
+
+// The coding parameters of a single macroblock, as stored in the macroblock table.
+typedef struct PTCX_MACROBLOCK_ENTRY
+{
+    uint8 mode;                                 // one of PTCX_BLOCK_MODE_*
+    uint8 shift_x;                              // horizontal subdivision level of the macroblock
+    uint8 shift_y;                              // vertical subdivision level of the macroblock
+    uint8 quant_step_bits;                      // index bits per pixel
+    uint8 region_shift_x[PTCX_MAX_PARTITION_REGIONS];   // horizontal subdivision level of each region of a split macroblock
+    uint8 region_shift_y[PTCX_MAX_PARTITION_REGIONS];   // vertical subdivision level of each region of a split macroblock
+    uint8 color_space;                          // one of PTCX_COLOR_SPACE_*
+
+} PTCX_MACROBLOCK_ENTRY;
+
+// A uniformly subdivided area of a macroblock. Macroblocks hold a single region unless
+// they are split.
+typedef struct PTCX_PARTITION_REGION
+{
+    uint32 x;
+    uint32 y;
+    uint32 width;
+    uint32 height;
+    uint32 micro_width;
+    uint32 micro_height;
+
+} PTCX_PARTITION_REGION;
+
+uint32 query_macroblock_partition_bits(const PTCX_FILE_HEADER &header);
+uint32 query_macroblock_entry_bits(const PTCX_FILE_HEADER &header);
+uint32 query_microblock_control_size(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry);
+uint32 query_partition_level_count(const PTCX_FILE_HEADER &header);
+uint32 query_partition_region_count(const PTCX_FILE_HEADER &header);
+bool is_split_macroblock(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry);
+bool is_identical_entry(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry_a, const PTCX_MACROBLOCK_ENTRY &entry_b);
+void write_macroblock_entry(const PTCX_FILE_HEADER &header, uint8 *mb_table, uint32 block_index, const PTCX_MACROBLOCK_ENTRY &entry);
+status read_macroblock_entry(const PTCX_FILE_HEADER &header, const uint8 *mb_table, uint32 block_index, PTCX_MACROBLOCK_ENTRY *entry);
+void query_microblock_size(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry, uint32 *width, uint32 *height);
+void query_smallest_microblock_size(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry, uint32 *width, uint32 *height);
+uint32 query_partition_regions(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry, PTCX_PARTITION_REGION *regions);
+uint32 query_region_microblock_count(const PTCX_PARTITION_REGION &region);
+status read_reference_distance(const uint8 *control, uint32 block_index, uint32 *distance);
+bool is_solid_microblock(const PTCX_FILE_HEADER &header, const uint8 *control);
+void unpack_control_values(const uint8 *input, const PTCX_FILE_HEADER &header, PTCX_PIXEL_RANGE *range);
+
+// Expanded control values of an indexed microblock. Palette entry i of each channel is
+// min_value + range_delta / quant_step_mask * i.
+typedef struct PTCX_PALETTE_RANGE
+{
+    int16 min_value[3];
+    int16 range_delta[3];
+
+} PTCX_PALETTE_RANGE;
+
+void expand_palette_range(const PTCX_PIXEL_RANGE &range, PTCX_PALETTE_RANGE *palette);
+
+// Planar blocks. Colors are held as expanded origin, horizontal and vertical values for 
+// each channel, and evaluated at pixel (x, y) of a block with the given log2 dimensions.
+typedef struct PTCX_PLANAR_COLORS
+{
+    int32 origin[3];
+    int32 horizontal[3];
+    int32 vertical[3];
+
+} PTCX_PLANAR_COLORS;
+
+void unpack_planar_colors(const uint8 *input, PTCX_PLANAR_COLORS *colors);
+void pack_planar_colors(const PTCX_PLANAR_COLORS &colors, uint8 *output);
+uint8 evaluate_planar_color(const PTCX_PLANAR_COLORS &colors, uint32 channel, uint32 width_bits, uint32 height_bits, uint32 x, uint32 y);
+
+/*
+// Decorrelated color
+//
+//   Files with PTCX_FLAG_DECORRELATED_COLOR may store the control values of each 
+//   macroblock in a YCoCg-R space rather than RGB, as selected by the color space of its
+//   table entry. Luma is held in the six bit (green) channel, and the chroma differences
+//   are offset into the remaining channels at full precision:
+//
+//     co = r - b, t = b + (co >> 1), cg = g - t, y = t + (cg >> 1)
+//     channel 0 = co + 128, channel 1 = y, channel 2 = cg + 128
+//
+//   A macroblock holding any color whose differences do not fit within a channel (see 
+//   is_decorrelated_range), such as a saturated red or blue, remains in RGB. Neutral
+//   colors keep a chroma of exactly 128, which every control value precision can 
+//   represent.
+//
+//   Decoders expand each palette in this space and convert it back to RGB. Encoders do
+//   the same when measuring error, so that every file is held to the same threshold.
+*/
+
+void decorrelate_color(const uint8 *input, uint8 *output);
+void correlate_color(const uint8 *input, uint8 *output);
+bool is_decorrelated_range(const uint8 *input);
+bool is_correlated_range(const uint8 *input);
+
+// 64 bit FNV-1a, continued from a previous hash. New hashes begin from PTCX_HASH_BASIS.
+#define PTCX_HASH_BASIS                          (0xCBF29CE484222325ull)
+
+uint64 hash_bytes(const uint8 *data, uint32 size, uint64 hash);
+
+// Stream helpers that fail unless the full amount of data is transferred.
+status read_stream_data(stream *input, void *data, uint32 size);
+status write_stream_data(stream *output, const void *data, uint32 size);
+
+/*
+// Entropy coding
+//
+//   An optional static model rANS coder that operates on the bytes of a section. Each
+//   file carries one model for control data and one for index data, with frequencies 
+//   normalized to PTCX_ENTROPY_TOTAL. Symbols are distributed round robin across 
+//   PTCX_ENTROPY_LANE_COUNT interleaved coder states so that the decoder can overlap
+//   the latency of consecutive symbols.
+*/
+
+#define PTCX_ENTROPY_PRECISION_BITS              (12)
+#define PTCX_ENTROPY_TOTAL                       (1 << PTCX_ENTROPY_PRECISION_BITS)
+#define PTCX_ENTROPY_SYMBOL_COUNT                (256)
+#define PTCX_ENTROPY_LANE_COUNT                  (4)
+
+typedef struct PTCX_ENTROPY_TABLE
+{
+    uint16 frequency[PTCX_ENTROPY_SYMBOL_COUNT];
+    uint16 cumulative[PTCX_ENTROPY_SYMBOL_COUNT + 1];
+    uint8 symbol[PTCX_ENTROPY_TOTAL];             // slot to symbol lookup used by the decoder
+
+} PTCX_ENTROPY_TABLE;
+
+void build_entropy_table(const uint32 *histogram, PTCX_ENTROPY_TABLE *table);
+status prepare_entropy_table(PTCX_ENTROPY_TABLE *table);
+status write_entropy_table(stream *output, const PTCX_ENTROPY_TABLE &table);
+status read_entropy_table(stream *input, PTCX_ENTROPY_TABLE *table);
+uint32 query_entropy_capacity(uint32 size);
+void accumulate_histogram(const std::vector<uint8> &data, uint32 *histogram);
+
+status entropy_encode(const PTCX_ENTROPY_TABLE &table, const uint8 *input, uint32 size, std::vector<uint8> *output);
+status entropy_decode(const PTCX_ENTROPY_TABLE &table, const uint8 *input, uint32 input_size, uint8 *output, uint32 output_size);
+
+/*
+// File context
+//
+//   The header along with any file level data that bands are coded against.
+*/
+
+typedef struct PTCX_FILE_CONTEXT
+{
+    PTCX_FILE_HEADER header;
+    PTCX_ENTROPY_TABLE control_model;
+    PTCX_ENTROPY_TABLE index_model;
+    std::vector<uint8> codebook;
+
+} PTCX_FILE_CONTEXT;
+
+/*
+// Band coding
+//
+//   A band is read from the stream in its entirety, and then decoded from memory. 
+//   decode_band writes the band_height rows of the band into output starting at
+//   row dest_y.
+*/
+
+typedef struct PTCX_BAND_DATA
+{
+    std::vector<uint8> table;
+    std::vector<uint8> control;
+    std::vector<uint8> index;
+    std::vector<uint8> residual;                 // predicted control section, if enabled
+    std::vector<uint8> coded;                    // staging for entropy coded sections
+
+} PTCX_BAND_DATA;
+
+status read_header(stream *input, PTCX_FILE_HEADER *header);
+status read_header(stream *input, uint32 supported_flags, PTCX_FILE_HEADER *header);
+status read_file_context(stream *input, PTCX_FILE_CONTEXT *context);
+status read_file_models(stream *input, PTCX_FILE_CONTEXT *context);
+status read_band(stream *input, const PTCX_FILE_CONTEXT &context, PTCX_BAND_DATA *output);
+status skip_band(stream *input, const PTCX_FILE_CONTEXT &context);
+status write_band(stream *output, const PTCX_FILE_CONTEXT &context, PTCX_BAND_DATA *band);
+
+// The control section as it is stored, which holds residuals when endpoints are predicted.
+const std::vector<uint8> &query_control_section(const PTCX_FILE_HEADER &header, const PTCX_BAND_DATA &band);
+status decode_band(const PTCX_FILE_CONTEXT &context, const PTCX_BAND_DATA &band, image *output, uint32 dest_y);
+
+// Decodes every band (or the legacy macroblock stream) of a file into an image that 
+// already holds the dimensions of the file.
+status decode_image(stream *input, const PTCX_FILE_CONTEXT &context, image *output);
+
+// Read positions within the control and index sections of a band. Each microblock decoder
+// advances the cursor past the data that it consumes.
+typedef struct PTCX_BAND_CURSOR
+{
+    const uint8 *control;
+    const uint8 *control_end;
+    const uint8 *index;
+    const uint8 *index_end;
+
+} PTCX_BAND_CURSOR;
+
+status decode_microblock(const PTCX_FILE_HEADER &header, uint32 block_width, uint32 block_height, uint32 quant_step_bits,
+                         uint32 color_space, PTCX_BAND_CURSOR *cursor, image *output, uint32 start_x, uint32 start_y);
+status decode_planar_microblock(uint32 block_width, uint32 block_height, uint32 color_space,
+                                PTCX_BAND_CURSOR *cursor, image *output, uint32 start_x, uint32 start_y);
+status decode_codebook_microblock(const PTCX_FILE_CONTEXT &context, uint32 block_width, uint32 block_height, uint32 color_space,
+                                  PTCX_BAND_CURSOR *cursor, image *output, uint32 start_x, uint32 start_y);
+
+// Version 2 files store a single macroblock table, followed by interleaved microblocks.
+status read_macroblock_table(stream *input, const PTCX_FILE_HEADER &header, std::vector<uint8> *output);
+status inverse_quantize_legacy(stream *input, const PTCX_FILE_HEADER &header, const std::vector<uint8> &macroblock_table, 
+                               uint32 first_row, uint32 row_count, image *output, uint32 dest_y);
+
+/*
+// Index codebook
+//
+//   A file level set of up to PTCX_MAX_CODEBOOK_SIZE index patterns for 4x4 tiles, 
+//   using the step bits of the header. The codebook follows the header as a uint16 
+//   pattern count and the packed patterns, and precedes any entropy models.
+//
+//   The encoder clusters the tiles of every band, and so defers its output until all
+//   bands are known. A tile uses a pattern only when doing so changes its reconstruction
+//   by no more than PTCX_CODEBOOK_DELTA_RATIO of the file's quality threshold, in mean 
+//   squared error.
+*/
+
+#define PTCX_CODEBOOK_TILE_SIZE                  (4)
+#define PTCX_CODEBOOK_TILE_PIXELS                (PTCX_CODEBOOK_TILE_SIZE * PTCX_CODEBOOK_TILE_SIZE)
+#define PTCX_MAX_CODEBOOK_SIZE                   (255)
+#define PTCX_CODEBOOK_ESCAPE                     (0xFF)
+#define PTCX_CODEBOOK_DELTA_RATIO                (0.25f)
+
+uint32 query_codebook_pattern_size(const PTCX_FILE_HEADER &header);
+status build_index_codebook(const PTCX_FILE_HEADER &header, const std::vector<PTCX_BAND_DATA> &bands, std::vector<uint8> *codebook);
+status apply_index_codebook(const PTCX_FILE_HEADER &header, const std::vector<uint8> &codebook, PTCX_BAND_DATA *band);
+status write_index_codebook(stream *output, const PTCX_FILE_HEADER &header, const std::vector<uint8> &codebook);
+status read_index_codebook(stream *input, const PTCX_FILE_HEADER &header, std::vector<uint8> *codebook);
+
+// Expands the tiles of a codebook microblock into its packed indices, advancing input.
+status expand_codebook_indices(const PTCX_FILE_HEADER &header, const std::vector<uint8> &codebook, uint32 block_width, uint32 block_height,
+                               const uint8 **input, const uint8 *input_end, uint8 *output);
+
+/*
+// Endpoint prediction
+//
+//   Converts the raw control section of a band to and from its predicted form. Both
+//   directions require the macroblock table of the band.
+*/
+
+status predict_band_endpoints(const PTCX_FILE_HEADER &header, const uint8 *mb_table, const std::vector<uint8> &control, std::vector<uint8> *output);
+status reconstruct_band_endpoints(const PTCX_FILE_HEADER &header, const uint8 *mb_table, const std::vector<uint8> &input, std::vector<uint8> *control);
+
+/*
+// Mip chains
+//
+//   A file with PTCX_FLAG_MIP_CHAIN holds image_depth levels, each half the width and
+//   height of the one before it. Its header is a copy of the header of the first level,
+//   with the flag set and image_depth holding the level count, and is followed by:
+//
+//     level table (one uint32 per level, the byte offset of the level from the end of the table)
+//     levels, in order from largest to smallest
+//
+//   Every level is a complete single level file, with its own header, codebook and 
+//   models, so readers skip to the level they need and decode it as any other file.
+*/
+
+#define PTCX_MAX_MIP_LEVELS                      (16)
+
+status read_mip_table(stream *input, const PTCX_FILE_HEADER &header, std::vector<uint32> *offsets);
+status seek_mip_level(stream *input, const PTCX_FILE_HEADER &header, uint32 level);
+status read_level_context(stream *input, uint32 level, PTCX_FILE_CONTEXT *context);
+
+// Encoder setup, shared with the mip chain encoder.
+status configure_header(uint32 width, uint32 height, PTCX_FILE_HEADER *out_header, uint8 quality, uint32 options);
+bool is_aligned_image_size(const PTCX_FILE_HEADER &header, uint32 width, uint32 height);
+
+// A growable stream that holds a single encoded file. Containers must list the size or
+// offset of every file before any of them, so each file is encoded in full first.
+class file_buffer_stream : public stream
+{
+    BASE_DISABLE_COPY_AND_ASSIGN(file_buffer_stream);
+
+    std::vector<uint8> data;
+    uint32 read_index;
+
+public:
+
+    file_buffer_stream() : read_index(0) {}
+
+    virtual void empty() { data.clear(); read_index = 0; }
+    virtual bool is_full() const { return false; }
+    virtual bool is_empty() const { return read_index == data.size(); }
+
+    virtual uint32 query_occupancy() const { return data.size() - read_index; }
+
+    virtual status read_data(void *output, uint32 size, uint32 *bytes_read = 0)
+    {
+        uint32 internal_to_read = base_min2(size, query_occupancy());
+
+        memcpy(output, data.data() + read_index, internal_to_read);
+        read_index += internal_to_read;
+
+        if (bytes_read)
+        {
+            *bytes_read = internal_to_read;
+        }
+
+        return internal_to_read ? BASE_SUCCESS : BASE_ERROR_INVALID_RESOURCE;
+    }
+
+    virtual status write_data(void *input, uint32 size, uint32 *bytes_written = 0)
+    {
+        const uint8 *source = static_cast<const uint8 *>(input);
+
+        data.insert(data.end(), source, source + size);
+
+        if (bytes_written)
+        {
+            *bytes_written = size;
+        }
+
+        return BASE_SUCCESS;
+    }
+
+    const uint8 *query_data() const { return data.data() + read_index; }
+};
+
+/*
+// Random access
+//
+//   Readers that decode parts of an image on demand hold every band in its decoded 
+//   section form, along with the location of the coded data of each macroblock. Blocks
+//   are numbered in row major order across the image, and since bands hold whole rows 
+//   of macroblocks, the blocks of each band follow those of the band before it.
+//
+//   A reference macroblock holds the location of the macroblock that it copies, so that 
+//   every location leads directly to coded microblocks. query_indexed_source returns the
+//   number of that macroblock, which readers may use to share decoded copies.
+*/
+
+typedef struct PTCX_BLOCK_LOCATION
+{
+    uint32 source_index;                        // band relative number of the macroblock that holds the data
+    uint32 control_offset;
+    uint32 index_offset;
+
+} PTCX_BLOCK_LOCATION;
+
+typedef struct PTCX_BLOCK_INDEX
+{
+    PTCX_FILE_CONTEXT context;
+    std::vector<PTCX_BAND_DATA> bands;
+    std::vector<PTCX_BLOCK_LOCATION> blocks;
+
+} PTCX_BLOCK_INDEX;
+
+status read_block_index(stream *input, uint32 level, PTCX_BLOCK_INDEX *output);
+status index_band(const PTCX_FILE_HEADER &header, const PTCX_BAND_DATA &band, PTCX_BLOCK_LOCATION *blocks);
+uint32 query_indexed_block(const PTCX_FILE_HEADER &header, uint32 x, uint32 y);
+uint32 query_indexed_source(const PTCX_BLOCK_INDEX &index, uint32 block_index);
+status read_indexed_entry(const PTCX_BLOCK_INDEX &index, uint32 block_index, PTCX_MACROBLOCK_ENTRY *entry);
+
+// The number of control and index bytes held at the location of a macroblock.
+status query_indexed_size(const PTCX_BLOCK_INDEX &index, uint32 block_index, uint32 *control_size, uint32 *index_size);
+
+// Advances a cursor past a single microblock of the given entry, without decoding it.
+status skip_microblock(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry, uint32 block_width, uint32 block_height,
+                       PTCX_BAND_CURSOR *cursor);
+
+// Advances a cursor past every microblock of a macroblock with the given entry.
+status skip_macroblock(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry, PTCX_BAND_CURSOR *cursor);
+
+// Decodes count microblocks of a macroblock, starting with microblock first in coding
+// order, to the positions they hold within a macroblock placed at (dest_x, dest_y).
+status decode_indexed_microblocks(const PTCX_BLOCK_INDEX &index, uint32 block_index, const PTCX_MACROBLOCK_ENTRY &entry, 
+                                  uint32 first, uint32 count, image *output, uint32 dest_x, uint32 dest_y);
+status decode_indexed_macroblock(const PTCX_BLOCK_INDEX &index, uint32 block_index, image *output, uint32 dest_x, uint32 dest_y);
+
+/*
+// Packs
+//
+//   A pack holds many PTCX files, each identified by the hash of its name (see 
+//   hash_bytes). The names themselves are not stored. A pack is laid out as:
+//
+//     PTCX_PACK_HEADER
+//     slot table (slot_count PTCX_PACK_ENTRY records)
+//     payloads, each beginning at a multiple of PTCX_PACK_ALIGNMENT bytes from the start
+//
+//   The slot table is an open addressed hash table. An entry is placed in the first free
+//   slot at or after (name_hash & (slot_count - 1)), wrapping at the end of the table, and
+//   free slots have a size of zero. Slot counts are powers of two, at least twice the 
+//   entry count, so that lookups touch very few slots. Entries with identical payloads
+//   share a single copy of the payload.
+*/
+
+#define PTCX_PACK_MAGIC_VALUE                    (0x4B505450)   // "PTPK"
+#define PTCX_PACK_VERSION                        (1)
+#define PTCX_PACK_ALIGNMENT                      (64)
+
+#pragma pack( push )
+#pragma pack( 1 )
+
+typedef struct PTCX_PACK_HEADER
+{
+    uint32 magic;
+    uint16 version;
+    uint16 header_size;
+    uint32 entry_count;
+    uint32 slot_count;
+
+} PTCX_PACK_HEADER;
+
+typedef struct PTCX_PACK_ENTRY
+{
+    uint64 name_hash;
+    uint32 offset;                              // from the start of the pack
+    uint32 size;
+
+} PTCX_PACK_ENTRY;
+
+#pragma pack(pop)
+
+uint64 hash_pack_name(const char *name);
+
+/*
+// Delta files
+//
+//   A delta file is a single level file with PTCX_FLAG_KEPT_BLOCKS and 
+//   PTCX_FLAG_BLOCK_REFERENCES set, which is decoded over an image that the decoder
+//   already holds. Macroblocks that are references with a distance of zero are kept: 
+//   they carry no microblocks, and decoders leave their pixels untouched.
+//
+//   save_ptcx_delta encodes such a file. A macroblock is kept when its source pixels
+//   are identical to those of previous, or when it quantizes to exactly the coded data
+//   of the same macroblock of base, whose coding parameters must then match those of 
+//   the file. With neither, it produces an ordinary file.
+//
+//   decode_delta decodes a file over output, which must already hold an image of the 
+//   same size. Files with PTCX_FLAG_KEPT_BLOCKS are rejected unless supported_flags 
+//   includes it.
+*/
+
+status save_ptcx_delta(const image &input, const image *previous, const PTCX_BLOCK_INDEX *base, uint8 quality, uint32 options, stream *output);
+status decode_delta(stream *input, uint32 supported_flags, image *output);
+
+// Confirms that coded data may be shared between files with these headers.
+bool is_compatible_base(const PTCX_FILE_HEADER &header, const PTCX_FILE_HEADER &base_header);
+
+/*
+// Sequences
+//
+//   A sequence holds the frames of an animation, such as a flipbook texture, in which
+//   most macroblocks are unchanged from one frame to the next. A sequence is laid out as:
+//
+//     PTCX_SEQUENCE_HEADER
+//     frame table (one uint32 per frame, the size of the frame in bytes)
+//     frames, in order
+//
+//   The first frame is a complete single level file. Every later frame is a delta file
+//   against the source pixels of the frame before it, and is decoded over that frame.
+*/
+
+#define PTCX_SEQUENCE_MAGIC_VALUE                (0x51535450)   // "PTSQ"
+#define PTCX_SEQUENCE_VERSION                    (1)
+
+#pragma pack( push )
+#pragma pack( 1 )
+
+typedef struct PTCX_SEQUENCE_HEADER
+{
+    uint32 magic;
+    uint16 version;
+    uint16 header_size;
+    uint32 frame_count;
+    uint16 image_width;
+    uint16 image_height;
+
+} PTCX_SEQUENCE_HEADER;
+
+#pragma pack(pop)
+
+/*
+// Incremental updates
+//
+//   An update re-encodes the dirty macroblocks of an existing file, marked by one byte
+//   per macroblock of the image in row major order, and carries every other macroblock
+//   over with its coded data. Only bands that hold a dirty macroblock need be present
+//   in the block index, and requantize_macroblocks replaces each of them (along with
+//   its block locations) with the updated band.
+//
+//   A carried over reference points directly at the macroblock that it resolves to when
+//   that macroblock is also carried over, and otherwise becomes a copy of its original
+//   data. New macroblocks may only reference other new macroblocks.
+*/
+
+bool is_dirty_band(const PTCX_FILE_HEADER &header, const std::vector<uint8> &dirty_blocks, uint32 band_index);
+status requantize_macroblocks(const image &input, const std::vector<uint8> &dirty_blocks, PTCX_BLOCK_INDEX *index);
+
+/*
+// Block staging
+//
+//   The encoder loads each macroblock exactly once into a set of aligned planar 
+//   arrays. All range estimators, trial quantizers and error metrics then operate 
+//   on this structure rather than gathering interleaved pixels from the image. 
+//   Coordinates passed alongside a staged block are relative to its origin, and 
+//   rows are always PTCX_MAX_BLOCK_SIZE samples apart.
+//
+//   We also keep per-channel sums and sums of squares for each PTCX_STAGING_CELL_SIZE
+//   square cell, which lets us compute the moments of any cell aligned microblock 
+//   without touching its pixels.
+//
+//   A block staged in PTCX_COLOR_SPACE_YCOCG falls back to RGB when any of its pixels
+//   lies outside of is_decorrelated_range, and its color space records the result.
+*/
+
+#define PTCX_STAGING_CELL_SIZE                   (2)
+#define PTCX_STAGING_CELL_STRIDE                 (PTCX_MAX_BLOCK_SIZE / PTCX_STAGING_CELL_SIZE)
+#define PTCX_STAGING_CELL_COUNT                  (PTCX_STAGING_CELL_STRIDE * PTCX_STAGING_CELL_STRIDE)
+
+typedef struct PTCX_BLOCK_DATA
+{
+    BASE_ALIGN(16) uint8 channel[3][PTCX_MAX_MB_TABLE_SIZE];
+
+    uint32 width;
+    uint32 height;
+    uint32 color_space;
+    uint32 cell_sum[3][PTCX_STAGING_CELL_COUNT];
+    uint32 cell_sum_squares[3][PTCX_STAGING_CELL_COUNT];
+
+} PTCX_BLOCK_DATA;
+
+typedef struct PTCX_BLOCK_MOMENTS
+{
+    uint32 count;
+    uint32 sum[3];
+    uint32 sum_squares[3];
+
+} PTCX_BLOCK_MOMENTS;
+
+status load_block_data(const image &input, uint32 x, uint32 y, uint32 width, uint32 height, uint32 color_space, PTCX_BLOCK_DATA *output);
+void query_block_moments(const PTCX_BLOCK_DATA &block, uint32 x, uint32 y, uint32 width, uint32 height, PTCX_BLOCK_MOMENTS *output);
+
+status range_estimate_min_max(const PTCX_FILE_HEADER &header, PTCX_PIXEL_RANGE *range, const PTCX_BLOCK_DATA &block, uint32 x, uint32 y);
+status range_estimate_linear_distance(const PTCX_FILE_HEADER &header, PTCX_PIXEL_RANGE *range, const PTCX_BLOCK_DATA &block, uint32 x, uint32 y);
+status range_estimate_regression(const PTCX_FILE_HEADER &header, PTCX_PIXEL_RANGE *range, const PTCX_BLOCK_DATA &block, uint32 x, uint32 y);
 
 #endif // __PTCX_INTERNAL_H__
@@ -0,0 +1,252 @@
+
+#include "ptcx_internal.h"
+
+#define PTCX_SAMPLER_CACHE_SIZE                  (8)
+#define PTCX_SAMPLER_WEIGHT_BITS                 (8)
+
+// A decoded microblock, identified by its source macroblock and its origin within that
+// macroblock. Pixels are held at their positions within the macroblock.
+struct PTCX_SAMPLER_CACHE_ENTRY
+{
+    uint32 block_index;
+    uint32 micro_x;
+    uint32 micro_y;
+    uint32 last_use;
+    image pixels;
+};
+
+struct PTCX_SAMPLER_STATE
+{
+    PTCX_BLOCK_INDEX index;
+    PTCX_SAMPLER_CACHE_ENTRY cache[PTCX_SAMPLER_CACHE_SIZE];
+    uint32 use_count;
+};
+
+status query_sampler_texel(PTCX_SAMPLER_STATE *state, uint32 x, uint32 y, uint8 *color)
+{
+    const PTCX_FILE_HEADER &header = state->index.context.header;
+    uint32 block_index = query_indexed_block(header, x, y);
+    uint32 source_index = query_indexed_source(state->index, block_index);
+    PTCX_PARTITION_REGION regions[PTCX_MAX_PARTITION_REGIONS];
+    PTCX_MACROBLOCK_ENTRY entry;
+
+    if (base_failed(read_indexed_entry(state->index, block_index, &entry)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    // Find the microblock that covers our texel. Regions are equally sized and row major,
+    // and the microblocks of every earlier region precede those of our own.
+
+    query_partition_regions(header, entry, regions);
+
+    uint32 local_x = x % header.block_width;
+    uint32 local_y = y % header.block_height;
+    uint32 r = (local_y / regions[0].height) * (header.block_width / regions[0].width) + local_x / regions[0].width;
+    uint32 microblock = 0;
+
+    for (uint32 i = 0; i < r; i++)
+    {
+        microblock += query_region_microblock_count(regions[i]);
+    }
+
+    const PTCX_PARTITION_REGION &region = regions[r];
+    uint32 micro_x = local_x - (local_x % region.micro_width);
+    uint32 micro_y = local_y - (local_y % region.micro_height);
+
+    microblock += ((micro_y - region.y) / region.micro_height) * (region.width / region.micro_width) + (micro_x - region.x) / region.micro_width;
+
+    // Duplicate macroblocks share the cache entries of their source. Upon a miss we evict
+    // the least recently used entry.
+
+    PTCX_SAMPLER_CACHE_ENTRY *slot = 0;
+    PTCX_SAMPLER_CACHE_ENTRY *oldest = &state->cache[0];
+
+    for (uint32 i = 0; i < PTCX_SAMPLER_CACHE_SIZE; i++)
+    {
+        PTCX_SAMPLER_CACHE_ENTRY *cache_entry = &state->cache[i];
+
+        if (cache_entry->block_index == source_index && cache_entry->micro_x == micro_x && cache_entry->micro_y == micro_y)
+        {
+            slot = cache_entry;
+            break;
+        }
+
+        if (cache_entry->last_use < oldest->last_use)
+        {
+            oldest = cache_entry;
+        }
+    }
+
+    if (!slot)
+    {
+        slot = oldest;
+        slot->block_index = BASE_MAX_UINT32;
+
+        if (base_failed(decode_indexed_microblocks(state->index, block_index, entry, microblock, 1, &slot->pixels, 0, 0)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+
+        slot->block_index = source_index;
+        slot->micro_x = micro_x;
+        slot->micro_y = micro_y;
+    }
+
+    slot->last_use = ++state->use_count;
+
+    const uint8 *texel = slot->pixels.query_data() + slot->pixels.query_block_offset(local_x, local_y);
+
+    color[0] = texel[0];
+    color[1] = texel[1];
+    color[2] = texel[2];
+
+    return BASE_SUCCESS;
+}
+
+status load_sampler_state(stream *input, uint32 level, PTCX_SAMPLER_STATE *state)
+{
+    status result = read_block_index(input, level, &state->index);
+
+    if (base_failed(result))
+    {
+        return result;
+    }
+
+    state->use_count = 0;
+
+    for (uint32 i = 0; i < PTCX_SAMPLER_CACHE_SIZE; i++)
+    {
+        PTCX_SAMPLER_CACHE_ENTRY &slot = state->cache[i];
+
+        if (base_failed(create_image(IGN_IMAGE_FORMAT_R8G8B8, PTCX_MAX_BLOCK_SIZE, PTCX_MAX_BLOCK_SIZE, &slot.pixels)))
+        {
+            return base_post_error(BASE_ERROR_OUTOFMEMORY);
+        }
+
+        slot.block_index = BASE_MAX_UINT32;
+        slot.last_use = 0;
+    }
+
+    return BASE_SUCCESS;
+}
+
+ptcx_sampler::ptcx_sampler()
+{
+    state = 0;
+}
+
+ptcx_sampler::~ptcx_sampler()
+{
+    delete state;
+}
+
+status ptcx_sampler::load(stream *input)
+{
+    return load(input, 0);
+}
+
+status ptcx_sampler::load(stream *input, uint32 level)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!input || input->is_empty())
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    delete state;
+    state = new PTCX_SAMPLER_STATE;
+
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+    }
+
+    status result = load_sampler_state(input, level, state);
+
+    if (base_failed(result))
+    {
+        delete state;
+        state = 0;
+    }
+
+    return result;
+}
+
+status ptcx_sampler::fetch(uint32 x, uint32 y, uint8 *color)
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_NOT_READY);
+    }
+
+    if (!color || x >= query_width() || y >= query_height())
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    return query_sampler_texel(state, x, y, color);
+}
+
+status ptcx_sampler::sample_bilinear(float32 u, float32 v, uint8 *color)
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_NOT_READY);
+    }
+
+    if (!color)
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    // Texel centers lie at half integer coordinates, and coordinates outside of the
+    // image clamp to its edge. Weights are rounded to PTCX_SAMPLER_WEIGHT_BITS, which
+    // keeps the blend in integer arithmetic.
+
+    float32 x = base_min2(base_max2(u * query_width() - 0.5f, 0.0f), (float32) (query_width() - 1));
+    float32 y = base_min2(base_max2(v * query_height() - 0.5f, 0.0f), (float32) (query_height() - 1));
+
+    uint32 x0 = static_cast<uint32>(x);
+    uint32 y0 = static_cast<uint32>(y);
+    uint32 x1 = base_min2(x0 + 1, query_width() - 1);
+    uint32 y1 = base_min2(y0 + 1, query_height() - 1);
+    uint32 weight_x = static_cast<uint32>((x - x0) * (1 << PTCX_SAMPLER_WEIGHT_BITS) + 0.5f);
+    uint32 weight_y = static_cast<uint32>((y - y0) * (1 << PTCX_SAMPLER_WEIGHT_BITS) + 0.5f);
+
+    uint8 texels[4][3];
+
+    if (base_failed(query_sampler_texel(state, x0, y0, texels[0])) ||
+        base_failed(query_sampler_texel(state, x1, y0, texels[1])) ||
+        base_failed(query_sampler_texel(state, x0, y1, texels[2])) ||
+        base_failed(query_sampler_texel(state, x1, y1, texels[3])))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    uint32 unit = 1 << PTCX_SAMPLER_WEIGHT_BITS;
+    uint32 weights[4] = {(unit - weight_x) * (unit - weight_y), weight_x * (unit - weight_y),
+                         (unit - weight_x) * weight_y, weight_x * weight_y};
+
+    for (uint8 c = 0; c < 3; c++)
+    {
+        uint32 total = texels[0][c] * weights[0] + texels[1][c] * weights[1] +
+                       texels[2][c] * weights[2] + texels[3][c] * weights[3];
+
+        color[c] = (total + (1 << (2 * PTCX_SAMPLER_WEIGHT_BITS - 1))) >> (2 * PTCX_SAMPLER_WEIGHT_BITS);
+    }
+
+    return BASE_SUCCESS;
+}
+
+uint32 ptcx_sampler::query_width() const
+{
+    return state ? state->index.context.header.image_width : 0;
+}
+
+uint32 ptcx_sampler::query_height() const
+{
+    return state ? state->index.context.header.image_height : 0;
+}
@@ -0,0 +1,781 @@
+
+#include "ptcx_internal.h"
+
+#define PTCX_MAX_SCALE_SHIFT                     (4)
+
+// Color sums over a grid of cells that covers one band. Cells are as large as an output
+// pixel, but never larger than a macroblock, so that every cell lies within a single
+// macroblock and references may copy the cells of their source.
+typedef struct PTCX_CELL_GRID
+{
+    uint32 cell_width;
+    uint32 cell_height;
+    uint32 cell_width_bits;
+    uint32 cell_height_bits;
+    uint32 row_cells;                           // cells per row of the band
+    std::vector<uint32> sum;                    // three channel sums per cell
+
+} PTCX_CELL_GRID;
+
+uint32 *query_grid_cell(PTCX_CELL_GRID *grid, uint32 x, uint32 y)
+{
+    return &grid->sum[((y >> grid->cell_height_bits) * grid->row_cells + (x >> grid->cell_width_bits)) * 3];
+}
+
+void accumulate_cell_color(uint32 *cell, const uint8 *color, uint32 count)
+{
+    cell[0] += color[0] * count;
+    cell[1] += color[1] * count;
+    cell[2] += color[2] * count;
+}
+
+void accumulate_cell_sum(uint32 *cell, const uint32 *sum, uint32 count, uint32 color_space)
+{
+    // The lifting steps of YCoCg-R are linear apart from their rounding, so decorrelated
+    // sums are converted as a whole, and differ only slightly from the sum of converted
+    // pixels. Saturated colors never reach here (see is_saturated_palette).
+
+    if (PTCX_COLOR_SPACE_YCOCG == color_space)
+    {
+        // Damaged palettes may step outside of a channel, so the sums are first limited 
+        // to those of valid colors.
+
+        int32 limit = 255 * count;
+        int32 co = base_min2(sum[0], (uint32) limit) - 128 * count;
+        int32 cg = base_min2(sum[2], (uint32) limit) - 128 * count;
+        int32 t = base_min2(sum[1], (uint32) limit) - (cg >> 1);
+        int32 g = cg + t;
+        int32 b = t - (co >> 1);
+        int32 r = b + co;
+
+        cell[0] += base_min2(base_max2(r, 0), limit);
+        cell[1] += base_min2(base_max2(g, 0), limit);
+        cell[2] += base_min2(base_max2(b, 0), limit);
+
+        return;
+    }
+
+    cell[0] += sum[0];
+    cell[1] += sum[1];
+    cell[2] += sum[2];
+}
+
+uint32 sum_packed_indices(uint8 packed, uint32 quant_step_bits)
+{
+    // Adds the fields of a byte in parallel, halving the number of fields at each step.
+    uint32 value = packed;
+
+    if (1 == quant_step_bits)
+    {
+        value = (value & 0x55) + ((value >> 1) & 0x55);
+    }
+
+    if (quant_step_bits <= 2)
+    {
+        value = (value & 0x33) + ((value >> 2) & 0x33);
+    }
+
+    return (value & 0x0F) + (value >> 4);
+}
+
+uint32 sum_index_data(const uint8 *data, uint32 byte_count, uint32 quant_step_bits)
+{
+    // As sum_packed_indices, but four bytes at a time. Fields never exceed four bits, so
+    // the byte sums of a word fit within a byte, and a multiply adds them together.
+
+    uint32 total = 0;
+    uint32 offset = 0;
+
+    for (; offset + sizeof(uint32) <= byte_count; offset += sizeof(uint32))
+    {
+        uint32 value;
+        memcpy(&value, data + offset, sizeof(uint32));
+
+        if (1 == quant_step_bits)
+        {
+            value = (value & 0x55555555) + ((value >> 1) & 0x55555555);
+        }
+
+        if (quant_step_bits <= 2)
+        {
+            value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+        }
+
+        value = (value & 0x0F0F0F0F) + ((value >> 4) & 0x0F0F0F0F);
+        total += (value * 0x01010101) >> 24;
+    }
+
+    for (; offset < byte_count; offset++)
+    {
+        total += sum_packed_indices(data[offset], quant_step_bits);
+    }
+
+    return total;
+}
+
+bool is_saturated_palette(const PTCX_PALETTE_RANGE &palette_range, uint32 quant_step_mask)
+{
+    // Palettes step linearly between their first and last colors, so only those need be
+    // tested against the range of RGB.
+
+    uint8 first[3];
+    uint8 last[3];
+
+    for (uint8 c = 0; c < 3; c++)
+    {
+        first[c] = palette_range.min_value[c];
+        last[c] = palette_range.min_value[c] + palette_range.range_delta[c] / quant_step_mask * quant_step_mask;
+    }
+
+    return !is_correlated_range(first) || !is_correlated_range(last);
+}
+
+void accumulate_palette_pixels(const PTCX_PALETTE_RANGE &palette_range, uint32 block_width, uint32 block_height, uint32 quant_step_bits,
+                               const uint8 *index_data, PTCX_CELL_GRID *grid, uint32 start_x, uint32 start_y)
+{
+    uint32 quant_step_mask = (1 << quant_step_bits) - 1;
+    uint8 palette[1 << PTCX_MAX_QUANT_STEP_BITS][3];
+
+    for (uint32 step_value = 0; step_value <= quant_step_mask; step_value++)
+    {
+        for (uint8 c = 0; c < 3; c++)
+        {
+            palette[step_value][c] = palette_range.min_value[c] + palette_range.range_delta[c] / quant_step_mask * step_value;
+        }
+
+        correlate_color(palette[step_value], palette[step_value]);
+    }
+
+    uint32 bit_offset = 0;
+
+    for (uint32 subj = 0; subj < block_height; subj++)
+    for (uint32 subi = 0; subi < block_width; subi++, bit_offset += quant_step_bits)
+    {
+        uint32 step_value = (index_data[bit_offset >> 3] >> (bit_offset & 7)) & quant_step_mask;
+        accumulate_cell_color(query_grid_cell(grid, start_x + subi, start_y + subj), palette[step_value], 1);
+    }
+}
+
+status accumulate_microblock(const PTCX_FILE_HEADER &header, uint32 block_width, uint32 block_height, uint32 quant_step_bits,
+                             uint32 color_space, PTCX_BAND_CURSOR *cursor, PTCX_CELL_GRID *grid, uint32 start_x, uint32 start_y)
+{
+    uint32 quant_step_mask = (1 << quant_step_bits) - 1;
+    uint32 control_bytes = (header.quant_control_bits << 1) >> 3;
+    uint32 index_bytes = (block_width * block_height * quant_step_bits + 7) >> 3;
+
+    if (cursor->control + control_bytes > cursor->control_end)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    bool is_solid = is_solid_microblock(header, cursor->control);
+
+    if (is_solid)
+    {
+        index_bytes = 0;
+    }
+
+    if (cursor->index + index_bytes > cursor->index_end)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    PTCX_PIXEL_RANGE range = {{255, 255, 255}, {0, 0, 0}};
+
+    unpack_control_values(cursor->control, header, &range);
+    cursor->control += control_bytes;
+
+    // Cells and microblocks are aligned powers of two, so the microblock either lies
+    // within a single cell or is evenly divided into whole cells.
+
+    uint32 region_width = base_min2(block_width, grid->cell_width);
+    uint32 region_height = base_min2(block_height, grid->cell_height);
+
+    if (is_solid)
+    {
+        uint8 color[3] = {range.min_value[0], range.min_value[1], range.min_value[2]};
+
+        if (PTCX_COLOR_SPACE_YCOCG == color_space)
+        {
+            correlate_color(color, color);
+        }
+
+        for (uint32 region_y = 0; region_y < block_height; region_y += region_height)
+        for (uint32 region_x = 0; region_x < block_width; region_x += region_width)
+        {
+            accumulate_cell_color(query_grid_cell(grid, start_x + region_x, start_y + region_y), color, region_width * region_height);
+        }
+
+        return BASE_SUCCESS;
+    }
+
+    PTCX_PALETTE_RANGE palette_range;
+
+    expand_palette_range(range, &palette_range);
+
+    const uint8 *index_data = cursor->index;
+
+    // Each palette entry is min + step * index, so the colors of a cell sum to a
+    // multiple of min plus a multiple of step by the sum of its indices. We sum the
+    // indices a field at a time, where a field is the part of a byte that lies within
+    // a single cell and row.
+
+    uint32 field_pixels = base_min2(8 / quant_step_bits, region_width);
+    uint32 field_bits = field_pixels * quant_step_bits;
+    uint32 field_mask = (1 << field_bits) - 1;
+    uint32 region_fields = region_width / field_pixels;
+    uint32 region_height_bits = log2(region_height);
+    uint32 region_columns = block_width / region_width;
+    uint32 region_base[3];
+    uint32 index_sum[(PTCX_MAX_BLOCK_SIZE / PTCX_MIN_BLOCK_SIZE) * (PTCX_MAX_BLOCK_SIZE / PTCX_MIN_BLOCK_SIZE)];
+    uint32 bit_offset = 0;
+    int32 step[3];
+
+    for (uint8 c = 0; c < 3; c++)
+    {
+        region_base[c] = palette_range.min_value[c] * region_width * region_height;
+        step[c] = palette_range.range_delta[c] / quant_step_mask;
+    }
+
+    // A decorrelated palette is linear in RGB unless its colors saturate, and those are 
+    // clamped pixel by pixel, so we sum the colors of its pixels rather than its indices.
+
+    if (PTCX_COLOR_SPACE_YCOCG == color_space && is_saturated_palette(palette_range, quant_step_mask))
+    {
+        accumulate_palette_pixels(palette_range, block_width, block_height, quant_step_bits, index_data, grid, start_x, start_y);
+        cursor->index += index_bytes;
+
+        return BASE_SUCCESS;
+    }
+
+    // Once cells are at least as large as the microblock, every index lies within the 
+    // same cell and we sum the index data whole.
+
+    if (region_width == block_width && region_height == block_height)
+    {
+        uint32 total = sum_index_data(index_data, index_bytes, quant_step_bits);
+        uint32 sum[3];
+
+        for (uint8 c = 0; c < 3; c++)
+        {
+            sum[c] = region_base[c] + step[c] * total;
+        }
+
+        accumulate_cell_sum(query_grid_cell(grid, start_x, start_y), sum, block_width * block_height, color_space);
+
+        cursor->index += index_bytes;
+
+        return BASE_SUCCESS;
+    }
+
+    memset(index_sum, 0, region_columns * (block_height / region_height) * sizeof(uint32));
+
+    for (uint32 subj = 0; subj < block_height; subj++)
+    {
+        uint32 *row_sum = index_sum + (subj >> region_height_bits) * region_columns;
+
+        for (uint32 region = 0; region < region_columns; region++)
+        {
+            uint32 total = 0;
+
+            for (uint32 field = 0; field < region_fields; field++, bit_offset += field_bits)
+            {
+                total += sum_packed_indices((index_data[bit_offset >> 3] >> (bit_offset & 7)) & field_mask, quant_step_bits);
+            }
+
+            row_sum[region] += total;
+        }
+    }
+
+    const uint32 *region_sum = index_sum;
+
+    for (uint32 region_y = 0; region_y < block_height; region_y += region_height)
+    for (uint32 region_x = 0; region_x < block_width; region_x += region_width, region_sum++)
+    {
+        uint32 sum[3];
+
+        for (uint8 c = 0; c < 3; c++)
+        {
+            sum[c] = region_base[c] + step[c] * (*region_sum);
+        }
+
+        accumulate_cell_sum(query_grid_cell(grid, start_x + region_x, start_y + region_y), sum, region_width * region_height, color_space);
+    }
+
+    cursor->index += index_bytes;
+
+    return BASE_SUCCESS;
+}
+
+bool is_planar_clamped(const PTCX_PLANAR_COLORS &colors, uint32 width_bits, uint32 height_bits, uint32 color_space)
+{
+    // Planes are linear, so they leave the range of a channel only where a corner does,
+    // and likewise for the range of RGB after a decorrelated plane is converted.
+
+    uint32 area_bits = width_bits + height_bits;
+    int32 corner_x[2] = {0, ((1 << width_bits) - 1) << height_bits};
+    int32 corner_y[2] = {0, ((1 << height_bits) - 1) << width_bits};
+
+    for (uint8 corner = 0; corner < 4; corner++)
+    {
+        uint8 color[3];
+
+        for (uint8 c = 0; c < 3; c++)
+        {
+            int32 origin = colors.origin[c];
+            int32 value = (origin << area_bits) + 
+                          (colors.horizontal[c] - origin) * corner_x[corner & 1] +
+                          (colors.vertical[c] - origin) * corner_y[corner >> 1] + 
+                          ((1 << area_bits) >> 1);
+
+            if (value < 0 || value >= (256 << area_bits))
+            {
+                return true;
+            }
+
+            color[c] = value >> area_bits;
+        }
+
+        if (PTCX_COLOR_SPACE_YCOCG == color_space && !is_correlated_range(color))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+status accumulate_planar_microblock(uint32 block_width, uint32 block_height, uint32 color_space, PTCX_BAND_CURSOR *cursor, PTCX_CELL_GRID *grid,
+                                    uint32 start_x, uint32 start_y)
+{
+    if (cursor->control + PTCX_PLANAR_CONTROL_SIZE > cursor->control_end)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    PTCX_PLANAR_COLORS colors;
+
+    unpack_planar_colors(cursor->control, &colors);
+    cursor->control += PTCX_PLANAR_CONTROL_SIZE;
+
+    uint32 width_bits = log2(block_width);
+    uint32 height_bits = log2(block_height);
+    uint32 area_bits = width_bits + height_bits;
+
+    // Pixels of a plane that leaves the range of a channel, or of RGB, are clamped 
+    // individually, so we evaluate each of them.
+
+    if (is_planar_clamped(colors, width_bits, height_bits, color_space))
+    {
+        for (uint32 subj = 0; subj < block_height; subj++)
+        for (uint32 subi = 0; subi < block_width; subi++)
+        {
+            uint8 color[3];
+
+            for (uint8 c = 0; c < 3; c++)
+            {
+                color[c] = evaluate_planar_color(colors, c, width_bits, height_bits, subi, subj);
+            }
+
+            if (PTCX_COLOR_SPACE_YCOCG == color_space)
+            {
+                correlate_color(color, color);
+            }
+
+            accumulate_cell_color(query_grid_cell(grid, start_x + subi, start_y + subj), color, 1);
+        }
+
+        return BASE_SUCCESS;
+    }
+
+    // Otherwise the mean of the plane over a cell is its value at the center of the cell, 
+    // which may fall between pixels, so plane values are held over twice the block area.
+    // This ignores the rounding of individual pixels, which differs only slightly from 
+    // that of the mean.
+
+    uint32 region_width = base_min2(block_width, grid->cell_width);
+    uint32 region_height = base_min2(block_height, grid->cell_height);
+    uint32 sum_shift = area_bits + 1 - log2(region_width) - log2(region_height);
+
+    for (uint32 region_y = 0; region_y < block_height; region_y += region_height)
+    for (uint32 region_x = 0; region_x < block_width; region_x += region_width)
+    {
+        int32 center_x = 2 * region_x + region_width - 1;
+        int32 center_y = 2 * region_y + region_height - 1;
+        uint32 sum[3];
+
+        for (uint8 c = 0; c < 3; c++)
+        {
+            int32 origin = colors.origin[c];
+            int32 value = (origin << (area_bits + 1)) + 
+                          (colors.horizontal[c] - origin) * (center_x << height_bits) +
+                          (colors.vertical[c] - origin) * (center_y << width_bits);
+
+            sum[c] = (value + (1 << (sum_shift - 1))) >> sum_shift;
+        }
+
+        accumulate_cell_sum(query_grid_cell(grid, start_x + region_x, start_y + region_y), sum, region_width * region_height, color_space);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status accumulate_codebook_microblock(const PTCX_FILE_CONTEXT &context, uint32 block_width, uint32 block_height, uint32 color_space,
+                                      PTCX_BAND_CURSOR *cursor, PTCX_CELL_GRID *grid, uint32 start_x, uint32 start_y)
+{
+    const PTCX_FILE_HEADER &header = context.header;
+    uint32 control_bytes = (header.quant_control_bits << 1) >> 3;
+
+    if (cursor->control + control_bytes > cursor->control_end)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    if (is_solid_microblock(header, cursor->control))
+    {
+        return accumulate_microblock(header, block_width, block_height, header.quant_step_bits, color_space, cursor, grid, start_x, start_y);
+    }
+
+    uint8 indices[PTCX_MAX_INDEX_DATA_SIZE];
+    PTCX_BAND_CURSOR tile_cursor = *cursor;
+
+    if (base_failed(expand_codebook_indices(header, context.codebook, block_width, block_height, &cursor->index, cursor->index_end, indices)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    tile_cursor.index = indices;
+    tile_cursor.index_end = indices + ((block_width * block_height * header.quant_step_bits) >> 3);
+
+    if (base_failed(accumulate_microblock(header, block_width, block_height, header.quant_step_bits, color_space, &tile_cursor, grid, start_x, start_y)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    cursor->control = tile_cursor.control;
+
+    return BASE_SUCCESS;
+}
+
+status accumulate_reference_macroblock(const PTCX_FILE_HEADER &header, uint32 block_index, PTCX_BAND_CURSOR *cursor, PTCX_CELL_GRID *grid,
+                                       uint32 start_x, uint32 start_y)
+{
+    uint32 distance = 0;
+
+    if (cursor->control + PTCX_REFERENCE_CONTROL_SIZE > cursor->control_end ||
+        base_failed(read_reference_distance(cursor->control, block_index, &distance)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    cursor->control += PTCX_REFERENCE_CONTROL_SIZE;
+
+    // The referenced macroblock has already been accumulated, and covers whole cells.
+
+    uint32 blocks_per_row = header.image_width / header.block_width;
+    uint32 source_index = block_index - distance;
+    uint32 source_x = (source_index % blocks_per_row) * header.block_width;
+    uint32 source_y = start_y - (block_index / blocks_per_row - source_index / blocks_per_row) * header.block_height;
+
+    for (uint32 subj = 0; subj < header.block_height; subj += grid->cell_height)
+    for (uint32 subi = 0; subi < header.block_width; subi += grid->cell_width)
+    {
+        memcpy(query_grid_cell(grid, start_x + subi, start_y + subj), query_grid_cell(grid, source_x + subi, source_y + subj), 3 * sizeof(uint32));
+    }
+
+    return BASE_SUCCESS;
+}
+
+status accumulate_band(const PTCX_FILE_CONTEXT &context, const PTCX_BAND_DATA &band, PTCX_CELL_GRID *grid)
+{
+    const PTCX_FILE_HEADER &header = context.header;
+    uint32 block_index = 0;
+    PTCX_BAND_CURSOR cursor;
+
+    cursor.control = band.control.data();
+    cursor.control_end = cursor.control + band.control.size();
+    cursor.index = band.index.data();
+    cursor.index_end = cursor.index + band.index.size();
+
+    memset(grid->sum.data(), 0, grid->sum.size() * sizeof(uint32));
+
+    for (uint32 j = 0; j < header.band_height; j += header.block_height)
+    for (uint32 i = 0; i < header.image_width; i += header.block_width)
+    {
+        PTCX_PARTITION_REGION regions[PTCX_MAX_PARTITION_REGIONS];
+        PTCX_MACROBLOCK_ENTRY entry;
+
+        if (base_failed(read_macroblock_entry(header, band.table.data(), block_index++, &entry)))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+
+        if (PTCX_BLOCK_MODE_REFERENCE == entry.mode)
+        {
+            if (base_failed(accumulate_reference_macroblock(header, block_index - 1, &cursor, grid, i, j)))
+            {
+                return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+            }
+
+            continue;
+        }
+
+        uint32 region_count = query_partition_regions(header, entry, regions);
+
+        for (uint32 r = 0; r < region_count; r++)
+        for (uint32 micro_j = regions[r].y; micro_j < regions[r].y + regions[r].height; micro_j += regions[r].micro_height)
+        for (uint32 micro_i = regions[r].x; micro_i < regions[r].x + regions[r].width; micro_i += regions[r].micro_width)
+        {
+            uint32 micro_width = regions[r].micro_width;
+            uint32 micro_height = regions[r].micro_height;
+            status result = BASE_SUCCESS;
+
+            if (PTCX_BLOCK_MODE_PLANAR == entry.mode)
+            {
+                result = accumulate_planar_microblock(micro_width, micro_height, entry.color_space, &cursor, grid, i + micro_i, j + micro_j);
+            }
+            else if (PTCX_BLOCK_MODE_CODEBOOK == entry.mode)
+            {
+                result = accumulate_codebook_microblock(context, micro_width, micro_height, entry.color_space, &cursor, grid, i + micro_i, j + micro_j);
+            }
+            else
+            {
+                result = accumulate_microblock(header, micro_width, micro_height, entry.quant_step_bits, entry.color_space, &cursor, grid, i + micro_i, j + micro_j);
+            }
+
+            if (base_failed(result))
+            {
+                return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+            }
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+void resolve_band(const PTCX_FILE_HEADER &header, PTCX_CELL_GRID *grid, uint32 scale_shift, image *output, uint32 dest_y)
+{
+    uint32 scale = 1 << scale_shift;
+    uint32 band_rows = header.band_height >> scale_shift;
+
+    for (uint32 j = 0; j < band_rows; j++)
+    for (uint32 i = 0; i < output->query_width(); i++)
+    {
+        uint32 total[3] = {0};
+        uint8 *dest_pixel = output->query_data() + output->query_block_offset(i, dest_y + j);
+
+        for (uint32 subj = 0; subj < scale; subj += grid->cell_height)
+        for (uint32 subi = 0; subi < scale; subi += grid->cell_width)
+        {
+            const uint32 *cell = query_grid_cell(grid, (i << scale_shift) + subi, (j << scale_shift) + subj);
+
+            total[0] += cell[0];
+            total[1] += cell[1];
+            total[2] += cell[2];
+        }
+
+        for (uint8 c = 0; c < 3; c++)
+        {
+            dest_pixel[c] = (total[c] + ((scale * scale) >> 1)) >> (scale_shift << 1);
+        }
+    }
+}
+
+status inverse_quantize_scaled(stream *input, const PTCX_FILE_CONTEXT &context, uint32 scale_shift, image *output)
+{
+    const PTCX_FILE_HEADER &header = context.header;
+    PTCX_BAND_DATA band;
+    PTCX_CELL_GRID grid;
+
+    grid.cell_width = base_min2(1u << scale_shift, (uint32) header.block_width);
+    grid.cell_height = base_min2(1u << scale_shift, (uint32) header.block_height);
+    grid.cell_width_bits = log2(grid.cell_width);
+    grid.cell_height_bits = log2(grid.cell_height);
+    grid.row_cells = header.image_width / grid.cell_width;
+    grid.sum.resize(grid.row_cells * (header.band_height / grid.cell_height) * 3);
+
+    for (uint32 j = 0; j < header.image_height; j += header.band_height)
+    {
+        if (base_failed(read_band(input, context, &band)) || base_failed(accumulate_band(context, band, &grid)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+
+        resolve_band(header, &grid, scale_shift, output, j >> scale_shift);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status reduce_image(const image &input, uint32 scale_shift, image *output)
+{
+    // Halving repeatedly would round at every octave, so larger scales average each
+    // square of pixels at once. This matches the rounding of resolve_band exactly.
+
+    if (1 == scale_shift)
+    {
+        return downsample_image(input, output);
+    }
+
+    uint32 scale = 1 << scale_shift;
+
+    for (uint32 j = 0; j < output->query_height(); j++)
+    for (uint32 i = 0; i < output->query_width(); i++)
+    {
+        uint32 total[3] = {0};
+
+        for (uint32 subj = 0; subj < scale; subj++)
+        {
+            const uint8 *src_data = input.query_data() + input.query_block_offset(i << scale_shift, (j << scale_shift) + subj);
+
+            for (uint32 subi = 0; subi < scale * 3; subi += 3)
+            {
+                total[0] += src_data[subi + 0];
+                total[1] += src_data[subi + 1];
+                total[2] += src_data[subi + 2];
+            }
+        }
+
+        uint8 *dest_data = output->query_data() + output->query_block_offset(i, j);
+
+        for (uint8 c = 0; c < 3; c++)
+        {
+            dest_data[c] = (total[c] + (scale * scale >> 1)) >> (scale_shift << 1);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+status downsample_decoded_bands(stream *input, const PTCX_FILE_CONTEXT &context, uint32 scale_shift, image *output)
+{
+    const PTCX_FILE_HEADER &header = context.header;
+    PTCX_BAND_DATA band;
+    image band_image;
+    image band_rows;
+
+    if (base_failed(create_image(IGN_IMAGE_FORMAT_R8G8B8, header.image_width, header.band_height, &band_image)))
+    {
+        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+    }
+
+    // Each band is decoded into a scratch image, and reduced directly into the output rows
+    // that it covers.
+
+    for (uint32 j = 0; j < header.image_height; j += header.band_height)
+    {
+        uint8 *row_data = output->query_data() + output->query_block_offset(0, j >> scale_shift);
+
+        if (base_failed(read_band(input, context, &band)) || 
+            base_failed(decode_band(context, band, &band_image, 0)) ||
+            base_failed(create_image(IGN_IMAGE_FORMAT_R8G8B8, row_data, header.image_width >> scale_shift, 
+                                     header.band_height >> scale_shift, &band_rows)) ||
+            base_failed(reduce_image(band_image, scale_shift, &band_rows)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+status downsample_decoded_image(stream *input, const PTCX_FILE_CONTEXT &context, uint32 scale_shift, image *output)
+{
+    const PTCX_FILE_HEADER &header = context.header;
+    image full_image;
+
+    // Files whose bands do not divide into whole output rows take the slow path, and are
+    // decoded in full before they are reduced.
+
+    if (base_failed(create_image(IGN_IMAGE_FORMAT_R8G8B8, header.image_width, header.image_height, &full_image)) ||
+        base_failed(decode_image(input, context, &full_image)) ||
+        base_failed(reduce_image(full_image, scale_shift, output)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status load_ptcx_scaled(stream *input, uint32 scale_shift, image *output)
+{
+    PTCX_FILE_CONTEXT context;
+    const PTCX_FILE_HEADER &pxh = context.header;
+
+    if (BASE_PARAM_CHECK)
+    {
+        if (!input || !output || input->is_empty())
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    if (scale_shift > PTCX_MAX_SCALE_SHIFT)
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    if (base_failed(read_header(input, &context.header)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    // Mip chains already hold reduced levels, so we begin from the smallest level that
+    // is no smaller than the output, and reduce only what remains.
+
+    if (pxh.flags & PTCX_FLAG_MIP_CHAIN)
+    {
+        uint32 level = base_min2(scale_shift, (uint32) pxh.image_depth - 1);
+
+        if (base_failed(seek_mip_level(input, pxh, level)) ||
+            base_failed(read_header(input, &context.header)) ||
+            (pxh.flags & PTCX_FLAG_MIP_CHAIN))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+
+        scale_shift -= level;
+    }
+
+    if (base_failed(read_file_models(input, &context)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    uint32 scale = 1 << scale_shift;
+
+    if (pxh.image_width < scale || pxh.image_height < scale)
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    if (base_failed(create_image(IGN_IMAGE_FORMAT_R8G8B8, pxh.image_width >> scale_shift, pxh.image_height >> scale_shift, output)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    if (0 == scale_shift)
+    {
+        return decode_image(input, context, output);
+    }
+
+    if (PTCX_LEGACY_VERSION == pxh.version || pxh.image_width % scale || pxh.band_height % scale)
+    {
+        return downsample_decoded_image(input, context, scale_shift, output);
+    }
+
+    // At half scale every cell holds only four pixels, and decoding each band followed by
+    // a box filter is faster than summing the indices of every cell.
+
+    if (1 == scale_shift)
+    {
+        return downsample_decoded_bands(input, context, scale_shift, output);
+    }
+
+    if (base_failed(inverse_quantize_scaled(input, context, scale_shift, output)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    return BASE_SUCCESS;
+}
@@ -0,0 +1,344 @@
+
+#include "ptcx_internal.h"
+
+struct PTCX_SEQUENCE_WRITER_STATE
+{
+    uint32 width;
+    uint32 height;
+    uint8 quality;
+    uint32 options;
+
+    image previous_frame;
+    std::vector<std::vector<uint8> > frames;
+};
+
+struct PTCX_SEQUENCE_STATE
+{
+    std::vector<uint8> data;
+    std::vector<uint32> frame_offsets;
+    std::vector<uint32> frame_sizes;
+
+    image frame;
+    uint32 current_frame;                       // the frame held by the frame buffer, if any
+};
+
+status read_sequence(stream *input, PTCX_SEQUENCE_STATE *state, PTCX_SEQUENCE_HEADER *header)
+{
+    if (base_failed(read_stream_data(input, header, sizeof(PTCX_SEQUENCE_HEADER))))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    if (PTCX_SEQUENCE_MAGIC_VALUE != header->magic || PTCX_SEQUENCE_VERSION != header->version ||
+        sizeof(PTCX_SEQUENCE_HEADER) != header->header_size || 0 == header->frame_count ||
+        0 == header->image_width || 0 == header->image_height)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    // Reject frame counts that the stream cannot possibly hold before allocating the table.
+    if (header->frame_count > input->query_occupancy() / sizeof(uint32))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    state->frame_sizes.resize(header->frame_count);
+    state->frame_offsets.resize(header->frame_count);
+
+    if (base_failed(read_stream_data(input, state->frame_sizes.data(), header->frame_count * sizeof(uint32))))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    uint64 total_size = 0;
+
+    for (uint32 i = 0; i < header->frame_count; i++)
+    {
+        if (state->frame_sizes[i] < sizeof(PTCX_FILE_HEADER))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+
+        state->frame_offsets[i] = static_cast<uint32>(total_size);
+        total_size += state->frame_sizes[i];
+    }
+
+    if (total_size > input->query_occupancy())
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    state->data.resize(static_cast<uint32>(total_size));
+
+    if (base_failed(read_stream_data(input, state->data.data(), state->data.size())))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status apply_sequence_frame(PTCX_SEQUENCE_STATE *state, uint32 frame)
+{
+    // Only the macroblocks that changed since the previous frame carry microblocks, so
+    // decoding a frame over its predecessor touches only those macroblocks. The first
+    // frame must be complete.
+
+    buffer_stream input(state->data.data() + state->frame_offsets[frame], state->frame_sizes[frame]);
+    uint32 supported_flags = frame ? (PTCX_SUPPORTED_FLAGS | PTCX_FLAG_KEPT_BLOCKS) : PTCX_SUPPORTED_FLAGS;
+
+    return decode_delta(&input, supported_flags, &state->frame);
+}
+
+ptcx_sequence_writer::ptcx_sequence_writer()
+{
+    state = 0;
+}
+
+ptcx_sequence_writer::~ptcx_sequence_writer()
+{
+    delete state;
+}
+
+status ptcx_sequence_writer::begin(uint32 width, uint32 height, uint8 quality, uint32 options)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (0 == width || 0 == height)
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    if (width > BASE_MAX_UINT16 || height > BASE_MAX_UINT16)
+    {
+        return BASE_ERROR_INVALID_RESOURCE;
+    }
+
+    delete state;
+    state = new PTCX_SEQUENCE_WRITER_STATE;
+
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+    }
+
+    state->width = width;
+    state->height = height;
+    state->quality = quality;
+    state->options = options;
+
+    return BASE_SUCCESS;
+}
+
+status ptcx_sequence_writer::add_frame(const image &frame)
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_NOT_READY);
+    }
+
+    if (IGN_IMAGE_FORMAT_R8G8B8 != frame.query_image_format() || !frame.query_data() ||
+        frame.query_width() != state->width || frame.query_height() != state->height)
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    file_buffer_stream frame_stream;
+    const image *previous = state->frames.empty() ? 0 : &state->previous_frame;
+
+    status result = save_ptcx_delta(frame, previous, 0, state->quality, state->options, &frame_stream);
+
+    if (base_failed(result))
+    {
+        return result;
+    }
+
+    // Each frame is compared against the source pixels of the frame before it, so we keep
+    // a copy of them until the next frame is added.
+
+    if (base_failed(clone_image(frame, &state->previous_frame)))
+    {
+        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+    }
+
+    state->frames.push_back(std::vector<uint8>(frame_stream.query_data(), frame_stream.query_data() + frame_stream.query_occupancy()));
+
+    return BASE_SUCCESS;
+}
+
+status ptcx_sequence_writer::write(stream *output)
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_NOT_READY);
+    }
+
+    if (BASE_PARAM_CHECK)
+    {
+        if (!output || output->is_full())
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    if (state->frames.empty())
+    {
+        return BASE_ERROR_NOT_READY;
+    }
+
+    PTCX_SEQUENCE_HEADER header;
+    std::vector<uint32> frame_sizes(state->frames.size());
+    uint64 total_size = sizeof(PTCX_SEQUENCE_HEADER) + frame_sizes.size() * sizeof(uint32);
+
+    for (uint32 i = 0; i < state->frames.size(); i++)
+    {
+        frame_sizes[i] = state->frames[i].size();
+        total_size += frame_sizes[i];
+    }
+
+    if (total_size > BASE_MAX_UINT32)
+    {
+        return base_post_error(BASE_ERROR_CAPACITY_LIMIT);
+    }
+
+    header.magic = PTCX_SEQUENCE_MAGIC_VALUE;
+    header.version = PTCX_SEQUENCE_VERSION;
+    header.header_size = sizeof(PTCX_SEQUENCE_HEADER);
+    header.frame_count = state->frames.size();
+    header.image_width = state->width;
+    header.image_height = state->height;
+
+    if (base_failed(write_stream_data(output, &header, sizeof(PTCX_SEQUENCE_HEADER))) ||
+        base_failed(write_stream_data(output, frame_sizes.data(), frame_sizes.size() * sizeof(uint32))))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    for (uint32 i = 0; i < state->frames.size(); i++)
+    {
+        if (base_failed(write_stream_data(output, state->frames[i].data(), state->frames[i].size())))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+uint32 ptcx_sequence_writer::query_frame_count() const
+{
+    return state ? state->frames.size() : 0;
+}
+
+ptcx_sequence::ptcx_sequence()
+{
+    state = 0;
+}
+
+ptcx_sequence::~ptcx_sequence()
+{
+    delete state;
+}
+
+status ptcx_sequence::load(stream *input)
+{
+    return load(input, IGN_IMAGE_LAYOUT_LINEAR);
+}
+
+status ptcx_sequence::load(stream *input, IGN_IMAGE_LAYOUT layout)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!input || input->is_empty())
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    delete state;
+    state = new PTCX_SEQUENCE_STATE;
+
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+    }
+
+    PTCX_SEQUENCE_HEADER header;
+
+    if (base_failed(read_sequence(input, state, &header)) ||
+        base_failed(create_image(IGN_IMAGE_FORMAT_R8G8B8, layout, header.image_width, header.image_height, &state->frame)))
+    {
+        delete state;
+        state = 0;
+
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    state->current_frame = BASE_MAX_UINT32;
+
+    return BASE_SUCCESS;
+}
+
+status ptcx_sequence::decode_frame(uint32 frame)
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_NOT_READY);
+    }
+
+    if (frame >= query_frame_count())
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    if (frame == state->current_frame)
+    {
+        return BASE_SUCCESS;
+    }
+
+    // Later frames are applied over the frame buffer one after another. Moving backward
+    // begins again from the first frame, which is complete.
+
+    uint32 first_frame = (BASE_MAX_UINT32 != state->current_frame && frame > state->current_frame) ? state->current_frame + 1 : 0;
+
+    for (uint32 i = first_frame; i <= frame; i++)
+    {
+        if (base_failed(apply_sequence_frame(state, i)))
+        {
+            // The frame buffer now holds a partial frame.
+            state->current_frame = BASE_MAX_UINT32;
+
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+
+        state->current_frame = i;
+    }
+
+    return BASE_SUCCESS;
+}
+
+const image *ptcx_sequence::query_frame() const
+{
+    return (state && BASE_MAX_UINT32 != state->current_frame) ? &state->frame : 0;
+}
+
+uint32 ptcx_sequence::query_frame_index() const
+{
+    return state ? state->current_frame : BASE_MAX_UINT32;
+}
+
+uint32 ptcx_sequence::query_frame_count() const
+{
+    return state ? state->frame_sizes.size() : 0;
+}
+
+uint32 ptcx_sequence::query_width() const
+{
+    return state ? state->frame.query_width() : 0;
+}
+
+uint32 ptcx_sequence::query_height() const
+{
+    return state ? state->frame.query_height() : 0;
+}
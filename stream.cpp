@@ -2,6 +2,31 @@
 
 namespace base {
 
+status stream::skip_data(uint32 size, uint32 *bytes_skipped)
+{
+    uint8 scratch[256];
+    uint32 total_skipped = 0;
+
+    while (total_skipped < size)
+    {
+        uint32 bytes_read = 0;
+
+        if (base_failed(read_data(scratch, min(size - total_skipped, (uint32) sizeof(scratch)), &bytes_read)) || !bytes_read)
+        {
+            break;
+        }
+
+        total_skipped += bytes_read;
+    }
+
+    if (bytes_skipped)
+    {
+        *bytes_skipped = total_skipped;
+    }
+
+    return (total_skipped == size) ? BASE_SUCCESS : BASE_ERROR_INVALID_RESOURCE;
+}
+
 memory_stream::memory_stream() {}
 memory_stream::~memory_stream() {}
 
@@ -102,6 +127,24 @@ status memory_stream::write_data(void *input, uint32 size, uint32 *bytes_written
     return BASE_SUCCESS;
 }
 
+status memory_stream::skip_data(uint32 size, uint32 *bytes_skipped)
+{
+    // Our data is resident, so we simply move the read position.
+    uint32 internal_to_skip = min(size, data.query_occupancy());
+
+    if (internal_to_skip)
+    {
+        data.advance_read_position(internal_to_skip);
+    }
+
+    if (bytes_skipped)
+    {
+        *bytes_skipped = internal_to_skip;
+    }
+
+    return (internal_to_skip == size) ? BASE_SUCCESS : BASE_ERROR_INVALID_RESOURCE;
+}
+
 void *memory_stream::query_write_pointer() const
 {
     uint32 write_index = data.query_write_position();
@@ -124,4 +167,88 @@ void memory_stream::advance_read_pointer(uint32 amount)
     data.advance_read_position(amount);
 }
 
+buffer_stream::buffer_stream(const void *buffer, uint32 size)
+{
+    data = static_cast<const uint8 *>(buffer);
+    data_size = size;
+    read_index = 0;
+}
+
+buffer_stream::~buffer_stream() {}
+
+void buffer_stream::empty()
+{
+    read_index = data_size;
+}
+
+bool buffer_stream::is_full() const
+{
+    return true;
+}
+
+bool buffer_stream::is_empty() const
+{
+    return read_index == data_size;
+}
+
+uint32 buffer_stream::query_occupancy() const
+{
+    return data_size - read_index;
+}
+
+const void *buffer_stream::query_read_pointer() const
+{
+    return data + read_index;
+}
+
+status buffer_stream::read_data(void *output, uint32 size, uint32 *bytes_read)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!output || 0 == size)
+        {
+            return base_post_error(BASE_ERROR_INVALIDARG);
+        }
+    }
+
+    uint32 internal_to_read = min(size, query_occupancy());
+
+    if (internal_to_read)
+    {
+        memcpy(output, data + read_index, internal_to_read);
+        read_index += internal_to_read;
+    }
+
+    if (bytes_read)
+    {
+        *bytes_read = internal_to_read;
+    }
+
+    return internal_to_read ? BASE_SUCCESS : BASE_ERROR_INVALID_RESOURCE;
+}
+
+status buffer_stream::write_data(void *, uint32, uint32 *bytes_written)
+{
+    if (bytes_written)
+    {
+        *bytes_written = 0;
+    }
+
+    return BASE_ERROR_PERMISSION_DENIED;
+}
+
+status buffer_stream::skip_data(uint32 size, uint32 *bytes_skipped)
+{
+    uint32 internal_to_skip = min(size, query_occupancy());
+
+    read_index += internal_to_skip;
+
+    if (bytes_skipped)
+    {
+        *bytes_skipped = internal_to_skip;
+    }
+
+    return (internal_to_skip == size) ? BASE_SUCCESS : BASE_ERROR_INVALID_RESOURCE;
+}
+
 } // namespace base
@@ -51,6 +51,11 @@ public:
 
     virtual status read_data(void *output, uint32 size, uint32 *bytes_read = 0) = 0;
     virtual status write_data(void *input, uint32 size, uint32 *bytes_written = 0) = 0;
+
+    // Discards the next size bytes of the stream. The default implementation reads into
+    // a small scratch buffer, and streams that can seek should override it.
+
+    virtual status skip_data(uint32 size, uint32 *bytes_skipped = 0);
 };
 
 class memory_stream : public stream
@@ -83,6 +88,37 @@ public:
 
     virtual status read_data(void *output, uint32 size, uint32 *bytes_read = 0);
     virtual status write_data(void *input, uint32 size, uint32 *bytes_written = 0);
+    virtual status skip_data(uint32 size, uint32 *bytes_skipped = 0);
+};
+
+// A read only stream over memory owned by the caller, such as a mapped file, which must
+// outlive the stream. Reads copy directly out of that memory, with no intermediate buffer,
+// and the stream is always full.
+
+class buffer_stream : public stream
+{
+    BASE_DISABLE_COPY_AND_ASSIGN(buffer_stream);
+
+    const uint8 *data;
+    uint32 data_size;
+    uint32 read_index;
+
+public:
+
+    buffer_stream(const void *buffer, uint32 size);
+    virtual ~buffer_stream();
+
+    virtual void empty();
+    virtual bool is_full() const;
+    virtual bool is_empty() const;
+
+    virtual uint32 query_occupancy() const;
+
+    virtual const void *query_read_pointer() const;
+
+    virtual status read_data(void *output, uint32 size, uint32 *bytes_read = 0);
+    virtual status write_data(void *input, uint32 size, uint32 *bytes_written = 0);
+    virtual status skip_data(uint32 size, uint32 *bytes_skipped = 0);
 };
 
 } // namespace base
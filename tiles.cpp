@@ -0,0 +1,648 @@
+
+#include "ptcx_internal.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+typedef std::chrono::steady_clock tile_clock;
+
+// A queued decode. Requests that are cancelled or reprioritized leave their older tasks
+// in the queues, which are recognized by their sequence and skipped.
+typedef struct PTCX_TILE_TASK
+{
+    uint64 key;
+    uint64 sequence;
+    uint32 priority;
+
+} PTCX_TILE_TASK;
+
+// Orders each queue as a heap whose top is the highest priority task, and the oldest
+// among tasks of equal priority.
+struct compare_tile_tasks
+{
+    bool operator()(const PTCX_TILE_TASK &left, const PTCX_TILE_TASK &right) const
+    {
+        return (left.priority != right.priority) ? (left.priority < right.priority) : (left.sequence > right.sequence);
+    }
+};
+
+struct PTCX_TILE_WORKER
+{
+    std::mutex lock;
+    std::vector<PTCX_TILE_TASK> queue;
+    std::thread thread;
+};
+
+struct PTCX_TILE_REQUEST
+{
+    uint64 sequence;                            // sequence of the live task for this tile
+    uint32 priority;
+    bool is_decoding;
+    tile_clock::time_point request_time;
+};
+
+struct PTCX_TILE_ENTRY
+{
+    std::vector<uint8> pixels;
+    uint32 width;
+    uint32 height;
+    std::list<uint64>::iterator position;
+};
+
+// Everything other than the worker queues is guarded by the state lock. A thread that
+// holds the state lock may take a queue lock, but never the reverse. The queued count
+// changes under the lock of the queue that holds the task, so that it always matches
+// the queues, and rises only under the state lock, so that idle workers cannot miss
+// new work.
+struct PTCX_TILE_SERVICE_STATE
+{
+    std::vector<PTCX_BLOCK_INDEX> levels;
+    uint32 tile_size;
+    uint32 cache_size;
+
+    PTCX_TILE_WORKER *workers;
+    uint32 worker_count;
+    uint32 next_worker;
+    std::atomic<uint32> queued_count;           // tasks in every queue, including stale ones
+
+    std::mutex lock;
+    std::condition_variable work_ready;
+    std::condition_variable idle;
+    bool is_stopping;
+
+    std::unordered_map<uint64, PTCX_TILE_REQUEST> requests;
+    std::unordered_map<uint64, PTCX_TILE_ENTRY> tiles;
+    std::list<uint64> recency;                  // resident tiles, most recently used first
+    uint64 next_sequence;
+
+    PTCX_TILE_STATISTICS statistics;
+};
+
+uint64 make_tile_key(uint32 x, uint32 y, uint32 level)
+{
+    return (static_cast<uint64>(level) << 48) | (static_cast<uint64>(y) << 24) | x;
+}
+
+void split_tile_key(uint64 key, uint32 *x, uint32 *y, uint32 *level)
+{
+    (*x) = static_cast<uint32>(key & 0xFFFFFF);
+    (*y) = static_cast<uint32>((key >> 24) & 0xFFFFFF);
+    (*level) = static_cast<uint32>(key >> 48);
+}
+
+void record_tile_latency(uint64 *histogram, tile_clock::duration elapsed)
+{
+    // Bucket i holds latencies of at least 2^i microseconds (bucket zero also holds those
+    // below one), and the final bucket holds everything beyond it.
+
+    uint64 microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    uint32 bucket = 0;
+
+    while (microseconds > 1 && bucket < PTCX_TILE_HISTOGRAM_SIZE - 1)
+    {
+        microseconds >>= 1;
+        bucket++;
+    }
+
+    histogram[bucket]++;
+}
+
+status decode_tile(const PTCX_BLOCK_INDEX &index, uint32 tile_size, uint32 tile_x, uint32 tile_y, PTCX_TILE_ENTRY *output)
+{
+    const PTCX_FILE_HEADER &header = index.context.header;
+    uint32 origin_x = tile_x * tile_size;
+    uint32 origin_y = tile_y * tile_size;
+
+    // Tiles along the right and bottom edges of a level are clipped to the level.
+
+    output->width = base_min2(tile_size, header.image_width - origin_x);
+    output->height = base_min2(tile_size, header.image_height - origin_y);
+    output->pixels.resize(output->width * output->height * 3);
+
+    image tile_image;
+    image block_image;
+    uint8 block_data[PTCX_MAX_BLOCK_SIZE * PTCX_MAX_BLOCK_SIZE * 3];
+
+    if (base_failed(create_image(IGN_IMAGE_FORMAT_R8G8B8, output->pixels.data(), output->width, output->height, &tile_image)) ||
+        base_failed(create_image(IGN_IMAGE_FORMAT_R8G8B8, block_data, header.block_width, header.block_height, &block_image)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    uint32 first_x = origin_x - (origin_x % header.block_width);
+    uint32 first_y = origin_y - (origin_y % header.block_height);
+    uint32 end_x = origin_x + output->width;
+    uint32 end_y = origin_y + output->height;
+
+    for (uint32 j = first_y; j < end_y; j += header.block_height)
+    for (uint32 i = first_x; i < end_x; i += header.block_width)
+    {
+        uint32 block_index = query_indexed_block(header, i, j);
+
+        // Macroblocks that lie entirely within the tile are decoded in place, and others
+        // are decoded aside and clipped.
+
+        if (i >= origin_x && j >= origin_y && i + header.block_width <= end_x && j + header.block_height <= end_y)
+        {
+            if (base_failed(decode_indexed_macroblock(index, block_index, &tile_image, i - origin_x, j - origin_y)))
+            {
+                return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+            }
+
+            continue;
+        }
+
+        if (base_failed(decode_indexed_macroblock(index, block_index, &block_image, 0, 0)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+
+        uint32 copy_x = base_max2(i, origin_x);
+        uint32 copy_y = base_max2(j, origin_y);
+        uint32 copy_width = base_min2(i + header.block_width, end_x) - copy_x;
+        uint32 copy_height = base_min2(j + header.block_height, end_y) - copy_y;
+
+        for (uint32 row = 0; row < copy_height; row++)
+        {
+            memcpy(tile_image.query_data() + tile_image.query_block_offset(copy_x - origin_x, copy_y - origin_y + row),
+                   block_image.query_data() + block_image.query_block_offset(copy_x - i, copy_y - j + row), copy_width * 3);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+void push_tile_task(PTCX_TILE_SERVICE_STATE *state, uint64 key, PTCX_TILE_REQUEST *request)
+{
+    // Called with the state lock held. Tasks are dealt to the workers in turn.
+
+    PTCX_TILE_TASK task;
+    PTCX_TILE_WORKER &worker = state->workers[state->next_worker++ % state->worker_count];
+
+    task.key = key;
+    task.sequence = state->next_sequence++;
+    task.priority = request->priority;
+    request->sequence = task.sequence;
+
+    {
+        std::lock_guard<std::mutex> guard(worker.lock);
+
+        worker.queue.push_back(task);
+        std::push_heap(worker.queue.begin(), worker.queue.end(), compare_tile_tasks());
+        state->queued_count++;
+    }
+
+    state->work_ready.notify_one();
+}
+
+bool pop_tile_task(PTCX_TILE_SERVICE_STATE *state, uint32 worker_index, PTCX_TILE_TASK *task)
+{
+    // Each worker serves its own queue first, and then steals from the others in turn.
+    // Either way it takes the highest priority task of the queue, so priorities hold
+    // strictly within a queue and approximately across them.
+
+    for (uint32 i = 0; i < state->worker_count; i++)
+    {
+        PTCX_TILE_WORKER &worker = state->workers[(worker_index + i) % state->worker_count];
+        std::lock_guard<std::mutex> guard(worker.lock);
+
+        if (worker.queue.empty())
+        {
+            continue;
+        }
+
+        std::pop_heap(worker.queue.begin(), worker.queue.end(), compare_tile_tasks());
+        (*task) = worker.queue.back();
+        worker.queue.pop_back();
+        state->queued_count--;
+
+        return true;
+    }
+
+    return false;
+}
+
+void insert_tile(PTCX_TILE_SERVICE_STATE *state, uint64 key, PTCX_TILE_ENTRY *tile)
+{
+    // Called with the state lock held. We evict until the new tile fits within the budget,
+    // although the cache always keeps at least the newest tile.
+
+    uint32 tile_bytes = tile->pixels.size();
+
+    while (!state->recency.empty() && state->statistics.resident_size + tile_bytes > state->cache_size)
+    {
+        std::unordered_map<uint64, PTCX_TILE_ENTRY>::iterator evicted = state->tiles.find(state->recency.back());
+
+        state->statistics.resident_size -= evicted->second.pixels.size();
+        state->statistics.eviction_count++;
+        state->tiles.erase(evicted);
+        state->recency.pop_back();
+    }
+
+    state->recency.push_front(key);
+    tile->position = state->recency.begin();
+
+    PTCX_TILE_ENTRY &entry = state->tiles[key];
+
+    entry.pixels.swap(tile->pixels);
+    entry.width = tile->width;
+    entry.height = tile->height;
+    entry.position = tile->position;
+
+    state->statistics.resident_size += tile_bytes;
+}
+
+void process_tile_task(PTCX_TILE_SERVICE_STATE *state, const PTCX_TILE_TASK &task)
+{
+    uint32 x = 0;
+    uint32 y = 0;
+    uint32 level = 0;
+
+    split_tile_key(task.key, &x, &y, &level);
+
+    {
+        std::lock_guard<std::mutex> guard(state->lock);
+        std::unordered_map<uint64, PTCX_TILE_REQUEST>::iterator request = state->requests.find(task.key);
+
+        if (request == state->requests.end() || request->second.sequence != task.sequence)
+        {
+            // The request was cancelled or reprioritized after this task was queued.
+            return;
+        }
+
+        request->second.is_decoding = true;
+    }
+
+    // Block indices are never modified once the service is open, so any number of workers
+    // may decode from them at once without holding the lock.
+
+    PTCX_TILE_ENTRY tile;
+    tile_clock::time_point decode_start = tile_clock::now();
+    status result = decode_tile(state->levels[level], state->tile_size, x, y, &tile);
+    tile_clock::time_point decode_end = tile_clock::now();
+
+    std::lock_guard<std::mutex> guard(state->lock);
+    std::unordered_map<uint64, PTCX_TILE_REQUEST>::iterator request = state->requests.find(task.key);
+
+    if (request != state->requests.end())
+    {
+        // A tile that was cancelled while it decoded is simply discarded.
+
+        if (base_succeeded(result))
+        {
+            record_tile_latency(state->statistics.request_latency, decode_end - request->second.request_time);
+            record_tile_latency(state->statistics.decode_latency, decode_end - decode_start);
+            insert_tile(state, task.key, &tile);
+            state->statistics.decode_count++;
+        }
+        else
+        {
+            state->statistics.failure_count++;
+        }
+
+        state->requests.erase(request);
+    }
+
+    if (state->requests.empty())
+    {
+        state->idle.notify_all();
+    }
+}
+
+void run_tile_worker(PTCX_TILE_SERVICE_STATE *state, uint32 worker_index)
+{
+    for (;;)
+    {
+        PTCX_TILE_TASK task;
+
+        if (pop_tile_task(state, worker_index, &task))
+        {
+            process_tile_task(state, task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(state->lock);
+
+        while (!state->is_stopping && !state->queued_count)
+        {
+            state->work_ready.wait(guard);
+        }
+
+        if (state->is_stopping)
+        {
+            return;
+        }
+    }
+}
+
+status load_tile_levels(const void *data, uint32 size, PTCX_TILE_SERVICE_STATE *state)
+{
+    // Each level is indexed from its own view of the file, since level offsets are
+    // relative to the start of the chain.
+
+    PTCX_FILE_HEADER header;
+    buffer_stream input(data, size);
+
+    if (base_failed(read_header(&input, &header)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    uint32 level_count = (header.flags & PTCX_FLAG_MIP_CHAIN) ? header.image_depth : 1;
+
+    state->levels.resize(level_count);
+
+    for (uint32 i = 0; i < level_count; i++)
+    {
+        buffer_stream level_input(data, size);
+
+        if (base_failed(read_block_index(&level_input, i, &state->levels[i])))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+ptcx_tile_service::ptcx_tile_service()
+{
+    state = 0;
+}
+
+ptcx_tile_service::~ptcx_tile_service()
+{
+    close();
+}
+
+status ptcx_tile_service::open(const void *data, uint32 size, uint32 tile_size, uint32 thread_count, uint32 cache_size)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!data || !size || !tile_size || tile_size > (1 << 16))
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    close();
+    state = new PTCX_TILE_SERVICE_STATE;
+
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+    }
+
+    state->workers = 0;
+    state->worker_count = 0;
+
+    if (base_failed(load_tile_levels(data, size, state)))
+    {
+        close();
+
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    if (!thread_count)
+    {
+        thread_count = base_max2(std::thread::hardware_concurrency(), 1U);
+    }
+
+    state->tile_size = tile_size;
+    state->cache_size = cache_size;
+    state->next_worker = 0;
+    state->queued_count = 0;
+    state->is_stopping = false;
+    state->next_sequence = 0;
+
+    memset(&state->statistics, 0, sizeof(PTCX_TILE_STATISTICS));
+
+    state->workers = new PTCX_TILE_WORKER[thread_count];
+    state->worker_count = thread_count;
+
+    for (uint32 i = 0; i < thread_count; i++)
+    {
+        state->workers[i].thread = std::thread(run_tile_worker, state, i);
+    }
+
+    return BASE_SUCCESS;
+}
+
+void ptcx_tile_service::close()
+{
+    if (!state)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(state->lock);
+
+        state->is_stopping = true;
+        state->requests.clear();
+        state->work_ready.notify_all();
+        state->idle.notify_all();
+    }
+
+    for (uint32 i = 0; i < state->worker_count; i++)
+    {
+        state->workers[i].thread.join();
+    }
+
+    delete [] state->workers;
+    delete state;
+    state = 0;
+}
+
+status ptcx_tile_service::request_tile(uint32 x, uint32 y, uint32 level, uint32 priority)
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_NOT_READY);
+    }
+
+    uint32 columns = 0;
+    uint32 rows = 0;
+
+    if (base_failed(query_tile_grid(level, &columns, &rows)) || x >= columns || y >= rows)
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    uint64 key = make_tile_key(x, y, level);
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    state->statistics.request_count++;
+
+    std::unordered_map<uint64, PTCX_TILE_ENTRY>::iterator tile = state->tiles.find(key);
+
+    if (tile != state->tiles.end())
+    {
+        state->statistics.hit_count++;
+        state->recency.splice(state->recency.begin(), state->recency, tile->second.position);
+
+        return BASE_SUCCESS;
+    }
+
+    std::unordered_map<uint64, PTCX_TILE_REQUEST>::iterator pending = state->requests.find(key);
+
+    if (pending != state->requests.end())
+    {
+        // Repeated requests keep their original request time. A change of priority queues
+        // a fresh task, unless the tile is already being decoded.
+
+        if (!pending->second.is_decoding && pending->second.priority != priority)
+        {
+            pending->second.priority = priority;
+            push_tile_task(state, key, &pending->second);
+        }
+
+        return BASE_SUCCESS;
+    }
+
+    PTCX_TILE_REQUEST &request = state->requests[key];
+
+    request.priority = priority;
+    request.is_decoding = false;
+    request.request_time = tile_clock::now();
+
+    push_tile_task(state, key, &request);
+
+    return BASE_SUCCESS;
+}
+
+status ptcx_tile_service::cancel_tile(uint32 x, uint32 y, uint32 level)
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_NOT_READY);
+    }
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    if (state->requests.erase(make_tile_key(x, y, level)))
+    {
+        state->statistics.cancel_count++;
+
+        if (state->requests.empty())
+        {
+            state->idle.notify_all();
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+status ptcx_tile_service::cancel_all()
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_NOT_READY);
+    }
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    state->statistics.cancel_count += state->requests.size();
+    state->requests.clear();
+    state->idle.notify_all();
+
+    return BASE_SUCCESS;
+}
+
+status ptcx_tile_service::query_tile(uint32 x, uint32 y, uint32 level, image *output)
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_NOT_READY);
+    }
+
+    if (!output)
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    std::lock_guard<std::mutex> guard(state->lock);
+    std::unordered_map<uint64, PTCX_TILE_ENTRY>::iterator tile = state->tiles.find(make_tile_key(x, y, level));
+
+    if (tile == state->tiles.end())
+    {
+        return BASE_ERROR_NOT_READY;
+    }
+
+    state->recency.splice(state->recency.begin(), state->recency, tile->second.position);
+
+    if (base_failed(create_image(IGN_IMAGE_FORMAT_R8G8B8, tile->second.width, tile->second.height, output)))
+    {
+        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+    }
+
+    memcpy(output->query_data(), tile->second.pixels.data(), tile->second.pixels.size());
+
+    return BASE_SUCCESS;
+}
+
+status ptcx_tile_service::wait_idle()
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_NOT_READY);
+    }
+
+    std::unique_lock<std::mutex> guard(state->lock);
+
+    while (!state->requests.empty())
+    {
+        state->idle.wait(guard);
+    }
+
+    return BASE_SUCCESS;
+}
+
+uint32 ptcx_tile_service::query_level_count() const
+{
+    return state ? state->levels.size() : 0;
+}
+
+status ptcx_tile_service::query_tile_grid(uint32 level, uint32 *columns, uint32 *rows) const
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_NOT_READY);
+    }
+
+    if (!columns || !rows || level >= state->levels.size())
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    const PTCX_FILE_HEADER &header = state->levels[level].context.header;
+
+    (*columns) = (header.image_width + state->tile_size - 1) / state->tile_size;
+    (*rows) = (header.image_height + state->tile_size - 1) / state->tile_size;
+
+    return BASE_SUCCESS;
+}
+
+status ptcx_tile_service::query_statistics(PTCX_TILE_STATISTICS *output) const
+{
+    if (!state)
+    {
+        return base_post_error(BASE_ERROR_NOT_READY);
+    }
+
+    if (!output)
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    (*output) = state->statistics;
+
+    return BASE_SUCCESS;
+}
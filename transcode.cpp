@@ -0,0 +1,437 @@
+
+#include "ptcx_internal.h"
+
+#define PTCX_BC1_BLOCK_SIZE                      (4)
+#define PTCX_BC1_BLOCK_BYTES                     (8)
+
+// BC1 orders its four colors as color0, color1, 2/3 color0 + 1/3 color1, and 1/3 color0 +
+// 2/3 color1. We place our maximum in color0, so a palette level counted up from the
+// minimum selects these indices.
+const uint8 bc1_level_index[4] = {1, 3, 2, 0};
+
+void write_bc1_block(uint16 color0, uint16 color1, uint32 indices, uint8 *output)
+{
+    output[0] = color0 & 0xFF;
+    output[1] = color0 >> 8;
+    output[2] = color1 & 0xFF;
+    output[3] = color1 >> 8;
+    output[4] = indices & 0xFF;
+    output[5] = (indices >> 8) & 0xFF;
+    output[6] = (indices >> 16) & 0xFF;
+    output[7] = indices >> 24;
+}
+
+uint16 pack_bc1_color(const uint8 *color)
+{
+    uint16 red5 = (color[0] * 31 + 127) / 255;
+    uint16 green6 = (color[1] * 63 + 127) / 255;
+    uint16 blue5 = (color[2] * 31 + 127) / 255;
+
+    return (red5 << 11) | (green6 << 5) | blue5;
+}
+
+status transcode_microblock(const PTCX_FILE_CONTEXT &context, uint32 block_width, uint32 block_height, uint32 quant_step_bits,
+                            bool is_codebook, PTCX_BAND_CURSOR *cursor, uint8 *output, uint32 output_pitch)
+{
+    const PTCX_FILE_HEADER &header = context.header;
+    uint32 quant_step_mask = (1 << quant_step_bits) - 1;
+    uint32 control_bytes = (header.quant_control_bits << 1) >> 3;
+    uint32 index_bytes = (block_width * block_height * quant_step_bits + 7) >> 3;
+
+    if (cursor->control + control_bytes > cursor->control_end)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    // Our endpoints expand without bit replication, so we repack their expanded values
+    // rather than copying the 565 fields, which would brighten every block slightly.
+
+    PTCX_PIXEL_RANGE range = {{255, 255, 255}, {0, 0, 0}};
+    unpack_control_values(cursor->control, header, &range);
+
+    uint16 color0 = pack_bc1_color(range.max_value);
+    uint16 color1 = pack_bc1_color(range.min_value);
+    bool is_solid = is_solid_microblock(header, cursor->control);
+
+    cursor->control += control_bytes;
+
+    // Codebook tiles are expanded into conventional packed indices first.
+
+    uint8 expanded[PTCX_MAX_INDEX_DATA_SIZE];
+    const uint8 *index_data = cursor->index;
+
+    if (is_solid)
+    {
+        index_bytes = 0;
+    }
+    else if (is_codebook)
+    {
+        if (base_failed(expand_codebook_indices(header, context.codebook, block_width, block_height, &cursor->index, cursor->index_end, expanded)))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+
+        index_data = expanded;
+        index_bytes = 0;
+    }
+
+    if (cursor->index + index_bytes > cursor->index_end)
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    cursor->index += index_bytes;
+
+    // Identical endpoints would select the three color mode of BC1, so such blocks use
+    // color0 throughout. Otherwise each step value maps to its nearest BC1 level.
+
+    uint8 step_index[1 << PTCX_MAX_QUANT_STEP_BITS] = {0};
+
+    if (!is_solid && color0 != color1)
+    {
+        for (uint32 step_value = 0; step_value <= quant_step_mask; step_value++)
+        {
+            step_index[step_value] = bc1_level_index[(step_value * 6 + quant_step_mask) / (quant_step_mask * 2)];
+        }
+    }
+
+    for (uint32 block_y = 0; block_y < block_height; block_y += PTCX_BC1_BLOCK_SIZE)
+    for (uint32 block_x = 0; block_x < block_width; block_x += PTCX_BC1_BLOCK_SIZE)
+    {
+        uint32 indices = 0;
+
+        if (!is_solid)
+        {
+            for (uint32 subj = 0; subj < PTCX_BC1_BLOCK_SIZE; subj++)
+            for (uint32 subi = 0; subi < PTCX_BC1_BLOCK_SIZE; subi++)
+            {
+                uint32 bit_offset = ((block_y + subj) * block_width + block_x + subi) * quant_step_bits;
+                uint32 step_value = (index_data[bit_offset >> 3] >> (bit_offset & 0x7)) & quant_step_mask;
+
+                indices |= step_index[step_value] << ((subj * PTCX_BC1_BLOCK_SIZE + subi) << 1);
+            }
+        }
+
+        uint8 *block = output + (block_y / PTCX_BC1_BLOCK_SIZE) * output_pitch + (block_x / PTCX_BC1_BLOCK_SIZE) * PTCX_BC1_BLOCK_BYTES;
+        write_bc1_block(color0, color1, indices, block);
+    }
+
+    return BASE_SUCCESS;
+}
+
+void unpack_bc1_color(uint16 packed, int32 *color)
+{
+    // Expand each channel to eight bits by replication, as BC1 decoders do.
+
+    uint32 red5 = packed >> 11;
+    uint32 green6 = (packed >> 5) & 0x3F;
+    uint32 blue5 = packed & 0x1F;
+
+    color[0] = (red5 << 3) | (red5 >> 2);
+    color[1] = (green6 << 2) | (green6 >> 4);
+    color[2] = (blue5 << 3) | (blue5 >> 2);
+}
+
+void fit_bc1_block(const image &source, uint32 x, uint32 y, uint8 *output)
+{
+    uint8 min_value[3] = {255, 255, 255};
+    uint8 max_value[3] = {0, 0, 0};
+
+    // A quick fit along the diagonal of the color bounding box, which mirrors the range
+    // estimate of our own encoder.
+
+    for (uint32 subj = 0; subj < PTCX_BC1_BLOCK_SIZE; subj++)
+    for (uint32 subi = 0; subi < PTCX_BC1_BLOCK_SIZE; subi++)
+    {
+        const uint8 *pixel = source.query_data() + source.query_block_offset(x + subi, y + subj);
+
+        for (uint8 c = 0; c < 3; c++)
+        {
+            min_value[c] = base_min2(min_value[c], pixel[c]);
+            max_value[c] = base_max2(max_value[c], pixel[c]);
+        }
+    }
+
+    // Every channel of the maximum is at least that of the minimum, so color0 >= color1
+    // and only identical endpoints would select the three color mode.
+
+    uint16 color0 = pack_bc1_color(max_value);
+    uint16 color1 = pack_bc1_color(min_value);
+    uint32 indices = 0;
+
+    if (color0 != color1)
+    {
+        int32 end[3];
+        int32 start[3];
+        int32 axis[3];
+
+        unpack_bc1_color(color0, end);
+        unpack_bc1_color(color1, start);
+
+        for (uint8 c = 0; c < 3; c++)
+        {
+            axis[c] = end[c] - start[c];
+        }
+
+        int32 axis_dot = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+
+        for (uint32 subj = 0; subj < PTCX_BC1_BLOCK_SIZE; subj++)
+        for (uint32 subi = 0; subi < PTCX_BC1_BLOCK_SIZE; subi++)
+        {
+            const uint8 *pixel = source.query_data() + source.query_block_offset(x + subi, y + subj);
+            int32 pixel_dot = (pixel[0] - start[0]) * axis[0] + (pixel[1] - start[1]) * axis[1] + (pixel[2] - start[2]) * axis[2];
+            int32 level = base_min2(base_max2((pixel_dot * 6 + axis_dot) / (axis_dot * 2), 0), 3);
+
+            indices |= bc1_level_index[level] << ((subj * PTCX_BC1_BLOCK_SIZE + subi) << 1);
+        }
+    }
+
+    write_bc1_block(color0, color1, indices, output);
+}
+
+void fit_bc1_region(const image &source, uint32 x, uint32 y, uint32 width, uint32 height, uint8 *output, uint32 output_pitch)
+{
+    for (uint32 block_y = 0; block_y < height; block_y += PTCX_BC1_BLOCK_SIZE)
+    for (uint32 block_x = 0; block_x < width; block_x += PTCX_BC1_BLOCK_SIZE)
+    {
+        uint8 *block = output + (block_y / PTCX_BC1_BLOCK_SIZE) * output_pitch + (block_x / PTCX_BC1_BLOCK_SIZE) * PTCX_BC1_BLOCK_BYTES;
+        fit_bc1_block(source, x + block_x, y + block_y, block);
+    }
+}
+
+bool is_direct_macroblock(const PTCX_FILE_HEADER &header, const PTCX_MACROBLOCK_ENTRY &entry)
+{
+    // Indexed microblocks share a single pair of RGB endpoints across whole BC1 blocks,
+    // and so map onto them directly.
+
+    if (PTCX_BLOCK_MODE_INDEXED != entry.mode && PTCX_BLOCK_MODE_CODEBOOK != entry.mode)
+    {
+        return false;
+    }
+
+    uint32 micro_width = 0;
+    uint32 micro_height = 0;
+
+    query_smallest_microblock_size(header, entry, &micro_width, &micro_height);
+
+    return !(header.flags & PTCX_FLAG_DECORRELATED_COLOR) &&
+           0 == (micro_width % PTCX_BC1_BLOCK_SIZE) && 0 == (micro_height % PTCX_BC1_BLOCK_SIZE);
+}
+
+status transcode_reference_macroblock(const PTCX_FILE_HEADER &header, uint32 block_index, PTCX_BAND_CURSOR *cursor,
+                                      uint8 *output, uint32 output_pitch, uint32 start_x, uint32 start_y)
+{
+    uint32 distance = 0;
+
+    if (cursor->control + PTCX_REFERENCE_CONTROL_SIZE > cursor->control_end ||
+        base_failed(read_reference_distance(cursor->control, block_index, &distance)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    cursor->control += PTCX_REFERENCE_CONTROL_SIZE;
+
+    // The referenced macroblock has already been transcoded earlier in the band, so we
+    // copy its BC1 blocks.
+
+    uint32 blocks_per_row = header.image_width / header.block_width;
+    uint32 source_index = block_index - distance;
+    uint32 source_x = (source_index % blocks_per_row) * header.block_width;
+    uint32 source_y = (source_index / blocks_per_row) * header.block_height;
+    uint32 row_bytes = (header.block_width / PTCX_BC1_BLOCK_SIZE) * PTCX_BC1_BLOCK_BYTES;
+
+    for (uint32 block_y = 0; block_y < header.block_height; block_y += PTCX_BC1_BLOCK_SIZE)
+    {
+        uint8 *dest = output + ((start_y + block_y) / PTCX_BC1_BLOCK_SIZE) * output_pitch + (start_x / PTCX_BC1_BLOCK_SIZE) * PTCX_BC1_BLOCK_BYTES;
+        uint8 *src = output + ((source_y + block_y) / PTCX_BC1_BLOCK_SIZE) * output_pitch + (source_x / PTCX_BC1_BLOCK_SIZE) * PTCX_BC1_BLOCK_BYTES;
+
+        memcpy(dest, src, row_bytes);
+    }
+
+    return BASE_SUCCESS;
+}
+
+status transcode_band(const PTCX_FILE_CONTEXT &context, const PTCX_BAND_DATA &band, image *scratch, uint8 *output)
+{
+    const PTCX_FILE_HEADER &header = context.header;
+    uint32 output_pitch = (header.image_width / PTCX_BC1_BLOCK_SIZE) * PTCX_BC1_BLOCK_BYTES;
+    uint32 block_index = 0;
+    PTCX_BAND_CURSOR cursor;
+
+    cursor.control = band.control.data();
+    cursor.control_end = cursor.control + band.control.size();
+    cursor.index = band.index.data();
+    cursor.index_end = cursor.index + band.index.size();
+
+    for (uint32 j = 0; j < header.band_height; j += header.block_height)
+    for (uint32 i = 0; i < header.image_width; i += header.block_width)
+    {
+        PTCX_PARTITION_REGION regions[PTCX_MAX_PARTITION_REGIONS];
+        PTCX_MACROBLOCK_ENTRY entry;
+
+        if (base_failed(read_macroblock_entry(header, band.table.data(), block_index++, &entry)))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+
+        if (PTCX_BLOCK_MODE_REFERENCE == entry.mode)
+        {
+            if (base_failed(transcode_reference_macroblock(header, block_index - 1, &cursor, output, output_pitch, i, j)))
+            {
+                return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+            }
+
+            continue;
+        }
+
+        uint32 region_count = query_partition_regions(header, entry, regions);
+        bool is_direct = is_direct_macroblock(header, entry);
+
+        for (uint32 r = 0; r < region_count; r++)
+        for (uint32 micro_j = regions[r].y; micro_j < regions[r].y + regions[r].height; micro_j += regions[r].micro_height)
+        for (uint32 micro_i = regions[r].x; micro_i < regions[r].x + regions[r].width; micro_i += regions[r].micro_width)
+        {
+            uint32 micro_width = regions[r].micro_width;
+            uint32 micro_height = regions[r].micro_height;
+            status result = BASE_SUCCESS;
+
+            if (is_direct)
+            {
+                uint8 *block = output + ((j + micro_j) / PTCX_BC1_BLOCK_SIZE) * output_pitch + ((i + micro_i) / PTCX_BC1_BLOCK_SIZE) * PTCX_BC1_BLOCK_BYTES;
+
+                result = transcode_microblock(context, micro_width, micro_height, entry.quant_step_bits,
+                                              PTCX_BLOCK_MODE_CODEBOOK == entry.mode, &cursor, block, output_pitch);
+            }
+            else if (PTCX_BLOCK_MODE_PLANAR == entry.mode)
+            {
+                result = decode_planar_microblock(micro_width, micro_height, entry.color_space, &cursor, scratch, micro_i, micro_j);
+            }
+            else if (PTCX_BLOCK_MODE_CODEBOOK == entry.mode)
+            {
+                result = decode_codebook_microblock(context, micro_width, micro_height, entry.color_space, &cursor, scratch, micro_i, micro_j);
+            }
+            else
+            {
+                result = decode_microblock(header, micro_width, micro_height, entry.quant_step_bits, entry.color_space, &cursor, scratch, micro_i, micro_j);
+            }
+
+            if (base_failed(result))
+            {
+                return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+            }
+        }
+
+        // Anything else is decoded in full, and then fit to BC1 one block at a time.
+
+        if (!is_direct)
+        {
+            uint8 *block = output + (j / PTCX_BC1_BLOCK_SIZE) * output_pitch + (i / PTCX_BC1_BLOCK_SIZE) * PTCX_BC1_BLOCK_BYTES;
+            fit_bc1_region(*scratch, 0, 0, header.block_width, header.block_height, block, output_pitch);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+status transcode_ptcx_bc1(stream *input, uint32 *width, uint32 *height, stream *output)
+{
+    PTCX_FILE_CONTEXT context;
+    const PTCX_FILE_HEADER &pxh = context.header;
+
+    if (BASE_PARAM_CHECK)
+    {
+        if (!input || !width || !height || !output || input->is_empty())
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    if (base_failed(read_file_context(input, &context)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    if (pxh.image_width % PTCX_BC1_BLOCK_SIZE || pxh.image_height % PTCX_BC1_BLOCK_SIZE)
+    {
+        // BC1 has no representation for partial blocks.
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    (*width) = pxh.image_width;
+    (*height) = pxh.image_height;
+
+    uint32 output_pitch = (pxh.image_width / PTCX_BC1_BLOCK_SIZE) * PTCX_BC1_BLOCK_BYTES;
+
+    // Macroblocks narrower than a BC1 block, and legacy files, offer no direct mapping.
+    // These are decoded a band at a time, and every block is fit.
+
+    bool is_macroblock_aligned = pxh.block_width >= PTCX_BC1_BLOCK_SIZE && pxh.block_height >= PTCX_BC1_BLOCK_SIZE;
+    uint32 band_height = (PTCX_LEGACY_VERSION == pxh.version) ? pxh.image_height : pxh.band_height;
+
+    image scratch;
+    PTCX_BAND_DATA band;
+    std::vector<uint8> macroblock_table;
+    std::vector<uint8> band_blocks((band_height / PTCX_BC1_BLOCK_SIZE) * output_pitch);
+
+    if (PTCX_LEGACY_VERSION != pxh.version && is_macroblock_aligned)
+    {
+        if (base_failed(create_image(IGN_IMAGE_FORMAT_R8G8B8, pxh.block_width, pxh.block_height, &scratch)))
+        {
+            return base_post_error(BASE_ERROR_OUTOFMEMORY);
+        }
+    }
+    else if (base_failed(create_image(IGN_IMAGE_FORMAT_R8G8B8, pxh.image_width, band_height, &scratch)))
+    {
+        return base_post_error(BASE_ERROR_OUTOFMEMORY);
+    }
+
+    if (PTCX_LEGACY_VERSION == pxh.version)
+    {
+        if (base_failed(read_macroblock_table(input, pxh, &macroblock_table)) ||
+            base_failed(inverse_quantize_legacy(input, pxh, macroblock_table, 0, pxh.image_height, &scratch, 0)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+
+        fit_bc1_region(scratch, 0, 0, pxh.image_width, pxh.image_height, band_blocks.data(), output_pitch);
+
+        if (base_failed(write_stream_data(output, band_blocks.data(), band_blocks.size())))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+
+        return BASE_SUCCESS;
+    }
+
+    for (uint32 j = 0; j < pxh.image_height; j += band_height)
+    {
+        if (base_failed(read_band(input, context, &band)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+
+        if (is_macroblock_aligned)
+        {
+            if (base_failed(transcode_band(context, band, &scratch, band_blocks.data())))
+            {
+                return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+            }
+        }
+        else
+        {
+            if (base_failed(decode_band(context, band, &scratch, 0)))
+            {
+                return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+            }
+
+            fit_bc1_region(scratch, 0, 0, pxh.image_width, band_height, band_blocks.data(), output_pitch);
+        }
+
+        if (base_failed(write_stream_data(output, band_blocks.data(), band_blocks.size())))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
@@ -0,0 +1,236 @@
+
+#include "ptcx_internal.h"
+
+status mark_dirty_blocks(const PTCX_FILE_HEADER &header, const PTCX_RECT *dirty_rects, uint32 rect_count, std::vector<uint8> *dirty_blocks)
+{
+    uint32 blocks_per_row = header.image_width / header.block_width;
+
+    dirty_blocks->assign(query_band_count(header) * query_band_macroblock_count(header), 0);
+
+    for (uint32 k = 0; k < rect_count; k++)
+    {
+        const PTCX_RECT &rect = dirty_rects[k];
+
+        if (rect.x > header.image_width || rect.width > header.image_width - rect.x ||
+            rect.y > header.image_height || rect.height > header.image_height - rect.y)
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+
+        if (0 == rect.width || 0 == rect.height)
+        {
+            continue;
+        }
+
+        for (uint32 j = rect.y / header.block_height; j <= (rect.y + rect.height - 1) / header.block_height; j++)
+        for (uint32 i = rect.x / header.block_width; i <= (rect.x + rect.width - 1) / header.block_width; i++)
+        {
+            (*dirty_blocks)[j * blocks_per_row + i] = 1;
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+bool is_coded_by_model(const PTCX_ENTROPY_TABLE &model, const std::vector<uint8> &section)
+{
+    for (uint32 i = 0; i < section.size(); i++)
+    {
+        if (!model.frequency[section[i]]) return false;
+    }
+
+    return true;
+}
+
+status rebuild_file_models(const std::vector<uint8> &data, const std::vector<uint32> &band_offsets, const std::vector<uint8> &dirty_blocks,
+                           PTCX_BLOCK_INDEX *index)
+{
+    PTCX_FILE_CONTEXT &context = index->context;
+    uint32 control_histogram[PTCX_ENTROPY_SYMBOL_COUNT] = {0};
+    uint32 index_histogram[PTCX_ENTROPY_SYMBOL_COUNT] = {0};
+
+    // Every band is coded again against the new models, so the bands that were skipped
+    // must now be read as well.
+
+    for (uint32 i = 0; i < index->bands.size(); i++)
+    {
+        if (!is_dirty_band(context.header, dirty_blocks, i))
+        {
+            buffer_stream band_stream(data.data() + band_offsets[i], band_offsets[i + 1] - band_offsets[i]);
+
+            if (base_failed(read_band(&band_stream, context, &index->bands[i])))
+            {
+                return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+            }
+        }
+
+        accumulate_histogram(query_control_section(context.header, index->bands[i]), control_histogram);
+        accumulate_histogram(index->bands[i].index, index_histogram);
+    }
+
+    build_entropy_table(control_histogram, &context.control_model);
+    build_entropy_table(index_histogram, &context.index_model);
+
+    return BASE_SUCCESS;
+}
+
+status write_file_context(stream *output, const PTCX_FILE_CONTEXT &context)
+{
+    const PTCX_FILE_HEADER &header = context.header;
+
+    if (base_failed(write_stream_data(output, &header, sizeof(PTCX_FILE_HEADER))))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    if (header.flags & PTCX_FLAG_INDEX_CODEBOOK)
+    {
+        if (base_failed(write_index_codebook(output, header, context.codebook)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    if (header.flags & PTCX_FLAG_ENTROPY_CODED)
+    {
+        if (base_failed(write_entropy_table(output, context.control_model)) ||
+            base_failed(write_entropy_table(output, context.index_model)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
+
+status save_ptcx_update(stream *input, const image &updated, const PTCX_RECT *dirty_rects, uint32 rect_count, stream *output)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!input || input->is_empty() || !output || output->is_full() || (rect_count && !dirty_rects))
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+
+        if (IGN_IMAGE_FORMAT_R8G8B8 != updated.query_image_format() || !updated.query_data())
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    // The file is held in memory so that the bands we do not touch can be copied to the
+    // output directly from their original bytes.
+
+    std::vector<uint8> data(input->query_occupancy());
+
+    if (base_failed(read_stream_data(input, data.data(), data.size())))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    buffer_stream source(data.data(), data.size());
+    PTCX_BLOCK_INDEX index;
+    const PTCX_FILE_HEADER &header = index.context.header;
+
+    if (base_failed(read_header(&source, &index.context.header)) ||
+        PTCX_LEGACY_VERSION == header.version || (header.flags & PTCX_FLAG_MIP_CHAIN) ||
+        base_failed(read_file_models(&source, &index.context)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    if (updated.query_width() != header.image_width || updated.query_height() != header.image_height)
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    std::vector<uint8> dirty_blocks;
+    status result = mark_dirty_blocks(header, dirty_rects, rect_count, &dirty_blocks);
+
+    if (base_failed(result))
+    {
+        return result;
+    }
+
+    // Build our index on the fly: bands that hold a dirty macroblock are decoded and
+    // indexed, while every other band is passed over and only its location recorded.
+
+    uint32 band_count = query_band_count(header);
+    uint32 band_block_count = query_band_macroblock_count(header);
+    std::vector<uint32> band_offsets(band_count + 1);
+
+    index.bands.resize(band_count);
+    index.blocks.resize(band_count * band_block_count);
+
+    for (uint32 i = 0; i < band_count; i++)
+    {
+        band_offsets[i] = data.size() - source.query_occupancy();
+
+        if (!is_dirty_band(header, dirty_blocks, i))
+        {
+            result = skip_band(&source, index.context);
+        }
+        else if (base_succeeded(result = read_band(&source, index.context, &index.bands[i])))
+        {
+            result = index_band(header, index.bands[i], &index.blocks[i * band_block_count]);
+        }
+
+        if (base_failed(result))
+        {
+            return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+        }
+    }
+
+    band_offsets[band_count] = data.size() - source.query_occupancy();
+
+    if (base_failed(requantize_macroblocks(updated, dirty_blocks, &index)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    // The file models only cover the symbols of the original bands, so new data that
+    // holds any other symbol requires new models.
+
+    bool is_rebuilt = false;
+
+    for (uint32 i = 0; i < band_count && (header.flags & PTCX_FLAG_ENTROPY_CODED) && !is_rebuilt; i++)
+    {
+        if (is_dirty_band(header, dirty_blocks, i))
+        {
+            is_rebuilt = !is_coded_by_model(index.context.control_model, query_control_section(header, index.bands[i])) ||
+                         !is_coded_by_model(index.context.index_model, index.bands[i].index);
+        }
+    }
+
+    if (is_rebuilt)
+    {
+        if (base_failed(rebuild_file_models(data, band_offsets, dirty_blocks, &index)) ||
+            base_failed(write_file_context(output, index.context)))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+    else if (base_failed(write_stream_data(output, data.data(), band_offsets[0])))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    for (uint32 i = 0; i < band_count; i++)
+    {
+        if (is_rebuilt || is_dirty_band(header, dirty_blocks, i))
+        {
+            result = write_band(output, index.context, &index.bands[i]);
+        }
+        else
+        {
+            result = write_stream_data(output, data.data() + band_offsets[i], band_offsets[i + 1] - band_offsets[i]);
+        }
+
+        if (base_failed(result))
+        {
+            return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+        }
+    }
+
+    return BASE_SUCCESS;
+}
@@ -0,0 +1,67 @@
+
+#include "ptcx_internal.h"
+
+status save_ptcx_variant(const image &input, uint8 quality, uint32 options, stream *base, stream *output)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!base || base->is_empty() || !output || output->is_full())
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+
+        if (IGN_IMAGE_FORMAT_R8G8B8 != input.query_image_format())
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    // The base is indexed rather than decoded, since macroblocks are compared by their
+    // coded data.
+
+    PTCX_BLOCK_INDEX base_index;
+    status result = read_block_index(base, 0, &base_index);
+
+    if (base_failed(result))
+    {
+        return result;
+    }
+
+    return save_ptcx_delta(input, 0, &base_index, quality, options, output);
+}
+
+status load_ptcx_variant(stream *input, const image &base, image *output)
+{
+    return load_ptcx_variant(input, base, IGN_IMAGE_LAYOUT_LINEAR, output);
+}
+
+status load_ptcx_variant(stream *input, const image &base, IGN_IMAGE_LAYOUT layout, image *output)
+{
+    if (BASE_PARAM_CHECK)
+    {
+        if (!input || !output || input->is_empty() || &base == output)
+        {
+            return BASE_ERROR_INVALIDARG;
+        }
+    }
+
+    if (IGN_IMAGE_FORMAT_R8G8B8 != base.query_image_format() || !base.query_data())
+    {
+        return BASE_ERROR_INVALIDARG;
+    }
+
+    // Kept macroblocks are copied along with the rest of the base, and every other
+    // macroblock is then decoded over its copy.
+
+    if (base_failed(convert_image_layout(base, layout, output)))
+    {
+        return base_post_error(BASE_ERROR_EXECUTION_FAILURE);
+    }
+
+    if (base_failed(decode_delta(input, PTCX_SUPPORTED_FLAGS | PTCX_FLAG_KEPT_BLOCKS, output)))
+    {
+        return base_post_error(BASE_ERROR_INVALID_RESOURCE);
+    }
+
+    return BASE_SUCCESS;
+}